@@ -689,6 +689,7 @@ int main(int argc, char* argv[])
         closelog();
     }
     g_free(opt.global.root_dir);
+    g_free(opt.global.staging_dir);
     mms_settings_sim_data_reset(&opt.settings);
     mms_app_dbus_config_clear(&opt.dbus);
     mms_lib_deinit();
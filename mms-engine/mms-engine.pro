@@ -1,6 +1,6 @@
 TEMPLATE = app
 CONFIG += link_pkgconfig
-PKGCONFIG += gmime-3.0 gio-unix-2.0 gio-2.0 glib-2.0 libsoup-2.4 dconf
+PKGCONFIG += gmime-3.0 gio-unix-2.0 gio-2.0 glib-2.0 libsoup-2.4 libpng dconf
 PKGCONFIG += libwspcodec libgofono libdbusaccess libglibutil libdbuslogserver-gio
 QMAKE_CFLAGS += -Wno-unused-parameter
 
@@ -11,6 +11,14 @@ ResizeImageMagick {
   PKGCONFIG += ImageMagick
 }
 
+IoUring {
+  PKGCONFIG += liburing
+}
+
+Gif {
+  LIBS += -lgif
+}
+
 ConnManNemo {
   PKGCONFIG += libgofonoext
   DEFINES += SAILFISH
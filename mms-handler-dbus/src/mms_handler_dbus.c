@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2013-2019 Jolla Ltd.
+ * Copyright (C) 2013-2020 Jolla Ltd.
  * Contact: Slava Monich <slava.monich@jolla.com>
  *
  * This program is free software; you can redistribute it and/or modify
@@ -14,6 +14,8 @@
 
 #include "mms_handler_dbus.h"
 
+#include <gio/gunixfdlist.h>
+
 /* Logging */
 #define GLOG_MODULE_NAME mms_handler_log
 #include "mms_lib_log.h"
@@ -242,16 +244,12 @@ mms_handler_dbus_message_notify_cancel(
 
 static
 void
-mms_handler_dbus_message_received_done(
-    GObject* proxy,
-    GAsyncResult* result,
-    gpointer data)
+mms_handler_dbus_message_received_complete(
+    MMSHandlerMessageReceivedCall* call,
+    gboolean ok,
+    GError* error)
 {
-    GError* error = NULL;
-    MMSHandlerMessageReceivedCall* call = data;
     MMSHandlerDbus* dbus = call->dbus;
-    gboolean ok = org_nemomobile_mms_handler_call_message_received_finish(
-        ORG_NEMOMOBILE_MMS_HANDLER(proxy), result, &error);
     if (!ok) {
         GERR("%s", GERRMSG(error));
         g_error_free(error);
@@ -264,6 +262,109 @@ mms_handler_dbus_message_received_done(
     mms_handler_busy_dec(&dbus->handler);
 }
 
+static
+void
+mms_handler_dbus_message_received_done(
+    GObject* proxy,
+    GAsyncResult* result,
+    gpointer data)
+{
+    GError* error = NULL;
+    gboolean ok = org_nemomobile_mms_handler_call_message_received_finish(
+        ORG_NEMOMOBILE_MMS_HANDLER(proxy), result, &error);
+    mms_handler_dbus_message_received_complete(data, ok, error);
+}
+
+static
+void
+mms_handler_dbus_message_received_fd_done(
+    GObject* proxy,
+    GAsyncResult* result,
+    gpointer data)
+{
+    GError* error = NULL;
+    gboolean ok = org_nemomobile_mms_handler_call_message_received_fd_finish(
+        ORG_NEMOMOBILE_MMS_HANDLER(proxy), NULL, result, &error);
+    mms_handler_dbus_message_received_complete(data, ok, error);
+}
+
+/* Returns the index of the descriptor in the list, -1 on failure */
+static
+int
+mms_handler_dbus_append_fd(
+    GUnixFDList* fds,
+    const char* file,
+    gsize* size)
+{
+    int index = -1;
+    int fd = open(file, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (!fstat(fd, &st)) {
+            GError* error = NULL;
+            index = g_unix_fd_list_append(fds, fd, &error);
+            if (index >= 0) {
+                if (size) *size = st.st_size;
+            } else {
+                GERR("%s", GERRMSG(error));
+                g_error_free(error);
+            }
+        } else {
+            GERR("Can't stat %s: %s", file, strerror(errno));
+        }
+        close(fd);
+    } else {
+        GERR("Can't open %s: %s", file, strerror(errno));
+    }
+    return index;
+}
+
+/*
+ * Virtual parts are passed as (a descriptor of) the PDU plus the range
+ * of bytes occupied by the part. The rest of them (e.g. those which had
+ * to be decoded) are passed as descriptors of the individual files.
+ */
+static
+GVariant*
+mms_handler_dbus_message_received_fd_parts(
+    MMSMessage* msg,
+    GUnixFDList* fds)
+{
+    GSList* list;
+    GVariantBuilder b;
+    int pdu_index = -1;
+
+    g_variant_builder_init(&b, G_VARIANT_TYPE("a(ssshtt)"));
+    for (list = msg->parts; list; list = list->next) {
+        const MMSMessagePart* part = list->data;
+        const char* name;
+        gsize offset = 0, length = 0;
+        int index;
+
+        if (part->file) {
+            G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
+            name = g_basename(part->file);
+            G_GNUC_END_IGNORE_DEPRECATIONS;
+            index = mms_handler_dbus_append_fd(fds, part->file, &length);
+        } else {
+            if (pdu_index < 0) {
+                pdu_index = mms_handler_dbus_append_fd(fds, msg->pdu, NULL);
+            }
+            name = part->name;
+            offset = part->offset;
+            length = part->length;
+            index = pdu_index;
+        }
+        if (index < 0) {
+            g_variant_builder_clear(&b);
+            return NULL;
+        }
+        g_variant_builder_add(&b, "(ssshtt)", name, part->content_type,
+            part->content_id, index, (guint64)offset, (guint64)length);
+    }
+    return g_variant_ref_sink(g_variant_builder_end(&b));
+}
+
 /* Message received notification */
 static
 MMSHandlerMessageReceivedCall*
@@ -283,27 +384,46 @@ mms_handler_dbus_message_received(
         const char* from = msg->from ? msg->from : "";
         const char** to = msg->to ? (const char**)msg->to : &nothing;
         const char** cc = msg->cc ? (const char**)msg->cc : &nothing;
-        GSList* list = msg->parts;
         GVariant* parts;
-        GVariantBuilder b;
-
-        g_variant_builder_init(&b, G_VARIANT_TYPE("a(sss)"));
-        while (list) {
-            const MMSMessagePart* part = list->data;
-            g_variant_builder_add(&b, "(sss)", part->file,
-                part->content_type, part->content_id);
-            list = list->next;
-        }
-        parts = g_variant_ref_sink(g_variant_builder_end(&b));
 
-        mms_handler_busy_inc(handler);
-        call = mms_handler_message_received_call_create(dbus, msg, cb, param);
-        org_nemomobile_mms_handler_call_message_received(
-            proxy, msg->id, msg->message_id, from, to, cc, subject,
-            msg->date, msg->priority, msg->cls, msg->read_report_req,
-            parts, NULL, mms_handler_dbus_message_received_done, call);
-
-        g_variant_unref(parts);
+        if (msg->pdu) {
+            /* Some parts only exist inside the PDU */
+            GUnixFDList* fds = g_unix_fd_list_new();
+            parts = mms_handler_dbus_message_received_fd_parts(msg, fds);
+            if (parts) {
+                mms_handler_busy_inc(handler);
+                call = mms_handler_message_received_call_create(dbus, msg,
+                    cb, param);
+                org_nemomobile_mms_handler_call_message_received_fd(
+                    proxy, msg->id, msg->message_id, from, to, cc, subject,
+                    msg->date, msg->priority, msg->cls, msg->read_report_req,
+                    parts, fds, NULL,
+                    mms_handler_dbus_message_received_fd_done, call);
+                g_variant_unref(parts);
+            }
+            g_object_unref(fds);
+        } else {
+            GSList* list = msg->parts;
+            GVariantBuilder b;
+
+            g_variant_builder_init(&b, G_VARIANT_TYPE("a(sss)"));
+            while (list) {
+                const MMSMessagePart* part = list->data;
+                g_variant_builder_add(&b, "(sss)", part->file,
+                    part->content_type, part->content_id);
+                list = list->next;
+            }
+            parts = g_variant_ref_sink(g_variant_builder_end(&b));
+
+            mms_handler_busy_inc(handler);
+            call = mms_handler_message_received_call_create(dbus, msg,
+                cb, param);
+            org_nemomobile_mms_handler_call_message_received(
+                proxy, msg->id, msg->message_id, from, to, cc, subject,
+                msg->date, msg->priority, msg->cls, msg->read_report_req,
+                parts, NULL, mms_handler_dbus_message_received_done, call);
+            g_variant_unref(parts);
+        }
     }
     return call;
 }
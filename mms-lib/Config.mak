@@ -24,3 +24,30 @@ else
   endif
 endif
 
+#
+# io_uring can be used for writing message parts in batches. The batch
+# is only used when the file system can't clone or copy the parts in
+# the kernel, so it's off by default. Build with MMS_URING=1 to use it.
+#
+
+MMS_URING ?= 0
+
+ifneq ($(MMS_URING),0)
+URING_PKG = liburing
+URING_DEFINES = -DHAVE_LIBURING
+URING_CFLAGS = $(shell pkg-config --cflags $(URING_PKG))
+endif
+
+#
+# Animated GIFs are resized natively with giflib (5.1 or later). It
+# doesn't come with a pkg-config file, so it's not autodetected.
+# Build with MMS_GIF=0 to do without it.
+#
+
+MMS_GIF ?= 1
+
+ifneq ($(MMS_GIF),0)
+GIF_DEFINES = -DHAVE_GIFLIB
+GIF_LIBS = -lgif
+endif
+
@@ -26,6 +26,7 @@ struct mms_attachment_info {
     const char* file_name;
     const char* content_type;
     const char* content_id;
+    int fd;                     /* Not owned, -1 if it's a path */
 };
 
 gboolean
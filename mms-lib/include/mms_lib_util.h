@@ -27,7 +27,9 @@ typedef enum {
     MMS_LIB_ERROR_EXPIRED,
     MMS_LIB_ERROR_NOSIM,
     MMS_LIB_ERROR_ARGS,
-    MMS_LIB_ERROR_UNSUPPORTED
+    MMS_LIB_ERROR_UNSUPPORTED,
+    MMS_LIB_ERROR_DECODE_LIMIT,
+    MMS_LIB_ERROR_NOSPACE
 } MMSLibError;
 
 /* One-time initialization */
@@ -38,6 +38,7 @@ struct _mms_message {
     gboolean read_report_req;               /* Request for read report */
     char* msg_dir;                          /* Delete when done if empty */
     char* parts_dir;                        /* Where parts are stored */
+    char* pdu;                              /* Contains virtual parts */
     GSList* parts;                          /* Message parts */
     int flags;                              /* Message flags: */
 
@@ -50,6 +51,9 @@ typedef struct _mms_message_part {
     char* content_id;                       /* Content-ID */
     char* file;                             /* File name */
     char* orig;                             /* File prior to decoding */
+    char* name;                             /* Virtual part (no file): */
+    gsize offset;                           /*   Offset in the PDU */
+    gsize length;                           /*   Size of the part */
 } MMSMessagePart;
 
 MMSMessage*
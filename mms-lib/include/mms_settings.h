@@ -18,6 +18,13 @@
 
 #include "mms_lib_types.h"
 
+/* When received data are flushed to disk */
+typedef enum mms_sync_mode {
+    MMS_SYNC_NONE,              /* Leave it up to the kernel */
+    MMS_SYNC_MESSAGE,           /* Once per message, before the ack */
+    MMS_SYNC_FILE               /* After writing each file */
+} MMS_SYNC_MODE;
+
 /* Static configuration, chosen at startup and never changing since then */
 struct mms_config {
     const char* root_dir;       /* Root directory for storing MMS files */
@@ -27,17 +34,38 @@ struct mms_config {
     gboolean convert_to_utf8;   /* Convert text parts to UTF-8 */
     gboolean keep_temp_files;   /* Keep temporary files around */
     gboolean attic_enabled;     /* Keep unrecognized push message in attic */
+    unsigned int max_headers;   /* Max number of headers in a PDU */
+    unsigned int max_parts;     /* Max number of parts in a PDU */
+    unsigned int max_text;      /* Max total size of header values */
+    unsigned int decode_ms;     /* Max time spent decoding a PDU */
+    gboolean virtual_parts;     /* Don't extract parts from the PDU */
+    MMS_SYNC_MODE sync;         /* Durability policy */
+    gboolean dedup;             /* Share identical files between messages */
+    const char* staging_dir;    /* Transient files (NULL = root_dir) */
+    unsigned int staging_limit; /* Max bytes kept in staging_dir */
+    int orphan_secs;            /* Age of abandoned files to delete */
+    unsigned int resize_cache;  /* Max bytes of cached resized images */
 };
 
 typedef struct mms_config_copy {
     MMSConfig config;           /* Config data */
     char* root_dir;             /* Allocated copy of root_dir */
+    char* staging_dir;          /* Allocated copy of staging_dir */
 } MMSConfigCopy;
 
 #define MMS_CONFIG_DEFAULT_ROOT_DIR             NULL /* Dynamic */
 #define MMS_CONFIG_DEFAULT_RETRY_SECS           (15)
 #define MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS    (10)
 #define MMS_CONFIG_DEFAULT_IDLE_SECS            (30)
+#define MMS_CONFIG_DEFAULT_MAX_HEADERS          (2000)
+#define MMS_CONFIG_DEFAULT_MAX_PARTS            (200)
+#define MMS_CONFIG_DEFAULT_MAX_TEXT             (256*1024)
+#define MMS_CONFIG_DEFAULT_DECODE_MS            (1000)
+#define MMS_CONFIG_DEFAULT_SYNC                 MMS_SYNC_MESSAGE
+#define MMS_CONFIG_DEFAULT_STAGING_DIR          NULL /* Disabled */
+#define MMS_CONFIG_DEFAULT_STAGING_LIMIT        (16*1024*1024)
+#define MMS_CONFIG_DEFAULT_ORPHAN_SECS          (24*60*60)
+#define MMS_CONFIG_DEFAULT_RESIZE_CACHE         (0) /* Disabled */
 
 /* Persistent mutable per-SIM settings */
 struct mms_settings_sim_data {
@@ -46,6 +74,7 @@ struct mms_settings_sim_data {
     unsigned int size_limit;    /* Maximum size of m-Send.req PDU */
     unsigned int max_pixels;    /* Pixel limit for outbound images */
     gboolean allow_dr;          /* Allow sending delivery reports */
+    unsigned int min_jpeg_quality; /* Lowest quality for resized JPEGs */
 };
 
 /* Copy of per-SIM settings */
@@ -85,6 +114,7 @@ typedef struct mms_settings_class {
 #define MMS_SETTINGS_DEFAULT_SIZE_LIMIT (300*1024)
 #define MMS_SETTINGS_DEFAULT_MAX_PIXELS (3000000)
 #define MMS_SETTINGS_DEFAULT_ALLOW_DR   TRUE
+#define MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY (70)
 
 GType mms_settings_get_type(void);
 #define MMS_TYPE_SETTINGS (mms_settings_get_type())
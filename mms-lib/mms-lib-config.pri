@@ -1,4 +1,8 @@
 #CONFIG += ResizeImageMagick
 CONFIG += ResizeQt
 
+#CONFIG += IoUring
+
+CONFIG += Gif
+
 #CONFIG += ConnManNemo
@@ -1,7 +1,7 @@
 TEMPLATE = lib
 CONFIG += staticlib
 CONFIG += link_pkgconfig
-PKGCONFIG += libglibutil libwspcodec gmime-3.0 glib-2.0 libsoup-2.4
+PKGCONFIG += libglibutil libwspcodec gmime-3.0 glib-2.0 libsoup-2.4 libpng
 INCLUDEPATH += include
 QMAKE_CFLAGS += -Wno-unused-parameter
 
@@ -17,6 +17,16 @@ ResizeImageMagick {
   }
 }
 
+IoUring {
+  PKGCONFIG += liburing
+  DEFINES += HAVE_LIBURING
+}
+
+Gif {
+  DEFINES += HAVE_GIFLIB
+  SOURCES += src/mms_attachment_gif.c
+}
+
 CONFIG(debug, debug|release) {
   DEFINES += DEBUG
   DESTDIR = $$_PRO_FILE_PWD_/build/debug
@@ -28,18 +38,28 @@ SOURCES += \
   src/mms_attachment.c \
   src/mms_attachment_image.c \
   src/mms_attachment_jpeg.c \
+  src/mms_attachment_png.c \
   src/mms_attachment_text.c \
   src/mms_attachment_qt.cpp \
+  src/mms_base64.c \
+  src/mms_box_filter.c \
+  src/mms_charset.c \
   src/mms_codec.c \
   src/mms_connection.c \
   src/mms_connman.c \
   src/mms_error.c \
   src/mms_dispatcher.c \
+  src/mms_file_batch.c \
   src/mms_file_util.c \
+  src/mms_gc.c \
   src/mms_handler.c \
   src/mms_message.c \
   src/mms_lib_util.c \
+  src/mms_pdu_stream.c \
+  src/mms_resize_cache.c \
   src/mms_settings.c \
+  src/mms_sniff.c \
+  src/mms_store.c \
   src/mms_task.c \
   src/mms_task_ack.c \
   src/mms_task_decode.c \
@@ -57,9 +77,18 @@ SOURCES += \
 HEADERS += \
   src/mms_attachment.h \
   src/mms_attachment_image.h \
+  src/mms_base64.h \
+  src/mms_box_filter.h \
+  src/mms_charset.h \
   src/mms_codec.h \
   src/mms_error.h \
+  src/mms_file_batch.h \
   src/mms_file_util.h \
+  src/mms_gc.h \
+  src/mms_pdu_stream.h \
+  src/mms_resize_cache.h \
+  src/mms_sniff.h \
+  src/mms_store.h \
   src/mms_task.h \
   src/mms_task_http.h \
   src/mms_util.h \
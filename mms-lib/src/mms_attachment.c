@@ -18,13 +18,10 @@
 #include "mms_file_util.h"
 #include "mms_settings.h"
 #include "mms_codec.h"
+#include "mms_sniff.h"
 
 #include "gutil_strv.h"
 
-#ifdef HAVE_MAGIC
-#  include <magic.h>
-#endif
-
 /* Logging */
 #define GLOG_MODULE_NAME mms_attachment_log
 #include "mms_error.h"
@@ -56,6 +53,8 @@ G_DEFINE_TYPE(MMSAttachment, mms_attachment, G_TYPE_OBJECT)
 #define MEDIA_TYPE_AUDIO_PREFIX "audio/"
 
 #define MEDIA_TYPE_IMAGE_JPEG   MEDIA_TYPE_IMAGE_PREFIX "jpeg"
+#define MEDIA_TYPE_IMAGE_PNG    MEDIA_TYPE_IMAGE_PREFIX "png"
+#define MEDIA_TYPE_IMAGE_GIF    MEDIA_TYPE_IMAGE_PREFIX "gif"
 
 static
 void
@@ -182,41 +181,32 @@ mms_attachment_write_smil(
     return FALSE;
 }
 
+/* The encoding is only returned for text */
 static
 char*
 mms_attachment_guess_content_type(
-    const MMSAttachmentInfo* ai)
+    const MMSAttachmentInfo* ai,
+    char** encoding)
 {
-    char* content_type = NULL;
-    const char* detected_type = NULL;
-
-#ifdef HAVE_MAGIC
-    /* Use magic to determine mime type */
-    magic_t magic = magic_open(MAGIC_MIME_TYPE);
-    if (magic) {
-        if (magic_load(magic, NULL) == 0) {
-            detected_type = magic_buffer(magic, ai->data, ai->size);
-        }
-    }
-#endif
+    char* charset = NULL;
+    char* content_type = mms_sniff_media_type(ai, &charset);
 
-    /* Magic detects SMIL as text/html */
-    if ((!detected_type ||
-         g_str_has_prefix(detected_type, MEDIA_TYPE_TEXT_PREFIX)) &&
-         mms_file_is_smil(ai)) {
-        detected_type = SMIL_CONTENT_TYPE;
-    }
-
-    if (!detected_type) {
+    if (!content_type) {
         GWARN("No mime type for %s", ai->file_name);
-        detected_type = MMS_ATTACHMENT_DEFAULT_TYPE;
+        content_type = g_strdup(MMS_ATTACHMENT_DEFAULT_TYPE);
     }
 
-    content_type = g_strdup(detected_type);
-
-#ifdef HAVE_MAGIC
-    if (magic) magic_close(magic);
-#endif
+    if (g_str_has_prefix(content_type, MEDIA_TYPE_TEXT_PREFIX)) {
+        if (charset) {
+            GDEBUG("%s: detected %s", ai->file_name, charset);
+            *encoding = charset;
+        } else {
+            *encoding = g_strdup(MMS_DEFAULT_CHARSET);
+        }
+    } else {
+        *encoding = NULL;
+        g_free(charset);
+    }
 
     return content_type;
 }
@@ -226,31 +216,14 @@ char*
 mms_attachment_guess_text_encoding(
     const MMSAttachmentInfo* ai)
 {
-    char* encoding = NULL;
-    const char* detected = NULL;
-
-#ifdef HAVE_MAGIC
-    /* Use magic to determine mime type */
-    magic_t magic = magic_open(MAGIC_MIME_ENCODING);
-    if (magic) {
-        if (magic_load(magic, NULL) == 0) {
-            detected = magic_buffer(magic, ai->data, ai->size);
-        }
-    }
-#endif
+    char* encoding = mms_sniff_charset(ai);
 
-    if (detected) {
-        GDEBUG("%s: detected %s", ai->file_name, detected);
-        encoding = g_strdup(detected);
+    if (encoding) {
+        GDEBUG("%s: detected %s", ai->file_name, encoding);
+        return encoding;
     } else {
-        encoding = g_strdup(MMS_DEFAULT_CHARSET);
+        return g_strdup(MMS_DEFAULT_CHARSET);
     }
-
-#ifdef HAVE_MAGIC
-    if (magic) magic_close(magic);
-#endif
-
-    return encoding;
 }
 
 static
@@ -258,6 +231,7 @@ gboolean
 mms_attachment_info_init(
     MMSAttachmentInfo* ai,
     GMappedFile* map,
+    int fd,
     const char* path,
     const char* content_type,
     const char* content_id)
@@ -269,9 +243,11 @@ mms_attachment_info_init(
         ai->file_name = path;
         ai->content_type = content_type;
         ai->content_id = content_id;
+        ai->fd = fd;
         return TRUE;
     } else {
         memset(ai, 0, sizeof(*ai));
+        ai->fd = -1;
         return FALSE;
     }
 }
@@ -285,7 +261,7 @@ mms_attachment_info_path(
     GError** error)
 {
     return mms_attachment_info_init(ai,
-        g_mapped_file_new(path, FALSE, error),
+        g_mapped_file_new(path, FALSE, error), -1,
         path, content_type, content_id);
 }
 
@@ -299,7 +275,7 @@ mms_attachment_info_fd(
     GError** error)
 {
     return mms_attachment_info_init(ai,
-        g_mapped_file_new_from_fd(fd, FALSE, error),
+        g_mapped_file_new_from_fd(fd, FALSE, error), fd,
         name, content_type, content_id);
 }
 
@@ -309,6 +285,7 @@ mms_attachment_info_cleanup(
 {
     if (ai->map) g_mapped_file_unref(ai->map);
     memset(ai, 0, sizeof(*ai));
+    ai->fd = -1;
 }
 
 MMSAttachment*
@@ -419,11 +396,8 @@ mms_attachment_new(
         const char* ct[6];
         int n = 0;
 
-        media_type = mms_attachment_guess_content_type(info);
-        if (g_str_has_prefix(media_type, MEDIA_TYPE_TEXT_PREFIX)) {
-            detected = mms_attachment_guess_text_encoding(info);
-            charset = detected;
-        }
+        media_type = mms_attachment_guess_content_type(info, &detected);
+        charset = detected;
 
         ct[n++] = media_type;
         if (charset) {
@@ -441,6 +415,12 @@ mms_attachment_new(
         flags |= MMS_ATTACHMENT_SMIL;
     } else if (!strcmp(media_type, MEDIA_TYPE_IMAGE_JPEG)) {
         type = MMS_TYPE_ATTACHMENT_JPEG;
+    } else if (!strcmp(media_type, MEDIA_TYPE_IMAGE_PNG)) {
+        type = MMS_TYPE_ATTACHMENT_PNG;
+#ifdef HAVE_GIFLIB
+    } else if (!strcmp(media_type, MEDIA_TYPE_IMAGE_GIF)) {
+        type = MMS_TYPE_ATTACHMENT_GIF;
+#endif
     } else if (g_str_has_prefix(media_type, MEDIA_TYPE_IMAGE_PREFIX)) {
         type = MMS_TYPE_ATTACHMENT_IMAGE;
     } else if (g_str_has_prefix(media_type, MEDIA_TYPE_TEXT_PREFIX)) {
@@ -514,6 +494,28 @@ mms_attachment_resize(
     return FALSE;
 }
 
+/**
+ * Shrinks the attachment to approximately the given fraction of its
+ * current size in one go. Falls back to the next resize step if the
+ * attachment doesn't know how to do that.
+ */
+gboolean
+mms_attachment_resize_ratio(
+    MMSAttachment* at,
+    const MMSSettingsSimData* settings,
+    double ratio)
+{
+    if (at) {
+        MMSAttachmentClass* klass = MMS_ATTACHMENT_GET_CLASS(at);
+        if (klass->fn_resize_ratio) {
+            return klass->fn_resize_ratio(at, settings, ratio);
+        } else if (klass->fn_resize) {
+            return klass->fn_resize(at, settings);
+        }
+    }
+    return FALSE;
+}
+
 /*
  * Local Variables:
  * mode: C
@@ -33,6 +33,7 @@ struct _mms_attachment {
 
 #define MMS_ATTACHMENT_SMIL         (0x01)
 #define MMS_ATTACHMENT_RESIZABLE    (0x02)
+#define MMS_ATTACHMENT_STAGED       (0x04)
 };
 
 #define CONTENT_TYPE_PARAM_NAME         "name"
@@ -48,16 +49,24 @@ typedef struct mms_attachment_class {
     gboolean (*fn_resize)(
         MMSAttachment* attachment,
         const MMSSettingsSimData* settings);
+    gboolean (*fn_resize_ratio)(
+        MMSAttachment* attachment,
+        const MMSSettingsSimData* settings,
+        double ratio);
 } MMSAttachmentClass;
 
 GType mms_attachment_get_type(void);
 GType mms_attachment_text_get_type(void);
 GType mms_attachment_image_get_type(void);
 GType mms_attachment_jpeg_get_type(void);
+GType mms_attachment_png_get_type(void);
+GType mms_attachment_gif_get_type(void);
 #define MMS_TYPE_ATTACHMENT         (mms_attachment_get_type())
 #define MMS_TYPE_ATTACHMENT_TEXT    (mms_attachment_text_get_type())
 #define MMS_TYPE_ATTACHMENT_IMAGE   (mms_attachment_image_get_type())
 #define MMS_TYPE_ATTACHMENT_JPEG    (mms_attachment_jpeg_get_type())
+#define MMS_TYPE_ATTACHMENT_PNG     (mms_attachment_png_get_type())
+#define MMS_TYPE_ATTACHMENT_GIF     (mms_attachment_gif_get_type())
 
 MMSAttachment*
 mms_attachment_new(
@@ -90,6 +99,12 @@ mms_attachment_resize(
     MMSAttachment* attachment,
     const MMSSettingsSimData* settings);
 
+gboolean
+mms_attachment_resize_ratio(
+    MMSAttachment* attachment,
+    const MMSSettingsSimData* settings,
+    double ratio);
+
 #endif /* SAILFISH_MMS_ATTACHMENT_H */
 
 /*
@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_attachment_image.h"
+#include "mms_settings.h"
+
+#include <gif_lib.h>
+
+#if GIFLIB_MAJOR < 5 || (GIFLIB_MAJOR == 5 && GIFLIB_MINOR < 1)
+#  error "giflib 5.1 or later is required"
+#endif
+
+/* Logging */
+#define GLOG_MODULE_NAME mms_attachment_log
+#include <gutil_log.h>
+
+typedef MMSAttachmentImageClass MMSAttachmentGifClass;
+typedef MMSAttachmentImage MMSAttachmentGif;
+
+G_DEFINE_TYPE(MMSAttachmentGif, mms_attachment_gif, \
+        MMS_TYPE_ATTACHMENT_IMAGE)
+
+#define MMS_GIF_MAX_DELAY (0xffff)
+
+/*
+ * Animated GIFs are resized frame by frame, one line at a time, without
+ * ever decoding the whole thing. The pixels are point-sampled so that
+ * the palette stays the same. If every frame covers the whole screen
+ * and has no transparency, some frames can also be dropped - each one
+ * doesn't depend on the previous one.
+ */
+typedef struct mms_attachment_gif_frame {
+    int left;
+    int top;
+    int width;
+    int height;
+    int delay;
+    gboolean interlaced;
+    gboolean transparent;
+} MMSAttachmentGifFrame;
+
+typedef struct mms_attachment_gif_info {
+    int width;
+    int height;
+    int max_frame_width;
+    GArray* frames;
+} MMSAttachmentGifInfo;
+
+static
+gboolean
+mms_attachment_gif_skip_extension(
+    GifFileType* gif,
+    GifByteType* ext)
+{
+    while (ext) {
+        if (DGifGetExtensionNext(gif, &ext) != GIF_OK) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static
+gboolean
+mms_attachment_gif_skip_pixels(
+    GifFileType* gif)
+{
+    int size;
+    GifByteType* block = NULL;
+
+    /* Skips the compressed data without decompressing it */
+    if (DGifGetCode(gif, &size, &block) != GIF_OK) {
+        return FALSE;
+    }
+    while (block) {
+        if (DGifGetCodeNext(gif, &block) != GIF_OK) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static
+gboolean
+mms_attachment_gif_read_gcb(
+    GifFileType* gif,
+    GifByteType* ext,
+    GraphicsControlBlock* gcb)
+{
+    return DGifExtensionToGCB(ext[0], ext + 1, gcb) == GIF_OK &&
+        mms_attachment_gif_skip_extension(gif, ext);
+}
+
+static
+gboolean
+mms_attachment_gif_scan(
+    const char* file,
+    MMSAttachmentGifInfo* info)
+{
+    int err = 0;
+    gboolean ok = FALSE;
+    GifFileType* gif = DGifOpenFileName(file, &err);
+
+    if (gif) {
+        GifRecordType type = UNDEFINED_RECORD_TYPE;
+        MMSAttachmentGifFrame frame;
+
+        memset(&frame, 0, sizeof(frame));
+        info->width = gif->SWidth;
+        info->height = gif->SHeight;
+        info->frames = g_array_new(FALSE, FALSE, sizeof(frame));
+        while (DGifGetRecordType(gif, &type) == GIF_OK &&
+            type != TERMINATE_RECORD_TYPE) {
+            if (type == IMAGE_DESC_RECORD_TYPE) {
+                if (DGifGetImageDesc(gif) != GIF_OK) {
+                    break;
+                }
+                frame.left = gif->Image.Left;
+                frame.top = gif->Image.Top;
+                frame.width = gif->Image.Width;
+                frame.height = gif->Image.Height;
+                frame.interlaced = gif->Image.Interlace;
+                g_array_append_val(info->frames, frame);
+                info->max_frame_width = MAX(info->max_frame_width,
+                    frame.width);
+                memset(&frame, 0, sizeof(frame));
+                if (!mms_attachment_gif_skip_pixels(gif)) {
+                    break;
+                }
+            } else if (type == EXTENSION_RECORD_TYPE) {
+                int code;
+                GifByteType* ext = NULL;
+
+                if (DGifGetExtension(gif, &code, &ext) != GIF_OK) {
+                    break;
+                }
+                if (code == GRAPHICS_EXT_FUNC_CODE && ext) {
+                    GraphicsControlBlock gcb;
+
+                    if (!mms_attachment_gif_read_gcb(gif, ext, &gcb)) {
+                        break;
+                    }
+                    frame.delay = gcb.DelayTime;
+                    frame.transparent = (gcb.TransparentColor !=
+                        NO_TRANSPARENT_COLOR);
+                } else if (!mms_attachment_gif_skip_extension(gif, ext)) {
+                    break;
+                }
+            }
+        }
+        /* Tolerate the missing trailer, as long as there are frames */
+        ok = info->frames->len > 0 && info->width > 0 && info->height > 0;
+        if (type != TERMINATE_RECORD_TYPE) {
+            GDEBUG("%s: %s", file, GifErrorString(gif->Error));
+        }
+        DGifCloseFile(gif, &err);
+    } else {
+        GERR("Failed to open %s: %s", file, GifErrorString(err));
+    }
+    return ok;
+}
+
+/*
+ * Returns the maximum number of consecutive frames which can be merged
+ * into one. Only frames which completely overwrite each other can be
+ * dropped, and at least two frames have to remain.
+ */
+static
+guint
+mms_attachment_gif_max_decimation(
+    const MMSAttachmentGifInfo* info)
+{
+    const MMSAttachmentGifFrame* frames = (void*)info->frames->data;
+    const guint n = info->frames->len;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        const MMSAttachmentGifFrame* frame = frames + i;
+
+        if (frame->transparent || frame->left || frame->top ||
+            frame->width != info->width || frame->height != info->height) {
+            return 1;
+        }
+    }
+    /* Keep it animated */
+    return (n > 2) ? (n - 1) : 1;
+}
+
+/*
+ * Picks the scale and the number of frames merged into one for the
+ * resize step. The step means the same as for other images: the file
+ * is expected to shrink (step + 1)^2 times. The size of an animation
+ * is proportional to its width, height and number of frames, so the
+ * reduction is spread evenly among the three, as far as the integer
+ * factors allow. Whatever the scale, it also has to satisfy max_pixels.
+ */
+static
+guint
+mms_attachment_gif_scale(
+    const MMSAttachmentGifInfo* info,
+    int step,
+    unsigned int max_pixels,
+    guint* decimate)
+{
+    const guint64 reduce = (guint64)(step + 1) * (step + 1);
+    const guint max_decimate = mms_attachment_gif_max_decimation(info);
+    guint scale = 1, d = 1;
+
+    /* Cube root, rounded down */
+    while (d < max_decimate && (guint64)(d + 1) * (d + 1) * (d + 1) <=
+        reduce) {
+        d++;
+    }
+    while ((guint64)scale * scale * d < reduce) {
+        scale++;
+    }
+    while (max_pixels > 0 && (guint64)(info->width/scale) *
+        (info->height/scale) > max_pixels) {
+        scale++;
+    }
+    /* Integer scale may have done more than its share */
+    *decimate = MAX((reduce + (guint64)scale * scale - 1) /
+        ((guint64)scale * scale), 1);
+    return scale;
+}
+
+/* Maps the output coordinate to the input one, within the frame */
+static inline
+int
+mms_attachment_gif_sample(
+    int pos,
+    guint scale,
+    int start,
+    int size)
+{
+    return CLAMP(pos * (int)scale, start, start + size - 1);
+}
+
+static
+void
+mms_attachment_gif_output_range(
+    int start,
+    int size,
+    guint scale,
+    int max,
+    int* out_start,
+    int* out_end)
+{
+    int first = (start + (int)scale - 1)/(int)scale;
+    int last = (start + size + (int)scale - 1)/(int)scale;
+
+    /* Every frame must have at least one pixel */
+    if (first >= max) first = max - 1;
+    if (last > max) last = max;
+    if (last <= first) last = first + 1;
+    *out_start = first;
+    *out_end = last;
+}
+
+static
+gboolean
+mms_attachment_gif_copy_extension(
+    GifFileType* in,
+    GifFileType* out,
+    int code,
+    GifByteType* ext)
+{
+    if (EGifPutExtensionLeader(out, code) != GIF_OK) {
+        return FALSE;
+    }
+    while (ext) {
+        if (EGifPutExtensionBlock(out, ext[0], ext + 1) != GIF_OK ||
+            DGifGetExtensionNext(in, &ext) != GIF_OK) {
+            return FALSE;
+        }
+    }
+    return EGifPutExtensionTrailer(out) == GIF_OK;
+}
+
+static
+gboolean
+mms_attachment_gif_write_frame(
+    GifFileType* in,
+    GifFileType* out,
+    const MMSAttachmentGifFrame* frame,
+    guint scale,
+    int out_width,
+    int out_height,
+    GifPixelType* in_line,
+    GifPixelType* out_line)
+{
+    int x0, x1, y0, y1, x, y, r;
+
+    mms_attachment_gif_output_range(frame->left, frame->width, scale,
+        out_width, &x0, &x1);
+    mms_attachment_gif_output_range(frame->top, frame->height, scale,
+        out_height, &y0, &y1);
+    if (EGifPutImageDesc(out, x0, y0, x1 - x0, y1 - y0, FALSE,
+        in->Image.ColorMap) != GIF_OK) {
+        return FALSE;
+    }
+
+    /* Source rows are read in order, each one produces 0 or more rows */
+    for (r = 0, y = y0; r < frame->height; r++) {
+        if (DGifGetLine(in, in_line, frame->width) != GIF_OK) {
+            return FALSE;
+        }
+        while (y < y1 && mms_attachment_gif_sample(y, scale, frame->top,
+            frame->height) == frame->top + r) {
+            for (x = x0; x < x1; x++) {
+                out_line[x - x0] = in_line[mms_attachment_gif_sample(x,
+                    scale, frame->left, frame->width) - frame->left];
+            }
+            if (EGifPutLine(out, out_line, x1 - x0) != GIF_OK) {
+                return FALSE;
+            }
+            y++;
+        }
+    }
+    return TRUE;
+}
+
+static
+gboolean
+mms_attachment_gif_transcode(
+    GifFileType* in,
+    GifFileType* out,
+    const MMSAttachmentGifInfo* info,
+    guint scale,
+    guint decimate)
+{
+    const MMSAttachmentGifFrame* frames = (void*)info->frames->data;
+    const int out_width = info->width/scale;
+    const int out_height = info->height/scale;
+    GifPixelType* in_line = g_malloc(info->max_frame_width);
+    GifPixelType* out_line = g_malloc(out_width);
+    GraphicsControlBlock gcb;
+    gboolean have_gcb = FALSE;
+    gboolean ok = FALSE;
+    GifRecordType type;
+    guint i = 0;
+
+    EGifSetGifVersion(out, TRUE);
+    if (EGifPutScreenDesc(out, out_width, out_height, in->SColorResolution,
+        in->SBackGroundColor, in->SColorMap) != GIF_OK) {
+        goto done;
+    }
+
+    while (DGifGetRecordType(in, &type) == GIF_OK &&
+        type != TERMINATE_RECORD_TYPE) {
+        if (type == IMAGE_DESC_RECORD_TYPE) {
+            if (DGifGetImageDesc(in) != GIF_OK || i >= info->frames->len) {
+                goto done;
+            }
+            if (i % decimate) {
+                /* Dropped frame */
+                if (!mms_attachment_gif_skip_pixels(in)) {
+                    goto done;
+                }
+            } else {
+                const guint last = MIN(i + decimate, info->frames->len);
+
+                if (have_gcb || decimate > 1) {
+                    GifByteType ext[4];
+                    guint k;
+
+                    if (!have_gcb) {
+                        memset(&gcb, 0, sizeof(gcb));
+                        gcb.DisposalMode = DISPOSAL_UNSPECIFIED;
+                        gcb.TransparentColor = NO_TRANSPARENT_COLOR;
+                    }
+                    /* The merged frame stays on the screen as long */
+                    for (gcb.DelayTime = 0, k = i; k < last; k++) {
+                        gcb.DelayTime += frames[k].delay;
+                    }
+                    gcb.DelayTime = MIN(gcb.DelayTime, MMS_GIF_MAX_DELAY);
+                    EGifGCBToExtension(&gcb, ext);
+                    if (EGifPutExtension(out, GRAPHICS_EXT_FUNC_CODE,
+                        sizeof(ext), ext) != GIF_OK) {
+                        goto done;
+                    }
+                }
+                if (!mms_attachment_gif_write_frame(in, out, frames + i,
+                    scale, out_width, out_height, in_line, out_line)) {
+                    goto done;
+                }
+            }
+            have_gcb = FALSE;
+            i++;
+        } else if (type == EXTENSION_RECORD_TYPE) {
+            int code;
+            GifByteType* ext = NULL;
+
+            if (DGifGetExtension(in, &code, &ext) != GIF_OK) {
+                goto done;
+            }
+            if (code == GRAPHICS_EXT_FUNC_CODE && ext) {
+                if (!mms_attachment_gif_read_gcb(in, ext, &gcb)) {
+                    goto done;
+                }
+                have_gcb = TRUE;
+            } else if (code == APPLICATION_EXT_FUNC_CODE && !i) {
+                /* That's where the loop count lives */
+                if (!mms_attachment_gif_copy_extension(in, out, code, ext)) {
+                    goto done;
+                }
+            } else if (!mms_attachment_gif_skip_extension(in, ext)) {
+                goto done;
+            }
+        }
+    }
+    ok = (i == info->frames->len);
+
+done:
+    if (!ok) {
+        GERR("GIF error: %s", GifErrorString(in->Error ? in->Error :
+            out->Error));
+    }
+    g_free(in_line);
+    g_free(out_line);
+    return ok;
+}
+
+static
+gboolean
+mms_attachment_gif_resize_file(
+    MMSAttachmentImage* image,
+    const MMSSettingsSimData* settings)
+{
+    MMSAttachment* at = &image->attachment;
+    MMSAttachmentGifInfo info;
+    gboolean ok = FALSE;
+
+    memset(&info, 0, sizeof(info));
+    if (mms_attachment_gif_scan(at->original_file, &info)) {
+        const MMSAttachmentGifFrame* frames = (void*)info.frames->data;
+        const int next_step = mms_attachment_image_next_resize_step(image,
+            settings, info.width, info.height);
+        guint decimate;
+        const guint scale = mms_attachment_gif_scale(&info, next_step,
+            settings ? settings->max_pixels : MMS_SETTINGS_DEFAULT_MAX_PIXELS,
+            &decimate);
+        guint i;
+
+        for (i = 0; i < info.frames->len && !frames[i].interlaced; i++);
+        if (i < info.frames->len) {
+            /* Not worth the trouble */
+            GDEBUG("%s is interlaced", at->original_file);
+        } else if (info.width/scale && info.height/scale) {
+            const char* fname = mms_attachment_image_prepare_filename(image);
+            int err = 0;
+            GifFileType* in = DGifOpenFileName(at->original_file, &err);
+            GifFileType* out = in ? EGifOpenFileName(fname, FALSE, &err) :
+                NULL;
+
+            GDEBUG("Resizing (%dx%d -> %ux%u, %u frame(s) -> %u)",
+                info.width, info.height, info.width/scale,
+                info.height/scale, info.frames->len,
+                (info.frames->len + decimate - 1)/decimate);
+            if (out) {
+                ok = mms_attachment_gif_transcode(in, out, &info, scale,
+                    decimate);
+                if (EGifCloseFile(out, &err) != GIF_OK) {
+                    GERR("Failed to write %s: %s", fname,
+                        GifErrorString(err));
+                    ok = FALSE;
+                }
+            } else {
+                GERR("%s", GifErrorString(err));
+            }
+            if (in) {
+                DGifCloseFile(in, &err);
+            }
+            if (ok) {
+                GDEBUG("Resized %s", fname);
+                image->resize_step = next_step;
+            }
+        }
+    }
+    if (info.frames) {
+        g_array_free(info.frames, TRUE);
+    }
+    return ok;
+}
+
+static
+void
+mms_attachment_gif_class_init(
+    MMSAttachmentGifClass* klass)
+{
+    klass->fn_resize_file = mms_attachment_gif_resize_file;
+}
+
+static
+void
+mms_attachment_gif_init(
+    MMSAttachmentGif* gif)
+{
+    gif->attachment.flags |= MMS_ATTACHMENT_RESIZABLE;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
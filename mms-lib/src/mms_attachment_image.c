@@ -16,6 +16,9 @@
 #include "mms_attachment_image.h"
 #include "mms_settings.h"
 #include "mms_file_util.h"
+#include "mms_store.h"
+#include "mms_box_filter.h"
+#include "mms_resize_cache.h"
 
 #ifdef MMS_RESIZE_IMAGEMAGICK
 #  include <magick/api.h>
@@ -38,9 +41,16 @@ mms_attachment_image_next_resize_step(
     unsigned int columns,
     unsigned int rows)
 {
-    int next_step = image->resize_step + 1;
+    int next_step = (image->plan_step >= 0) ? image->plan_step :
+        (image->resize_step + 1);
     const unsigned int max_pixels = settings ? settings->max_pixels :
         MMS_SETTINGS_DEFAULT_MAX_PIXELS;
+
+    /* Don't shrink it to nothing, whatever has been planned */
+    while (image->plan_step >= 0 && next_step > 0 &&
+        (!(columns/(next_step+1)) || !(rows/(next_step+1)))) {
+        next_step--;
+    }
     if (max_pixels > 0) {
         unsigned int size = (columns/(next_step+1))*(rows/(next_step+1));
         while (size > 0 && size > max_pixels) {
@@ -51,6 +61,27 @@ mms_attachment_image_next_resize_step(
     return next_step;
 }
 
+/*
+ * The file size is assumed to be proportional to the number of
+ * pixels, i.e. bytes per pixel don't change. Both dimensions get
+ * divided by (step + 1), returns the smallest step that does it.
+ */
+int
+mms_attachment_image_ratio_step(
+    MMSAttachmentImage* image,
+    double ratio)
+{
+    const double div = image->resize_step + 1;
+    int step = image->resize_step + 1;
+
+    if (ratio > 0) {
+        while ((div * div) / ((step + 1) * (step + 1)) > ratio) {
+            step++;
+        }
+    }
+    return step;
+}
+
 const char*
 mms_attachment_image_prepare_filename(
     MMSAttachmentImage* image)
@@ -136,6 +167,9 @@ mms_attachment_image_resize_type_specific(
     MMSAttachment* at = &image->attachment;
     MMSAttachmentImageClass* klass = MMS_ATTACHMENT_IMAGE_GET_CLASS(image);
     MMSAttachmentImageResize* resize;
+    if (klass->fn_resize_file) {
+        return klass->fn_resize_file(image, settings);
+    }
     if (klass->fn_resize_new && (resize =
         klass->fn_resize_new(image, at->original_file)) != NULL) {
         gboolean can_resize;
@@ -179,58 +213,29 @@ mms_attachment_image_resize_type_specific(
             } else {
                 const guint nx = (resize->in.width/resize->out.width);
                 const guint ny = (resize->in.height/resize->out.height);
-                gsize bufsize = 3*resize->out.width*sizeof(guint);
-                guint* buf = g_malloc(bufsize);
-                memset(buf, 0, bufsize);
-                GDEBUG("Resizing (%ux%u -> %ux%u)",
+                MMSBoxFilter* filter = mms_box_filter_new(resize->out.width,
+                    nx, ny, MMS_BOX_FILTER_AUTO);
+                GDEBUG("Resizing (%ux%u -> %ux%u, %s)",
                     image_size.width, image_size.height,
-                    out_size.width, out_size.height);
+                    out_size.width, out_size.height,
+                    mms_box_filter_impl_name(mms_box_filter_impl(filter)));
                 for (y=0;
                      y<resize->in.height &&
                      klass->fn_resize_read_line(resize, line);
                      y++) {
-
-                    /* Update the resize buffer */
-                    guint x;
-                    guint* bufptr = buf;
-                    const unsigned char* lineptr = line;
-                    for (x=0; x<resize->out.width; x++) {
-                        guint k;
-                        for (k=0; k<nx; k++) {
-                            bufptr[0] += (*lineptr++);
-                            bufptr[1] += (*lineptr++);
-                            bufptr[2] += (*lineptr++);
-                        }
-                        bufptr += 3;
-                    }
-
-                    if ((y % ny) == (ny-1)) {
-                        /* Average the pixels */
-                        unsigned char* outptr = line;
-                        const guint denominator = nx*ny;
-                        bufptr = buf;
-                        for (x=0; x<resize->out.width; x++) {
-                            (*outptr++) = (*bufptr++)/denominator;
-                            (*outptr++) = (*bufptr++)/denominator;
-                            (*outptr++) = (*bufptr++)/denominator;
-                        }
-
-                        /* And write the next line */
-                        if (klass->fn_resize_write_line(resize, line)) {
-                            memset(buf, 0, bufsize);
-                        } else {
-                            break;
-                        }
+                    /* Every ny-th line produces the output line */
+                    if (mms_box_filter_add_row(filter, line, line) &&
+                        !klass->fn_resize_write_line(resize, line)) {
+                        break;
                     }
                 }
-                g_free(buf);
+                mms_box_filter_free(filter);
             }
 
-            if (klass->fn_resize_finish) {
-                klass->fn_resize_finish(resize);
-            }
-
-            if (y == resize->in.height) {
+            if (klass->fn_resize_finish &&
+                !klass->fn_resize_finish(resize)) {
+                GDEBUG("Failed to finish %s", fname);
+            } else if (y == resize->in.height) {
                 GDEBUG("Resized %s", fname);
                 image->resize_step = next_step;
                 ok = TRUE;
@@ -245,6 +250,44 @@ mms_attachment_image_resize_type_specific(
     return ok;
 }
 
+/*
+ * Everything which determines the result of the resize: the original
+ * file, the limits and the current state of the attachment.
+ */
+static
+char*
+mms_attachment_image_cache_key(
+    MMSAttachmentImage* image,
+    const MMSSettingsSimData* settings)
+{
+    MMSAttachment* at = &image->attachment;
+    MMSAttachmentImageClass* klass = MMS_ATTACHMENT_IMAGE_GET_CLASS(image);
+    GString* buf;
+    char* key;
+
+    /* The original doesn't change, it only needs to be hashed once */
+    if (!image->original_hash) {
+        GMappedFile* map = g_mapped_file_new(at->original_file, FALSE, NULL);
+
+        if (!map) return NULL;
+        image->original_hash = mms_store_key(g_mapped_file_get_contents(map),
+            g_mapped_file_get_length(map));
+        g_mapped_file_unref(map);
+    }
+
+    buf = g_string_new(image->original_hash);
+    g_string_append_printf(buf, " %s %u %d %d", G_OBJECT_TYPE_NAME(image),
+        settings ? settings->max_pixels : MMS_SETTINGS_DEFAULT_MAX_PIXELS,
+        image->resize_step, image->plan_step);
+    if (klass->fn_cache_key) {
+        klass->fn_cache_key(image, buf);
+    }
+    key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, buf->str,
+        buf->len);
+    g_string_free(buf, TRUE);
+    return key;
+}
+
 static
 gboolean
 mms_attachment_image_resize(
@@ -252,16 +295,46 @@ mms_attachment_image_resize(
     const MMSSettingsSimData* settings)
 {
     MMSAttachmentImage* image = MMS_ATTACHMENT_IMAGE(at);
+    MMSAttachmentImageClass* klass = MMS_ATTACHMENT_IMAGE_GET_CLASS(image);
+    MMSResizeCacheResult cached;
+    char* key = NULL;
     gboolean ok;
     if (at->map && image->resized) {
         g_mapped_file_unref(at->map);
         at->map = NULL;
     }
-    ok = mms_attachment_image_resize_type_specific(image, settings);
-    if (!ok) ok = mms_attachment_image_resize_default(image, settings);
+    /* Staged images live on tmpfs, the cache is on persistent storage */
+    if (at->config->resize_cache && !(at->flags & MMS_ATTACHMENT_STAGED)) {
+        key = mms_attachment_image_cache_key(image, settings);
+    }
+    if (key && mms_resize_cache_get(at->config, key,
+        mms_attachment_image_prepare_filename(image), &cached)) {
+        /* Resized exactly this way before */
+        image->resize_step = cached.step;
+        if (klass->fn_cache_set_state) {
+            klass->fn_cache_set_state(image, cached.state);
+        }
+        ok = TRUE;
+    } else {
+        ok = mms_attachment_image_resize_type_specific(image, settings);
+        if (!ok) ok = mms_attachment_image_resize_default(image, settings);
+        if (ok && key) {
+            cached.step = image->resize_step;
+            cached.state = klass->fn_cache_get_state ?
+                klass->fn_cache_get_state(image) : 0;
+            mms_resize_cache_put(at->config, key, image->resized, &cached);
+        }
+    }
+    g_free(key);
     if (ok) {
         GError* error = NULL;
-        GMappedFile* map = g_mapped_file_new(image->resized, FALSE, &error);
+        GMappedFile* map;
+
+        /* The same image may have already been resized the same way */
+        if (at->config->dedup && !(at->flags & MMS_ATTACHMENT_STAGED)) {
+            mms_store_intern(at->config->root_dir, image->resized);
+        }
+        map = g_mapped_file_new(image->resized, FALSE, &error);
         if (map) {
             if (at->map) g_mapped_file_unref(at->map);
             at->file_name = image->resized;
@@ -272,21 +345,43 @@ mms_attachment_image_resize(
             ok = FALSE;
         }
     }
+    if (!ok && !at->map) {
+        /* The resized file is gone, fall back to the original */
+        image->resize_step = 0;
+        at->file_name = at->original_file;
+        at->map = g_mapped_file_new(at->original_file, FALSE, NULL);
+    }
+    image->plan_step = -1;
     return ok;
 }
 
+static
+gboolean
+mms_attachment_image_resize_ratio(
+    MMSAttachment* at,
+    const MMSSettingsSimData* settings,
+    double ratio)
+{
+    MMSAttachmentImage* image = MMS_ATTACHMENT_IMAGE(at);
+
+    image->plan_step = mms_attachment_image_ratio_step(image, ratio);
+    return mms_attachment_image_resize(at, settings);
+}
+
 static
 void
 mms_attachment_image_reset(
     MMSAttachment* at)
 {
     MMSAttachmentImage* image = MMS_ATTACHMENT_IMAGE(at);
-    at->file_name = at->original_file;
-    if (image->resize_step) {
+    image->plan_step = -1;
+    /* Re-encoding at step zero replaces the file too */
+    if (image->resize_step || at->file_name != at->original_file) {
         image->resize_step = 0;
         if (at->map) g_mapped_file_unref(at->map);
         at->map = g_mapped_file_new(at->original_file, FALSE, NULL);
     }
+    at->file_name = at->original_file;
 }
 
 static
@@ -299,6 +394,7 @@ mms_attachment_image_finalize(
         mms_remove_file_and_dir(image->resized);
     }
     g_free(image->resized);
+    g_free(image->original_hash);
     G_OBJECT_CLASS(mms_attachment_image_parent_class)->finalize(object);
 }
 
@@ -309,6 +405,7 @@ mms_attachment_image_class_init(
 {
     klass->attachment.fn_reset = mms_attachment_image_reset;
     klass->attachment.fn_resize = mms_attachment_image_resize;
+    klass->attachment.fn_resize_ratio = mms_attachment_image_resize_ratio;
     G_OBJECT_CLASS(klass)->finalize = mms_attachment_image_finalize;
 }
 
@@ -317,6 +414,7 @@ void
 mms_attachment_image_init(
     MMSAttachmentImage* image)
 {
+    image->plan_step = -1;
 #if defined(MMS_RESIZE_IMAGEMAGICK) || defined(MMS_RESIZE_QT)
     image->attachment.flags |= MMS_ATTACHMENT_RESIZABLE;
 #endif
@@ -31,7 +31,9 @@ typedef struct mms_attachment_image_resize {
 typedef struct mms_attachment_image {
     MMSAttachment attachment;
     int resize_step;
+    int plan_step;              /* Next step if planned, otherwise -1 */
     char* resized;
+    char* original_hash;        /* Computed when needed */
 } MMSAttachmentImage;
 
 typedef struct mms_attachment_image_class {
@@ -62,13 +64,30 @@ typedef struct mms_attachment_image_class {
         const unsigned char* rgb24);
 
     /* Finishes resizing */
-    void (*fn_resize_finish)(
+    gboolean (*fn_resize_finish)(
         MMSAttachmentImageResize* resize);
 
     /* Frees the resize context */
     void (*fn_resize_free)(
         MMSAttachmentImageResize* resize);
 
+    /* Resizes the whole file in one go, bypassing the callbacks above */
+    gboolean (*fn_resize_file)(
+        MMSAttachmentImage* image,
+        const MMSSettingsSimData* settings);
+
+    /* Appends the encoder parameters to the resize cache key */
+    void (*fn_cache_key)(
+        MMSAttachmentImage* image,
+        GString* key);
+
+    /* Encoder state which comes with the cached image */
+    int (*fn_cache_get_state)(
+        MMSAttachmentImage* image);
+    void (*fn_cache_set_state)(
+        MMSAttachmentImage* image,
+        int state);
+
 } MMSAttachmentImageClass;
 
 int
@@ -78,6 +97,11 @@ mms_attachment_image_next_resize_step(
     unsigned int columns,
     unsigned int rows);
 
+int
+mms_attachment_image_ratio_step(
+    MMSAttachmentImage* image,
+    double ratio);
+
 const char*
 mms_attachment_image_prepare_filename(
     MMSAttachmentImage* image);
@@ -1,6 +1,7 @@
 /*
- * Copyright (C) 2013-2016 Jolla Ltd.
- * Contact: Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2013-2020 Jolla Ltd.
+ * Copyright (C) 2013-2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License version 2 as
@@ -14,6 +15,7 @@
 
 #include "mms_attachment_image.h"
 #include "mms_file_util.h"
+#include "mms_settings.h"
 
 #include <gutil_macros.h>
 
@@ -25,13 +27,38 @@
 #define GLOG_MODULE_NAME mms_attachment_log
 #include <gutil_log.h>
 
+/* Quality of the re-encoded images, unless the size requires less */
+#define MMS_JPEG_QUALITY (90)
+
+/* Markers and tags which lead to the embedded previews */
+#define MMS_JPEG_SOI (0xd8)
+#define MMS_JPEG_EOI (0xd9)
+#define MMS_JPEG_SOS (0xda)
+#define MMS_JPEG_IS_SOF(m) ((m) >= 0xc0 && (m) <= 0xcf && \
+        (m) != 0xc4 && (m) != 0xc8 && (m) != 0xcc)
+#define MMS_TIFF_SHORT (3)
+#define MMS_EXIF_TAG_JPEG_OFFSET (0x0201)
+#define MMS_EXIF_TAG_JPEG_LENGTH (0x0202)
+#define MMS_MPF_TAG_NUMBER_OF_IMAGES (0xb001)
+#define MMS_MPF_TAG_ENTRY (0xb002)
+#define MMS_MPF_ENTRY_SIZE (16)
+#define MMS_MPF_TYPE_MASK (0x07ffffff) /* Format and type */
+#define MMS_MPF_TYPE_PREVIEW_VGA (0x010001)
+#define MMS_MPF_TYPE_PREVIEW_FULL_HD (0x010002)
+
 typedef MMSAttachmentImageClass MMSAttachmentJpegClass;
-typedef MMSAttachmentImage MMSAttachmentJpeg;
+typedef struct mms_attachment_jpeg {
+    MMSAttachmentImage image;
+    int quality;                /* Quality of the current file */
+    int min_quality;            /* Lowest quality worth trying */
+    gsize target;               /* Non-zero to search for quality */
+} MMSAttachmentJpeg;
 
 G_DEFINE_TYPE(MMSAttachmentJpeg, mms_attachment_jpeg, \
         MMS_TYPE_ATTACHMENT_IMAGE)
 #define MMS_ATTACHMENT_JPEG(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), \
         MMS_TYPE_ATTACHMENT_JPEG, MMSAttachmentJpeg))
+#define PARENT_CLASS ((MMSAttachmentClass*)mms_attachment_jpeg_parent_class)
 
 typedef struct mms_attachment_jpeg_error {
     struct jpeg_error_mgr pub;
@@ -43,10 +70,43 @@ typedef struct mms_attachment_jpeg_resize {
     MMSAttachmentJpegError err;
     struct jpeg_decompress_struct decomp;
     struct jpeg_compress_struct comp;
+    MMSAttachmentJpeg* owner;
     FILE* in;
     FILE* out;
+    unsigned char* rgb;         /* Buffered pixels for quality search */
+    unsigned int rows;          /* Number of buffered rows */
+    unsigned char* mem;         /* Output of jpeg_mem_dest */
+    unsigned long mem_size;
+    unsigned char* best;        /* Best output so far */
+    unsigned long best_size;
+    GMappedFile* map;           /* The original, for embedded previews */
+    struct jpeg_decompress_struct preview;
+    guint32* acc;               /* Non-NULL if decoding the preview */
+    guint* xmap;                /* Preview columns per output pixel */
+    unsigned char* line;        /* Preview scanline */
+    unsigned int preview_row;   /* Next output row */
 } MMSAttachmentJpegResize;
 
+typedef struct mms_attachment_jpeg_segment {
+    int marker;
+    const guint8* data;
+    gsize size;
+} MMSAttachmentJpegSegment;
+
+typedef struct mms_attachment_jpeg_tiff {
+    const guint8* data;
+    gsize size;
+    gboolean big_endian;
+} MMSAttachmentJpegTiff;
+
+typedef struct mms_attachment_jpeg_preview {
+    const guint8* data;
+    gsize size;
+    guint width;
+    guint height;
+    int components;
+} MMSAttachmentJpegPreview;
+
 static inline MMSAttachmentJpegResize*
 mms_attachment_jpeg_resize_cast(MMSAttachmentImageResize* resize)
     { return G_CAST(resize, MMSAttachmentJpegResize, pub); }
@@ -90,6 +150,7 @@ mms_attachment_jpeg_resize_new(
     const char* file)
 {
     MMSAttachmentJpegResize* jpeg = g_new0(MMSAttachmentJpegResize, 1);
+    jpeg->owner = MMS_ATTACHMENT_JPEG(image);
     jpeg->in = fopen(file, "rb");
     if (jpeg->in) {
         jpeg->decomp.err = jpeg_std_error(&jpeg->err.pub);
@@ -107,6 +168,7 @@ mms_attachment_jpeg_resize_new(
             jpeg->pub.image.width = jpeg->decomp.image_width;
             jpeg->pub.image.height = jpeg->decomp.image_height;
             jpeg->pub.in = jpeg->pub.image;
+            jpeg->map = g_mapped_file_new(file, FALSE, NULL);
             return &jpeg->pub;
         }
         jpeg_destroy_decompress(&jpeg->decomp);
@@ -116,6 +178,464 @@ mms_attachment_jpeg_resize_new(
     return NULL;
 }
 
+static
+void
+mms_attachment_jpeg_write_markers(
+    MMSAttachmentJpegResize* jpeg)
+{
+    jpeg_saved_marker_ptr marker;
+
+    for (marker = jpeg->decomp.marker_list;
+         marker != NULL;
+        marker = marker->next) {
+        /* Avoid duplicating markers */
+        if (jpeg->comp.write_JFIF_header &&
+            marker->marker == JPEG_APP0 &&
+            marker->data_length >= 5 &&
+            memcmp("JFIF", marker->data, 5) == 0) {
+            continue;
+        }
+        if (jpeg->comp.write_Adobe_marker &&
+            marker->marker == JPEG_APP0+14 &&
+            marker->data_length >= 5 &&
+            memcmp("Adobe", marker->data, 5) == 0) {
+            continue;
+        }
+        /* MPF offsets point past the end of the original image */
+        if (marker->marker == JPEG_APP0+2 &&
+            marker->data_length >= 4 &&
+            memcmp("MPF", marker->data, 4) == 0) {
+            continue;
+        }
+        jpeg_write_marker(&jpeg->comp, marker->marker,
+            marker->data, marker->data_length);
+    }
+}
+
+/*
+ * Picks the DCT scaling factor which leaves the least work for the box
+ * filter, i.e. the smallest decoded size which can still be reduced to
+ * the output size by an integer factor (dropping less than one output
+ * pixel worth of the input). Older libjpeg only supports 1/2, 1/4 and
+ * 1/8 and rounds the rest up, so all M/8 are actually tried.
+ */
+static
+void
+mms_attachment_jpeg_resize_scale(
+    MMSAttachmentJpegResize* jpeg)
+{
+    MMSAttachmentImageResize* resize = &jpeg->pub;
+    const MMSAttachmentImageSize* out = &resize->out;
+    struct jpeg_decompress_struct* decomp = &jpeg->decomp;
+    int m, best_m = 8;
+
+    resize->in = resize->image;
+    for (m = 1; m <= 8; m++) {
+        guint w, h;
+
+        decomp->scale_num = m;
+        decomp->scale_denom = 8;
+        jpeg_calc_output_dimensions(decomp);
+        w = decomp->output_width;
+        h = decomp->output_height;
+        if (w >= out->width && h >= out->height &&
+            (w < resize->in.width || h < resize->in.height)) {
+            const guint nx = w / out->width;
+            const guint ny = h / out->height;
+
+            if ((w - nx * out->width) < nx && (h - ny * out->height) < ny) {
+                resize->in.width = w;
+                resize->in.height = h;
+                best_m = m;
+            }
+        }
+    }
+    decomp->scale_num = best_m;
+    decomp->scale_denom = 8;
+    GDEBUG("DCT scale %d/8 (%ux%u)", best_m, resize->in.width,
+        resize->in.height);
+}
+
+/* Walks the segments preceding the compressed data */
+static
+gboolean
+mms_attachment_jpeg_segment_next(
+    MMSAttachmentJpegSegment* seg,
+    const guint8** ptr,
+    const guint8* end)
+{
+    const guint8* p = *ptr;
+
+    /* Any marker may be preceded by fill bytes */
+    while (p + 4 <= end && p[0] == 0xff && p[1] == 0xff) p++;
+    if (p + 4 <= end && p[0] == 0xff &&
+        p[1] != MMS_JPEG_SOS && p[1] != MMS_JPEG_EOI) {
+        const gsize len = (p[2] << 8) | p[3];
+
+        if (len >= 2 && len <= (gsize)(end - p) - 2) {
+            seg->marker = p[1];
+            seg->data = p + 4;
+            seg->size = len - 2;
+            *ptr = p + 2 + len;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+gboolean
+mms_attachment_jpeg_tiff_init(
+    MMSAttachmentJpegTiff* tiff,
+    const guint8* data,
+    gsize size)
+{
+    if (size >= 8 && (!memcmp(data, "II*", 4) || !memcmp(data, "MM\0*", 4))) {
+        tiff->data = data;
+        tiff->size = size;
+        tiff->big_endian = (data[0] == 'M');
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Out of range reads return zero. The offsets come from the file,
+ * so the checks are written in a way that can't overflow.
+ */
+static
+guint
+mms_attachment_jpeg_tiff_u16(
+    const MMSAttachmentJpegTiff* tiff,
+    gsize off)
+{
+    if (off <= tiff->size && tiff->size - off >= 2) {
+        const guint8* p = tiff->data + off;
+
+        return tiff->big_endian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]);
+    }
+    return 0;
+}
+
+static
+guint32
+mms_attachment_jpeg_tiff_u32(
+    const MMSAttachmentJpegTiff* tiff,
+    gsize off)
+{
+    if (off <= tiff->size && tiff->size - off >= 4) {
+        const guint32 w1 = mms_attachment_jpeg_tiff_u16(tiff, off);
+        const guint32 w2 = mms_attachment_jpeg_tiff_u16(tiff, off + 2);
+
+        return tiff->big_endian ? ((w1 << 16) | w2) : ((w2 << 16) | w1);
+    }
+    return 0;
+}
+
+/* Number of IFD entries which actually fit into the data */
+static
+guint
+mms_attachment_jpeg_tiff_count(
+    const MMSAttachmentJpegTiff* tiff,
+    guint32 ifd)
+{
+    if (ifd <= tiff->size && tiff->size - ifd >= 2) {
+        const guint n = mms_attachment_jpeg_tiff_u16(tiff, ifd);
+
+        return MIN(n, (tiff->size - ifd - 2) / 12);
+    }
+    return 0;
+}
+
+static
+gboolean
+mms_attachment_jpeg_tiff_tag(
+    const MMSAttachmentJpegTiff* tiff,
+    guint32 ifd,
+    guint tag,
+    guint32* value)
+{
+    const guint n = mms_attachment_jpeg_tiff_count(tiff, ifd);
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        const gsize entry = (gsize)ifd + 2 + 12 * i;
+
+        if (mms_attachment_jpeg_tiff_u16(tiff, entry) == tag) {
+            *value = (mms_attachment_jpeg_tiff_u16(tiff, entry + 2) ==
+                MMS_TIFF_SHORT) ? mms_attachment_jpeg_tiff_u16(tiff,
+                entry + 8) : mms_attachment_jpeg_tiff_u32(tiff, entry + 8);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+guint32
+mms_attachment_jpeg_tiff_next_ifd(
+    const MMSAttachmentJpegTiff* tiff,
+    guint32 ifd)
+{
+    if (ifd && ifd <= tiff->size && tiff->size - ifd >= 2) {
+        const guint n = mms_attachment_jpeg_tiff_u16(tiff, ifd);
+
+        /* The next IFD offset follows the last entry */
+        if ((tiff->size - ifd - 2) / 12 >= n) {
+            return mms_attachment_jpeg_tiff_u32(tiff, (gsize)ifd + 2 +
+                12 * n);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Only the frame header of the embedded image is looked at. Whether
+ * the rest of it is any good, becomes clear when it's decoded.
+ */
+static
+gboolean
+mms_attachment_jpeg_preview_parse(
+    MMSAttachmentJpegPreview* preview,
+    const guint8* data,
+    gsize size)
+{
+    if (size > 2 && data[0] == 0xff && data[1] == MMS_JPEG_SOI) {
+        const guint8* ptr = data + 2;
+        const guint8* end = data + size;
+        MMSAttachmentJpegSegment seg;
+
+        while (mms_attachment_jpeg_segment_next(&seg, &ptr, end)) {
+            if (MMS_JPEG_IS_SOF(seg.marker) && seg.size >= 6) {
+                preview->data = data;
+                preview->size = size;
+                preview->height = (seg.data[1] << 8) | seg.data[2];
+                preview->width = (seg.data[3] << 8) | seg.data[4];
+                preview->components = seg.data[5];
+                return preview->width && preview->height;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * The preview has to cover the output size, be smaller than the image
+ * itself and have the same aspect ratio as the pixels of the image (as
+ * opposed to the displayed image). The orientation tag of the original
+ * is what gets written to the output, and a preview which is already
+ * rotated has its width and height swapped, which rules it out. The
+ * smallest suitable preview wins.
+ */
+static
+void
+mms_attachment_jpeg_preview_check(
+    MMSAttachmentJpegResize* jpeg,
+    MMSAttachmentJpegPreview* best,
+    const guint8* data,
+    gsize size)
+{
+    const MMSAttachmentImageSize* image = &jpeg->pub.image;
+    const MMSAttachmentImageSize* out = &jpeg->pub.out;
+    MMSAttachmentJpegPreview preview;
+
+    if (mms_attachment_jpeg_preview_parse(&preview, data, size)) {
+        const guint64 a = (guint64)preview.width * image->height;
+        const guint64 b = (guint64)preview.height * image->width;
+
+        GVERBOSE("%ux%u preview", preview.width, preview.height);
+        if (preview.components == 3 &&
+            preview.width >= out->width && preview.height >= out->height &&
+            preview.width < image->width && preview.height < image->height &&
+            (a > b ? (a - b) : (b - a)) * 100 <= a &&
+            (!best->data || preview.width < best->width)) {
+            *best = preview;
+        }
+    }
+}
+
+/*
+ * Looks for the EXIF thumbnail (IFD1 of APP1) and the large thumbnails
+ * listed in the Multi-Picture Format index (APP2). MPF offsets are
+ * relative to its TIFF header, the images themselves are stored after
+ * the primary one.
+ */
+static
+gboolean
+mms_attachment_jpeg_preview_find(
+    MMSAttachmentJpegResize* jpeg,
+    MMSAttachmentJpegPreview* best)
+{
+    const guint8* data = (void*)g_mapped_file_get_contents(jpeg->map);
+    const gsize size = g_mapped_file_get_length(jpeg->map);
+    const guint8* ptr = data + 2;
+    const guint8* end = data + size;
+    MMSAttachmentJpegSegment seg;
+
+    memset(best, 0, sizeof(*best));
+    while (size > 2 && mms_attachment_jpeg_segment_next(&seg, &ptr, end)) {
+        MMSAttachmentJpegTiff tiff;
+        guint32 ifd, off, len, n, i;
+
+        if (seg.marker == JPEG_APP0+1 && seg.size > 6 &&
+            !memcmp(seg.data, "Exif\0", 6) &&
+            mms_attachment_jpeg_tiff_init(&tiff, seg.data + 6,
+                seg.size - 6)) {
+            ifd = mms_attachment_jpeg_tiff_next_ifd(&tiff,
+                mms_attachment_jpeg_tiff_u32(&tiff, 4));
+            if (ifd && mms_attachment_jpeg_tiff_tag(&tiff, ifd,
+                MMS_EXIF_TAG_JPEG_OFFSET, &off) &&
+                mms_attachment_jpeg_tiff_tag(&tiff, ifd,
+                MMS_EXIF_TAG_JPEG_LENGTH, &len) &&
+                off < tiff.size && len <= tiff.size - off) {
+                mms_attachment_jpeg_preview_check(jpeg, best,
+                    tiff.data + off, len);
+            }
+        } else if (seg.marker == JPEG_APP0+2 && seg.size > 4 &&
+            !memcmp(seg.data, "MPF", 4) &&
+            mms_attachment_jpeg_tiff_init(&tiff, seg.data + 4,
+                seg.size - 4)) {
+            const gsize base = tiff.data - data;
+
+            ifd = mms_attachment_jpeg_tiff_u32(&tiff, 4);
+            if (mms_attachment_jpeg_tiff_tag(&tiff, ifd,
+                MMS_MPF_TAG_NUMBER_OF_IMAGES, &n) &&
+                mms_attachment_jpeg_tiff_tag(&tiff, ifd,
+                MMS_MPF_TAG_ENTRY, &off) && off <= tiff.size &&
+                n <= (tiff.size - off) / MMS_MPF_ENTRY_SIZE) {
+                for (i = 0; i < n; i++) {
+                    const gsize e = off + i * MMS_MPF_ENTRY_SIZE;
+                    const guint32 type = MMS_MPF_TYPE_MASK &
+                        mms_attachment_jpeg_tiff_u32(&tiff, e);
+                    const guint32 img_size =
+                        mms_attachment_jpeg_tiff_u32(&tiff, e + 4);
+                    const guint32 img_off =
+                        mms_attachment_jpeg_tiff_u32(&tiff, e + 8);
+
+                    if ((type == MMS_MPF_TYPE_PREVIEW_VGA ||
+                        type == MMS_MPF_TYPE_PREVIEW_FULL_HD) &&
+                        img_off && img_off < size - base &&
+                        img_size <= size - base - img_off) {
+                        mms_attachment_jpeg_preview_check(jpeg, best,
+                            data + base + img_off, img_size);
+                    }
+                }
+            }
+        }
+    }
+    return best->data != NULL;
+}
+
+/*
+ * Decoding a camera-generated preview is a lot cheaper than entropy
+ * decoding the whole image only to throw away most of what's been
+ * decoded. The preview is DCT scaled as close to the output size as
+ * possible and then area averaged down to exactly the output size,
+ * so that the result is the same size as the one produced from the
+ * full image. Anything unexpected, and it's the full image again.
+ */
+static
+void
+mms_attachment_jpeg_preview_start(
+    MMSAttachmentJpegResize* jpeg,
+    J_COLOR_SPACE color_space)
+{
+    MMSAttachmentImageResize* resize = &jpeg->pub;
+    const MMSAttachmentImageSize* out = &resize->out;
+    struct jpeg_decompress_struct* src = &jpeg->preview;
+    MMSAttachmentJpegPreview preview;
+
+    if (jpeg->map && mms_attachment_jpeg_preview_find(jpeg, &preview)) {
+        src->err = &jpeg->err.pub;
+        if (!setjmp(jpeg->err.setjmp_buf)) {
+            int m;
+
+            jpeg_create_decompress(src);
+            jpeg_mem_src(src, (void*)preview.data, preview.size);
+            jpeg_read_header(src, TRUE);
+            for (m = 1; m < 8; m++) {
+                src->scale_num = m;
+                src->scale_denom = 8;
+                jpeg_calc_output_dimensions(src);
+                if (src->output_width >= out->width &&
+                    src->output_height >= out->height) {
+                    break;
+                }
+            }
+            src->scale_num = m;
+            src->scale_denom = 8;
+            jpeg_calc_output_dimensions(src);
+            if (src->output_width != out->width ||
+                src->output_height != out->height) {
+                src->do_fancy_upsampling = FALSE;
+            }
+            src->out_color_space = color_space;
+            jpeg_start_decompress(src);
+            if (src->output_width >= out->width &&
+                src->output_height >= out->height &&
+                src->output_components == 3) {
+                guint x;
+
+                GDEBUG("Using %ux%u preview, DCT scale %d/8 (%ux%u)",
+                    preview.width, preview.height, m, src->output_width,
+                    src->output_height);
+                jpeg->line = g_malloc(src->output_width * 3);
+                jpeg->acc = g_new(guint32, out->width * 3);
+                jpeg->xmap = g_new(guint, out->width + 1);
+                for (x = 0; x <= out->width; x++) {
+                    jpeg->xmap[x] = (guint)((guint64)x *
+                        src->output_width / out->width);
+                }
+                return;
+            }
+        }
+        GDEBUG("Preview didn't work out");
+        jpeg_destroy_decompress(src);
+    }
+}
+
+/* Produces one output line out of as many preview lines as it takes */
+static
+gboolean
+mms_attachment_jpeg_preview_read_line(
+    MMSAttachmentJpegResize* jpeg,
+    unsigned char* rgb24)
+{
+    struct jpeg_decompress_struct* src = &jpeg->preview;
+    const guint width = jpeg->pub.out.width;
+    const guint last = (guint)((guint64)(jpeg->preview_row + 1) *
+        src->output_height / jpeg->pub.out.height);
+    const guint ny = last - src->output_scanline;
+    guint32* acc = jpeg->acc;
+    guint x;
+
+    memset(acc, 0, sizeof(acc[0]) * width * 3);
+    while (src->output_scanline < last) {
+        JSAMPROW row = jpeg->line;
+        const unsigned char* p = row;
+
+        if (!jpeg_read_scanlines(src, &row, 1)) {
+            return FALSE;
+        }
+        for (x = 0; x < width; x++) {
+            const unsigned char* end = row + 3 * jpeg->xmap[x + 1];
+
+            for (; p < end; p += 3) {
+                acc[3 * x] += p[0];
+                acc[3 * x + 1] += p[1];
+                acc[3 * x + 2] += p[2];
+            }
+        }
+    }
+    for (x = 0; x < 3 * width; x++) {
+        const guint n = ny * (jpeg->xmap[x / 3 + 1] - jpeg->xmap[x / 3]);
+
+        rgb24[x] = (acc[x] + n / 2) / n;
+    }
+    jpeg->preview_row++;
+    return TRUE;
+}
+
 static
 gboolean
 mms_attachment_jpeg_resize_prepare(
@@ -125,51 +645,57 @@ mms_attachment_jpeg_resize_prepare(
     MMSAttachmentJpegResize* jpeg = mms_attachment_jpeg_resize_cast(resize);
     jpeg->out = fopen(file, "wb");
     if (jpeg->out) {
+        /*
+         * Averaging works equally well in YCbCr space, no need to
+         * convert the pixels to RGB and back. Grayscale and other
+         * unusual colour spaces get converted to RGB.
+         */
+        const J_COLOR_SPACE color_space =
+            (jpeg->decomp.jpeg_color_space == JCS_YCbCr &&
+            jpeg->decomp.num_components == 3) ? JCS_YCbCr : JCS_RGB;
+
         jpeg->comp.err = &jpeg->err.pub;
+        mms_attachment_jpeg_preview_start(jpeg, color_space);
         if (!setjmp(jpeg->err.setjmp_buf)) {
-            jpeg_saved_marker_ptr marker;
             jpeg_create_compress(&jpeg->comp);
+            if (jpeg->acc) {
+                /* The preview gets resampled by read_line */
+                resize->in = resize->out;
+            } else {
+                mms_attachment_jpeg_resize_scale(jpeg);
+                if (resize->in.width != resize->out.width ||
+                    resize->in.height != resize->out.height) {
+                    /* The box filter is going to smooth it anyway */
+                    jpeg->decomp.do_fancy_upsampling = FALSE;
+                }
+                jpeg->decomp.out_color_space = color_space;
+                jpeg_start_decompress(&jpeg->decomp);
+            }
 
-            jpeg->decomp.scale_num = resize->in.width;
-            jpeg->decomp.scale_denom = resize->image.width;
-            jpeg->decomp.out_color_space = JCS_RGB;
-            jpeg_start_decompress(&jpeg->decomp);
-
-            if (jpeg->decomp.output_width == resize->in.width &&
-                jpeg->decomp.output_height == resize->in.height) {
+            if (jpeg->acc ||
+                (jpeg->decomp.output_width == resize->in.width &&
+                jpeg->decomp.output_height == resize->in.height &&
+                jpeg->decomp.output_components == 3)) {
 
                 jpeg->comp.image_width = resize->out.width;
                 jpeg->comp.image_height = resize->out.height;
                 jpeg->comp.input_components = 3;
-                jpeg->comp.in_color_space = JCS_RGB;
+                jpeg->comp.in_color_space = color_space;
 
-                jpeg_stdio_dest(&jpeg->comp, jpeg->out);
                 jpeg_set_defaults(&jpeg->comp);
-                jpeg_set_quality(&jpeg->comp, 90, TRUE);
-
                 jpeg->comp.write_JFIF_header = jpeg->decomp.saw_JFIF_marker;
-                jpeg_start_compress(&jpeg->comp, TRUE);
-
-                for (marker = jpeg->decomp.marker_list;
-                     marker != NULL;
-                    marker = marker->next) {
-                    /* Avoid duplicating markers */
-                    if (jpeg->comp.write_JFIF_header &&
-                        marker->marker == JPEG_APP0 &&
-                        marker->data_length >= 5 &&
-                        memcmp("JFIF", marker->data, 5) == 0) {
-                        continue;
-                    }
-                    if (jpeg->comp.write_Adobe_marker &&
-                        marker->marker == JPEG_APP0+14 &&
-                        marker->data_length >= 5 &&
-                        memcmp("Adobe", marker->data, 5) == 0) {
-                        continue;
-                    }
-                    jpeg_write_marker(&jpeg->comp, marker->marker,
-                        marker->data, marker->data_length);
-                }
 
+                if (jpeg->owner->target) {
+                    /* Compressed in memory by the resize_finish */
+                    jpeg->rgb = g_malloc(resize->out.width *
+                        resize->out.height * 3);
+                } else {
+                    jpeg_stdio_dest(&jpeg->comp, jpeg->out);
+                    jpeg_set_quality(&jpeg->comp, jpeg->owner->quality,
+                        TRUE);
+                    jpeg_start_compress(&jpeg->comp, TRUE);
+                    mms_attachment_jpeg_write_markers(jpeg);
+                }
                 return TRUE;
             }
         }
@@ -186,6 +712,9 @@ mms_attachment_jpeg_read_line(
     MMSAttachmentJpegResize* jpeg = mms_attachment_jpeg_resize_cast(resize);
     if (!setjmp(jpeg->err.setjmp_buf)) {
         JSAMPROW row = rgb24;
+        if (jpeg->acc) {
+            return mms_attachment_jpeg_preview_read_line(jpeg, rgb24);
+        }
         jpeg_read_scanlines(&jpeg->decomp, &row, 1);
         return TRUE;
     }
@@ -199,7 +728,14 @@ mms_attachment_jpeg_write_line(
     const unsigned char* rgb24)
 {
     MMSAttachmentJpegResize* jpeg = mms_attachment_jpeg_resize_cast(resize);
-    if (!setjmp(jpeg->err.setjmp_buf)) {
+    if (jpeg->rgb) {
+        const gsize stride = resize->out.width * 3;
+
+        if (jpeg->rows < resize->out.height) {
+            memcpy(jpeg->rgb + stride * (jpeg->rows++), rgb24, stride);
+            return TRUE;
+        }
+    } else if (!setjmp(jpeg->err.setjmp_buf)) {
         JSAMPROW row = (void*)rgb24;
         jpeg_write_scanlines(&jpeg->comp, &row, 1);
         return TRUE;
@@ -207,16 +743,98 @@ mms_attachment_jpeg_write_line(
     return FALSE;
 }
 
+/* Compresses the buffered image into jpeg->mem */
 static
 void
+mms_attachment_jpeg_encode_mem(
+    MMSAttachmentJpegResize* jpeg,
+    int quality)
+{
+    const gsize stride = jpeg->comp.image_width * 3;
+    unsigned int y;
+
+    jpeg->mem = NULL;
+    jpeg->mem_size = 0;
+    jpeg_mem_dest(&jpeg->comp, &jpeg->mem, &jpeg->mem_size);
+    jpeg_set_quality(&jpeg->comp, quality, TRUE);
+    jpeg->comp.optimize_coding = TRUE;
+    jpeg_start_compress(&jpeg->comp, TRUE);
+    mms_attachment_jpeg_write_markers(jpeg);
+    for (y = 0; y < jpeg->comp.image_height; y++) {
+        JSAMPROW row = jpeg->rgb + stride * y;
+        jpeg_write_scanlines(&jpeg->comp, &row, 1);
+    }
+    jpeg_finish_compress(&jpeg->comp);
+}
+
+/*
+ * Binary search for the highest quality which fits into the target
+ * size. Nothing touches the disk until the choice is made. If even
+ * the lowest quality doesn't fit, that's what gets written.
+ */
+static
+gboolean
+mms_attachment_jpeg_search(
+    MMSAttachmentJpegResize* jpeg)
+{
+    MMSAttachmentJpeg* owner = jpeg->owner;
+    int lo = owner->min_quality, hi = owner->quality - 1, best = 0;
+
+    while (lo <= hi) {
+        const int q = (lo + hi) / 2;
+        gboolean fits;
+
+        mms_attachment_jpeg_encode_mem(jpeg, q);
+        fits = (jpeg->mem_size <= owner->target);
+        GVERBOSE("Quality %d => %lu bytes", q, jpeg->mem_size);
+        if (fits || q == owner->min_quality) {
+            free(jpeg->best);
+            jpeg->best = jpeg->mem;
+            jpeg->best_size = jpeg->mem_size;
+            best = q;
+        } else {
+            free(jpeg->mem);
+        }
+        jpeg->mem = NULL;
+        if (fits) {
+            lo = q + 1;
+        } else {
+            hi = q - 1;
+        }
+    }
+
+    if (best && fwrite(jpeg->best, 1, jpeg->best_size, jpeg->out) ==
+        jpeg->best_size) {
+        GDEBUG("Quality %d, %lu bytes (target %u)", best, jpeg->best_size,
+            (guint)owner->target);
+        owner->quality = best;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+gboolean
 mms_attachment_jpeg_resize_finish(
     MMSAttachmentImageResize* resize)
 {
     MMSAttachmentJpegResize* jpeg = mms_attachment_jpeg_resize_cast(resize);
+    gboolean ok = FALSE;
+
     if (!setjmp(jpeg->err.setjmp_buf)) {
-        jpeg_finish_compress(&jpeg->comp);
-        jpeg_finish_decompress(&jpeg->decomp);
+        if (jpeg->rgb) {
+            ok = (jpeg->rows == resize->out.height) &&
+                mms_attachment_jpeg_search(jpeg);
+        } else {
+            jpeg_finish_compress(&jpeg->comp);
+            ok = TRUE;
+        }
+    }
+    /* Whatever may be wrong with the rest of the input doesn't matter */
+    if (ok && !setjmp(jpeg->err.setjmp_buf)) {
+        jpeg_finish_decompress(jpeg->acc ? &jpeg->preview : &jpeg->decomp);
     }
+    return ok;
 }
 
 static
@@ -227,22 +845,107 @@ mms_attachment_jpeg_resize_free(
     MMSAttachmentJpegResize* jpeg = mms_attachment_jpeg_resize_cast(resize);
     jpeg_destroy_compress(&jpeg->comp);
     jpeg_destroy_decompress(&jpeg->decomp);
+    jpeg_destroy_decompress(&jpeg->preview);
     if (jpeg->in) fclose(jpeg->in);
     if (jpeg->out) fclose(jpeg->out);
+    if (jpeg->map) g_mapped_file_unref(jpeg->map);
+    free(jpeg->mem);
+    free(jpeg->best);
+    g_free(jpeg->rgb);
+    g_free(jpeg->line);
+    g_free(jpeg->acc);
+    g_free(jpeg->xmap);
     g_free(jpeg);
 }
 
+/*
+ * Lowering the quality is cheaper (in terms of visual damage) than
+ * lowering the resolution, try that first. The resolution stays
+ * the same, unless it has to be reduced anyway.
+ */
+static
+gboolean
+mms_attachment_jpeg_resize_ratio(
+    MMSAttachment* at,
+    const MMSSettingsSimData* settings,
+    double ratio)
+{
+    MMSAttachmentJpeg* jpeg = MMS_ATTACHMENT_JPEG(at);
+    const int min_quality = settings ? (int)settings->min_jpeg_quality :
+        MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY;
+
+    if (min_quality > 0 && min_quality < jpeg->quality &&
+        ratio > 0 && ratio < 1 && at->map) {
+        gboolean ok;
+
+        jpeg->min_quality = min_quality;
+        jpeg->target = (gsize)(ratio * g_mapped_file_get_length(at->map));
+        jpeg->image.plan_step = jpeg->image.resize_step;
+        ok = PARENT_CLASS->fn_resize(at, settings);
+        jpeg->target = 0;
+        return ok;
+    } else {
+        return PARENT_CLASS->fn_resize_ratio(at, settings, ratio);
+    }
+}
+
+static
+void
+mms_attachment_jpeg_cache_key(
+    MMSAttachmentImage* image,
+    GString* key)
+{
+    MMSAttachmentJpeg* jpeg = MMS_ATTACHMENT_JPEG(image);
+
+    g_string_append_printf(key, " %d", jpeg->quality);
+    if (jpeg->target) {
+        g_string_append_printf(key, " %d %" G_GSIZE_FORMAT,
+            jpeg->min_quality, jpeg->target);
+    }
+}
+
+static
+int
+mms_attachment_jpeg_cache_get_state(
+    MMSAttachmentImage* image)
+{
+    return MMS_ATTACHMENT_JPEG(image)->quality;
+}
+
+static
+void
+mms_attachment_jpeg_cache_set_state(
+    MMSAttachmentImage* image,
+    int state)
+{
+    MMS_ATTACHMENT_JPEG(image)->quality = state;
+}
+
+static
+void
+mms_attachment_jpeg_reset(
+    MMSAttachment* at)
+{
+    MMS_ATTACHMENT_JPEG(at)->quality = MMS_JPEG_QUALITY;
+    PARENT_CLASS->fn_reset(at);
+}
+
 static
 void
 mms_attachment_jpeg_class_init(
     MMSAttachmentJpegClass* klass)
 {
+    klass->attachment.fn_reset = mms_attachment_jpeg_reset;
+    klass->attachment.fn_resize_ratio = mms_attachment_jpeg_resize_ratio;
     klass->fn_resize_new = mms_attachment_jpeg_resize_new;
     klass->fn_resize_prepare = mms_attachment_jpeg_resize_prepare;
     klass->fn_resize_read_line = mms_attachment_jpeg_read_line;
     klass->fn_resize_write_line = mms_attachment_jpeg_write_line;
     klass->fn_resize_finish = mms_attachment_jpeg_resize_finish;
     klass->fn_resize_free = mms_attachment_jpeg_resize_free;
+    klass->fn_cache_key = mms_attachment_jpeg_cache_key;
+    klass->fn_cache_get_state = mms_attachment_jpeg_cache_get_state;
+    klass->fn_cache_set_state = mms_attachment_jpeg_cache_set_state;
 }
 
 static
@@ -250,7 +953,8 @@ void
 mms_attachment_jpeg_init(
     MMSAttachmentJpeg* jpeg)
 {
-    jpeg->attachment.flags |= MMS_ATTACHMENT_RESIZABLE;
+    jpeg->quality = MMS_JPEG_QUALITY;
+    jpeg->image.attachment.flags |= MMS_ATTACHMENT_RESIZABLE;
 }
 
 /*
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_attachment_image.h"
+
+#include <gutil_macros.h>
+
+#include <png.h>
+#include <setjmp.h>
+
+/* Logging */
+#define GLOG_MODULE_NAME mms_attachment_log
+#include <gutil_log.h>
+
+typedef MMSAttachmentImageClass MMSAttachmentPngClass;
+typedef MMSAttachmentImage MMSAttachmentPng;
+
+G_DEFINE_TYPE(MMSAttachmentPng, mms_attachment_png, \
+        MMS_TYPE_ATTACHMENT_IMAGE)
+
+/*
+ * Only one row is kept in memory at any time. Interlaced images and
+ * images with transparency don't fit into that (or into RGB24), those
+ * are left to the generic code.
+ */
+typedef struct mms_attachment_png_resize {
+    MMSAttachmentImageResize pub;
+    jmp_buf jmp;
+    png_structp rd;
+    png_infop rd_info;
+    png_structp wr;
+    png_infop wr_info;
+    FILE* in;
+    FILE* out;
+} MMSAttachmentPngResize;
+
+static inline MMSAttachmentPngResize*
+mms_attachment_png_resize_cast(MMSAttachmentImageResize* resize)
+    { return G_CAST(resize, MMSAttachmentPngResize, pub); }
+
+static
+void
+mms_attachment_png_error(
+    png_structp png,
+    png_const_charp msg)
+{
+    MMSAttachmentPngResize* resize = png_get_error_ptr(png);
+    GWARN("%s", msg);
+    longjmp(resize->jmp, 1);
+}
+
+static
+void
+mms_attachment_png_warning(
+    png_structp png,
+    png_const_charp msg)
+{
+    GDEBUG("%s", msg);
+}
+
+static
+void
+mms_attachment_png_resize_free(
+    MMSAttachmentImageResize* resize)
+{
+    MMSAttachmentPngResize* png = mms_attachment_png_resize_cast(resize);
+    if (png->rd) png_destroy_read_struct(&png->rd, &png->rd_info, NULL);
+    if (png->wr) png_destroy_write_struct(&png->wr, &png->wr_info);
+    if (png->in) fclose(png->in);
+    if (png->out) fclose(png->out);
+    g_free(png);
+}
+
+static
+MMSAttachmentImageResize*
+mms_attachment_png_resize_new(
+    MMSAttachmentImage* image,
+    const char* file)
+{
+    MMSAttachmentPngResize* png = g_new0(MMSAttachmentPngResize, 1);
+    png->in = fopen(file, "rb");
+    if (png->in) {
+        png->rd = png_create_read_struct(PNG_LIBPNG_VER_STRING, png,
+            mms_attachment_png_error, mms_attachment_png_warning);
+        if (png->rd) png->rd_info = png_create_info_struct(png->rd);
+    }
+    if (png->rd_info) {
+        if (!setjmp(png->jmp)) {
+            int color_type, depth;
+
+            png_init_io(png->rd, png->in);
+            png_read_info(png->rd, png->rd_info);
+            color_type = png_get_color_type(png->rd, png->rd_info);
+            depth = png_get_bit_depth(png->rd, png->rd_info);
+            if (png_get_interlace_type(png->rd, png->rd_info) !=
+                PNG_INTERLACE_NONE) {
+                GDEBUG("%s is interlaced", file);
+            } else if ((color_type & PNG_COLOR_MASK_ALPHA) ||
+                png_get_valid(png->rd, png->rd_info, PNG_INFO_tRNS)) {
+                GDEBUG("%s is transparent", file);
+            } else {
+                /* Whatever it is, turn it into 8-bit RGB */
+                if (color_type == PNG_COLOR_TYPE_PALETTE) {
+                    png_set_palette_to_rgb(png->rd);
+                } else if (color_type == PNG_COLOR_TYPE_GRAY) {
+                    if (depth < 8) png_set_expand_gray_1_2_4_to_8(png->rd);
+                    png_set_gray_to_rgb(png->rd);
+                }
+                if (depth == 16) png_set_strip_16(png->rd);
+                png_read_update_info(png->rd, png->rd_info);
+                if (png_get_rowbytes(png->rd, png->rd_info) ==
+                    3 * png_get_image_width(png->rd, png->rd_info)) {
+                    png->pub.image.width =
+                        png_get_image_width(png->rd, png->rd_info);
+                    png->pub.image.height =
+                        png_get_image_height(png->rd, png->rd_info);
+                    png->pub.in = png->pub.image;
+                    return &png->pub;
+                }
+            }
+        }
+    }
+    mms_attachment_png_resize_free(&png->pub);
+    return NULL;
+}
+
+static
+gboolean
+mms_attachment_png_resize_prepare(
+    MMSAttachmentImageResize* resize,
+    const char* file)
+{
+    MMSAttachmentPngResize* png = mms_attachment_png_resize_cast(resize);
+
+    /* There's no decoder-assisted scaling */
+    resize->in = resize->image;
+    png->out = fopen(file, "wb");
+    if (png->out) {
+        png->wr = png_create_write_struct(PNG_LIBPNG_VER_STRING, png,
+            mms_attachment_png_error, mms_attachment_png_warning);
+        if (png->wr) png->wr_info = png_create_info_struct(png->wr);
+    }
+    if (png->wr_info) {
+        if (!setjmp(png->jmp)) {
+            double gamma;
+            int intent;
+
+            png_init_io(png->wr, png->out);
+            png_set_IHDR(png->wr, png->wr_info, resize->out.width,
+                resize->out.height, 8, PNG_COLOR_TYPE_RGB,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+            if (png_get_sRGB(png->rd, png->rd_info, &intent)) {
+                png_set_sRGB(png->wr, png->wr_info, intent);
+            } else if (png_get_gAMA(png->rd, png->rd_info, &gamma)) {
+                png_set_gAMA(png->wr, png->wr_info, gamma);
+            }
+            png_write_info(png->wr, png->wr_info);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static
+gboolean
+mms_attachment_png_read_line(
+    MMSAttachmentImageResize* resize,
+    unsigned char* rgb24)
+{
+    MMSAttachmentPngResize* png = mms_attachment_png_resize_cast(resize);
+    if (!setjmp(png->jmp)) {
+        png_read_row(png->rd, rgb24, NULL);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+gboolean
+mms_attachment_png_write_line(
+    MMSAttachmentImageResize* resize,
+    const unsigned char* rgb24)
+{
+    MMSAttachmentPngResize* png = mms_attachment_png_resize_cast(resize);
+    if (!setjmp(png->jmp)) {
+        png_write_row(png->wr, (png_bytep)rgb24);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static
+gboolean
+mms_attachment_png_resize_finish(
+    MMSAttachmentImageResize* resize)
+{
+    MMSAttachmentPngResize* png = mms_attachment_png_resize_cast(resize);
+    if (!setjmp(png->jmp)) {
+        png_write_end(png->wr, NULL);
+        return fflush(png->out) == 0;
+    }
+    return FALSE;
+}
+
+static
+void
+mms_attachment_png_class_init(
+    MMSAttachmentPngClass* klass)
+{
+    klass->fn_resize_new = mms_attachment_png_resize_new;
+    klass->fn_resize_prepare = mms_attachment_png_resize_prepare;
+    klass->fn_resize_read_line = mms_attachment_png_read_line;
+    klass->fn_resize_write_line = mms_attachment_png_write_line;
+    klass->fn_resize_finish = mms_attachment_png_resize_finish;
+    klass->fn_resize_free = mms_attachment_png_resize_free;
+}
+
+static
+void
+mms_attachment_png_init(
+    MMSAttachmentPng* png)
+{
+    png->attachment.flags |= MMS_ATTACHMENT_RESIZABLE;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
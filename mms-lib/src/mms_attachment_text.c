@@ -16,6 +16,7 @@
 #include "mms_attachment.h"
 #include "mms_settings.h"
 #include "mms_codec.h"
+#include "mms_charset.h"
 #include "mms_file_util.h"
 
 #include <gutil_strv.h>
@@ -34,12 +35,74 @@ G_DEFINE_TYPE(MMSAttachmentText, mms_attachment_text, MMS_TYPE_ATTACHMENT)
 #define MMS_ATTACHMENT_TEXT(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), \
         MMS_TYPE_ATTACHMENT_TEXT, MMSAttachmentText))
 
+/*
+ * Streams the converted text into the convert directory. The original
+ * may be a hard link to the caller's file or to the store, so it can't
+ * be rewritten in place.
+ */
+static
+gboolean
+mms_attachment_text_convert_file(
+    MMSAttachment* at,
+    const char* charset)
+{
+    MMSAttachmentText* self = MMS_ATTACHMENT_TEXT(at);
+    gboolean ok = FALSE;
+    GError* err = NULL;
+    const char* in = at->original_file;
+    const gchar* indata = g_mapped_file_get_contents(at->map);
+    const gsize insize = g_mapped_file_get_length(at->map);
+    char* dir = g_path_get_dirname(in);
+    char* convert_dir = g_build_filename(dir, MMS_CONVERT_DIR, NULL);
+    char* name = g_path_get_basename(in);
+    char* out = NULL;
+    int fd = mms_create_file(convert_dir, name, &out, &err);
+
+    if (fd >= 0) {
+        gsize utf8size = 0;
+
+        ok = mms_charset_convert_to_fd(indata, insize, MMS_DEFAULT_CHARSET,
+            charset, fd, &utf8size, &err);
+        close(fd);
+        if (ok) {
+            GMappedFile* map = g_mapped_file_new(out, FALSE, &err);
+
+            if (map) {
+                GDEBUG("%s (%d bytes) -> %s (%d bytes)", in, (int)insize,
+                    out, (int)utf8size);
+                /* Substitute file mapping */
+                g_mapped_file_unref(at->map);
+                at->file_name = self->utf8file = out;
+                at->map = map;
+                out = NULL;
+            } else {
+                GERR("Failed to map %s: %s", out, GERRMSG(err));
+                ok = FALSE;
+            }
+        } else {
+            GERR("Failed to convert %s: %s", in, GERRMSG(err));
+        }
+        if (!ok) {
+            mms_remove_file_and_dir(out);
+        }
+    } else {
+        GERR("%s", GERRMSG(err));
+    }
+    if (err) {
+        g_error_free(err);
+    }
+    g_free(out);
+    g_free(name);
+    g_free(convert_dir);
+    g_free(dir);
+    return ok;
+}
+
 static
 void
 mms_attachment_text_convert_to_utf8(
     MMSAttachment* at)
 {
-    MMSAttachmentText* self = MMS_ATTACHMENT_TEXT(at);
     char** ct = mms_parse_http_content_type(at->content_type);
     const int n = gutil_strv_length(ct);
     int i, cs_pos = 0;
@@ -54,45 +117,26 @@ mms_attachment_text_convert_to_utf8(
         /* Check if it's already UTF-8 or US-ASCII */
         const char* charset = ct[cs_pos + 1];
         if (g_ascii_strcasecmp(charset, MMS_DEFAULT_CHARSET) &&
-            g_ascii_strcasecmp(charset, "US=ASCII")) {
-            /* Conversion is needed */
-            GError* err = NULL;
-            gsize utf8size;
-            const char* in = at->original_file;
-            const gchar* indata = g_mapped_file_get_contents(at->map);
-            const gsize insize = g_mapped_file_get_length(at->map);
-            gchar* utf8 = g_convert(indata, insize, MMS_DEFAULT_CHARSET,
-                charset, NULL, &utf8size, &err);
-            if (utf8) {
-                char* out = mms_prepare_filename(in, MMS_CONVERT_DIR);
-                if (g_file_set_contents(out, utf8, utf8size, &err)) {
-                    GMappedFile* map = g_mapped_file_new(out, FALSE, &err);
-                    if (map) {
-                        GDEBUG("%s (%d bytes) -> %s (%d bytes)", in,
-                            (int)insize, out, (int)utf8size);
-                        /* Substitute file mapping */
-                        g_mapped_file_unref(at->map);
-                        at->file_name = self->utf8file = out;
-                        at->map = map;
-                        out = NULL;
-                        /* Update content type header */
-                        g_free(at->content_type);
-                        g_free(ct[cs_pos + 1]);
-                        ct[cs_pos + 1] = g_strdup(MMS_DEFAULT_CHARSET);
-                        at->content_type = mms_unparse_http_content_type(ct);
-                    } else {
-                        GERR("Failed to map %s: %s", out, GERRMSG(err));
-                        g_error_free(err);
-                    }
-                } else {
-                    GERR("Failed to write %s: %s", out, GERRMSG(err));
-                    g_error_free(err);
-                }
-                g_free(out);
-                g_free(utf8);
+            g_ascii_strcasecmp(charset, "US-ASCII")) {
+            gboolean relabel;
+
+            if (mms_charset_is_ascii_compatible(charset) &&
+                mms_charset_is_ascii(g_mapped_file_get_contents(at->map),
+                    g_mapped_file_get_length(at->map))) {
+                /* 7-bit text is the same in UTF-8, only the label changes */
+                GDEBUG("%s: %s is 7-bit, nothing to convert", at->file_name,
+                    charset);
+                relabel = TRUE;
             } else {
-                GERR("Failed to convert %s: %s", in, GERRMSG(err));
-                g_error_free(err);
+                /* Conversion is needed */
+                relabel = mms_attachment_text_convert_file(at, charset);
+            }
+            if (relabel) {
+                /* Update content type header */
+                g_free(at->content_type);
+                g_free(ct[cs_pos + 1]);
+                ct[cs_pos + 1] = g_strdup(MMS_DEFAULT_CHARSET);
+                at->content_type = mms_unparse_http_content_type(ct);
             }
         } else {
             GDEBUG("%s: no conversion required", at->file_name);
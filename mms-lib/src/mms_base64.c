@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_base64.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define MMS_BASE64_NEON
+#endif
+
+#define MMS_BASE64_INVALID (0xff)
+
+/* Same as in GMime, '=' is decoded as zero and dropped at the end */
+static const guint8 mms_base64_rank[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+    0x3c, 0x3d, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+    0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+    0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+#if defined(__SSE2__)
+
+/* 16 characters in, 12 bytes out */
+#define MMS_BASE64_BLOCK (16)
+
+static inline
+__m128i
+mms_base64_range(
+    __m128i c,
+    char first,
+    char last)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(first - 1)),
+        _mm_cmplt_epi8(c, _mm_set1_epi8(last + 1)));
+}
+
+static inline
+gboolean
+mms_base64_decode_block(
+    const guint8* in,
+    guint8* out)
+{
+    /* Bytes >= 0x80 are negative and don't fall into any range */
+    const __m128i c = _mm_loadu_si128((const __m128i*)in);
+    const __m128i upper = mms_base64_range(c, 'A', 'Z');
+    const __m128i lower = mms_base64_range(c, 'a', 'z');
+    const __m128i digit = mms_base64_range(c, '0', '9');
+    const __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+    const __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+    const __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+        _mm_or_si128(_mm_or_si128(digit, plus), slash));
+
+    if (_mm_movemask_epi8(valid) == 0xffff) {
+        const __m128i mask = _mm_set1_epi32(0x3f);
+        const __m128i shift = _mm_or_si128(_mm_or_si128(
+            _mm_and_si128(upper, _mm_set1_epi8(-'A')),
+            _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+            _mm_or_si128(_mm_or_si128(
+            _mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+            _mm_and_si128(plus, _mm_set1_epi8(62 - '+'))),
+            _mm_and_si128(slash, _mm_set1_epi8(63 - '/'))));
+        const __m128i v = _mm_add_epi8(c, shift);
+
+        /* Each 32-bit lane turns into 24 bits of output */
+        const __m128i bits = _mm_or_si128(_mm_or_si128(
+            _mm_slli_epi32(_mm_and_si128(v, mask), 18),
+            _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), mask), 12)),
+            _mm_or_si128(
+            _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 16), mask), 6),
+            _mm_srli_epi32(v, 24)));
+        guint32 w[4];
+        int i;
+
+        _mm_storeu_si128((__m128i*)w, bits);
+        for (i = 0; i < 3; i++) {
+            /* The 4th byte gets overwritten by the next lane */
+            const guint32 be = GUINT32_TO_BE(w[i] << 8);
+
+            memcpy(out, &be, 4);
+            out += 3;
+        }
+        out[0] = (guint8)(w[3] >> 16);
+        out[1] = (guint8)(w[3] >> 8);
+        out[2] = (guint8)w[3];
+        return TRUE;
+    }
+    return FALSE;
+}
+
+#elif defined(MMS_BASE64_NEON)
+
+/* 64 characters in, 48 bytes out */
+#define MMS_BASE64_BLOCK (64)
+
+static inline
+uint8x16_t
+mms_base64_range(
+    uint8x16_t c,
+    guint8 first,
+    guint8 last)
+{
+    return vandq_u8(vcgeq_u8(c, vdupq_n_u8(first)),
+        vcleq_u8(c, vdupq_n_u8(last)));
+}
+
+static inline
+uint8x16_t
+mms_base64_neon_decode(
+    uint8x16_t c,
+    uint8x16_t* valid)
+{
+    const uint8x16_t upper = mms_base64_range(c, 'A', 'Z');
+    const uint8x16_t lower = mms_base64_range(c, 'a', 'z');
+    const uint8x16_t digit = mms_base64_range(c, '0', '9');
+    const uint8x16_t plus = vceqq_u8(c, vdupq_n_u8('+'));
+    const uint8x16_t slash = vceqq_u8(c, vdupq_n_u8('/'));
+    const uint8x16_t shift = vorrq_u8(vorrq_u8(
+        vandq_u8(upper, vdupq_n_u8((guint8)(-'A'))),
+        vandq_u8(lower, vdupq_n_u8((guint8)(26 - 'a')))),
+        vorrq_u8(vorrq_u8(
+        vandq_u8(digit, vdupq_n_u8((guint8)(52 - '0'))),
+        vandq_u8(plus, vdupq_n_u8((guint8)(62 - '+')))),
+        vandq_u8(slash, vdupq_n_u8((guint8)(63 - '/')))));
+
+    *valid = vandq_u8(*valid, vorrq_u8(vorrq_u8(upper, lower),
+        vorrq_u8(vorrq_u8(digit, plus), slash)));
+    return vaddq_u8(c, shift);
+}
+
+static inline
+gboolean
+mms_base64_neon_all_set(
+    uint8x16_t v)
+{
+#ifdef __aarch64__
+    return vminvq_u8(v) == 0xff;
+#else
+    uint8x8_t m = vand_u8(vget_low_u8(v), vget_high_u8(v));
+
+    m = vpmin_u8(m, m);
+    m = vpmin_u8(m, m);
+    m = vpmin_u8(m, m);
+    return vget_lane_u8(m, 0) == 0xff;
+#endif
+}
+
+static inline
+gboolean
+mms_base64_decode_block(
+    const guint8* in,
+    guint8* out)
+{
+    /* De-interleaved, i.e. val[0] has characters 0, 4, 8 and so on */
+    const uint8x16x4_t c = vld4q_u8(in);
+    uint8x16_t valid = vdupq_n_u8(0xff);
+    const uint8x16_t a = mms_base64_neon_decode(c.val[0], &valid);
+    const uint8x16_t b = mms_base64_neon_decode(c.val[1], &valid);
+    const uint8x16_t d = mms_base64_neon_decode(c.val[2], &valid);
+    const uint8x16_t e = mms_base64_neon_decode(c.val[3], &valid);
+
+    if (mms_base64_neon_all_set(valid)) {
+        uint8x16x3_t bytes;
+
+        bytes.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+        bytes.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(d, 2));
+        bytes.val[2] = vorrq_u8(vshlq_n_u8(d, 6), e);
+        vst3q_u8(out, bytes);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+#else
+
+/* Portable version, one quantum at a time */
+#define MMS_BASE64_BLOCK (4)
+
+static inline
+gboolean
+mms_base64_decode_block(
+    const guint8* in,
+    guint8* out)
+{
+    const guint r0 = mms_base64_rank[in[0]];
+    const guint r1 = mms_base64_rank[in[1]];
+    const guint r2 = mms_base64_rank[in[2]];
+    const guint r3 = mms_base64_rank[in[3]];
+
+    if (!((r0 | r1 | r2 | r3) & 0x80)) {
+        const guint32 w = (r0 << 18) | (r1 << 12) | (r2 << 6) | r3;
+
+        out[0] = (guint8)(w >> 16);
+        out[1] = (guint8)(w >> 8);
+        out[2] = (guint8)w;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+#endif
+
+gsize
+mms_base64_decode(
+    const void* in,
+    gsize len,
+    void* out)
+{
+    const guint8* start = in;
+    const guint8* ptr = start;
+    const guint8* end = ptr + len;
+    guint8* dest = out;
+    guint32 saved = 0;
+    guint n = 0;
+    int pad;
+
+    while (ptr < end) {
+        gboolean skipped = FALSE;
+
+        if ((gsize)(end - ptr) >= MMS_BASE64_BLOCK &&
+            mms_base64_decode_block(ptr, dest)) {
+            ptr += MMS_BASE64_BLOCK;
+            dest += MMS_BASE64_BLOCK / 4 * 3;
+            continue;
+        }
+
+        /*
+         * Something in the block is not base64 (most likely, a line
+         * break). Go one by one until we skip it and get back to the
+         * quantum boundary.
+         */
+        while (ptr < end && (n || !skipped)) {
+            const guint8 c = mms_base64_rank[*ptr++];
+
+            if (c == MMS_BASE64_INVALID) {
+                skipped = TRUE;
+            } else {
+                saved = (saved << 6) | c;
+                if (++n == 4) {
+                    *dest++ = (guint8)(saved >> 16);
+                    *dest++ = (guint8)(saved >> 8);
+                    *dest++ = (guint8)saved;
+                    n = 0;
+                }
+            }
+        }
+    }
+
+    /* Drop one byte for each trailing '=' (up to 2) */
+    for (pad = 2; ptr > start && pad > 0;) {
+        const guint8 c = *--ptr;
+
+        if (mms_base64_rank[c] != MMS_BASE64_INVALID) {
+            if (c == '=' && dest > (guint8*)out) {
+                dest--;
+            }
+            pad--;
+        }
+    }
+    return dest - (guint8*)out;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_BASE64_H
+#define SAILFISH_MMS_BASE64_H
+
+#include <glib.h>
+
+/* Enough room for decoding len bytes of base64 */
+#define MMS_BASE64_DECODED_MAX(len) ((((len) + 3) / 4) * 3)
+
+/*
+ * Decodes the whole thing in one go, returns the number of bytes
+ * written to out. Characters outside of the base64 alphabet (line
+ * breaks, whitespaces and such) are skipped, same as GMime does.
+ */
+gsize
+mms_base64_decode(
+    const void* in,
+    gsize len,
+    void* out);
+
+#endif /* SAILFISH_MMS_BASE64_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
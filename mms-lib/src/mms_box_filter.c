@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_box_filter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define MMS_BOX_FILTER_HAVE_SSE2
+#  define MMS_SSE2 __attribute__((target("sse2")))
+#  include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define MMS_BOX_FILTER_HAVE_NEON
+#  include <arm_neon.h>
+#  ifndef __aarch64__
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#  endif
+#endif
+
+/* Logging */
+#define GLOG_MODULE_NAME mms_attachment_log
+#include <gutil_log.h>
+
+typedef struct mms_box_filter_kernel {
+    void (*add)(MMSBoxFilter* filter, const guint8* in);
+    void (*emit)(MMSBoxFilter* filter, guint8* out);
+} MMSBoxFilterKernel;
+
+struct mms_box_filter {
+    const MMSBoxFilterKernel* kernel;
+    MMS_BOX_FILTER_IMPL impl;
+    guint out_width;
+    guint nx;
+    guint ny;
+    guint rows;                 /* Rows accumulated so far */
+    guint divisor;              /* nx * ny */
+    guint32 recip;              /* Reciprocal of the divisor, 0 if none */
+    guint* acc;                 /* Accumulated values */
+    guint* sums;                /* Box sums (vector kernels only) */
+};
+
+/*==========================================================================*
+ * Scalar
+ *==========================================================================*/
+
+static
+void
+mms_box_filter_scalar_add(
+    MMSBoxFilter* filter,
+    const guint8* in)
+{
+    const guint nx = filter->nx;
+    guint* acc = filter->acc;
+    guint x;
+
+    for (x = 0; x < filter->out_width; x++) {
+        guint k;
+
+        for (k = 0; k < nx; k++) {
+            acc[0] += (*in++);
+            acc[1] += (*in++);
+            acc[2] += (*in++);
+        }
+        acc += 3;
+    }
+}
+
+static
+void
+mms_box_filter_scalar_emit(
+    MMSBoxFilter* filter,
+    guint8* out)
+{
+    const guint n = 3 * filter->out_width;
+    const guint d = filter->divisor;
+    guint* acc = filter->acc;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = acc[i] / d;
+    }
+    memset(acc, 0, n * sizeof(acc[0]));
+}
+
+static const MMSBoxFilterKernel mms_box_filter_scalar = {
+    mms_box_filter_scalar_add,
+    mms_box_filter_scalar_emit
+};
+
+/*==========================================================================*
+ * Common parts of the vector kernels. Those accumulate the columns
+ * (which is what vectorizes well) and sum up the boxes only when it's
+ * time to emit the output row. Division is replaced with multiplication
+ * by the reciprocal, see mms_box_filter_new() for the details.
+ *==========================================================================*/
+
+#if defined(MMS_BOX_FILTER_HAVE_SSE2) || defined(MMS_BOX_FILTER_HAVE_NEON)
+
+static
+void
+mms_box_filter_sum_boxes(
+    MMSBoxFilter* filter)
+{
+    const guint nx = filter->nx;
+    const guint* acc = filter->acc;
+    guint* sums = filter->sums;
+    guint x;
+
+    for (x = 0; x < filter->out_width; x++) {
+        guint k, r = 0, g = 0, b = 0;
+
+        for (k = 0; k < nx; k++) {
+            r += acc[0];
+            g += acc[1];
+            b += acc[2];
+            acc += 3;
+        }
+        sums[0] = r;
+        sums[1] = g;
+        sums[2] = b;
+        sums += 3;
+    }
+    memset(filter->acc, 0, 3 * filter->out_width * nx * sizeof(guint));
+}
+
+static inline
+guint8
+mms_box_filter_div(
+    const MMSBoxFilter* filter,
+    guint value)
+{
+    return filter->recip ?
+        (guint8)(((guint64)value * filter->recip) >> 32) :
+        (guint8)(value / filter->divisor);
+}
+
+#endif
+
+/*==========================================================================*
+ * SSE2
+ *==========================================================================*/
+
+#ifdef MMS_BOX_FILTER_HAVE_SSE2
+
+static
+MMS_SSE2
+void
+mms_box_filter_sse2_add(
+    MMSBoxFilter* filter,
+    const guint8* in)
+{
+    const guint n = 3 * filter->out_width * filter->nx;
+    const __m128i zero = _mm_setzero_si128();
+    guint* acc = filter->acc;
+    guint i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        const __m128i lo = _mm_unpacklo_epi8(v, zero);
+        const __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i* a = (__m128i*)(acc + i);
+
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a),
+            _mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1),
+            _mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2),
+            _mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3),
+            _mm_unpackhi_epi16(hi, zero)));
+    }
+    for (; i < n; i++) {
+        acc[i] += in[i];
+    }
+}
+
+/* Divides 4 values by multiplying them by the reciprocal */
+static inline
+MMS_SSE2
+__m128i
+mms_box_filter_sse2_div4(
+    const guint* sums,
+    __m128i recip)
+{
+    const __m128i v = _mm_loadu_si128((const __m128i*)sums);
+    const __m128i even = _mm_mul_epu32(v, recip);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(v, 32), recip);
+
+    /* High halves of the 64-bit products */
+    return _mm_or_si128(_mm_srli_epi64(even, 32),
+        _mm_and_si128(odd, _mm_set_epi32(-1, 0, -1, 0)));
+}
+
+static
+MMS_SSE2
+void
+mms_box_filter_sse2_emit(
+    MMSBoxFilter* filter,
+    guint8* out)
+{
+    const guint n = 3 * filter->out_width;
+    const guint* sums = filter->sums;
+    guint i = 0;
+
+    mms_box_filter_sum_boxes(filter);
+    if (filter->recip) {
+        const __m128i recip = _mm_set1_epi32(filter->recip);
+
+        for (; i + 16 <= n; i += 16) {
+            /* The values don't exceed 255, saturation doesn't kick in */
+            const __m128i w0 = _mm_packs_epi32(
+                mms_box_filter_sse2_div4(sums + i, recip),
+                mms_box_filter_sse2_div4(sums + i + 4, recip));
+            const __m128i w1 = _mm_packs_epi32(
+                mms_box_filter_sse2_div4(sums + i + 8, recip),
+                mms_box_filter_sse2_div4(sums + i + 12, recip));
+
+            _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(w0, w1));
+        }
+    }
+    for (; i < n; i++) {
+        out[i] = mms_box_filter_div(filter, sums[i]);
+    }
+}
+
+static const MMSBoxFilterKernel mms_box_filter_sse2 = {
+    mms_box_filter_sse2_add,
+    mms_box_filter_sse2_emit
+};
+
+#endif /* MMS_BOX_FILTER_HAVE_SSE2 */
+
+/*==========================================================================*
+ * NEON
+ *==========================================================================*/
+
+#ifdef MMS_BOX_FILTER_HAVE_NEON
+
+static
+void
+mms_box_filter_neon_add(
+    MMSBoxFilter* filter,
+    const guint8* in)
+{
+    const guint n = 3 * filter->out_width * filter->nx;
+    guint* acc = filter->acc;
+    guint i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        const uint8x16_t v = vld1q_u8(in + i);
+        const uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+        const uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+        guint* a = acc + i;
+
+        vst1q_u32(a, vaddw_u16(vld1q_u32(a), vget_low_u16(lo)));
+        vst1q_u32(a + 4, vaddw_u16(vld1q_u32(a + 4), vget_high_u16(lo)));
+        vst1q_u32(a + 8, vaddw_u16(vld1q_u32(a + 8), vget_low_u16(hi)));
+        vst1q_u32(a + 12, vaddw_u16(vld1q_u32(a + 12), vget_high_u16(hi)));
+    }
+    for (; i < n; i++) {
+        acc[i] += in[i];
+    }
+}
+
+/* Divides 4 values by multiplying them by the reciprocal */
+static inline
+uint16x4_t
+mms_box_filter_neon_div4(
+    const guint* sums,
+    uint32x2_t recip)
+{
+    const uint32x4_t v = vld1q_u32(sums);
+    const uint32x4_t q = vcombine_u32(
+        vshrn_n_u64(vmull_u32(vget_low_u32(v), recip), 32),
+        vshrn_n_u64(vmull_u32(vget_high_u32(v), recip), 32));
+
+    return vmovn_u32(q);
+}
+
+static
+void
+mms_box_filter_neon_emit(
+    MMSBoxFilter* filter,
+    guint8* out)
+{
+    const guint n = 3 * filter->out_width;
+    const guint* sums = filter->sums;
+    guint i = 0;
+
+    mms_box_filter_sum_boxes(filter);
+    if (filter->recip) {
+        const uint32x2_t recip = vdup_n_u32(filter->recip);
+
+        for (; i + 16 <= n; i += 16) {
+            const uint16x8_t w0 = vcombine_u16(
+                mms_box_filter_neon_div4(sums + i, recip),
+                mms_box_filter_neon_div4(sums + i + 4, recip));
+            const uint16x8_t w1 = vcombine_u16(
+                mms_box_filter_neon_div4(sums + i + 8, recip),
+                mms_box_filter_neon_div4(sums + i + 12, recip));
+
+            vst1q_u8(out + i, vcombine_u8(vmovn_u16(w0), vmovn_u16(w1)));
+        }
+    }
+    for (; i < n; i++) {
+        out[i] = mms_box_filter_div(filter, sums[i]);
+    }
+}
+
+static const MMSBoxFilterKernel mms_box_filter_neon = {
+    mms_box_filter_neon_add,
+    mms_box_filter_neon_emit
+};
+
+#endif /* MMS_BOX_FILTER_HAVE_NEON */
+
+/*==========================================================================*
+ * API
+ *==========================================================================*/
+
+gboolean
+mms_box_filter_impl_supported(
+    MMS_BOX_FILTER_IMPL impl)
+{
+    switch (impl) {
+    case MMS_BOX_FILTER_AUTO:
+    case MMS_BOX_FILTER_SCALAR:
+        return TRUE;
+    case MMS_BOX_FILTER_SSE2:
+#ifdef MMS_BOX_FILTER_HAVE_SSE2
+        return __builtin_cpu_supports("sse2");
+#else
+        break;
+#endif
+    case MMS_BOX_FILTER_NEON:
+#if defined(MMS_BOX_FILTER_HAVE_NEON) && defined(__aarch64__)
+        return TRUE;
+#elif defined(MMS_BOX_FILTER_HAVE_NEON)
+        return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+        break;
+#endif
+    }
+    return FALSE;
+}
+
+const char*
+mms_box_filter_impl_name(
+    MMS_BOX_FILTER_IMPL impl)
+{
+    switch (impl) {
+    case MMS_BOX_FILTER_AUTO: return "auto";
+    case MMS_BOX_FILTER_SCALAR: return "scalar";
+    case MMS_BOX_FILTER_SSE2: return "sse2";
+    case MMS_BOX_FILTER_NEON: return "neon";
+    }
+    return "unknown";
+}
+
+/**
+ * Creates the filter. If the requested implementation is not
+ * supported, falls back to the scalar one.
+ */
+MMSBoxFilter*
+mms_box_filter_new(
+    guint out_width,
+    guint nx,
+    guint ny,
+    MMS_BOX_FILTER_IMPL impl)
+{
+    MMSBoxFilter* filter;
+
+    g_return_val_if_fail(out_width && nx && ny, NULL);
+    filter = g_new0(MMSBoxFilter, 1);
+    filter->out_width = out_width;
+    filter->nx = nx;
+    filter->ny = ny;
+    filter->divisor = nx * ny;
+
+    if (impl == MMS_BOX_FILTER_AUTO) {
+        if (mms_box_filter_impl_supported(MMS_BOX_FILTER_NEON)) {
+            impl = MMS_BOX_FILTER_NEON;
+        } else if (mms_box_filter_impl_supported(MMS_BOX_FILTER_SSE2)) {
+            impl = MMS_BOX_FILTER_SSE2;
+        } else {
+            impl = MMS_BOX_FILTER_SCALAR;
+        }
+    } else if (!mms_box_filter_impl_supported(impl)) {
+        impl = MMS_BOX_FILTER_SCALAR;
+    }
+
+    switch (impl) {
+#ifdef MMS_BOX_FILTER_HAVE_SSE2
+    case MMS_BOX_FILTER_SSE2:
+        filter->kernel = &mms_box_filter_sse2;
+        break;
+#endif
+#ifdef MMS_BOX_FILTER_HAVE_NEON
+    case MMS_BOX_FILTER_NEON:
+        filter->kernel = &mms_box_filter_neon;
+        break;
+#endif
+    default:
+        impl = MMS_BOX_FILTER_SCALAR;
+        filter->kernel = &mms_box_filter_scalar;
+        break;
+    }
+    filter->impl = impl;
+
+    if (impl == MMS_BOX_FILTER_SCALAR) {
+        filter->acc = g_new0(guint, 3 * out_width);
+    } else {
+        const guint64 d = filter->divisor;
+
+        filter->acc = g_new0(guint, 3 * out_width * nx);
+        filter->sums = g_new(guint, 3 * out_width);
+
+        /*
+         * With m = floor(2^32/d) + 1, floor(a*m/2^32) == floor(a/d)
+         * as long as a*d < 2^32. The box sums never exceed 255*d,
+         * which gives the upper limit for d. That's about 4000, which
+         * is way more than any practical downscaling factor.
+         */
+        if (d > 1 && 255 * d * d < G_GUINT64_CONSTANT(0x100000000)) {
+            filter->recip = (guint32)(G_GUINT64_CONSTANT(0x100000000)/d + 1);
+        }
+    }
+    GVERBOSE("Box filter %ux%u (%s)", nx, ny, mms_box_filter_impl_name(impl));
+    return filter;
+}
+
+void
+mms_box_filter_free(
+    MMSBoxFilter* filter)
+{
+    if (filter) {
+        g_free(filter->acc);
+        g_free(filter->sums);
+        g_free(filter);
+    }
+}
+
+/**
+ * Adds 3*nx*out_width bytes of RGB24 data to the filter. Every ny-th
+ * call writes 3*out_width bytes to the output and returns TRUE. The
+ * output buffer may be the same as the input one.
+ */
+gboolean
+mms_box_filter_add_row(
+    MMSBoxFilter* filter,
+    const guint8* in,
+    guint8* out)
+{
+    filter->kernel->add(filter, in);
+    if (++filter->rows == filter->ny) {
+        filter->rows = 0;
+        filter->kernel->emit(filter, out);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+MMS_BOX_FILTER_IMPL
+mms_box_filter_impl(
+    MMSBoxFilter* filter)
+{
+    return filter->impl;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
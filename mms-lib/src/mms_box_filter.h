@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_BOX_FILTER_H
+#define SAILFISH_MMS_BOX_FILTER_H
+
+#include "mms_lib_types.h"
+
+/*
+ * Box filter for downscaling RGB24 images by integer factors. Each
+ * output pixel is the average of nx*ny input pixels, rounded down.
+ * The rows are fed one by one, every ny-th row produces an output
+ * row. Rightmost columns which don't make up a whole box are ignored.
+ *
+ * All implementations produce exactly the same output. The vector
+ * ones are only available if they are supported by both the compiler
+ * and the CPU, MMS_BOX_FILTER_AUTO picks the best one at run time.
+ */
+
+typedef enum mms_box_filter_impl {
+    MMS_BOX_FILTER_AUTO,
+    MMS_BOX_FILTER_SCALAR,
+    MMS_BOX_FILTER_SSE2,
+    MMS_BOX_FILTER_NEON
+} MMS_BOX_FILTER_IMPL;
+
+typedef struct mms_box_filter MMSBoxFilter;
+
+MMSBoxFilter*
+mms_box_filter_new(
+    guint out_width,
+    guint nx,
+    guint ny,
+    MMS_BOX_FILTER_IMPL impl);
+
+void
+mms_box_filter_free(
+    MMSBoxFilter* filter);
+
+gboolean
+mms_box_filter_add_row(
+    MMSBoxFilter* filter,
+    const guint8* in,
+    guint8* out);
+
+MMS_BOX_FILTER_IMPL
+mms_box_filter_impl(
+    MMSBoxFilter* filter);
+
+gboolean
+mms_box_filter_impl_supported(
+    MMS_BOX_FILTER_IMPL impl);
+
+const char*
+mms_box_filter_impl_name(
+    MMS_BOX_FILTER_IMPL impl);
+
+#endif /* SAILFISH_MMS_BOX_FILTER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
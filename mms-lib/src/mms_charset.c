@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_charset.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define MMS_CHARSET_NEON
+#endif
+
+/* Logging */
+#define GLOG_MODULE_NAME mms_codec_log
+#include "mms_lib_log.h"
+#include <gutil_log.h>
+
+/* Number of idle descriptors kept per charset pair */
+#define MMS_CHARSET_CACHE_DEPTH (4)
+
+/* Output buffer of mms_charset_convert_to_fd */
+#define MMS_CHARSET_CHUNK_SIZE (16*1024)
+
+typedef struct mms_charset_converters {
+    GIConv cd[MMS_CHARSET_CACHE_DEPTH];
+    guint count;
+} MMSCharsetConverters;
+
+static GMutex mms_charset_mutex;
+static GHashTable* mms_charset_cache = NULL;
+
+/* 0x8080...80 whatever the size of gsize is */
+#define MMS_CHARSET_HIGH_BITS ((G_MAXSIZE / 0xff) * 0x80)
+
+gboolean
+mms_charset_is_ascii(
+    const void* data,
+    gsize len)
+{
+    const guint8* ptr = data;
+    const guint8* end = ptr + len;
+
+#if defined(__SSE2__)
+    while ((end - ptr) >= 16) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ptr))) {
+            return FALSE;
+        }
+        ptr += 16;
+    }
+#elif defined(MMS_CHARSET_NEON)
+    while ((end - ptr) >= 16) {
+        if (vmaxvq_u8(vld1q_u8(ptr)) & 0x80) {
+            return FALSE;
+        }
+        ptr += 16;
+    }
+#else
+    /* Portable version, one machine word at a time */
+    while (ptr < end && ((gsize)ptr & (sizeof(gsize) - 1))) {
+        if (*ptr++ & 0x80) {
+            return FALSE;
+        }
+    }
+    while ((gsize)(end - ptr) >= sizeof(gsize)) {
+        if (*((const gsize*)ptr) & MMS_CHARSET_HIGH_BITS) {
+            return FALSE;
+        }
+        ptr += sizeof(gsize);
+    }
+#endif
+
+    while (ptr < end) {
+        if (*ptr++ & 0x80) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gboolean
+mms_charset_is_ascii_compatible(
+    const char* charset)
+{
+    /*
+     * Charsets which map 0x00..0x7f to the same code points as ASCII.
+     * Notably, that's not true for Shift_JIS (backslash and tilde),
+     * ISO-2022-* (escape sequences), UTF-7 and anything 16 or 32-bit.
+     */
+    static const char* prefixes[] = {
+        "iso-8859-", "iso8859-", "iso_8859-", "windows-", "cp125", "koi8-"
+    };
+    static const char* names[] = {
+        "us-ascii", "ascii", "ansi_x3.4-1968", "utf-8", "utf8", "big5",
+        "gb2312", "gbk", "gb18030", "euc-jp", "euc-kr", "euc-tw"
+    };
+    guint i;
+
+    if (charset) {
+        for (i = 0; i < G_N_ELEMENTS(names); i++) {
+            if (!g_ascii_strcasecmp(charset, names[i])) {
+                return TRUE;
+            }
+        }
+        for (i = 0; i < G_N_ELEMENTS(prefixes); i++) {
+            if (!g_ascii_strncasecmp(charset, prefixes[i],
+                strlen(prefixes[i]))) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+static
+void
+mms_charset_converters_free(
+    gpointer data)
+{
+    MMSCharsetConverters* conv = data;
+    guint i;
+
+    for (i = 0; i < conv->count; i++) {
+        g_iconv_close(conv->cd[i]);
+    }
+    g_slice_free(MMSCharsetConverters, conv);
+}
+
+static
+char*
+mms_charset_key(
+    const char* to_charset,
+    const char* from_charset)
+{
+    char* key = g_strconcat(to_charset, "\n", from_charset, NULL);
+    char* lower = g_ascii_strdown(key, -1);
+
+    g_free(key);
+    return lower;
+}
+
+static
+GIConv
+mms_charset_open(
+    const char* key,
+    const char* to_charset,
+    const char* from_charset)
+{
+    GIConv cd = (GIConv)-1;
+    MMSCharsetConverters* conv;
+
+    g_mutex_lock(&mms_charset_mutex);
+    if (mms_charset_cache) {
+        conv = g_hash_table_lookup(mms_charset_cache, key);
+        if (conv && conv->count > 0) {
+            cd = conv->cd[--conv->count];
+        }
+    }
+    g_mutex_unlock(&mms_charset_mutex);
+
+    if (cd == (GIConv)-1) {
+        GVERBOSE("Opening %s -> %s converter", from_charset, to_charset);
+        cd = g_iconv_open(to_charset, from_charset);
+    }
+    return cd;
+}
+
+static
+void
+mms_charset_close(
+    char* key,
+    GIConv cd)
+{
+    MMSCharsetConverters* conv;
+
+    /* Reset the conversion state */
+    g_iconv(cd, NULL, NULL, NULL, NULL);
+
+    g_mutex_lock(&mms_charset_mutex);
+    if (!mms_charset_cache) {
+        mms_charset_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, mms_charset_converters_free);
+    }
+    conv = g_hash_table_lookup(mms_charset_cache, key);
+    if (!conv) {
+        conv = g_slice_new0(MMSCharsetConverters);
+        g_hash_table_insert(mms_charset_cache, key, conv);
+        key = NULL;
+    }
+    if (conv->count < MMS_CHARSET_CACHE_DEPTH) {
+        conv->cd[conv->count++] = cd;
+        cd = (GIConv)-1;
+    }
+    g_mutex_unlock(&mms_charset_mutex);
+
+    if (cd != (GIConv)-1) {
+        g_iconv_close(cd);
+    }
+    g_free(key);
+}
+
+char*
+mms_charset_convert(
+    const char* data,
+    gsize len,
+    const char* to_charset,
+    const char* from_charset,
+    gsize* bytes_read,
+    gsize* bytes_written,
+    GError** error)
+{
+    char* key;
+    char* out;
+    GIConv cd;
+
+    if (mms_charset_is_ascii_compatible(from_charset) &&
+        mms_charset_is_ascii_compatible(to_charset) &&
+        mms_charset_is_ascii(data, len)) {
+        /* Nothing to convert */
+        if (bytes_read) *bytes_read = len;
+        if (bytes_written) *bytes_written = len;
+        out = g_malloc(len + 1);
+        memcpy(out, data, len);
+        out[len] = 0;
+        return out;
+    }
+
+    key = mms_charset_key(to_charset, from_charset);
+    cd = mms_charset_open(key, to_charset, from_charset);
+    if (cd == (GIConv)-1) {
+        g_set_error(error, G_CONVERT_ERROR, G_CONVERT_ERROR_NO_CONVERSION,
+            "Conversion from character set '%s' to '%s' is not supported",
+            from_charset, to_charset);
+        g_free(key);
+        return NULL;
+    }
+
+    out = g_convert_with_iconv(data, len, cd, bytes_read, bytes_written,
+        error);
+    mms_charset_close(key, cd);
+    return out;
+}
+
+static
+gboolean
+mms_charset_write(
+    int fd,
+    const char* buf,
+    gsize size,
+    GError** error)
+{
+    while (size > 0) {
+        const gssize written = write(fd, buf, size);
+
+        if (written > 0) {
+            buf += written;
+            size -= written;
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else {
+            const int err = written ? errno : ENOSPC;
+
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+                "Write failed: %s", g_strerror(err));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gboolean
+mms_charset_convert_to_fd(
+    const char* data,
+    gsize len,
+    const char* to_charset,
+    const char* from_charset,
+    int fd,
+    gsize* bytes_written,
+    GError** error)
+{
+    gboolean ok = TRUE;
+    gsize total = 0;
+
+    if (mms_charset_is_ascii_compatible(from_charset) &&
+        mms_charset_is_ascii_compatible(to_charset) &&
+        mms_charset_is_ascii(data, len)) {
+        /* Nothing to convert */
+        ok = mms_charset_write(fd, data, len, error);
+        if (ok) total = len;
+    } else {
+        char* key = mms_charset_key(to_charset, from_charset);
+        GIConv cd = mms_charset_open(key, to_charset, from_charset);
+
+        if (cd == (GIConv)-1) {
+            g_set_error(error, G_CONVERT_ERROR,
+                G_CONVERT_ERROR_NO_CONVERSION, "Conversion from character "
+                "set '%s' to '%s' is not supported", from_charset,
+                to_charset);
+            g_free(key);
+            ok = FALSE;
+        } else {
+            char* buf = g_malloc(MMS_CHARSET_CHUNK_SIZE);
+            gchar* in = (gchar*)data;
+            gsize in_left = len;
+
+            while (ok) {
+                /* Empty input flushes the shift state at the end */
+                const gboolean flush = !in_left;
+                gchar* out = buf;
+                gsize out_left = MMS_CHARSET_CHUNK_SIZE;
+                const gsize ret = flush ?
+                    g_iconv(cd, NULL, NULL, &out, &out_left) :
+                    g_iconv(cd, &in, &in_left, &out, &out_left);
+                const int err = (ret == (gsize)-1) ? errno : 0;
+
+                if (err == EINVAL) {
+                    g_set_error_literal(error, G_CONVERT_ERROR,
+                        G_CONVERT_ERROR_PARTIAL_INPUT,
+                        "Partial character sequence at end of input");
+                    ok = FALSE;
+                } else if (err && err != E2BIG) {
+                    g_set_error_literal(error, G_CONVERT_ERROR,
+                        G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+                        "Invalid byte sequence in conversion input");
+                    ok = FALSE;
+                } else {
+                    ok = mms_charset_write(fd, buf, out - buf, error);
+                    total += out - buf;
+                    if (flush && !err) break;
+                }
+            }
+            g_free(buf);
+            mms_charset_close(key, cd);
+        }
+    }
+    if (bytes_written) *bytes_written = ok ? total : 0;
+    return ok;
+}
+
+void
+mms_charset_cache_clear(void)
+{
+    GHashTable* cache;
+
+    g_mutex_lock(&mms_charset_mutex);
+    cache = mms_charset_cache;
+    mms_charset_cache = NULL;
+    g_mutex_unlock(&mms_charset_mutex);
+
+    if (cache) {
+        g_hash_table_destroy(cache);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
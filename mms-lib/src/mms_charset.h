@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_CHARSET_H
+#define SAILFISH_MMS_CHARSET_H
+
+#include <glib.h>
+
+/* TRUE if all bytes are 7-bit */
+gboolean
+mms_charset_is_ascii(
+    const void* data,
+    gsize len);
+
+/* TRUE if 7-bit data in this charset can be taken as is */
+gboolean
+mms_charset_is_ascii_compatible(
+    const char* charset);
+
+/*
+ * Same as g_convert() but reuses iconv descriptors and doesn't convert
+ * pure 7-bit data if the source charset is ASCII compatible. Can be
+ * called from any thread.
+ */
+char*
+mms_charset_convert(
+    const char* data,
+    gsize len,
+    const char* to_charset,
+    const char* from_charset,
+    gsize* bytes_read,
+    gsize* bytes_written,
+    GError** error);
+
+/*
+ * Same thing but the output goes to the file descriptor, one chunk at
+ * a time, and never is in memory in its entirety.
+ */
+gboolean
+mms_charset_convert_to_fd(
+    const char* data,
+    gsize len,
+    const char* to_charset,
+    const char* from_charset,
+    int fd,
+    gsize* bytes_written,
+    GError** error);
+
+/* Closes the cached descriptors */
+void
+mms_charset_cache_clear(void);
+
+#endif /* SAILFISH_MMS_CHARSET_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
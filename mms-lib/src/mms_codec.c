@@ -32,8 +32,8 @@
 
 #include <glib.h>
 
-#include "wsputil.h"
 #include "mms_codec.h"
+#include "mms_charset.h"
 
 /* Logging */
 #define GLOG_MODULE_NAME mms_codec_log
@@ -168,7 +168,8 @@ struct file_buffer {
 	unsigned char buf[FB_SIZE];
 	unsigned int size;
 	unsigned int fsize;
-	int fd;
+	mms_encode_write_cb write;
+	void *user_data;
 };
 
 typedef gboolean (*header_handler)(struct wsp_header_iter *, void *);
@@ -529,8 +530,8 @@ static char *decode_encoded_string_with_mib_enum(const unsigned char *p,
 	if (from_codeset == NULL)
 		return NULL;
 
-	converted = g_convert((const char *) p + consumed, l - consumed,
-			to_codeset, from_codeset,
+	converted = mms_charset_convert((const char *) p + consumed,
+			l - consumed, to_codeset, from_codeset,
 			&bytes_read, &bytes_written, &error);
 
 	if (!converted) {
@@ -1042,7 +1043,52 @@ struct header_handler_entry {
 	int pos;
 };
 
-static gboolean mms_parse_headers(struct wsp_header_iter *iter,
+static void decode_budget_start(struct mms_message_attachment_iter *ai)
+{
+	if (ai->limits.max_time_ms)
+		ai->started = g_get_monotonic_time();
+}
+
+static void decode_budget_stop(struct mms_message_attachment_iter *ai)
+{
+	if (ai->limits.max_time_ms)
+		ai->elapsed += g_get_monotonic_time() - ai->started;
+}
+
+static gboolean decode_budget_spend(struct mms_message_attachment_iter *ai,
+					unsigned int headers, unsigned int text)
+{
+	const struct mms_decode_limits *limits = &ai->limits;
+
+	ai->nheaders += headers;
+	ai->ntext += text;
+
+	if (limits->max_headers && ai->nheaders > limits->max_headers) {
+		GWARN("Too many headers (more than %u)", limits->max_headers);
+		goto exceeded;
+	}
+
+	if (limits->max_text && ai->ntext > limits->max_text) {
+		GWARN("Too much text (more than %u bytes)", limits->max_text);
+		goto exceeded;
+	}
+
+	if (limits->max_time_ms && (ai->elapsed + g_get_monotonic_time() -
+			ai->started) > (gint64)limits->max_time_ms * 1000) {
+		GWARN("Decoding takes too long (more than %u ms)",
+							limits->max_time_ms);
+		goto exceeded;
+	}
+
+	return TRUE;
+
+exceeded:
+	ai->result = MMS_DECODE_ERROR_LIMIT;
+	return FALSE;
+}
+
+static gboolean mms_parse_headers(struct mms_message_attachment_iter *ai,
+					struct wsp_header_iter *iter,
 					enum mms_header orig_header, ...)
 {
 	struct header_handler_entry entries[__MMS_HEADER_MAX + 1];
@@ -1069,6 +1115,9 @@ static gboolean mms_parse_headers(struct wsp_header_iter *iter,
 		unsigned char h;
 		header_handler handler;
 
+		if (decode_budget_spend(ai, 1, 0) == FALSE)
+			return FALSE;
+
 		/* Skip application headers */
 		if (wsp_header_iter_get_hdr_type(iter) !=
 				WSP_HEADER_TYPE_WELL_KNOWN)
@@ -1100,6 +1149,10 @@ static gboolean mms_parse_headers(struct wsp_header_iter *iter,
 
 		entries[h].pos = i;
 		entries[h].flags |= HEADER_FLAG_MARKED;
+
+		if (decode_budget_spend(ai, 0,
+				wsp_header_iter_get_val_len(iter)) == FALSE)
+			return FALSE;
 	}
 
 	for (i = 0; i < __MMS_HEADER_MAX + 1; i++) {
@@ -1144,9 +1197,10 @@ static gboolean mms_parse_headers(struct wsp_header_iter *iter,
 }
 
 static gboolean decode_notification_ind(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	return mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	return mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
 				&out->transaction_id,
 				MMS_HEADER_MMS_VERSION,
@@ -1168,9 +1222,10 @@ static gboolean decode_notification_ind(struct wsp_header_iter *iter,
 }
 
 static gboolean decode_notify_resp_ind(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	return mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	return mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
 				&out->transaction_id,
 				MMS_HEADER_MMS_VERSION,
@@ -1182,9 +1237,10 @@ static gboolean decode_notify_resp_ind(struct wsp_header_iter *iter,
 }
 
 static gboolean decode_acknowledge_ind(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	return mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	return mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
 				&out->transaction_id,
 				MMS_HEADER_MMS_VERSION,
@@ -1196,9 +1252,10 @@ static gboolean decode_acknowledge_ind(struct wsp_header_iter *iter,
 }
 
 static gboolean decode_delivery_ind(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	return mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	return mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_PRESET_POS, NULL,
 				MMS_HEADER_MMS_VERSION,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
@@ -1215,9 +1272,10 @@ static gboolean decode_delivery_ind(struct wsp_header_iter *iter,
 }
 
 static gboolean decode_read_ind(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	return mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	return mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_PRESET_POS, NULL,
 				MMS_HEADER_MMS_VERSION,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
@@ -1251,45 +1309,43 @@ static const char *decode_attachment_charset(const unsigned char *pdu,
 	return NULL;
 }
 
-static gboolean extract_quoted_string(struct wsp_header_iter *iter, char **out)
+static const char *decode_quoted_string(struct wsp_header_iter *iter)
 {
 	const unsigned char *p;
 	unsigned int l;
-	const char *text;
 
 	p = wsp_header_iter_get_val(iter);
 	l = wsp_header_iter_get_val_len(iter);
 
 	if (wsp_header_iter_get_val_type(iter) != WSP_VALUE_TYPE_TEXT)
-		return FALSE;
-
-	text = wsp_decode_quoted_string(p, l, NULL);
-
-	if (text == NULL)
-		return FALSE;
-
-	*out = g_strdup(text);
+		return NULL;
 
-	return TRUE;
+	return wsp_decode_quoted_string(p, l, NULL);
 }
 
-static gboolean attachment_parse_headers(struct wsp_header_iter *iter,
-						struct mms_attachment *part)
+static gboolean attachment_parse_headers(
+					struct mms_message_attachment_iter *ai,
+					struct wsp_header_iter *iter,
+					struct mms_attachment_view *part)
 {
 	while (wsp_header_iter_next(iter)) {
 		const unsigned char *hdr = wsp_header_iter_get_hdr(iter);
 
+		if (decode_budget_spend(ai, 1,
+				wsp_header_iter_get_val_len(iter)) == FALSE)
+			return FALSE;
+
 		if (wsp_header_iter_get_hdr_type(iter) ==
 					WSP_HEADER_TYPE_WELL_KNOWN) {
 			switch (hdr[0] & 0x7f) {
 			case MMS_PART_HEADER_CONTENT_ID:
-				if (!extract_quoted_string(iter,
-						&part->content_id))
+				part->content_id = decode_quoted_string(iter);
+				if (part->content_id == NULL)
 					return FALSE;
 				break;
 			case MMS_PART_HEADER_CONTENT_LOCATION:
-				if (!extract_text(iter,
-						&part->content_location))
+				part->content_location = decode_text(iter);
+				if (part->content_location == NULL)
 					return FALSE;
 				break;
 			}
@@ -1297,8 +1353,8 @@ static gboolean attachment_parse_headers(struct wsp_header_iter *iter,
 			/* Application (textual) header */
 			if (g_ascii_strcasecmp((char*)hdr,
 					"content-transfer-encoding") == 0) {
-				if (!extract_text(iter,
-						&part->transfer_encoding))
+				part->transfer_encoding = decode_text(iter);
+				if (part->transfer_encoding == NULL)
 					return FALSE;
 			}
 		}
@@ -1319,83 +1375,135 @@ static void free_attachment(gpointer data, gpointer user_data)
 	g_free(attach);
 }
 
-static gboolean mms_parse_attachments(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+static gboolean attachment_iter_init(struct mms_message_attachment_iter *ai,
+				struct wsp_header_iter *iter,
+				gboolean allow_single)
+{
+	ai->hdr = *iter;
+
+	if (wsp_header_iter_at_end(iter) == TRUE)
+		return TRUE;
+
+	/* Single part is ignored */
+	if (wsp_header_iter_is_multipart(iter) == FALSE)
+		return allow_single && wsp_header_iter_is_content_type(iter);
+
+	if (wsp_multipart_iter_init(&ai->parts, &ai->hdr, NULL, NULL) == FALSE)
+		return FALSE;
+
+	ai->multipart = TRUE;
+
+	return TRUE;
+}
+
+static gboolean attachment_iter_fail(struct mms_message_attachment_iter *ai)
 {
-	struct wsp_multipart_iter mi;
+	if (ai->result == MMS_DECODE_OK)
+		ai->result = MMS_DECODE_ERROR_FORMAT;
+
+	return FALSE;
+}
+
+static gboolean attachment_iter_next(struct mms_message_attachment_iter *ai,
+					struct mms_attachment_view *part)
+{
+	struct wsp_header_iter hi;
 	const void *ct;
+	const void *mimetype;
 	unsigned int ct_len;
 	unsigned int consumed;
 
-	if (wsp_multipart_iter_init(&mi, iter, &ct, &ct_len) == FALSE)
+	if (wsp_multipart_iter_next(&ai->parts) == FALSE)
 		return FALSE;
 
-	while (wsp_multipart_iter_next(&mi) == TRUE) {
-		struct mms_attachment *part;
-		struct wsp_header_iter hi;
-		const void *mimetype;
-		const char *charset;
+	ai->nparts++;
+	if (ai->limits.max_parts && ai->nparts > ai->limits.max_parts) {
+		GWARN("Too many parts (more than %u)", ai->limits.max_parts);
+		ai->result = MMS_DECODE_ERROR_LIMIT;
+		return FALSE;
+	}
 
-		ct = wsp_multipart_iter_get_content_type(&mi);
-		ct_len = wsp_multipart_iter_get_content_type_len(&mi);
+	ct = wsp_multipart_iter_get_content_type(&ai->parts);
+	ct_len = wsp_multipart_iter_get_content_type_len(&ai->parts);
 
-		if (wsp_decode_content_type(ct, ct_len, &mimetype,
-						&consumed, NULL) == FALSE)
-			return FALSE;
+	if (decode_budget_spend(ai, 0, ct_len) == FALSE)
+		return FALSE;
+
+	if (wsp_decode_content_type(ct, ct_len, &mimetype,
+					&consumed, NULL) == FALSE)
+		return attachment_iter_fail(ai);
 
-		charset = decode_attachment_charset(
+	memset(part, 0, sizeof(*part));
+	part->mimetype = mimetype;
+	part->charset = decode_attachment_charset(
 					(const unsigned char *)ct + consumed,
 					ct_len - consumed);
 
-		wsp_header_iter_init(&hi, wsp_multipart_iter_get_hdr(&mi),
-					wsp_multipart_iter_get_hdr_len(&mi),
-					0);
+	wsp_header_iter_init(&hi, wsp_multipart_iter_get_hdr(&ai->parts),
+				wsp_multipart_iter_get_hdr_len(&ai->parts), 0);
 
-		part = g_try_new0(struct mms_attachment, 1);
-		if (part == NULL)
+	if (attachment_parse_headers(ai, &hi, part) == FALSE) {
+
+		/*
+		 * Better to ignore this. It doesn't stop us from
+		 * parsing the rest of the PDU. And yes, it does
+		 * happen in real life.
+		 */
+		if (ai->result != MMS_DECODE_OK)
 			return FALSE;
 
-		if (attachment_parse_headers(&hi, part) == FALSE) {
+		GWARN("Failed to parse part headers");
+	}
+
+	if (wsp_header_iter_at_end(&hi) == FALSE)
+		return attachment_iter_fail(ai);
 
-			/*
-			 * Better to ignore this. It doesn't stop us from
-			 * parsing the rest of the PDU. And yes, it does
-			 * happen in real life.
-			 */
-			GWARN("Failed to parse part headers");
-		}
+	part->data = wsp_multipart_iter_get_body(&ai->parts);
+	part->length = wsp_multipart_iter_get_body_len(&ai->parts);
+	part->offset = part->data - wsp_header_iter_get_pdu(&ai->hdr);
 
-		if (wsp_header_iter_at_end(&hi) == FALSE) {
-			free_attachment(part, NULL);
-			return FALSE;
-		}
+	return TRUE;
+}
 
-		if (charset == NULL)
-			part->content_type = g_strdup(mimetype);
-		else
-			part->content_type = g_strconcat(mimetype, ";charset=",
-								charset, NULL);
+gboolean mms_message_attachment_iter_next(
+				struct mms_message_attachment_iter *ai,
+				struct mms_attachment_view *part)
+{
+	gboolean ok;
 
-		part->length = wsp_multipart_iter_get_body_len(&mi);
-		part->offset = (const unsigned char *)
-					wsp_multipart_iter_get_body(&mi) -
-					wsp_header_iter_get_pdu(iter);
+	if (ai->multipart == FALSE || ai->result != MMS_DECODE_OK)
+		return FALSE;
 
-		out->attachments = g_slist_prepend(out->attachments, part);
-	}
+	decode_budget_start(ai);
+	ok = attachment_iter_next(ai, part);
+	decode_budget_stop(ai);
 
-	if (wsp_multipart_iter_close(&mi, iter) == FALSE)
+	return ok;
+}
+
+gboolean mms_message_attachment_iter_close(
+				struct mms_message_attachment_iter *ai)
+{
+	if (ai->result != MMS_DECODE_OK)
 		return FALSE;
 
-	out->attachments = g_slist_reverse(out->attachments);
+	if (ai->multipart == FALSE)
+		return TRUE;
+
+	ai->multipart = FALSE;
+
+	if (wsp_multipart_iter_close(&ai->parts, &ai->hdr) == FALSE ||
+			wsp_header_iter_at_end(&ai->hdr) == FALSE)
+		return attachment_iter_fail(ai);
 
 	return TRUE;
 }
 
 static gboolean decode_retrieve_conf(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	if (mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	if (mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_PRESET_POS, &out->transaction_id,
 				MMS_HEADER_MMS_VERSION,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
@@ -1423,26 +1531,15 @@ static gboolean decode_retrieve_conf(struct wsp_header_iter *iter,
 				MMS_HEADER_INVALID) == FALSE)
 		return FALSE;
 
-	if (wsp_header_iter_at_end(iter) == TRUE)
-		return TRUE;
-
 	/* Ignore non-multipart attachments */
-	if (wsp_header_iter_is_multipart(iter) == FALSE)
-		return wsp_header_iter_is_content_type(iter);
-
-	if (mms_parse_attachments(iter, out) == FALSE)
-		return FALSE;
-
-	if (wsp_header_iter_at_end(iter) == FALSE)
-		return FALSE;
-
-	return TRUE;
+	return attachment_iter_init(ai, iter, TRUE);
 }
 
 static gboolean decode_send_conf(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	return mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	return mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
 				&out->transaction_id,
 				MMS_HEADER_MMS_VERSION,
@@ -1458,9 +1555,10 @@ static gboolean decode_send_conf(struct wsp_header_iter *iter,
 }
 
 static gboolean decode_send_req(struct wsp_header_iter *iter,
-                        struct mms_message *out)
+                        struct mms_message *out,
+                        struct mms_message_attachment_iter *ai)
 {
-	if (mms_parse_headers(iter, MMS_HEADER_TRANSACTION_ID,
+	if (mms_parse_headers(ai, iter, MMS_HEADER_TRANSACTION_ID,
 				HEADER_FLAG_MANDATORY | HEADER_FLAG_PRESET_POS,
 				&out->transaction_id,
 				MMS_HEADER_MMS_VERSION,
@@ -1477,19 +1575,7 @@ static gboolean decode_send_req(struct wsp_header_iter *iter,
 				MMS_HEADER_INVALID) == FALSE)
 		return FALSE;
 
-	if (wsp_header_iter_at_end(iter) == TRUE)
-		return TRUE;
-
-	if (wsp_header_iter_is_multipart(iter) == FALSE)
-		return FALSE;
-
-	if (mms_parse_attachments(iter, out) == FALSE)
-		return FALSE;
-
-	if (wsp_header_iter_at_end(iter) == FALSE)
-		return FALSE;
-
-	return TRUE;
+	return attachment_iter_init(ai, iter, FALSE);
 }
 
 #define CHECK_WELL_KNOWN_HDR(hdr)			\
@@ -1505,16 +1591,15 @@ static gboolean decode_send_req(struct wsp_header_iter *iter,
 	if ((p[0] & 0x7f) != hdr)			\
 		return FALSE				\
 
-gboolean mms_message_decode(const unsigned char *pdu,
-                unsigned int len, struct mms_message *out)
+static gboolean decode_headers(struct mms_message_attachment_iter *ai,
+				const unsigned char *pdu, unsigned int len,
+				struct mms_message *out)
 {
 	unsigned int flags = 0;
 	struct wsp_header_iter iter;
 	const unsigned char *p;
 	unsigned char octet;
 
-	memset(out, 0, sizeof(*out));
-
 	flags |= WSP_HEADER_ITER_FLAG_REJECT_CP;
 	flags |= WSP_HEADER_ITER_FLAG_DETECT_MMS_MULTIPART;
 	wsp_header_iter_init(&iter, pdu, len, flags);
@@ -1528,27 +1613,105 @@ gboolean mms_message_decode(const unsigned char *pdu,
 
 	switch (out->type) {
 	case MMS_MESSAGE_TYPE_SEND_REQ:
-		return decode_send_req(&iter, out);
+		return decode_send_req(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_SEND_CONF:
-		return decode_send_conf(&iter, out);
+		return decode_send_conf(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_NOTIFICATION_IND:
-		return decode_notification_ind(&iter, out);
+		return decode_notification_ind(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_NOTIFYRESP_IND:
-		return decode_notify_resp_ind(&iter, out);
+		return decode_notify_resp_ind(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_RETRIEVE_CONF:
-		return decode_retrieve_conf(&iter, out);
+		return decode_retrieve_conf(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_ACKNOWLEDGE_IND:
-		return decode_acknowledge_ind(&iter, out);
+		return decode_acknowledge_ind(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_DELIVERY_IND:
-		return decode_delivery_ind(&iter, out);
+		return decode_delivery_ind(&iter, out, ai);
 	case MMS_MESSAGE_TYPE_READ_REC_IND:
 	case MMS_MESSAGE_TYPE_READ_ORIG_IND:
-		return decode_read_ind(&iter, out);
+		return decode_read_ind(&iter, out, ai);
 	}
 
 	return FALSE;
 }
 
+gboolean mms_message_attachment_iter_init_full(
+				struct mms_message_attachment_iter *ai,
+				const unsigned char *pdu, unsigned int len,
+				struct mms_message *out,
+				const struct mms_decode_limits *limits)
+{
+	gboolean ok;
+
+	memset(out, 0, sizeof(*out));
+	memset(ai, 0, sizeof(*ai));
+
+	if (limits != NULL)
+		ai->limits = *limits;
+
+	decode_budget_start(ai);
+	ok = decode_headers(ai, pdu, len, out);
+	decode_budget_stop(ai);
+
+	if (ok == FALSE)
+		return attachment_iter_fail(ai);
+
+	return TRUE;
+}
+
+gboolean mms_message_attachment_iter_init(
+				struct mms_message_attachment_iter *ai,
+				const unsigned char *pdu, unsigned int len,
+				struct mms_message *out)
+{
+	return mms_message_attachment_iter_init_full(ai, pdu, len, out, NULL);
+}
+
+enum mms_decode_result mms_message_decode_full(const unsigned char *pdu,
+				unsigned int len, struct mms_message *out,
+				const struct mms_decode_limits *limits)
+{
+	struct mms_message_attachment_iter ai;
+	struct mms_attachment_view view;
+
+	if (mms_message_attachment_iter_init_full(&ai, pdu, len, out,
+							limits) == FALSE)
+		return ai.result;
+
+	while (mms_message_attachment_iter_next(&ai, &view) == TRUE) {
+		struct mms_attachment *part;
+
+		part = g_try_new0(struct mms_attachment, 1);
+		if (part == NULL)
+			return MMS_DECODE_ERROR_FORMAT;
+
+		if (view.charset == NULL)
+			part->content_type = g_strdup(view.mimetype);
+		else
+			part->content_type = g_strconcat(view.mimetype,
+						";charset=", view.charset, NULL);
+
+		part->content_id = g_strdup(view.content_id);
+		part->content_location = g_strdup(view.content_location);
+		part->transfer_encoding = g_strdup(view.transfer_encoding);
+		part->length = view.length;
+		part->offset = view.offset;
+
+		out->attachments = g_slist_prepend(out->attachments, part);
+	}
+
+	out->attachments = g_slist_reverse(out->attachments);
+
+	mms_message_attachment_iter_close(&ai);
+
+	return ai.result;
+}
+
+gboolean mms_message_decode(const unsigned char *pdu,
+                unsigned int len, struct mms_message *out)
+{
+	return mms_message_decode_full(pdu, len, out, NULL) == MMS_DECODE_OK;
+}
+
 void mms_message_free(struct mms_message *msg)
 {
 	switch (msg->type) {
@@ -1603,31 +1766,40 @@ void mms_message_free(struct mms_message *msg)
 	g_free(msg);
 }
 
-static void fb_init(struct file_buffer *fb, int fd)
+static gboolean fb_write_fd(const void *buf, unsigned int c,
+				const struct mms_attachment *part, void *user_data)
+{
+	const int *fd = user_data;
+	unsigned int written;
+	ssize_t len;
+
+	len = TFR(write(*fd, buf, c));
+	if (len < 0)
+		return FALSE;
+
+	written = len;
+
+	return written == c;
+}
+
+static void fb_init(struct file_buffer *fb, mms_encode_write_cb cb,
+							void *user_data)
 {
 	fb->size = 0;
 	fb->fsize = 0;
-	fb->fd = fd;
+	fb->write = cb;
+	fb->user_data = user_data;
 }
 
 static gboolean fb_flush(struct file_buffer *fb)
 {
-	unsigned int size;
-	ssize_t len;
-
 	if (fb->size == 0)
 		return TRUE;
 
-	len = write(fb->fd, fb->buf, fb->size);
-	if (len < 0)
-		return FALSE;
-
-	size = len;
-
-	if (size != fb->size)
+	if (fb->write(fb->buf, fb->size, NULL, fb->user_data) == FALSE)
 		return FALSE;
 
-	fb->fsize += size;
+	fb->fsize += fb->size;
 
 	fb->size = 0;
 
@@ -1672,24 +1844,16 @@ static void *fb_request_field(struct file_buffer *fb, unsigned char token,
 	return ptr + 1;
 }
 
-static gboolean fb_copy(struct file_buffer *fb, const void *buf, unsigned int c)
+static gboolean fb_copy_part(struct file_buffer *fb,
+					const struct mms_attachment *part)
 {
-	unsigned int written;
-	ssize_t len;
-
 	if (fb_flush(fb) == FALSE)
 		return FALSE;
 
-	len = TFR(write(fb->fd, buf, c));
-	if (len < 0)
+	if (fb->write(part->data, part->length, part, fb->user_data) == FALSE)
 		return FALSE;
 
-	written = len;
-
-	if (written != c)
-		return FALSE;
-
-	fb->fsize += written;
+	fb->fsize += part->length;
 
 	return TRUE;
 }
@@ -2257,7 +2421,7 @@ static gboolean mms_encode_send_req_part(struct mms_attachment *part,
 
 	part->offset = fb_get_file_size(fb);
 
-	return fb_copy(fb, part->data, part->length);
+	return fb_copy_part(fb, part);
 }
 
 static gboolean mms_encode_headers(struct file_buffer *fb,
@@ -2369,10 +2533,16 @@ done:
 }
 
 gboolean mms_message_encode(struct mms_message *msg, int fd)
+{
+	return mms_message_encode_stream(msg, fb_write_fd, &fd);
+}
+
+gboolean mms_message_encode_stream(struct mms_message *msg,
+				mms_encode_write_cb cb, void *user_data)
 {
 	struct file_buffer fb;
 
-	fb_init(&fb, fd);
+	fb_init(&fb, cb, user_data);
 
 	switch (msg->type) {
 	case MMS_MESSAGE_TYPE_SEND_REQ:
@@ -19,6 +19,8 @@
 
 #include <glib.h>
 
+#include "wsputil.h"
+
 enum mms_message_type {
 	MMS_MESSAGE_TYPE_SEND_REQ =			128,
 	MMS_MESSAGE_TYPE_SEND_CONF =			129,
@@ -189,6 +191,55 @@ struct mms_attachment {
 	char *transfer_encoding;
 };
 
+/*
+ * Borrowed view of a message part. Strings point into the PDU (or to
+ * static data) and remain valid for as long as the PDU does. Unlike
+ * mms_attachment, the charset is not appended to the content type.
+ */
+struct mms_attachment_view {
+	const unsigned char *data;
+	size_t offset;
+	size_t length;
+	const char *mimetype;
+	const char *charset;
+	const char *content_id;
+	const char *content_location;
+	const char *transfer_encoding;
+};
+
+/*
+ * Protection against pathological input. Zero means no limit. The text
+ * limit applies to the total size of the header values which have been
+ * decoded, including the part headers. The time limit is the total time
+ * spent in the decoder (not including the time spent by the caller in
+ * between mms_message_attachment_iter_next() calls).
+ */
+struct mms_decode_limits {
+	unsigned int max_headers;
+	unsigned int max_parts;
+	unsigned int max_text;
+	unsigned int max_time_ms;
+};
+
+enum mms_decode_result {
+	MMS_DECODE_OK,
+	MMS_DECODE_ERROR_FORMAT,
+	MMS_DECODE_ERROR_LIMIT,
+};
+
+struct mms_message_attachment_iter {
+	struct wsp_header_iter hdr;
+	struct wsp_multipart_iter parts;
+	struct mms_decode_limits limits;
+	enum mms_decode_result result;
+	gboolean multipart;
+	unsigned int nheaders;
+	unsigned int nparts;
+	unsigned int ntext;
+	gint64 started;
+	gint64 elapsed;
+};
+
 struct mms_message {
 	enum mms_message_type type;
 	char *transaction_id;
@@ -206,11 +257,47 @@ struct mms_message {
 	};
 };
 
+/*
+ * Callback for the streaming encoder. Encoded headers are passed in
+ * a temporary buffer and part is NULL. Attachment data is passed as is,
+ * together with the attachment it belongs to, so that the caller can
+ * reference the data rather than copy it.
+ */
+typedef gboolean (*mms_encode_write_cb)(const void *data, unsigned int len,
+				const struct mms_attachment *part, void *user_data);
+
 char **mms_parse_http_content_type(const char *str);
 char *mms_unparse_http_content_type(char **ct);
 gboolean mms_message_decode(const unsigned char *pdu,
 				unsigned int len, struct mms_message *out);
+enum mms_decode_result mms_message_decode_full(const unsigned char *pdu,
+				unsigned int len, struct mms_message *out,
+				const struct mms_decode_limits *limits);
+/*
+ * Lazy alternative to mms_message_decode(). The iterator decodes the
+ * headers into out (leaving out->attachments empty) and then walks the
+ * parts one by one without copying anything. The iteration must run to
+ * the end, mms_message_attachment_iter_close() then tells whether the
+ * whole PDU has been decoded successfully. If it hasn't, iter->result
+ * tells whether the PDU is malformed or exceeds the limits.
+ */
+gboolean mms_message_attachment_iter_init(
+				struct mms_message_attachment_iter *iter,
+				const unsigned char *pdu, unsigned int len,
+				struct mms_message *out);
+gboolean mms_message_attachment_iter_init_full(
+				struct mms_message_attachment_iter *iter,
+				const unsigned char *pdu, unsigned int len,
+				struct mms_message *out,
+				const struct mms_decode_limits *limits);
+gboolean mms_message_attachment_iter_next(
+				struct mms_message_attachment_iter *iter,
+				struct mms_attachment_view *part);
+gboolean mms_message_attachment_iter_close(
+				struct mms_message_attachment_iter *iter);
 gboolean mms_message_encode(struct mms_message *msg, int fd);
+gboolean mms_message_encode_stream(struct mms_message *msg,
+				mms_encode_write_cb cb, void *user_data);
 void mms_message_free(struct mms_message *msg);
 
 #endif /* MMS_CODEC_H_ */
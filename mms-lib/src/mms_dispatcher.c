@@ -19,6 +19,8 @@
 #include "mms_connman.h"
 #include "mms_transfer_list.h"
 #include "mms_file_util.h"
+#include "mms_store.h"
+#include "mms_gc.h"
 #include "mms_codec.h"
 #include "mms_util.h"
 #include "mms_task.h"
@@ -43,6 +45,7 @@ struct mms_dispatcher {
     MMSTransferList* transfers;
     MMSDispatcherDelegate* delegate;
     GQueue* tasks;
+    MMSGc* gc;
     guint next_run_id;
     guint network_idle_id;
     gulong handler_done_id;
@@ -80,6 +83,14 @@ mms_dispatcher_check_if_done(
             g_source_remove(disp->next_run_id);
             disp->next_run_id = 0;
         }
+        /* Drop the files which no message refers to anymore */
+        if (disp->started && disp->settings->config->dedup) {
+            mms_store_gc(disp->settings->config->root_dir);
+        }
+        /* And whatever the previous runs have left behind */
+        if (disp->started) {
+            mms_gc_start(disp->gc);
+        }
         /* Notify the delegate that we are done */
         if (disp->delegate && disp->delegate->fn_done && disp->started) {
             disp->started = FALSE;
@@ -600,7 +611,7 @@ mms_dispatcher_receive_message(
     GError** error)
 {
     gboolean ok = FALSE;
-    MMSPdu* pdu = mms_decode_bytes(bytes);
+    MMSPdu* pdu = mms_decode_bytes(disp->settings->config, bytes, error);
     if (pdu) {
         GASSERT(pdu->type == MMS_MESSAGE_TYPE_NOTIFICATION_IND);
         if (pdu->type == MMS_MESSAGE_TYPE_NOTIFICATION_IND) {
@@ -619,8 +630,6 @@ mms_dispatcher_receive_message(
             MMS_ERROR(error, MMS_LIB_ERROR_DECODE, "Inexpected MMS PDU type");
         }
         mms_message_free(pdu);
-    } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_DECODE, "Failed to decode MMS PDU");
     }
     return ok;
 }
@@ -762,6 +771,31 @@ mms_dispatcher_connman_done(
     mms_dispatcher_check_if_done(disp);
 }
 
+/**
+ * Tells the garbage collector whether the message is still being worked on
+ */
+static
+gboolean
+mms_dispatcher_gc_busy(
+    const char* id,
+    void* user_data)
+{
+    MMSDispatcher* disp = user_data;
+    GList* entry;
+
+    if (disp->active_task && !g_strcmp0(disp->active_task->id, id)) {
+        return TRUE;
+    }
+    for (entry = disp->tasks->head; entry; entry = entry->next) {
+        MMSTask* task = entry->data;
+
+        if (!g_strcmp0(task->id, id)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 /**
  * Creates the dispatcher object. Caller must call mms_dispatcher_unref
  * when it no longer needs it.
@@ -788,6 +822,7 @@ mms_dispatcher_new(
         mms_dispatcher_handler_done, disp);
     disp->connman_done_id = mms_connman_add_done_callback(cm,
         mms_dispatcher_connman_done, disp);
+    disp->gc = mms_gc_new(settings->config, mms_dispatcher_gc_busy, disp);
     return disp;
 }
 
@@ -800,9 +835,12 @@ mms_dispatcher_finalize(
     MMSDispatcher* disp)
 {
     MMSTask* task;
-    const char* root_dir = disp->settings->config->root_dir;
-    char* msg_dir = g_build_filename(root_dir, MMS_MESSAGE_DIR, NULL);
+    const MMSConfig* config = disp->settings->config;
+    char* msg_dir = g_build_filename(config->root_dir, MMS_MESSAGE_DIR, NULL);
+    char* staging_dir = config->staging_dir ? g_build_filename(
+        config->staging_dir, MMS_MESSAGE_DIR, NULL) : NULL;
     GVERBOSE_("");
+    mms_gc_free(disp->gc);
     mms_handler_remove_callback(disp->handler, disp->handler_done_id);
     mms_connman_remove_callback(disp->cm, disp->connman_done_id);
     mms_dispatcher_drop_connection(disp);
@@ -820,6 +858,10 @@ mms_dispatcher_finalize(
     /* Try to remove the message directory */
     remove(msg_dir);
     g_free(msg_dir);
+    if (staging_dir) {
+        remove(staging_dir);
+        g_free(staging_dir);
+    }
 }
 
 /**
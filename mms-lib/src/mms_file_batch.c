@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_file_batch.h"
+
+#ifdef HAVE_LIBURING
+#  include <liburing.h>
+#endif
+
+/* Logging (it's the decoder which writes the parts) */
+#define GLOG_MODULE_NAME mms_task_decode_log
+#include "mms_lib_log.h"
+#include <gutil_log.h>
+
+typedef struct mms_file_batch_entry {
+    char* file;
+    char* tmp;
+    GBytes* bytes;
+    int fd;
+    int err;
+    gboolean done;
+} MMSFileBatchEntry;
+
+struct mms_file_batch {
+    MMSDir* dir;
+    int flags;
+    GPtrArray* entries;
+};
+
+static
+void
+mms_file_batch_entry_free(
+    gpointer data)
+{
+    MMSFileBatchEntry* entry = data;
+
+    GASSERT(entry->fd < 0);
+    g_bytes_unref(entry->bytes);
+    g_free(entry->file);
+    g_free(entry->tmp);
+    g_free(entry);
+}
+
+#ifdef HAVE_LIBURING
+
+/* Each file takes up to 4 entries (write, fsync, close, rename) */
+#define MMS_URING_DEPTH         (64)
+#define MMS_URING_CHAIN         (4)
+
+/* Larger files are written the usual way */
+#define MMS_URING_MAX_WRITE     (0x40000000)
+
+/* user_data is the entry index combined with the operation */
+typedef enum mms_uring_op {
+    MMS_URING_OPEN,
+    MMS_URING_WRITE,
+    MMS_URING_FSYNC,
+    MMS_URING_CLOSE,
+    MMS_URING_RENAME
+} MMS_URING_OP;
+
+#define MMS_URING_OP_BITS       (3)
+#define MMS_URING_OP_MASK       ((1 << MMS_URING_OP_BITS) - 1)
+#define MMS_URING_DATA(i,op)    ((((guint64)(i)) << MMS_URING_OP_BITS) | (op))
+
+/* 0 = not probed yet, 1 = supported, -1 = not supported */
+static gint mms_file_batch_uring = 0;
+
+static
+gboolean
+mms_file_batch_uring_probe(
+    void)
+{
+    gboolean ok = FALSE;
+    struct io_uring_probe* probe = io_uring_get_probe();
+
+    if (probe) {
+        ok = io_uring_opcode_supported(probe, IORING_OP_OPENAT) &&
+            io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+            io_uring_opcode_supported(probe, IORING_OP_FSYNC) &&
+            io_uring_opcode_supported(probe, IORING_OP_CLOSE) &&
+            io_uring_opcode_supported(probe, IORING_OP_RENAMEAT);
+        io_uring_free_probe(probe);
+    }
+    GDEBUG("io_uring is%s supported", ok ? "" : " not");
+    return ok;
+}
+
+/* Must be called after io_uring_prep_xxx which clears the flags */
+static
+void
+mms_file_batch_uring_tag(
+    struct io_uring_sqe* sqe,
+    guint index,
+    MMS_URING_OP op,
+    gboolean link)
+{
+    sqe->user_data = MMS_URING_DATA(index, op);
+    if (link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+static
+void
+mms_file_batch_uring_reap(
+    MMSFileBatch* batch,
+    struct io_uring* ring,
+    guint count)
+{
+    while (count > 0) {
+        struct io_uring_cqe* cqe = NULL;
+        MMSFileBatchEntry* entry;
+        int res;
+
+        if (io_uring_wait_cqe(ring, &cqe) < 0 || !cqe) {
+            break;
+        }
+
+        entry = batch->entries->pdata[cqe->user_data >> MMS_URING_OP_BITS];
+        res = cqe->res;
+        switch (cqe->user_data & MMS_URING_OP_MASK) {
+        case MMS_URING_OPEN:
+            if (res >= 0) {
+                entry->fd = res;
+                res = 0;
+            }
+            break;
+        case MMS_URING_WRITE:
+            if (res >= 0) {
+                /* Short write breaks the chain, treat it as an error */
+                res = (res == (int)g_bytes_get_size(entry->bytes)) ? 0 :
+                    -ENOSPC;
+            }
+            break;
+        case MMS_URING_CLOSE:
+            if (res >= 0) {
+                entry->fd = -1;
+            }
+            break;
+        case MMS_URING_RENAME:
+            entry->done = (res >= 0);
+            break;
+        }
+
+        /* Remember the first real error, the rest gets cancelled */
+        if (res < 0 && !entry->err) {
+            entry->err = -res;
+        }
+        io_uring_cqe_seen(ring, cqe);
+        count--;
+    }
+}
+
+static
+void
+mms_file_batch_commit_uring(
+    MMSFileBatch* batch)
+{
+    struct io_uring ring;
+    const int dfd = mms_dir_fd(batch->dir);
+    const gboolean sync = (mms_dir_flags(batch->dir) &
+        MMS_DIR_SYNC_FILES) != 0;
+    const guint n = batch->entries->len;
+    guint i, queued, renamed = 0;
+    int err = io_uring_queue_init(MMS_URING_DEPTH, &ring, 0);
+
+    if (err < 0) {
+        /* Probably blocked by seccomp or something like that */
+        GDEBUG("io_uring_queue_init failed: %s", strerror(-err));
+        g_atomic_int_set(&mms_file_batch_uring, -1);
+        return;
+    }
+
+    /* Create all temporary files */
+    for (i = 0; i < n; i += queued) {
+        for (queued = 0; queued < MMS_URING_DEPTH && (i + queued) < n;
+             queued++) {
+            const guint k = i + queued;
+            MMSFileBatchEntry* entry = batch->entries->pdata[k];
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+
+            io_uring_prep_openat(sqe, dfd, entry->tmp, O_CREAT|O_WRONLY|
+                O_TRUNC|O_BINARY|O_CLOEXEC, MMS_FILE_PERM);
+            mms_file_batch_uring_tag(sqe, k, MMS_URING_OPEN, FALSE);
+        }
+        io_uring_submit(&ring);
+        mms_file_batch_uring_reap(batch, &ring, queued);
+    }
+
+    /* Write, (sync), close and rename each one, as a linked chain */
+    for (i = 0; i < n; ) {
+        for (queued = 0; i < n && io_uring_sq_space_left(&ring) >=
+             MMS_URING_CHAIN; i++) {
+            MMSFileBatchEntry* entry = batch->entries->pdata[i];
+            gsize size = 0;
+            const void* data = g_bytes_get_data(entry->bytes, &size);
+            struct io_uring_sqe* sqe;
+
+            /* umask doesn't apply to fchmod, we want exactly that */
+            if (entry->fd < 0 || size > MMS_URING_MAX_WRITE ||
+                fchmod(entry->fd, MMS_FILE_PERM)) {
+                continue;
+            }
+            if (size > 0) {
+                sqe = io_uring_get_sqe(&ring);
+                io_uring_prep_write(sqe, entry->fd, data, size, 0);
+                mms_file_batch_uring_tag(sqe, i, MMS_URING_WRITE, TRUE);
+                queued++;
+            }
+            if (sync) {
+                sqe = io_uring_get_sqe(&ring);
+                io_uring_prep_fsync(sqe, entry->fd, IORING_FSYNC_DATASYNC);
+                mms_file_batch_uring_tag(sqe, i, MMS_URING_FSYNC, TRUE);
+                queued++;
+            }
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_close(sqe, entry->fd);
+            mms_file_batch_uring_tag(sqe, i, MMS_URING_CLOSE, TRUE);
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_renameat(sqe, dfd, entry->tmp, dfd, entry->file, 0);
+            mms_file_batch_uring_tag(sqe, i, MMS_URING_RENAME, FALSE);
+            queued += 2;
+        }
+        if (queued) {
+            io_uring_submit(&ring);
+            mms_file_batch_uring_reap(batch, &ring, queued);
+        }
+    }
+    io_uring_queue_exit(&ring);
+
+    /* Clean up whatever didn't make it */
+    for (i = 0; i < n; i++) {
+        MMSFileBatchEntry* entry = batch->entries->pdata[i];
+
+        if (entry->fd >= 0) {
+            close(entry->fd);
+            entry->fd = -1;
+        }
+        if (entry->done) {
+            GVERBOSE("Created %s/%s", mms_dir_path(batch->dir), entry->file);
+            renamed++;
+        } else {
+            if (entry->err) {
+                GDEBUG("%s/%s: %s", mms_dir_path(batch->dir), entry->tmp,
+                    strerror(entry->err));
+            }
+            unlinkat(dfd, entry->tmp, 0);
+        }
+    }
+
+    /* And the directory entries, all at once */
+    if (renamed && sync) {
+        mms_file_sync(dfd);
+    }
+}
+
+#endif /* HAVE_LIBURING */
+
+/**
+ * Checks whether io_uring can be used for writing files.
+ */
+gboolean
+mms_file_batch_uring_supported(
+    void)
+{
+#ifdef HAVE_LIBURING
+    gint state = g_atomic_int_get(&mms_file_batch_uring);
+
+    if (!state) {
+        state = mms_file_batch_uring_probe() ? 1 : -1;
+        g_atomic_int_set(&mms_file_batch_uring, state);
+    }
+    return state > 0;
+#else
+    return FALSE;
+#endif
+}
+
+MMSFileBatch*
+mms_file_batch_new(
+    MMSDir* dir,
+    int flags)
+{
+    MMSFileBatch* batch = g_new0(MMSFileBatch, 1);
+
+    batch->dir = dir;
+    batch->flags = flags;
+    batch->entries = g_ptr_array_new_with_free_func(mms_file_batch_entry_free);
+    return batch;
+}
+
+void
+mms_file_batch_free(
+    MMSFileBatch* batch)
+{
+    if (batch) {
+        g_ptr_array_free(batch->entries, TRUE);
+        g_free(batch);
+    }
+}
+
+/**
+ * Queues the file for writing. The file name is supposed to be unique
+ * within the batch. Returns the full path via the last parameter.
+ */
+void
+mms_file_batch_add(
+    MMSFileBatch* batch,
+    const char* file,
+    GBytes* bytes,
+    char** path)
+{
+    MMSFileBatchEntry* entry = g_new0(MMSFileBatchEntry, 1);
+
+    entry->file = g_strdup(file);
+    entry->tmp = g_strconcat(".", file, ".tmp", NULL);
+    entry->bytes = g_bytes_ref(bytes);
+    entry->fd = -1;
+    g_ptr_array_add(batch->entries, entry);
+    if (path) {
+        *path = g_build_filename(mms_dir_path(batch->dir), file, NULL);
+    }
+}
+
+guint
+mms_file_batch_count(
+    MMSFileBatch* batch)
+{
+    return batch ? batch->entries->len : 0;
+}
+
+/**
+ * Writes all the queued files and waits until it's done. Stops at the
+ * first file which can't be written.
+ */
+gboolean
+mms_file_batch_commit(
+    MMSFileBatch* batch,
+    GError** error)
+{
+    gboolean ok = TRUE;
+    guint i;
+
+#ifdef HAVE_LIBURING
+    if (!(batch->flags & MMS_FILE_BATCH_NO_URING) &&
+        batch->entries->len > 0 && mms_file_batch_uring_supported()) {
+        mms_file_batch_commit_uring(batch);
+    }
+#endif
+
+    /* Whatever hasn't been written yet */
+    for (i = 0; i < batch->entries->len && ok; i++) {
+        MMSFileBatchEntry* entry = batch->entries->pdata[i];
+
+        if (!entry->done) {
+            gsize size = 0;
+            const void* data = g_bytes_get_data(entry->bytes, &size);
+
+            ok = entry->done = mms_dir_write_file(batch->dir, entry->file,
+                data, size, NULL, error);
+        }
+    }
+    return ok;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
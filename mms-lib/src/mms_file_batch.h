@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_FILE_BATCH_H
+#define SAILFISH_MMS_FILE_BATCH_H
+
+#include "mms_file_util.h"
+
+/*
+ * A bunch of files written to the same directory in one go. Nothing
+ * is written until mms_file_batch_commit() is called. If io_uring is
+ * available (both at compile time and at run time), all files are
+ * written with a couple of io_uring submissions, otherwise (or if
+ * something goes wrong) with mms_dir_write_file(). Either way, each
+ * file gets written atomically. The directory must stay open until
+ * the batch is committed.
+ */
+
+typedef struct mms_file_batch MMSFileBatch;
+
+#define MMS_FILE_BATCH_NO_URING         (0x01) /* Use plain syscalls */
+
+MMSFileBatch*
+mms_file_batch_new(
+    MMSDir* dir,
+    int flags);
+
+void
+mms_file_batch_free(
+    MMSFileBatch* batch);
+
+void
+mms_file_batch_add(
+    MMSFileBatch* batch,
+    const char* file,
+    GBytes* bytes,
+    char** path);
+
+guint
+mms_file_batch_count(
+    MMSFileBatch* batch);
+
+gboolean
+mms_file_batch_commit(
+    MMSFileBatch* batch,
+    GError** error);
+
+gboolean
+mms_file_batch_uring_supported(
+    void);
+
+#endif /* SAILFISH_MMS_FILE_BATCH_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
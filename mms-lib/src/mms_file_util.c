@@ -13,12 +13,48 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE /* O_TMPFILE, fallocate */
+
 #include "mms_attachment_info.h"
 #include "mms_file_util.h"
+#include "mms_settings.h"
+#include "mms_base64.h"
 #include "mms_error.h"
 
+#ifdef __linux__
+#  include <sys/ioctl.h>
+#  include <sys/statvfs.h>
+#  include <sys/syscall.h>
+#  include <linux/falloc.h>
+#  include <linux/fs.h>
+#endif
+
+/* Capabilities of the file system, cached per root directory */
+#define MMS_FILE_NO_CLONE       (0x01)
+#define MMS_FILE_NO_COPY_RANGE  (0x02)
+
+static GMutex mms_file_caps_mutex;
+static GHashTable* mms_file_caps = NULL;
+
+/* Time spent waiting for the data to hit the disk */
+static GMutex mms_file_sync_mutex;
+static MMSSyncStats mms_file_sync_stats;
+
+/* Bytes reserved in the staging directory */
+static GMutex mms_file_staging_mutex;
+static guint64 mms_file_staging_bytes;
+
+/* Enough to get past the XML declaration, DOCTYPE and comments */
+#define MMS_SMIL_SNIFF_SIZE     (4096)
+
+typedef enum mms_smil_sniff {
+    MMS_SMIL_UNKNOWN,
+    MMS_SMIL_YES,
+    MMS_SMIL_NO
+} MMS_SMIL_SNIFF;
+
 /**
- * Callbacks for mms_file_is_smil
+ * Callback for mms_file_is_smil
  */
 static
 void
@@ -30,44 +66,32 @@ mms_smil_parse_start(
     gpointer userdata,
     GError** error)
 {
-    static const GMarkupParser skip = { NULL, NULL, NULL, NULL, NULL };
-    if (!strcmp(element_name, "smil")) {
-        gboolean* smil_found = userdata;
-        *smil_found = TRUE;
-    }
-    g_markup_parse_context_push(parser, &skip, NULL);
-}
+    MMS_SMIL_SNIFF* sniff = userdata;
 
-static
-void
-mms_smil_parse_end(
-    GMarkupParseContext* parser,
-    const gchar* element_name,
-    gpointer userdata,
-    GError** error)
-{
-    g_markup_parse_context_pop(parser);
+    /* The root element is all we need, stop parsing right there */
+    *sniff = strcmp(element_name, "smil") ? MMS_SMIL_NO : MMS_SMIL_YES;
+    g_set_error_literal(error, G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE, "");
 }
 
 /**
- * Checks if this ia a SMIL file, i.e. a parsable XML with <smil> as a
- * root tag.
+ * Checks if this ia a SMIL file, i.e. an XML with <smil> as a root tag.
+ * Only the beginning of the file is looked at, the rest doesn't change
+ * the verdict.
  */
 gboolean
 mms_file_is_smil(
     const MMSAttachmentInfo* ai)
 {
-    static const GMarkupParser toplevel = { mms_smil_parse_start,
-        mms_smil_parse_end, NULL, NULL, NULL };
-    gboolean smil = FALSE, smil_found = FALSE;
-    GMarkupParseContext* parser = g_markup_parse_context_new(&toplevel,
-        G_MARKUP_TREAT_CDATA_AS_TEXT, &smil_found, NULL);
-    if (g_markup_parse_context_parse(parser, ai->data, ai->size, NULL)) {
-        g_markup_parse_context_end_parse(parser, NULL);
-        smil = smil_found;
-    }
+    static const GMarkupParser root = { mms_smil_parse_start,
+        NULL, NULL, NULL, NULL };
+    MMS_SMIL_SNIFF sniff = MMS_SMIL_UNKNOWN;
+    GMarkupParseContext* parser = g_markup_parse_context_new(&root,
+        G_MARKUP_TREAT_CDATA_AS_TEXT, &sniff, NULL);
+
+    g_markup_parse_context_parse(parser, ai->data,
+        MIN(ai->size, MMS_SMIL_SNIFF_SIZE), NULL);
     g_markup_parse_context_free(parser);
-    return smil;
+    return sniff == MMS_SMIL_YES;
 }
 
 /**
@@ -109,6 +133,490 @@ mms_prepare_filename(
     return out;
 }
 
+/*
+ * Directory handle. Files are created relative to the directory
+ * descriptor, which saves path lookups when a bunch of files is
+ * written to the same directory.
+ */
+struct mms_dir {
+    int fd;
+    int flags;
+    char* path;
+    gboolean no_tmpfile;
+};
+
+static
+void
+mms_file_sync_account(
+    gint64 start)
+{
+    const guint64 usec = g_get_monotonic_time() - start;
+
+    g_mutex_lock(&mms_file_sync_mutex);
+    mms_file_sync_stats.count++;
+    mms_file_sync_stats.total_us += usec;
+    if (mms_file_sync_stats.max_us < usec) {
+        mms_file_sync_stats.max_us = usec;
+    }
+    g_mutex_unlock(&mms_file_sync_mutex);
+}
+
+/**
+ * Checks whether the file system containing the directory has room
+ * for that many more bytes, keeping MMS_FILE_SPACE_RESERVE bytes free.
+ * If we can't tell, assumes that it does.
+ */
+gboolean
+mms_file_space_available(
+    const char* dir,
+    guint64 size)
+{
+#ifdef __linux__
+    struct statvfs st;
+
+    if (!statvfs(dir, &st)) {
+        const guint64 avail = (guint64)st.f_bavail * st.f_frsize;
+
+        if (avail < size + MMS_FILE_SPACE_RESERVE) {
+            GWARN("%s: need %" G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+                " available", dir, size, avail);
+            return FALSE;
+        }
+    } else {
+        GDEBUG("Can't stat %s: %s", dir, strerror(errno));
+    }
+#endif
+    return TRUE;
+}
+
+/**
+ * Allocates disk blocks for the file without changing its size.
+ * Returns FALSE only if the file system is full. Other failures
+ * (most likely fallocate not being supported) are ignored.
+ */
+gboolean
+mms_file_reserve(
+    int fd,
+    guint64 size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    if (size > 0) {
+        int err;
+
+        while ((err = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size)) < 0 &&
+            errno == EINTR);
+        if (err < 0 && errno == ENOSPC) {
+            return FALSE;
+        }
+    }
+#endif
+    return TRUE;
+}
+
+/**
+ * Reserves room for that many bytes of transient files in the staging
+ * directory. Returns FALSE if there's no staging directory, or the
+ * reservation would exceed the configured limit or the free space.
+ * In that case transient files go to the root directory.
+ */
+gboolean
+mms_file_staging_reserve(
+    const MMSConfig* config,
+    guint64 size)
+{
+    gboolean ok = FALSE;
+
+    if (config->staging_dir) {
+        g_mutex_lock(&mms_file_staging_mutex);
+        if (mms_file_staging_bytes + size > config->staging_limit) {
+            GDEBUG("Staging limit exceeded (%" G_GUINT64_FORMAT " + %"
+                G_GUINT64_FORMAT ")", mms_file_staging_bytes, size);
+        } else if (g_mkdir_with_parents(config->staging_dir, MMS_DIR_PERM)) {
+            GWARN("Failed to create %s: %s", config->staging_dir,
+                strerror(errno));
+        } else if (mms_file_space_available(config->staging_dir, size)) {
+            mms_file_staging_bytes += size;
+            ok = TRUE;
+        }
+        g_mutex_unlock(&mms_file_staging_mutex);
+    }
+    return ok;
+}
+
+/**
+ * Releases the reservation made by mms_file_staging_reserve.
+ */
+void
+mms_file_staging_release(
+    guint64 size)
+{
+    g_mutex_lock(&mms_file_staging_mutex);
+    GASSERT(mms_file_staging_bytes >= size);
+    mms_file_staging_bytes -= MIN(mms_file_staging_bytes, size);
+    g_mutex_unlock(&mms_file_staging_mutex);
+}
+
+/**
+ * Returns the number of bytes currently reserved in the staging directory.
+ */
+guint64
+mms_file_staging_used(
+    void)
+{
+    guint64 used;
+
+    g_mutex_lock(&mms_file_staging_mutex);
+    used = mms_file_staging_bytes;
+    g_mutex_unlock(&mms_file_staging_mutex);
+    return used;
+}
+
+/**
+ * Flushes file data to disk. Metadata which isn't necessary for
+ * reading the data back (like timestamps) may remain unflushed.
+ */
+gboolean
+mms_file_sync(
+    int fd)
+{
+    const gint64 start = g_get_monotonic_time();
+    int err;
+
+    while ((err = fdatasync(fd)) < 0 && errno == EINTR);
+    mms_file_sync_account(start);
+    return !err;
+}
+
+/**
+ * Returns the number of syncs and the time spent in them since
+ * the process has started.
+ */
+void
+mms_file_sync_stats_get(
+    MMSSyncStats* stats)
+{
+    g_mutex_lock(&mms_file_sync_mutex);
+    *stats = mms_file_sync_stats;
+    g_mutex_unlock(&mms_file_sync_mutex);
+}
+
+MMSDir*
+mms_dir_open(
+    const char* path,
+    GError** error)
+{
+    return mms_dir_open_full(path, 0, error);
+}
+
+MMSDir*
+mms_dir_open_full(
+    const char* path,
+    int flags,
+    GError** error)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0 && errno == ENOENT) {
+        /* Only walk the path if the directory doesn't exist yet */
+        if (g_mkdir_with_parents(path, MMS_DIR_PERM) == 0) {
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+    if (fd >= 0) {
+        MMSDir* dir = g_slice_new0(MMSDir);
+
+        dir->fd = fd;
+        dir->flags = flags;
+        dir->path = g_strdup(path);
+        return dir;
+    } else {
+        MMS_ERROR(error, MMS_LIB_ERROR_IO,
+            "Failed to create directory %s: %s", path, strerror(errno));
+        return NULL;
+    }
+}
+
+void
+mms_dir_close(
+    MMSDir* dir)
+{
+    if (dir) {
+        close(dir->fd);
+        g_free(dir->path);
+        g_slice_free(MMSDir, dir);
+    }
+}
+
+const char*
+mms_dir_path(
+    MMSDir* dir)
+{
+    return dir->path;
+}
+
+int
+mms_dir_fd(
+    MMSDir* dir)
+{
+    return dir->fd;
+}
+
+int
+mms_dir_flags(
+    MMSDir* dir)
+{
+    return dir->flags;
+}
+
+/**
+ * Group commit. Flushes everything written to the file system which
+ * contains this directory, in one go.
+ */
+gboolean
+mms_dir_sync(
+    MMSDir* dir,
+    GError** error)
+{
+    const gint64 start = g_get_monotonic_time();
+    int err;
+
+#ifdef __NR_syncfs
+    /* Called via syscall() because older glibc doesn't have a wrapper */
+    while ((err = syscall(__NR_syncfs, dir->fd)) < 0 && errno == EINTR);
+#else
+    sync();
+    err = 0;
+#endif
+    mms_file_sync_account(start);
+    if (!err) {
+        GDEBUG("Synced %s in %u ms", dir->path, (guint)
+            ((g_get_monotonic_time() - start) / 1000));
+        return TRUE;
+    } else {
+        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to sync %s: %s",
+            dir->path, strerror(errno));
+        return FALSE;
+    }
+}
+
+/* With MMS_DIR_SYNC_FILES, makes the file data and its name durable */
+static
+gboolean
+mms_dir_sync_fd(
+    MMSDir* dir,
+    int fd)
+{
+    return !(dir->flags & MMS_DIR_SYNC_FILES) || mms_file_sync(fd);
+}
+
+static
+gboolean
+mms_dir_sync_entry(
+    MMSDir* dir)
+{
+    return !(dir->flags & MMS_DIR_SYNC_FILES) || mms_file_sync(dir->fd);
+}
+
+/**
+ * Flushes the file to disk if the directory was opened with
+ * MMS_DIR_SYNC_FILES flag, otherwise does nothing. For files
+ * written by someone else.
+ */
+gboolean
+mms_dir_sync_file(
+    MMSDir* dir,
+    const char* file)
+{
+    gboolean ok = TRUE;
+
+    if (dir->flags & MMS_DIR_SYNC_FILES) {
+        const int fd = openat(dir->fd, file, O_RDONLY|O_CLOEXEC);
+
+        ok = (fd >= 0 && mms_file_sync(fd) && mms_dir_sync_entry(dir));
+        if (!ok) {
+            GWARN("Failed to sync %s/%s: %s", dir->path, file,
+                strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+static
+gboolean
+mms_file_write_all(
+    int fd,
+    const void* data,
+    gsize size)
+{
+    const guint8* ptr = data;
+
+    while (size > 0) {
+        const gssize written = write(fd, ptr, size);
+        if (written > 0) {
+            ptr += written;
+            size -= written;
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Creates a file in the directory, truncating the existing one.
+ * Returns the file descriptor or -1 if an I/O error occurs.
+ */
+int
+mms_dir_create_file(
+    MMSDir* dir,
+    const char* file,
+    char** path,
+    GError** error)
+{
+    int fd = openat(dir->fd, file, O_CREAT|O_RDWR|O_TRUNC|O_BINARY|O_CLOEXEC,
+        MMS_FILE_PERM);
+
+    if (fd < 0) {
+        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to create file %s/%s: %s",
+            dir->path, file, strerror(errno));
+    } else if (path) {
+        *path = g_build_filename(dir->path, file, NULL);
+    }
+    return fd;
+}
+
+/* Writes the data into a nameless file and then gives it a name */
+static
+int
+mms_dir_write_tmpfile(
+    MMSDir* dir,
+    const char* file,
+    const void* data,
+    gsize size)
+{
+#ifdef O_TMPFILE
+    if (!dir->no_tmpfile) {
+        int fd = openat(dir->fd, ".", O_TMPFILE|O_WRONLY|O_CLOEXEC,
+            MMS_FILE_PERM);
+
+        if (fd >= 0) {
+            int err = 0;
+
+            if (mms_file_write_all(fd, data, size) &&
+                !fchmod(fd, MMS_FILE_PERM) &&
+                mms_dir_sync_fd(dir, fd)) {
+                char proc[32];
+
+                /* Normally the file doesn't exist yet */
+                snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+                if (!linkat(AT_FDCWD, proc, dir->fd, file,
+                    AT_SYMLINK_FOLLOW)) {
+                    close(fd);
+                    return 1;
+                } else if (errno == EEXIST) {
+                    /* linkat can't replace the file, renameat can */
+                    char* tmp = g_strconcat(".", file, ".tmp", NULL);
+
+                    unlinkat(dir->fd, tmp, 0);
+                    if (!linkat(AT_FDCWD, proc, dir->fd, tmp,
+                        AT_SYMLINK_FOLLOW) &&
+                        !renameat(dir->fd, tmp, dir->fd, file)) {
+                        g_free(tmp);
+                        close(fd);
+                        return 1;
+                    }
+                    err = errno;
+                    unlinkat(dir->fd, tmp, 0);
+                    g_free(tmp);
+                } else if (errno == ENOENT || errno == EOPNOTSUPP ||
+                    errno == EISDIR) {
+                    /* No /proc? Try the other way */
+                    dir->no_tmpfile = TRUE;
+                } else {
+                    /* Something transient, e.g. ENOSPC */
+                    err = errno;
+                }
+            } else {
+                err = errno;
+            }
+            close(fd);
+            if (err) {
+                errno = err;
+                return -1;
+            }
+        } else if (errno == EOPNOTSUPP || errno == EISDIR ||
+            errno == EINVAL) {
+            /* Not supported by the kernel or the file system */
+            dir->no_tmpfile = TRUE;
+        } else {
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Atomically writes the file. The file either gets written completely
+ * or not at all. Nothing gets synced to disk unless the directory was
+ * opened with MMS_DIR_SYNC_FILES flag.
+ */
+gboolean
+mms_dir_write_file(
+    MMSDir* dir,
+    const char* file,
+    const void* data,
+    gsize size,
+    char** path,
+    GError** error)
+{
+    int ret = mms_dir_write_tmpfile(dir, file, data, size);
+
+    if (!ret) {
+        /* Temporary file and rename */
+        char* tmp = g_strconcat(".", file, ".tmp", NULL);
+        int fd = openat(dir->fd, tmp, O_CREAT|O_WRONLY|O_TRUNC|O_BINARY|
+            O_CLOEXEC, MMS_FILE_PERM);
+
+        ret = -1;
+        if (fd >= 0) {
+            if (mms_file_write_all(fd, data, size) &&
+                !fchmod(fd, MMS_FILE_PERM) &&
+                mms_dir_sync_fd(dir, fd) &&
+                !renameat(dir->fd, tmp, dir->fd, file)) {
+                ret = 1;
+            } else {
+                const int err = errno;
+
+                unlinkat(dir->fd, tmp, 0);
+                errno = err;
+            }
+            close(fd);
+        }
+        g_free(tmp);
+    }
+
+    if (ret > 0 && !mms_dir_sync_entry(dir)) {
+        ret = -1;
+    }
+    if (ret > 0) {
+        GVERBOSE("Created %s/%s", dir->path, file);
+        if (path) {
+            *path = g_build_filename(dir->path, file, NULL);
+        }
+        return TRUE;
+    } else {
+        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to write %s/%s: %s",
+            dir->path, file, strerror(errno));
+        return FALSE;
+    }
+}
+
 /**
  * Creates a file in the specified directory. Creates the directory if
  * it doesn't exist. If file already exists, truncates it. Returns file
@@ -123,21 +631,11 @@ mms_create_file(
     GError** error)
 {
     int fd = -1;
-    int err = g_mkdir_with_parents(dir, MMS_DIR_PERM);
-    if (!err || errno == EEXIST) {
-        char* fname = g_build_filename(dir, file, NULL);
-        fd = open(fname, O_CREAT|O_RDWR|O_TRUNC|O_BINARY, MMS_FILE_PERM);
-        if (fd < 0) {
-            MMS_ERROR(error, MMS_LIB_ERROR_IO,
-                "Failed to create file %s: %s", fname, strerror(errno));
-        } else if (path) {
-            *path = fname;
-            fname = NULL;
-        }
-        g_free(fname);
-    } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_IO,
-            "Failed to create directory %s: %s", dir, strerror(errno));
+    MMSDir* d = mms_dir_open(dir, error);
+
+    if (d) {
+        fd = mms_dir_create_file(d, file, path, error);
+        mms_dir_close(d);
     }
     return fd;
 }
@@ -154,26 +652,16 @@ mms_write_file(
     char** path)
 {
     gboolean saved = FALSE;
-    int err = g_mkdir_with_parents(dir, MMS_DIR_PERM);
-    if (!err || errno == EEXIST) {
-        GError* error = NULL;
-        char* fname = g_build_filename(dir, file, NULL);
-        unlink(fname);
-        if (g_file_set_contents(fname, data, size, &error)) {
-            GVERBOSE("Created %s", fname);
-            chmod(fname, MMS_FILE_PERM);
-            saved = TRUE;
-            if (path) {
-                *path = fname;
-                fname = NULL;
-            }
-        } else {
-            GERR("%s", GERRMSG(error));
-            g_error_free(error);
-        }
-        g_free(fname);
-    } else {
-        GERR("Failed to create directory %s: %s", dir, strerror(errno));
+    GError* error = NULL;
+    MMSDir* d = mms_dir_open(dir, &error);
+
+    if (d) {
+        saved = mms_dir_write_file(d, file, data, size, path, &error);
+        mms_dir_close(d);
+    }
+    if (error) {
+        GERR("%s", GERRMSG(error));
+        g_error_free(error);
     }
     return saved;
 }
@@ -194,147 +682,377 @@ mms_write_bytes(
 }
 
 /**
- * Copies attachment to a file. Assumes that the destination directory
- * already exists.
+ * Copies attachment to a file in the specified directory.
  */
 gboolean
 mms_copy_attachment(
     const MMSAttachmentInfo* ai,
-    const char* dest,
+    MMSDir* dir,
+    const char* file,
     GError** error)
 {
-    gboolean ok = FALSE;
-    int out = open(dest, O_CREAT|O_WRONLY|O_TRUNC|O_BINARY, MMS_FILE_PERM);
+    return mms_dir_write_file(dir, file, ai->data, ai->size, NULL, error);
+}
 
-    if (out >= 0) {
-        if (write(out, ai->data, ai->size) == (gssize)ai->size) {
-            ok = TRUE;
-        } else {
-            MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to write %s: %s",
-                dest, strerror(errno));
-        }
-        close(out);
-    } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to create file %s: %s",
-            dest, strerror(errno));
+static
+int
+mms_file_caps_get(
+    const char* root_dir)
+{
+    int caps = 0;
+
+    g_mutex_lock(&mms_file_caps_mutex);
+    if (mms_file_caps) {
+        caps = GPOINTER_TO_INT(g_hash_table_lookup(mms_file_caps, root_dir));
     }
-    return ok;
+    g_mutex_unlock(&mms_file_caps_mutex);
+    return caps;
 }
 
-/*
- * MIME decoding
+static
+void
+mms_file_caps_add(
+    const char* root_dir,
+    int flags)
+{
+    g_mutex_lock(&mms_file_caps_mutex);
+    if (!mms_file_caps) {
+        mms_file_caps = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+    }
+    g_hash_table_insert(mms_file_caps, g_strdup(root_dir), GINT_TO_POINTER(
+        GPOINTER_TO_INT(g_hash_table_lookup(mms_file_caps, root_dir)) |
+        flags));
+    g_mutex_unlock(&mms_file_caps_mutex);
+}
+
+void
+mms_file_caps_clear(void)
+{
+    GHashTable* caps;
+
+    g_mutex_lock(&mms_file_caps_mutex);
+    caps = mms_file_caps;
+    mms_file_caps = NULL;
+    g_mutex_unlock(&mms_file_caps_mutex);
+
+    if (caps) {
+        g_hash_table_destroy(caps);
+    }
+}
+
+/**
+ * Checks whether mms_file_extract may be able to avoid copying the data
+ * through the user space, i.e. the file system hasn't been found to lack
+ * both reflinks and copy_file_range.
  */
-typedef struct mms_mime_decode {
-    int out;
-    const char* dest;
-    size_t outbytes;
-    size_t outbuflen;
-    void* outbuf;
-    GMimeEncoding state;
-} MMSMimeDecode;
+gboolean
+mms_file_can_extract_in_kernel(
+    const char* root_dir,
+    int fd)
+{
+    const int none = MMS_FILE_NO_CLONE | MMS_FILE_NO_COPY_RANGE;
 
+    return fd >= 0 && (mms_file_caps_get(root_dir) & none) != none;
+}
+
+/* errno values meaning that the file system can't do it at all */
 static
 gboolean
-mms_file_decode_init(
-    MMSMimeDecode* dec,
-    const char* dest,
-    GMimeContentEncoding enc,
-    GError** error)
+mms_file_not_supported(
+    int err)
 {
-    memset(dec, 0, sizeof(*dec));
-    dec->out = open(dest, O_CREAT|O_WRONLY|O_TRUNC|O_BINARY, MMS_FILE_PERM);
-    if (dec->out >= 0) {
-        dec->dest = dest;
-        g_mime_encoding_init_decode(&dec->state, enc);
+    switch (err) {
+    case ENOSYS:
+    case ENOTTY:
+    case EXDEV:
+    case EOPNOTSUPP:
+#if defined(ENOTSUP) && ENOTSUP != EOPNOTSUPP
+    case ENOTSUP:
+#endif
         return TRUE;
-    } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to create file %s: %s",
-            dest, strerror(errno));
+    default:
         return FALSE;
     }
 }
 
 static
-void
-mms_file_decode_deinit(
-    MMSMimeDecode* dec)
+gboolean
+mms_file_clone(
+    const char* root_dir,
+    int in,
+    gsize offset,
+    gsize size,
+    int out)
 {
-    g_free(dec->outbuf);
-    close(dec->out);
+#ifdef FICLONERANGE
+    struct stat st;
+
+    /*
+     * The source range has to be aligned at the block boundary (except
+     * for the tail at the end of file) because we are cloning it to the
+     * beginning of the destination file.
+     */
+    if (!fstat(in, &st) && st.st_blksize > 0 &&
+        !(offset % st.st_blksize) &&
+        (!(size % st.st_blksize) || (offset + size) == (gsize)st.st_size)) {
+        struct file_clone_range range;
+
+        memset(&range, 0, sizeof(range));
+        range.src_fd = in;
+        range.src_offset = offset;
+        range.src_length = size;
+        if (!ioctl(out, FICLONERANGE, &range)) {
+            return TRUE;
+        } else if (mms_file_not_supported(errno)) {
+            GDEBUG("No reflinks in %s (%s)", root_dir, strerror(errno));
+            mms_file_caps_add(root_dir, MMS_FILE_NO_CLONE);
+        }
+    }
+#else
+    mms_file_caps_add(root_dir, MMS_FILE_NO_CLONE);
+#endif
+    return FALSE;
 }
 
-gboolean
-mms_file_decode_step(
-    MMSMimeDecode* dec,
-    const void* inbuf,
-    size_t inlen,
-    size_t (*step)(GMimeEncoding*, const char*, size_t, char*),
-    GError** error)
+static
+gsize
+mms_file_copy_range(
+    const char* root_dir,
+    int in,
+    gsize offset,
+    gsize size,
+    int out)
 {
-    gssize nbytes;
-    size_t need = g_mime_encoding_outlen(&dec->state, inlen);
-    if (need > dec->outbuflen) {
-        g_free(dec->outbuf);
-        dec->outbuf = g_malloc(need);
-        dec->outbuflen = need;
+    gsize copied = 0;
+#ifdef __NR_copy_file_range
+    gint64 in_off = offset; /* loff_t */
+
+    /* Called via syscall() because older glibc doesn't have a wrapper */
+    while (copied < size) {
+        const long n = syscall(__NR_copy_file_range, in, &in_off, out, NULL,
+            size - copied, 0);
+        if (n > 0) {
+            copied += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && !copied && (mms_file_not_supported(errno) ||
+                errno == EINVAL)) {
+                GDEBUG("No copy_file_range in %s (%s)", root_dir,
+                    strerror(errno));
+                mms_file_caps_add(root_dir, MMS_FILE_NO_COPY_RANGE);
+            }
+            break;
+        }
     }
-    nbytes = step(&dec->state, inbuf, inlen, dec->outbuf);
-    if (write(dec->out, dec->outbuf, nbytes) == nbytes) {
-        dec->outbytes += nbytes;
-        return TRUE;
+#else
+    mms_file_caps_add(root_dir, MMS_FILE_NO_COPY_RANGE);
+#endif
+    return copied;
+}
+
+/**
+ * Extracts a slice of the file into a separate file. Where possible,
+ * the data don't travel through the user space at all. The file
+ * system capabilities are remembered per root directory, so that we
+ * don't keep trying what is known not to work. The data pointer must
+ * point to the same bytes as the fd/offset pair (it's normally the
+ * mapped source file). The data are written to a temporary file which
+ * then replaces the target, so that a crash never leaves a truncated
+ * file under the final name.
+ */
+MMS_FILE_EXTRACT
+mms_file_extract(
+    const char* root_dir,
+    int fd,
+    gsize offset,
+    const void* data,
+    gsize size,
+    MMSDir* dir,
+    const char* file,
+    char** path)
+{
+    MMS_FILE_EXTRACT method = MMS_FILE_EXTRACT_FAILED;
+    GError* error = NULL;
+    char* tmp = g_strconcat(".", file, ".tmp", NULL);
+    int out = mms_dir_create_file(dir, tmp, NULL, &error);
+
+    if (out >= 0) {
+        const guint8* ptr = data;
+        gsize done = 0;
+
+        if (fd >= 0 && size > 0) {
+            const int caps = mms_file_caps_get(root_dir);
+
+            if (!(caps & MMS_FILE_NO_CLONE) &&
+                mms_file_clone(root_dir, fd, offset, size, out)) {
+                method = MMS_FILE_EXTRACT_CLONE;
+                done = size;
+            } else if (!(caps & MMS_FILE_NO_COPY_RANGE)) {
+                done = mms_file_copy_range(root_dir, fd, offset, size, out);
+                if (done == size) {
+                    method = MMS_FILE_EXTRACT_COPY_RANGE;
+                }
+            }
+        }
+
+        /* Whatever is left (normally everything) */
+        if (done < size || !size) {
+            if (mms_file_write_all(out, ptr + done, size - done)) {
+                method = MMS_FILE_EXTRACT_WRITE;
+            } else {
+                GERR("Failed to write %s/%s: %s", dir->path, file,
+                    strerror(errno));
+                method = MMS_FILE_EXTRACT_FAILED;
+            }
+        }
+
+        if (method != MMS_FILE_EXTRACT_FAILED &&
+            !mms_dir_sync_fd(dir, out)) {
+            GERR("Failed to sync %s/%s: %s", dir->path, tmp,
+                strerror(errno));
+            method = MMS_FILE_EXTRACT_FAILED;
+        }
+        close(out);
+        if (method != MMS_FILE_EXTRACT_FAILED) {
+            if (renameat(dir->fd, tmp, dir->fd, file)) {
+                GERR("Failed to rename %s/%s: %s", dir->path, tmp,
+                    strerror(errno));
+                method = MMS_FILE_EXTRACT_FAILED;
+            } else if (!mms_dir_sync_entry(dir)) {
+                GERR("Failed to sync %s: %s", dir->path, strerror(errno));
+                method = MMS_FILE_EXTRACT_FAILED;
+            }
+        }
+        if (method != MMS_FILE_EXTRACT_FAILED) {
+            GVERBOSE("Created %s/%s", dir->path, file);
+            if (path) {
+                *path = g_build_filename(dir->path, file, NULL);
+            }
+        } else {
+            unlinkat(dir->fd, tmp, 0);
+        }
     } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to write %s: %s",
-            dec->dest, strerror(errno));
-        return FALSE;
+        GERR("%s", GERRMSG(error));
+        g_error_free(error);
     }
+    g_free(tmp);
+    return method;
 }
 
-gboolean
-mms_file_decode(
-    const char* src,
-    const char* dest,
-    GMimeContentEncoding enc,
+/**
+ * Puts the attachment into the directory, avoiding the copy if possible.
+ * A regular file which still exists and hasn't changed its size since
+ * it was mapped is hard-linked. If that doesn't work, it's reflinked or
+ * copied by the kernel. Anything else (a pipe, a deleted file, a file
+ * on another file system) is copied from memory.
+ */
+MMS_FILE_STAGE
+mms_stage_attachment(
+    const char* root_dir,
+    const MMSAttachmentInfo* ai,
+    MMSDir* dir,
+    const char* file,
     GError** error)
 {
-    gboolean ok = FALSE;
-    int in = open(src, O_RDONLY | O_BINARY);
-    if (in >= 0) {
-        MMSMimeDecode dec;
-        if (mms_file_decode_init(&dec, dest, enc, error)) {
-            int nbytes;
-            size_t inbytes = 0;
-            const size_t buflen = 1024;
-            void* inbuf = g_malloc(buflen);
-            ok = TRUE;
-            while ((nbytes = read(in, inbuf, buflen)) > 0) {
-                inbytes += nbytes;
-                if (!mms_file_decode_step(&dec, inbuf, nbytes,
-                    g_mime_encoding_step, error)) {
-                    ok = FALSE;
-                    break;
-                }
-            }
-            if (nbytes < 0) {
-                ok = FALSE;
-                MMS_ERROR(error, MMS_LIB_ERROR_IO,
-                    "Failed to read %s: %s", src, strerror(errno));
-            } else if (ok) {
-                if (mms_file_decode_step(&dec, NULL, 0,
-                    g_mime_encoding_flush, error)) {
-                    GDEBUG("Decoded %s (%d bytes) -> %s (%d bytes)",
-                        src, (int)inbytes, dest, (int)dec.outbytes);
+    MMS_FILE_STAGE method = MMS_FILE_STAGE_FAILED;
+    int fd = ai->fd;
+    struct stat st, dst;
+
+    if (fd < 0 && ai->file_name) {
+        fd = open(ai->file_name, O_RDONLY|O_BINARY|O_CLOEXEC);
+    }
+
+    if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+        !fstat(dir->fd, &dst) && st.st_dev == dst.st_dev) {
+        if (st.st_nlink > 0 && (gsize)st.st_size == ai->size) {
+            char proc[32];
+
+            snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+            unlinkat(dir->fd, file, 0);
+            if (!linkat(AT_FDCWD, proc, dir->fd, file, AT_SYMLINK_FOLLOW)) {
+                if (mms_dir_sync_fd(dir, fd) && mms_dir_sync_entry(dir)) {
+                    method = MMS_FILE_STAGE_LINK;
                 } else {
-                    ok = FALSE;
+                    unlinkat(dir->fd, file, 0);
                 }
+            } else {
+                GDEBUG("Can't link %s: %s", ai->file_name, strerror(errno));
             }
-            mms_file_decode_deinit(&dec);
-            g_free(inbuf);
         }
-        close(in);
+        if (method == MMS_FILE_STAGE_FAILED) {
+            switch (mms_file_extract(root_dir, fd, 0, ai->data, ai->size,
+                dir, file, NULL)) {
+            case MMS_FILE_EXTRACT_CLONE:
+                method = MMS_FILE_STAGE_CLONE;
+                break;
+            case MMS_FILE_EXTRACT_COPY_RANGE:
+                method = MMS_FILE_STAGE_COPY_RANGE;
+                break;
+            case MMS_FILE_EXTRACT_WRITE:
+                method = MMS_FILE_STAGE_WRITE;
+                break;
+            case MMS_FILE_EXTRACT_FAILED:
+                break;
+            }
+        }
+    } else if (mms_file_extract(root_dir, -1, 0, ai->data, ai->size,
+        dir, file, NULL) == MMS_FILE_EXTRACT_WRITE) {
+        /* The source can't be shared, keep the copy */
+        method = MMS_FILE_STAGE_WRITE;
+    }
+
+    if (fd >= 0 && fd != ai->fd) {
+        close(fd);
+    }
+    if (method == MMS_FILE_STAGE_FAILED) {
+        MMS_ERROR(error, MMS_LIB_ERROR_IO, "Failed to stage %s/%s",
+            dir->path, file);
+    }
+    return method;
+}
+
+/**
+ * Decodes transfer-encoded data straight into the destination file.
+ * Base64 (by far the most common one) is decoded by mms_base64_decode,
+ * everything else goes through GMime in a single step. The file is
+ * replaced atomically, without touching the inode which may be shared
+ * with the content store.
+ */
+gboolean
+mms_file_decode(
+    const void* data,
+    gsize size,
+    MMSDir* dir,
+    const char* file,
+    GMimeContentEncoding enc,
+    char** path,
+    GError** error)
+{
+    gboolean ok;
+    gsize len;
+    guint8* buf;
+
+    if (enc == GMIME_CONTENT_ENCODING_BASE64) {
+        buf = g_malloc(MMS_BASE64_DECODED_MAX(size));
+        len = mms_base64_decode(data, size, buf);
     } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_IO,
-            "Failed to open file %s: %s", src, strerror(errno));
+        GMimeEncoding state;
+
+        g_mime_encoding_init_decode(&state, enc);
+        buf = g_malloc(g_mime_encoding_outlen(&state, size) +
+            g_mime_encoding_outlen(&state, 0));
+        len = g_mime_encoding_step(&state, data, size, (char*)buf);
+        len += g_mime_encoding_flush(&state, NULL, 0, (char*)buf + len);
+    }
+
+    ok = mms_dir_write_file(dir, file, buf, len, path, error);
+    if (ok) {
+        GDEBUG("Decoded %u bytes -> %s/%s (%u bytes)", (guint)size,
+            dir->path, file, (guint)len);
     }
+    g_free(buf);
     return ok;
 }
 
@@ -31,6 +31,8 @@
 #define MMS_PARTS_DIR                   "parts"
 #define MMS_ENCODE_DIR                  "encode"
 #define MMS_CONVERT_DIR                 "convert"
+#define MMS_STORE_DIR                   "store"
+#define MMS_RESIZE_CACHE_DIR            "resize"
 
 #define MMS_NOTIFICATION_IND_FILE       "m-notification.ind"
 #define MMS_NOTIFYRESP_IND_FILE         "m-notifyresp.ind"
@@ -57,6 +59,106 @@ mms_prepare_filename(
     const char* subdir)
     G_GNUC_WARN_UNUSED_RESULT;
 
+/* Free space we don't touch, so that the rest of the system can breathe */
+#define MMS_FILE_SPACE_RESERVE          (1024*1024)
+
+gboolean
+mms_file_space_available(
+    const char* dir,
+    guint64 size);
+
+gboolean
+mms_file_reserve(
+    int fd,
+    guint64 size);
+
+gboolean
+mms_file_staging_reserve(
+    const MMSConfig* config,
+    guint64 size);
+
+void
+mms_file_staging_release(
+    guint64 size);
+
+guint64
+mms_file_staging_used(
+    void);
+
+/* Sync statistics */
+typedef struct mms_sync_stats {
+    guint count;                /* Number of sync calls */
+    guint64 total_us;           /* Total time spent syncing */
+    guint64 max_us;             /* The longest sync */
+} MMSSyncStats;
+
+gboolean
+mms_file_sync(
+    int fd);
+
+void
+mms_file_sync_stats_get(
+    MMSSyncStats* stats);
+
+/* Directory handle for creating files */
+typedef struct mms_dir MMSDir;
+
+#define MMS_DIR_SYNC_FILES              (0x01) /* Sync each file */
+
+MMSDir*
+mms_dir_open(
+    const char* path,
+    GError** error);
+
+MMSDir*
+mms_dir_open_full(
+    const char* path,
+    int flags,
+    GError** error);
+
+void
+mms_dir_close(
+    MMSDir* dir);
+
+const char*
+mms_dir_path(
+    MMSDir* dir);
+
+int
+mms_dir_fd(
+    MMSDir* dir);
+
+int
+mms_dir_flags(
+    MMSDir* dir);
+
+gboolean
+mms_dir_sync(
+    MMSDir* dir,
+    GError** error);
+
+gboolean
+mms_dir_sync_file(
+    MMSDir* dir,
+    const char* file);
+
+int
+mms_dir_create_file(
+    MMSDir* dir,
+    const char* file,
+    char** path,
+    GError** error)
+    G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean
+mms_dir_write_file(
+    MMSDir* dir,
+    const char* file,
+    const void* data,
+    gsize size,
+    char** path,
+    GError** error);
+
 int
 mms_create_file(
     const char* dir,
@@ -80,17 +182,65 @@ mms_write_bytes(
     GBytes* bytes,
     char** path);
 
+/* How mms_file_extract got the data there */
+typedef enum mms_file_extract {
+    MMS_FILE_EXTRACT_FAILED,
+    MMS_FILE_EXTRACT_CLONE,         /* FICLONERANGE, blocks are shared */
+    MMS_FILE_EXTRACT_COPY_RANGE,    /* copy_file_range, in-kernel copy */
+    MMS_FILE_EXTRACT_WRITE          /* Plain write from memory */
+} MMS_FILE_EXTRACT;
+
+MMS_FILE_EXTRACT
+mms_file_extract(
+    const char* root_dir,
+    int fd,
+    gsize offset,
+    const void* data,
+    gsize size,
+    MMSDir* dir,
+    const char* file,
+    char** path);
+
+void
+mms_file_caps_clear(void);
+
+gboolean
+mms_file_can_extract_in_kernel(
+    const char* root_dir,
+    int fd);
+
+/* How mms_stage_attachment got the attachment there */
+typedef enum mms_file_stage {
+    MMS_FILE_STAGE_FAILED,
+    MMS_FILE_STAGE_LINK,            /* Hard link to the original file */
+    MMS_FILE_STAGE_CLONE,           /* Reflink, blocks are shared */
+    MMS_FILE_STAGE_COPY_RANGE,      /* copy_file_range, in-kernel copy */
+    MMS_FILE_STAGE_WRITE            /* Plain write from memory */
+} MMS_FILE_STAGE;
+
+MMS_FILE_STAGE
+mms_stage_attachment(
+    const char* root_dir,
+    const MMSAttachmentInfo* ai,
+    MMSDir* dir,
+    const char* file,
+    GError** error);
+
 gboolean
 mms_copy_attachment(
-    const MMSAttachmentInfo* parts,
-    const char* dest,
+    const MMSAttachmentInfo* ai,
+    MMSDir* dir,
+    const char* file,
     GError** error);
 
 gboolean
 mms_file_decode(
-    const char* src,
-    const char* dest,
+    const void* data,
+    gsize size,
+    MMSDir* dir,
+    const char* file,
     GMimeContentEncoding enc,
+    char** path,
     GError** error);
 
 #define mms_message_dir(config,id) \
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_gc.h"
+#include "mms_settings.h"
+#include "mms_file_util.h"
+
+#include <gutil_log.h>
+
+/* Max time spent in one idle callback */
+#define MMS_GC_SLICE_US     (2000)
+
+/* Don't walk the directories more often than that */
+#define MMS_GC_INTERVAL_US  (G_GINT64_CONSTANT(3600) * G_USEC_PER_SEC)
+
+struct mms_gc {
+    const MMSConfig* config;
+    MMSGcBusyFunc busy;
+    void* user_data;
+    char* dirs[2];              /* Directories to walk */
+    guint dir_index;            /* Next directory to walk */
+    GDir* dir;                  /* Directory being walked */
+    time_t cutoff;              /* Entries older than that are deleted */
+    gint64 last_pass;           /* When the last pass has completed */
+    guint idle_id;
+    MMSGcStats stats;
+};
+
+/**
+ * Returns TRUE if nothing in there has been modified since cutoff.
+ */
+static
+gboolean
+mms_gc_expired(
+    const char* path,
+    time_t cutoff)
+{
+    struct stat st;
+    gboolean expired = FALSE;
+
+    if (!lstat(path, &st) && st.st_mtime < cutoff) {
+        expired = TRUE;
+        if (S_ISDIR(st.st_mode)) {
+            GDir* dir = g_dir_open(path, 0, NULL);
+
+            if (dir) {
+                const char* name;
+
+                while (expired && (name = g_dir_read_name(dir)) != NULL) {
+                    char* child = g_build_filename(path, name, NULL);
+
+                    expired = mms_gc_expired(child, cutoff);
+                    g_free(child);
+                }
+                g_dir_close(dir);
+            }
+        }
+    }
+    return expired;
+}
+
+/**
+ * Deletes the whole thing, returns the number of bytes reclaimed.
+ * Files which are hard-linked from elsewhere don't count.
+ */
+static
+guint64
+mms_gc_remove(
+    const char* path)
+{
+    struct stat st;
+    guint64 bytes = 0;
+
+    if (!lstat(path, &st)) {
+        if (S_ISDIR(st.st_mode)) {
+            GDir* dir = g_dir_open(path, 0, NULL);
+
+            if (dir) {
+                const char* name;
+
+                while ((name = g_dir_read_name(dir)) != NULL) {
+                    char* child = g_build_filename(path, name, NULL);
+
+                    bytes += mms_gc_remove(child);
+                    g_free(child);
+                }
+                g_dir_close(dir);
+            }
+            if (rmdir(path)) {
+                GWARN("Failed to delete %s: %s", path, strerror(errno));
+            }
+        } else if (!unlink(path)) {
+            if (st.st_nlink == 1) {
+                bytes += st.st_size;
+            }
+        } else {
+            GWARN("Failed to delete %s: %s", path, strerror(errno));
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Looks at one directory entry. Returns FALSE when the pass is done.
+ */
+static
+gboolean
+mms_gc_step(
+    MMSGc* gc)
+{
+    const char* name;
+
+    if (!gc->dir) {
+        const char* path = (gc->dir_index < G_N_ELEMENTS(gc->dirs)) ?
+            gc->dirs[gc->dir_index] : NULL;
+
+        if (path) {
+            gc->dir_index++;
+            gc->dir = g_dir_open(path, 0, NULL);
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    }
+
+    name = g_dir_read_name(gc->dir);
+    if (name) {
+        if (name[0] != '.' && !(gc->busy && gc->busy(name, gc->user_data))) {
+            char* path = g_build_filename(gc->dirs[gc->dir_index - 1],
+                name, NULL);
+
+            if (mms_gc_expired(path, gc->cutoff)) {
+                const guint64 bytes = mms_gc_remove(path);
+
+                GDEBUG("Deleted %s (%" G_GUINT64_FORMAT " bytes)", path,
+                    bytes);
+                gc->stats.dirs++;
+                gc->stats.bytes += bytes;
+            }
+            g_free(path);
+        }
+    } else {
+        g_dir_close(gc->dir);
+        gc->dir = NULL;
+    }
+    return TRUE;
+}
+
+static
+gboolean
+mms_gc_idle(
+    gpointer data)
+{
+    MMSGc* gc = data;
+    const gint64 start = g_get_monotonic_time();
+
+    while (mms_gc_step(gc)) {
+        if (g_get_monotonic_time() - start >= MMS_GC_SLICE_US) {
+            /* Let others run */
+            return G_SOURCE_CONTINUE;
+        }
+    }
+
+    GDEBUG("Garbage collection done, %u dir(s) %" G_GUINT64_FORMAT
+        " bytes reclaimed so far", gc->stats.dirs, gc->stats.bytes);
+    gc->last_pass = g_get_monotonic_time();
+    gc->idle_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Creates the collector. It does nothing until mms_gc_start is called.
+ */
+MMSGc*
+mms_gc_new(
+    const MMSConfig* config,
+    MMSGcBusyFunc busy,
+    void* user_data)
+{
+    MMSGc* gc = g_new0(MMSGc, 1);
+
+    gc->config = config;
+    gc->busy = busy;
+    gc->user_data = user_data;
+    gc->dirs[0] = g_build_filename(config->root_dir, MMS_MESSAGE_DIR, NULL);
+    if (config->staging_dir) {
+        gc->dirs[1] = g_build_filename(config->staging_dir,
+            MMS_MESSAGE_DIR, NULL);
+    }
+    return gc;
+}
+
+/**
+ * Stops the collector and deallocates it. NULL is safely ignored.
+ */
+void
+mms_gc_free(
+    MMSGc* gc)
+{
+    if (gc) {
+        if (gc->idle_id) {
+            g_source_remove(gc->idle_id);
+        }
+        if (gc->dir) {
+            g_dir_close(gc->dir);
+        }
+        g_free(gc->dirs[0]);
+        g_free(gc->dirs[1]);
+        g_free(gc);
+    }
+}
+
+/**
+ * Schedules a pass unless one is already running or the last one
+ * has completed recently. Returns TRUE if the pass is running.
+ */
+gboolean
+mms_gc_start(
+    MMSGc* gc)
+{
+    const MMSConfig* config = gc->config;
+
+    if (!gc->idle_id && config->orphan_secs > 0 &&
+        !config->keep_temp_files && (!gc->last_pass ||
+        (g_get_monotonic_time() - gc->last_pass) >= MMS_GC_INTERVAL_US)) {
+        gc->cutoff = time(NULL) - config->orphan_secs;
+        gc->dir_index = 0;
+        gc->idle_id = g_idle_add_full(G_PRIORITY_LOW, mms_gc_idle, gc, NULL);
+    }
+    return gc->idle_id != 0;
+}
+
+/**
+ * Checks whether the pass is running.
+ */
+gboolean
+mms_gc_running(
+    MMSGc* gc)
+{
+    return gc && gc->idle_id;
+}
+
+/**
+ * Returns the totals since the collector has been created.
+ */
+void
+mms_gc_stats_get(
+    MMSGc* gc,
+    MMSGcStats* stats)
+{
+    *stats = gc->stats;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_GC_H
+#define SAILFISH_MMS_GC_H
+
+#include "mms_lib_types.h"
+
+/*
+ * Collector of message directories left behind by the previous runs
+ * (e.g. if the engine got killed). Walks the message directories in
+ * small steps from a low priority idle callback and deletes the ones
+ * which haven't been touched for orphan_secs, unless the busy callback
+ * says that the id is still in use.
+ */
+
+typedef struct mms_gc MMSGc;
+
+typedef struct mms_gc_stats {
+    guint dirs;                 /* Number of deleted directories */
+    guint64 bytes;              /* Number of reclaimed bytes */
+} MMSGcStats;
+
+typedef
+gboolean
+(*MMSGcBusyFunc)(
+    const char* id,
+    void* user_data);
+
+MMSGc*
+mms_gc_new(
+    const MMSConfig* config,
+    MMSGcBusyFunc busy,
+    void* user_data);
+
+void
+mms_gc_free(
+    MMSGc* gc);
+
+gboolean
+mms_gc_start(
+    MMSGc* gc);
+
+gboolean
+mms_gc_running(
+    MMSGc* gc);
+
+void
+mms_gc_stats_get(
+    MMSGc* gc,
+    MMSGcStats* stats);
+
+#endif /* SAILFISH_MMS_GC_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
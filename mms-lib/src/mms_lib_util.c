@@ -15,6 +15,10 @@
 
 #include "mms_lib_util.h"
 #include "mms_settings.h"
+#include "mms_charset.h"
+#include "mms_file_util.h"
+#include "mms_resize_cache.h"
+#include "mms_sniff.h"
 
 #ifdef MMS_RESIZE_IMAGEMAGICK
 #  include <magick/api.h>
@@ -53,6 +57,10 @@ mms_lib_init(
 void
 mms_lib_deinit()
 {
+    mms_charset_cache_clear();
+    mms_file_caps_clear();
+    mms_resize_cache_clear();
+    mms_sniff_cleanup();
 #ifdef MMS_RESIZE_IMAGEMAGICK
     MagickCoreTerminus();
 #endif
@@ -72,6 +80,17 @@ mms_lib_default_config(
     config->keep_temp_files = FALSE;
     config->attic_enabled = FALSE;
     config->convert_to_utf8 = TRUE;
+    config->max_headers = MMS_CONFIG_DEFAULT_MAX_HEADERS;
+    config->max_parts = MMS_CONFIG_DEFAULT_MAX_PARTS;
+    config->max_text = MMS_CONFIG_DEFAULT_MAX_TEXT;
+    config->decode_ms = MMS_CONFIG_DEFAULT_DECODE_MS;
+    config->virtual_parts = FALSE;
+    config->sync = MMS_CONFIG_DEFAULT_SYNC;
+    config->dedup = FALSE;
+    config->staging_dir = MMS_CONFIG_DEFAULT_STAGING_DIR;
+    config->staging_limit = MMS_CONFIG_DEFAULT_STAGING_LIMIT;
+    config->orphan_secs = MMS_CONFIG_DEFAULT_ORPHAN_SECS;
+    config->resize_cache = MMS_CONFIG_DEFAULT_RESIZE_CACHE;
 }
 
 /*
@@ -37,6 +37,7 @@ mms_message_part_free(
         if (!(msg->flags & MMS_MESSAGE_FLAG_KEEP_FILES)) remove(part->orig);
         g_free(part->orig);
     }
+    g_free(part->name);
     g_free(part);
 }
 
@@ -55,6 +56,10 @@ mms_message_finalize(
     g_free(msg->cls);
     g_slist_foreach(msg->parts, mms_message_part_free, msg);
     g_slist_free(msg->parts);
+    if (msg->pdu) {
+        if (!(msg->flags & MMS_MESSAGE_FLAG_KEEP_FILES)) remove(msg->pdu);
+        g_free(msg->pdu);
+    }
     if (msg->parts_dir) {
         if (!(msg->flags & MMS_MESSAGE_FLAG_KEEP_FILES)) {
             if (rmdir(msg->parts_dir) == 0) {
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_pdu_stream.h"
+#include "mms_codec.h"
+
+/* Logging */
+#define GLOG_MODULE_NAME mms_codec_log
+#include "mms_lib_log.h"
+#include <gutil_log.h>
+
+struct mms_pdu_stream {
+    gint ref_count;
+    GPtrArray* segments;
+    gsize size;
+};
+
+typedef struct mms_pdu_stream_encoder {
+    MMSPduStream* stream;
+    GByteArray* headers;
+    GBytes* const* data;
+} MMSPduStreamEncoder;
+
+static
+void
+mms_pdu_stream_append(
+    MMSPduStream* stream,
+    GBytes* bytes)
+{
+    stream->size += g_bytes_get_size(bytes);
+    g_ptr_array_add(stream->segments, bytes);
+}
+
+static
+void
+mms_pdu_stream_encoder_flush(
+    MMSPduStreamEncoder* enc)
+{
+    if (enc->headers->len) {
+        mms_pdu_stream_append(enc->stream,
+            g_byte_array_free_to_bytes(enc->headers));
+        enc->headers = g_byte_array_new();
+    }
+}
+
+static
+gboolean
+mms_pdu_stream_encoder_write(
+    const void* data,
+    unsigned int len,
+    const struct mms_attachment* part,
+    void* user_data)
+{
+    MMSPduStreamEncoder* enc = user_data;
+    if (part) {
+        GBytes* bytes = *enc->data;
+        gsize size = 0;
+        if (bytes && g_bytes_get_data(bytes, &size) == data && size == len) {
+            mms_pdu_stream_encoder_flush(enc);
+            mms_pdu_stream_append(enc->stream, g_bytes_ref(bytes));
+            enc->data++;
+            return TRUE;
+        }
+        GERR("Unexpected attachment data");
+        return FALSE;
+    } else {
+        g_byte_array_append(enc->headers, data, len);
+        return TRUE;
+    }
+}
+
+MMSPduStream*
+mms_pdu_stream_encode(
+    MMSPdu* pdu,
+    GBytes* const* data)
+{
+    MMSPduStreamEncoder enc;
+    MMSPduStream* stream = g_slice_new0(MMSPduStream);
+    stream->ref_count = 1;
+    stream->segments = g_ptr_array_new_with_free_func((GDestroyNotify)
+        g_bytes_unref);
+    enc.stream = stream;
+    enc.headers = g_byte_array_new();
+    enc.data = data;
+    if (mms_message_encode_stream(pdu, mms_pdu_stream_encoder_write, &enc)) {
+        mms_pdu_stream_encoder_flush(&enc);
+        g_byte_array_free(enc.headers, TRUE);
+        GDEBUG("Encoded %u bytes in %u segment(s)", (guint)stream->size,
+            stream->segments->len);
+        return stream;
+    }
+    g_byte_array_free(enc.headers, TRUE);
+    mms_pdu_stream_unref(stream);
+    return NULL;
+}
+
+MMSPduStream*
+mms_pdu_stream_ref(
+    MMSPduStream* stream)
+{
+    if (stream) {
+        GASSERT(stream->ref_count > 0);
+        g_atomic_int_inc(&stream->ref_count);
+    }
+    return stream;
+}
+
+void
+mms_pdu_stream_unref(
+    MMSPduStream* stream)
+{
+    if (stream) {
+        GASSERT(stream->ref_count > 0);
+        if (g_atomic_int_dec_and_test(&stream->ref_count)) {
+            g_ptr_array_free(stream->segments, TRUE);
+            g_slice_free(MMSPduStream, stream);
+        }
+    }
+}
+
+gsize
+mms_pdu_stream_size(
+    MMSPduStream* stream)
+{
+    return stream ? stream->size : 0;
+}
+
+/**
+ * Returns the next chunk of data (no more than max_bytes) and advances
+ * the position. The data is not copied.
+ */
+GBytes*
+mms_pdu_stream_read(
+    MMSPduStream* stream,
+    MMSPduStreamPos* pos,
+    gsize max_bytes)
+{
+    if (stream && max_bytes) {
+        GPtrArray* segments = stream->segments;
+        while (pos->segment < segments->len) {
+            GBytes* bytes = segments->pdata[pos->segment];
+            const gsize size = g_bytes_get_size(bytes);
+            if (pos->offset < size) {
+                const gsize len = MIN(size - pos->offset, max_bytes);
+                GBytes* chunk = (!pos->offset && len == size) ?
+                    g_bytes_ref(bytes) :
+                    g_bytes_new_from_bytes(bytes, pos->offset, len);
+                pos->offset += len;
+                return chunk;
+            }
+            pos->segment++;
+            pos->offset = 0;
+        }
+    }
+    return NULL;
+}
+
+gboolean
+mms_pdu_stream_write(
+    MMSPduStream* stream,
+    int fd)
+{
+    guint i;
+    GPtrArray* segments = stream->segments;
+    for (i = 0; i < segments->len; i++) {
+        gsize size;
+        const guint8* ptr = g_bytes_get_data(segments->pdata[i], &size);
+        while (size > 0) {
+            const ssize_t written = write(fd, ptr, size);
+            if (written > 0) {
+                ptr += written;
+                size -= written;
+            } else if (written < 0 && errno == EINTR) {
+                continue;
+            } else {
+                GERR("Write error: %s", strerror(errno));
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_PDU_STREAM_H
+#define SAILFISH_MMS_PDU_STREAM_H
+
+#include "mms_lib_types.h"
+
+/*
+ * Encoded PDU kept in memory as a sequence of segments. Encoded headers
+ * are copied, attachment data is referenced (normally, it's a slice of
+ * a memory mapped file). The whole thing is immutable and can be shared
+ * between threads.
+ */
+typedef struct mms_pdu_stream MMSPduStream;
+
+/* Read position */
+typedef struct mms_pdu_stream_pos {
+    guint segment;
+    gsize offset;
+} MMSPduStreamPos;
+
+/*
+ * The attachment data must belong to the GBytes passed in the array,
+ * in the same order as the attachments are listed in the PDU.
+ */
+MMSPduStream*
+mms_pdu_stream_encode(
+    MMSPdu* pdu,
+    GBytes* const* data);
+
+MMSPduStream*
+mms_pdu_stream_ref(
+    MMSPduStream* stream);
+
+void
+mms_pdu_stream_unref(
+    MMSPduStream* stream);
+
+gsize
+mms_pdu_stream_size(
+    MMSPduStream* stream);
+
+/* Returns NULL at the end of the stream */
+GBytes*
+mms_pdu_stream_read(
+    MMSPduStream* stream,
+    MMSPduStreamPos* pos,
+    gsize max_bytes);
+
+gboolean
+mms_pdu_stream_write(
+    MMSPduStream* stream,
+    int fd);
+
+#endif /* SAILFISH_MMS_PDU_STREAM_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
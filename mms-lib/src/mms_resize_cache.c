@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_resize_cache.h"
+#include "mms_file_util.h"
+#include "mms_settings.h"
+
+#include <dirent.h>
+
+#include <gutil_log.h>
+
+typedef struct mms_resize_cache_entry {
+    char* name;
+    struct timespec mtime;
+    guint64 size;
+} MMSResizeCacheEntry;
+
+/* Enough for a SHA256 key followed by two integers */
+#define MMS_RESIZE_CACHE_NAME_MAX (128)
+
+static GMutex mms_resize_cache_mutex;
+static MMSResizeCacheStats mms_resize_cache_stats;
+
+/* Bytes in the cache per root directory, known since the last trim */
+static GHashTable* mms_resize_cache_bytes = NULL;
+
+static
+void
+mms_resize_cache_account(
+    gboolean hit)
+{
+    g_mutex_lock(&mms_resize_cache_mutex);
+    mms_resize_cache_stats.lookups++;
+    if (hit) {
+        mms_resize_cache_stats.hits++;
+        GDEBUG("Resize cache hit %u/%u", mms_resize_cache_stats.hits,
+            mms_resize_cache_stats.lookups);
+    }
+    g_mutex_unlock(&mms_resize_cache_mutex);
+}
+
+/*
+ * Adds the size of the new entry to the total. Returns TRUE if the total
+ * isn't known yet or exceeds the limit, i.e. it's time to trim.
+ */
+static
+gboolean
+mms_resize_cache_grow(
+    const char* root_dir,
+    guint64 size,
+    guint64 max_bytes)
+{
+    gboolean trim = TRUE;
+    guint64* total;
+
+    g_mutex_lock(&mms_resize_cache_mutex);
+    if (mms_resize_cache_bytes &&
+        (total = g_hash_table_lookup(mms_resize_cache_bytes, root_dir))) {
+        *total += size;
+        trim = (*total > max_bytes);
+    }
+    g_mutex_unlock(&mms_resize_cache_mutex);
+    return trim;
+}
+
+static
+void
+mms_resize_cache_set_bytes(
+    const char* root_dir,
+    guint64 bytes)
+{
+    guint64* total = g_new(guint64, 1);
+
+    *total = bytes;
+    g_mutex_lock(&mms_resize_cache_mutex);
+    if (!mms_resize_cache_bytes) {
+        mms_resize_cache_bytes = g_hash_table_new_full(g_str_hash,
+            g_str_equal, g_free, g_free);
+    }
+    g_hash_table_insert(mms_resize_cache_bytes, g_strdup(root_dir), total);
+    g_mutex_unlock(&mms_resize_cache_mutex);
+}
+
+/* Hard links don't work across file systems, that's the fallback */
+static
+gboolean
+mms_resize_cache_copy(
+    const char* from,
+    const char* to)
+{
+    gboolean ok = FALSE;
+    GMappedFile* map = g_mapped_file_new(from, FALSE, NULL);
+
+    if (map) {
+        char* dir = g_path_get_dirname(to);
+        char* file = g_path_get_basename(to);
+
+        ok = mms_write_file(dir, file, g_mapped_file_get_contents(map),
+            g_mapped_file_get_length(map), NULL);
+        g_mapped_file_unref(map);
+        g_free(dir);
+        g_free(file);
+    }
+    return ok;
+}
+
+static
+gboolean
+mms_resize_cache_link(
+    const char* from,
+    const char* to)
+{
+    if (!link(from, to)) {
+        return TRUE;
+    } else if (errno == EXDEV) {
+        return mms_resize_cache_copy(from, to);
+    } else {
+        GWARN("Failed to link %s => %s: %s", from, to, strerror(errno));
+        return FALSE;
+    }
+}
+
+/*
+ * The key is a symbolic link pointing to the entry, the entry name
+ * carries the result. That's one readlink per lookup, no matter how
+ * many entries there are.
+ */
+static
+gboolean
+mms_resize_cache_find(
+    int fd,
+    const char* key,
+    char* name,
+    MMSResizeCacheResult* result)
+{
+    const gsize len = strlen(key);
+    const ssize_t n = readlinkat(fd, key, name, MMS_RESIZE_CACHE_NAME_MAX);
+
+    if (n > 0 && n < MMS_RESIZE_CACHE_NAME_MAX) {
+        int step, state;
+        char c;
+
+        name[n] = 0;
+        if (!strncmp(name, key, len) && name[len] == '-' &&
+            sscanf(name + len + 1, "%d-%d%c", &step, &state, &c) == 2) {
+            if (!faccessat(fd, name, F_OK, 0)) {
+                result->step = step;
+                result->state = state;
+                return TRUE;
+            }
+            /* The entry has been evicted, the link is stale */
+            unlinkat(fd, key, 0);
+        }
+    }
+    return FALSE;
+}
+
+static
+int
+mms_resize_cache_entry_compare(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const MMSResizeCacheEntry* e1 = a;
+    const MMSResizeCacheEntry* e2 = b;
+
+    /* Oldest first */
+    if (e1->mtime.tv_sec != e2->mtime.tv_sec) {
+        return (e1->mtime.tv_sec < e2->mtime.tv_sec) ? -1 : 1;
+    } else if (e1->mtime.tv_nsec != e2->mtime.tv_nsec) {
+        return (e1->mtime.tv_nsec < e2->mtime.tv_nsec) ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Looks up the resized image by key, links it to the specified path
+ * and fills in the result. Returns FALSE if it's not in the cache.
+ */
+gboolean
+mms_resize_cache_get(
+    const MMSConfig* config,
+    const char* key,
+    const char* path,
+    MMSResizeCacheResult* result)
+{
+    gboolean hit = FALSE;
+
+    if (config->resize_cache) {
+        char* cache = g_build_filename(config->root_dir,
+            MMS_RESIZE_CACHE_DIR, NULL);
+        const int fd = open(cache, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd >= 0) {
+            char name[MMS_RESIZE_CACHE_NAME_MAX];
+            MMSResizeCacheResult found;
+
+            if (mms_resize_cache_find(fd, key, name, &found)) {
+                char* entry = g_build_filename(cache, name, NULL);
+
+                unlink(path);
+                if (mms_resize_cache_link(entry, path)) {
+                    /* It has just been used */
+                    utimensat(fd, name, NULL, 0);
+                    GVERBOSE("%s => %s", path, name);
+                    *result = found;
+                    hit = TRUE;
+                }
+                g_free(entry);
+            }
+            close(fd);
+        }
+        mms_resize_cache_account(hit);
+        g_free(cache);
+    }
+    return hit;
+}
+
+/**
+ * Adds the resized image to the cache. Whatever doesn't fit in there
+ * anymore gets evicted, but the cache directory is only scanned when
+ * the total goes over the limit.
+ */
+void
+mms_resize_cache_put(
+    const MMSConfig* config,
+    const char* key,
+    const char* path,
+    const MMSResizeCacheResult* result)
+{
+    if (config->resize_cache) {
+        char* cache = g_build_filename(config->root_dir,
+            MMS_RESIZE_CACHE_DIR, NULL);
+        char* name = g_strdup_printf("%s-%d-%d", key, result->step,
+            result->state);
+        char* entry = g_build_filename(cache, name, NULL);
+        struct stat st;
+        int fd;
+
+        g_mkdir_with_parents(cache, MMS_DIR_PERM);
+        fd = open(cache, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0 && !stat(path, &st)) {
+            /* Replace the orphan left behind by a crash, if any */
+            unlinkat(fd, name, 0);
+            unlinkat(fd, key, 0);
+            if (mms_resize_cache_link(path, entry)) {
+                if (!symlinkat(name, fd, key)) {
+                    GVERBOSE("%s <= %s", name, path);
+                    if (mms_resize_cache_grow(config->root_dir, st.st_size,
+                        config->resize_cache)) {
+                        mms_resize_cache_trim(config->root_dir,
+                            config->resize_cache);
+                    }
+                } else {
+                    GWARN("Failed to create %s/%s: %s", cache, key,
+                        strerror(errno));
+                    unlinkat(fd, name, 0);
+                }
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        g_free(entry);
+        g_free(name);
+        g_free(cache);
+    }
+}
+
+/**
+ * Evicts the least recently used entries until the cache takes no more
+ * than max_bytes. Returns the number of evicted entries.
+ */
+guint
+mms_resize_cache_trim(
+    const char* root_dir,
+    guint64 max_bytes)
+{
+    guint evicted = 0;
+    char* path = g_build_filename(root_dir, MMS_RESIZE_CACHE_DIR, NULL);
+    DIR* dir = opendir(path);
+
+    if (dir) {
+        const int fd = dirfd(dir);
+        GArray* entries = g_array_new(FALSE, FALSE,
+            sizeof(MMSResizeCacheEntry));
+        const struct dirent* de;
+        guint64 total = 0;
+        guint i;
+
+        /* Symbolic links (the keys) don't take any space to speak of */
+        while ((de = readdir(dir)) != NULL) {
+            struct stat st;
+
+            if (de->d_name[0] != '.' &&
+                !fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+                S_ISREG(st.st_mode)) {
+                MMSResizeCacheEntry entry;
+
+                entry.name = g_strdup(de->d_name);
+                entry.mtime = st.st_mtim;
+                entry.size = st.st_size;
+                g_array_append_val(entries, entry);
+                total += entry.size;
+            }
+        }
+
+        if (total > max_bytes) {
+            g_array_sort(entries, mms_resize_cache_entry_compare);
+            for (i = 0; i < entries->len && total > max_bytes; i++) {
+                const MMSResizeCacheEntry* entry =
+                    &g_array_index(entries, MMSResizeCacheEntry, i);
+                char* key = g_strdup(entry->name);
+                char* sep = strchr(key, '-');
+
+                /* Whoever else has it linked, still has it */
+                if (!unlinkat(fd, entry->name, 0)) {
+                    GVERBOSE("Evicted %s/%s", path, entry->name);
+                    if (sep) {
+                        *sep = 0;
+                        unlinkat(fd, key, 0);
+                    }
+                    total -= entry->size;
+                    evicted++;
+                }
+                g_free(key);
+            }
+        }
+
+        for (i = 0; i < entries->len; i++) {
+            g_free(g_array_index(entries, MMSResizeCacheEntry, i).name);
+        }
+        g_array_free(entries, TRUE);
+        closedir(dir);
+        mms_resize_cache_set_bytes(root_dir, total);
+    }
+    if (evicted) {
+        g_mutex_lock(&mms_resize_cache_mutex);
+        mms_resize_cache_stats.evicted += evicted;
+        g_mutex_unlock(&mms_resize_cache_mutex);
+        GDEBUG("Evicted %u file(s) from %s", evicted, path);
+    }
+    g_free(path);
+    return evicted;
+}
+
+/**
+ * Forgets the cache sizes, they will be recalculated when needed.
+ */
+void
+mms_resize_cache_clear(
+    void)
+{
+    GHashTable* bytes;
+
+    g_mutex_lock(&mms_resize_cache_mutex);
+    bytes = mms_resize_cache_bytes;
+    mms_resize_cache_bytes = NULL;
+    g_mutex_unlock(&mms_resize_cache_mutex);
+
+    if (bytes) {
+        g_hash_table_destroy(bytes);
+    }
+}
+
+/**
+ * Returns the cache statistics since the process has started.
+ */
+void
+mms_resize_cache_stats_get(
+    MMSResizeCacheStats* stats)
+{
+    g_mutex_lock(&mms_resize_cache_mutex);
+    *stats = mms_resize_cache_stats;
+    g_mutex_unlock(&mms_resize_cache_mutex);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_RESIZE_CACHE_H
+#define SAILFISH_MMS_RESIZE_CACHE_H
+
+#include "mms_lib_types.h"
+
+/*
+ * Persistent cache of resized images, shared by all messages. The key
+ * covers the contents of the original and everything else that affects
+ * the result. Each entry is named after the key followed by the resize
+ * step and the encoder state which it took to produce it, and is hard
+ * linked to wherever it's needed. The key itself is a symbolic link
+ * to the entry. Hits refresh the modification time, the least recently
+ * used entries are evicted when the total size exceeds the configured
+ * limit. Only images resized next to the message are cached, i.e. the
+ * cache is always on the same file system as the root directory.
+ */
+
+typedef struct mms_resize_cache_stats {
+    guint lookups;              /* Number of lookups */
+    guint hits;                 /* Number of resizes avoided */
+    guint evicted;              /* Number of entries evicted */
+} MMSResizeCacheStats;
+
+typedef struct mms_resize_cache_result {
+    int step;                   /* Resize step */
+    int state;                  /* Encoder specific, e.g. JPEG quality */
+} MMSResizeCacheResult;
+
+gboolean
+mms_resize_cache_get(
+    const MMSConfig* config,
+    const char* key,
+    const char* path,
+    MMSResizeCacheResult* result);
+
+void
+mms_resize_cache_put(
+    const MMSConfig* config,
+    const char* key,
+    const char* path,
+    const MMSResizeCacheResult* result);
+
+guint
+mms_resize_cache_trim(
+    const char* root_dir,
+    guint64 max_bytes);
+
+void
+mms_resize_cache_clear(
+    void);
+
+void
+mms_resize_cache_stats_get(
+    MMSResizeCacheStats* stats);
+
+#endif /* SAILFISH_MMS_RESIZE_CACHE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
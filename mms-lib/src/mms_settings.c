@@ -27,6 +27,17 @@ GLOG_MODULE_DEFINE("mms-settings");
 #define SETTINGS_GLOBAL_KEY_NETWORK_IDLE_SEC    "NetworkIdleTimeout"
 #define SETTINGS_GLOBAL_KEY_IDLE_SEC            "IdleTimeout"
 #define SETTINGS_GLOBAL_KEY_COVERT_TO_UTF8      "ConvertToUTF8"
+#define SETTINGS_GLOBAL_KEY_MAX_HEADERS         "MaxHeaders"
+#define SETTINGS_GLOBAL_KEY_MAX_PARTS           "MaxParts"
+#define SETTINGS_GLOBAL_KEY_MAX_TEXT            "MaxTextSize"
+#define SETTINGS_GLOBAL_KEY_DECODE_MS           "DecodeTimeLimit"
+#define SETTINGS_GLOBAL_KEY_VIRTUAL_PARTS       "VirtualParts"
+#define SETTINGS_GLOBAL_KEY_SYNC                "Sync"
+#define SETTINGS_GLOBAL_KEY_DEDUP               "Deduplicate"
+#define SETTINGS_GLOBAL_KEY_STAGING_DIR         "StagingDir"
+#define SETTINGS_GLOBAL_KEY_STAGING_LIMIT       "StagingLimit"
+#define SETTINGS_GLOBAL_KEY_ORPHAN_SEC          "OrphanTimeout"
+#define SETTINGS_GLOBAL_KEY_RESIZE_CACHE        "ResizeCache"
 
 #define SETTINGS_DEFAULTS_GROUP                 "Defaults"
 #define SETTINGS_DEFAULTS_KEY_USER_AGENT        "UserAgent"
@@ -34,6 +45,7 @@ GLOG_MODULE_DEFINE("mms-settings");
 #define SETTINGS_DEFAULTS_KEY_SIZE_LIMIT        "SizeLimit"
 #define SETTINGS_DEFAULTS_KEY_MAX_PIXELS        "MaxPixels"
 #define SETTINGS_DEFAULTS_KEY_ALLOW_DR          "SendDeliveryReport"
+#define SETTINGS_DEFAULTS_KEY_MIN_JPEG_QUALITY  "MinJpegQuality"
 
 G_DEFINE_TYPE(MMSSettings, mms_settings, G_TYPE_OBJECT)
 #define MMS_SETTINGS_GET_CLASS(obj)  \
@@ -66,6 +78,7 @@ mms_settings_sim_data_default(
     data->size_limit = MMS_SETTINGS_DEFAULT_SIZE_LIMIT;
     data->max_pixels = MMS_SETTINGS_DEFAULT_MAX_PIXELS;
     data->allow_dr = MMS_SETTINGS_DEFAULT_ALLOW_DR;
+    data->min_jpeg_quality = MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY;
 }
 
 static
@@ -123,6 +136,42 @@ mms_settings_parse_bool(
     }
 }
 
+static
+void
+mms_settings_parse_sync(
+    GKeyFile* file,
+    const char* group,
+    const char* key,
+    MMS_SYNC_MODE* out)
+{
+    static const struct mms_settings_sync_value {
+        const char* name;
+        MMS_SYNC_MODE value;
+    } values[] = {
+        { "none", MMS_SYNC_NONE },
+        { "message", MMS_SYNC_MESSAGE },
+        { "file", MMS_SYNC_FILE }
+    };
+    char* s = g_key_file_get_string(file, group, key, NULL);
+
+    if (s) {
+        guint i;
+
+        g_strstrip(s);
+        for (i = 0; i < G_N_ELEMENTS(values); i++) {
+            if (!g_ascii_strcasecmp(s, values[i].name)) {
+                *out = values[i].value;
+                GDEBUG("%s = %s", key, values[i].name);
+                break;
+            }
+        }
+        if (i == G_N_ELEMENTS(values)) {
+            GWARN("Invalid %s value '%s'", key, s);
+        }
+        g_free(s);
+    }
+}
+
 static
 void
 mms_settings_parse_global_config(
@@ -156,6 +205,54 @@ mms_settings_parse_global_config(
     mms_settings_parse_bool(file, group,
         SETTINGS_GLOBAL_KEY_COVERT_TO_UTF8,
         &config->convert_to_utf8);
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_GLOBAL_KEY_MAX_HEADERS,
+        &config->max_headers);
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_GLOBAL_KEY_MAX_PARTS,
+        &config->max_parts);
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_GLOBAL_KEY_MAX_TEXT,
+        &config->max_text);
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_GLOBAL_KEY_DECODE_MS,
+        &config->decode_ms);
+
+    mms_settings_parse_bool(file, group,
+        SETTINGS_GLOBAL_KEY_VIRTUAL_PARTS,
+        &config->virtual_parts);
+
+    mms_settings_parse_sync(file, group,
+        SETTINGS_GLOBAL_KEY_SYNC,
+        &config->sync);
+
+    mms_settings_parse_bool(file, group,
+        SETTINGS_GLOBAL_KEY_DEDUP,
+        &config->dedup);
+
+    s = g_key_file_get_string(file, group,
+        SETTINGS_GLOBAL_KEY_STAGING_DIR, NULL);
+    if (s) {
+        g_free(global->staging_dir);
+        config->staging_dir = global->staging_dir = s;
+        GDEBUG("%s = %s", SETTINGS_GLOBAL_KEY_STAGING_DIR, s);
+    }
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_GLOBAL_KEY_STAGING_LIMIT,
+        &config->staging_limit);
+
+    mms_settings_parse_int(file, group,
+        SETTINGS_GLOBAL_KEY_ORPHAN_SEC,
+        &config->orphan_secs, 0);
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_GLOBAL_KEY_RESIZE_CACHE,
+        &config->resize_cache);
 }
 
 static
@@ -202,6 +299,10 @@ mms_settings_parse_sim_config(
         GDEBUG("%s = %s", SETTINGS_DEFAULTS_KEY_ALLOW_DR, b ? "on" : "off");
         defaults->data.allow_dr = b;
     }
+
+    mms_settings_parse_uint(file, group,
+        SETTINGS_DEFAULTS_KEY_MIN_JPEG_QUALITY,
+        &defaults->data.min_jpeg_quality);
 }
 
 gboolean
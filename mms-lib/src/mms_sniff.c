@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_sniff.h"
+#include "mms_attachment_info.h"
+#include "mms_file_util.h"
+
+#ifdef HAVE_MAGIC
+#  include <magic.h>
+#endif
+
+#include <gutil_log.h>
+
+#define MMS_SNIFF_TEXT_PREFIX "text/"
+#define MMS_SNIFF_CHARSET "charset="
+
+#ifdef HAVE_MAGIC
+
+/* magic_t is not thread safe, hence one per thread */
+static
+void
+mms_sniff_magic_free(
+    gpointer magic)
+{
+    magic_close(magic);
+}
+
+static GPrivate mms_sniff_magic = G_PRIVATE_INIT(mms_sniff_magic_free);
+
+static
+magic_t
+mms_sniff_magic_get(void)
+{
+    magic_t magic = g_private_get(&mms_sniff_magic);
+
+    if (!magic) {
+        magic = magic_open(MAGIC_MIME_TYPE | MAGIC_MIME_ENCODING);
+        if (magic) {
+            if (magic_load(magic, NULL) == 0) {
+                GDEBUG("Loaded magic database");
+                g_private_set(&mms_sniff_magic, magic);
+            } else {
+                GWARN("Failed to load magic database: %s",
+                    magic_error(magic));
+                magic_close(magic);
+                magic = NULL;
+            }
+        }
+    }
+    return magic;
+}
+
+#endif /* HAVE_MAGIC */
+
+/*
+ * Splits "type/subtype; charset=xxx" into the media type and the
+ * charset. Either one may be missing.
+ */
+static
+char*
+mms_sniff_lookup(
+    const MMSAttachmentInfo* ai,
+    char** charset)
+{
+    char* type = NULL;
+
+    *charset = NULL;
+#ifdef HAVE_MAGIC
+    {
+        const gint64 start = g_get_monotonic_time();
+        magic_t magic = mms_sniff_magic_get();
+        const char* result = magic ?
+            magic_buffer(magic, ai->data, ai->size) : NULL;
+
+        GDEBUG("%s: %s (%u us)", ai->file_name, result ? result : "?",
+            (guint)(g_get_monotonic_time() - start));
+
+        if (result) {
+            const char* sep = strchr(result, ';');
+
+            if (sep) {
+                const char* cs = strstr(sep, MMS_SNIFF_CHARSET);
+
+                if (cs) {
+                    *charset = g_strstrip(g_strdup(cs +
+                        strlen(MMS_SNIFF_CHARSET)));
+                    if (!(*charset)[0]) {
+                        g_free(*charset);
+                        *charset = NULL;
+                    }
+                }
+                type = g_strstrip(g_strndup(result, sep - result));
+            } else {
+                type = g_strstrip(g_strdup(result));
+            }
+            if (!type[0]) {
+                g_free(type);
+                type = NULL;
+            }
+        }
+    }
+#endif
+    return type;
+}
+
+/**
+ * Detects the media type and (optionally) the charset in one go.
+ */
+char*
+mms_sniff_media_type(
+    const MMSAttachmentInfo* ai,
+    char** charset)
+{
+    char* cs;
+    char* type = mms_sniff_lookup(ai, &cs);
+
+    /* Magic detects SMIL as text/html */
+    if ((!type || g_str_has_prefix(type, MMS_SNIFF_TEXT_PREFIX)) &&
+        mms_file_is_smil(ai)) {
+        g_free(type);
+        type = g_strdup(SMIL_CONTENT_TYPE);
+    }
+    if (charset) {
+        *charset = cs;
+    } else {
+        g_free(cs);
+    }
+    return type;
+}
+
+/**
+ * Detects the charset of the text.
+ */
+char*
+mms_sniff_charset(
+    const MMSAttachmentInfo* ai)
+{
+    char* cs;
+
+    g_free(mms_sniff_lookup(ai, &cs));
+    return cs;
+}
+
+/**
+ * Releases the magic database loaded by the calling thread. Other
+ * threads release theirs when they exit.
+ */
+void
+mms_sniff_cleanup(void)
+{
+#ifdef HAVE_MAGIC
+    g_private_replace(&mms_sniff_magic, NULL);
+#endif
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_SNIFF_H
+#define SAILFISH_MMS_SNIFF_H
+
+#include "mms_lib_types.h"
+
+/*
+ * Content sniffing. Each thread loads the magic database once, on the
+ * first use, and keeps it until the thread exits. The media type and
+ * the charset come out of the same lookup. Both functions return NULL
+ * if the content isn't recognized, the results need to be g_free'd.
+ */
+
+char*
+mms_sniff_media_type(
+    const MMSAttachmentInfo* ai,
+    char** charset);
+
+char*
+mms_sniff_charset(
+    const MMSAttachmentInfo* ai);
+
+void
+mms_sniff_cleanup(void);
+
+#endif /* SAILFISH_MMS_SNIFF_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "mms_store.h"
+
+#include <dirent.h>
+
+#include <gutil_log.h>
+
+static GMutex mms_store_mutex;
+static MMSStoreStats mms_store_stats;
+
+static
+MMSDir*
+mms_store_open(
+    const char* root_dir)
+{
+    GError* error = NULL;
+    char* path = g_build_filename(root_dir, MMS_STORE_DIR, NULL);
+    MMSDir* store = mms_dir_open(path, &error);
+
+    if (!store) {
+        GERR("%s", GERRMSG(error));
+        g_error_free(error);
+    }
+    g_free(path);
+    return store;
+}
+
+static
+void
+mms_store_account(
+    gboolean hit,
+    guint64 size)
+{
+    g_mutex_lock(&mms_store_mutex);
+    mms_store_stats.lookups++;
+    if (hit) {
+        mms_store_stats.hits++;
+        mms_store_stats.bytes_saved += size;
+        GDEBUG("Store hit %u/%u, %" G_GUINT64_FORMAT " bytes saved",
+            mms_store_stats.hits, mms_store_stats.lookups,
+            mms_store_stats.bytes_saved);
+    }
+    g_mutex_unlock(&mms_store_mutex);
+}
+
+/**
+ * Generates the store key for the data.
+ */
+char*
+mms_store_key(
+    const void* data,
+    gsize size)
+{
+    return g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, size);
+}
+
+/**
+ * Links the file with the matching key from the store into the
+ * directory, replacing the existing file if there is one. Returns
+ * FALSE if there's no such file in the store, or if the link couldn't
+ * be synced to disk when the directory requires that.
+ */
+gboolean
+mms_store_link(
+    const char* root_dir,
+    const char* key,
+    MMSDir* dir,
+    const char* file,
+    char** path)
+{
+    gboolean linked = FALSE;
+    MMSDir* store = mms_store_open(root_dir);
+
+    if (store) {
+        const int sfd = mms_dir_fd(store);
+        const int dfd = mms_dir_fd(dir);
+        struct stat st, st2;
+
+        if (!fstatat(sfd, key, &st, 0)) {
+            if (!fstatat(dfd, file, &st2, 0) && st.st_dev == st2.st_dev &&
+                st.st_ino == st2.st_ino) {
+                /* It's already there (and renameat would do nothing) */
+                linked = TRUE;
+            } else {
+                char* tmp = g_strconcat(".", file, ".tmp", NULL);
+
+                /* Link it under a temporary name and then rename */
+                unlinkat(dfd, tmp, 0);
+                if (!linkat(sfd, key, dfd, tmp, 0)) {
+                    if (!renameat(dfd, tmp, dfd, file)) {
+                        GVERBOSE("%s/%s => %s", mms_dir_path(dir), file,
+                            key);
+                        /* Not durable means not linked (it logs why) */
+                        linked = mms_dir_sync_file(dir, file);
+                    } else {
+                        GWARN("Failed to link %s/%s: %s", mms_dir_path(dir),
+                            file, strerror(errno));
+                        unlinkat(dfd, tmp, 0);
+                    }
+                } else {
+                    GWARN("Failed to link %s/%s: %s", mms_dir_path(dir),
+                        file, strerror(errno));
+                }
+                g_free(tmp);
+            }
+            if (linked && path) {
+                *path = g_build_filename(mms_dir_path(dir), file, NULL);
+            }
+        }
+        mms_store_account(linked, linked ? st.st_size : 0);
+        mms_dir_close(store);
+    }
+    return linked;
+}
+
+/**
+ * Adds the file to the store. The key must match the contents.
+ */
+void
+mms_store_add(
+    const char* root_dir,
+    const char* key,
+    MMSDir* dir,
+    const char* file)
+{
+    MMSDir* store = mms_store_open(root_dir);
+
+    if (store) {
+        if (!linkat(mms_dir_fd(dir), file, mms_dir_fd(store), key, 0)) {
+            GVERBOSE("%s <= %s/%s", key, mms_dir_path(dir), file);
+        } else if (errno != EEXIST) {
+            GWARN("Failed to store %s/%s: %s", mms_dir_path(dir), file,
+                strerror(errno));
+        }
+        mms_dir_close(store);
+    }
+}
+
+/**
+ * Same as mms_dir_write_file but takes the file from the store if
+ * it's there, and puts it there if it's not.
+ */
+gboolean
+mms_store_write(
+    const char* root_dir,
+    MMSDir* dir,
+    const char* file,
+    const void* data,
+    gsize size,
+    char** path,
+    GError** error)
+{
+    gboolean ok;
+
+    if (size > 0) {
+        char* key = mms_store_key(data, size);
+
+        ok = mms_store_link(root_dir, key, dir, file, path);
+        if (!ok && mms_dir_write_file(dir, file, data, size, path, error)) {
+            mms_store_add(root_dir, key, dir, file);
+            ok = TRUE;
+        }
+        g_free(key);
+    } else {
+        /* Nothing to share */
+        ok = mms_dir_write_file(dir, file, data, size, path, error);
+    }
+    return ok;
+}
+
+/**
+ * Replaces the file with a link to the identical one from the store,
+ * or adds it to the store if there's no such file there yet.
+ */
+void
+mms_store_intern(
+    const char* root_dir,
+    const char* path)
+{
+    GMappedFile* map = g_mapped_file_new(path, FALSE, NULL);
+
+    if (map) {
+        const gsize size = g_mapped_file_get_length(map);
+
+        if (size > 0) {
+            char* key = mms_store_key(g_mapped_file_get_contents(map), size);
+            char* dirname = g_path_get_dirname(path);
+            char* file = g_path_get_basename(path);
+            MMSDir* dir = mms_dir_open(dirname, NULL);
+
+            if (dir) {
+                if (!mms_store_link(root_dir, key, dir, file, NULL)) {
+                    mms_store_add(root_dir, key, dir, file);
+                }
+                mms_dir_close(dir);
+            }
+            g_free(dirname);
+            g_free(file);
+            g_free(key);
+        }
+        g_mapped_file_unref(map);
+    }
+}
+
+/**
+ * Deletes the files which are no longer linked from anywhere else.
+ * Returns the number of deleted files.
+ */
+guint
+mms_store_gc(
+    const char* root_dir)
+{
+    guint removed = 0;
+    char* path = g_build_filename(root_dir, MMS_STORE_DIR, NULL);
+    const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        DIR* dir = fdopendir(fd);
+
+        if (dir) {
+            const struct dirent* entry;
+
+            while ((entry = readdir(dir)) != NULL) {
+                const char* name = entry->d_name;
+                struct stat st;
+
+                if (name[0] != '.' &&
+                    !fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) &&
+                    S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+                    !unlinkat(fd, name, 0)) {
+                    GVERBOSE("Deleted %s/%s", path, name);
+                    removed++;
+                }
+            }
+            /* This closes the descriptor too */
+            closedir(dir);
+        } else {
+            close(fd);
+        }
+    }
+    if (removed) {
+        GDEBUG("Deleted %u file(s) from %s", removed, path);
+    }
+    g_free(path);
+    return removed;
+}
+
+/**
+ * Returns the deduplication statistics since the process has started.
+ */
+void
+mms_store_stats_get(
+    MMSStoreStats* stats)
+{
+    g_mutex_lock(&mms_store_mutex);
+    *stats = mms_store_stats;
+    g_mutex_unlock(&mms_store_mutex);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SAILFISH_MMS_STORE_H
+#define SAILFISH_MMS_STORE_H
+
+#include "mms_file_util.h"
+
+/*
+ * Content-addressed store of files shared between messages. Files
+ * are named after the SHA-256 of their contents and hard-linked to
+ * wherever they are needed, so the link count is the reference count.
+ * Once nothing but the store refers to a file, mms_store_gc() deletes
+ * it. Linked files must never be modified in place, only replaced.
+ */
+
+typedef struct mms_store_stats {
+    guint lookups;              /* Number of files looked up */
+    guint hits;                 /* Number of files found in the store */
+    guint64 bytes_saved;        /* Bytes which didn't have to be written */
+} MMSStoreStats;
+
+char*
+mms_store_key(
+    const void* data,
+    gsize size)
+    G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean
+mms_store_link(
+    const char* root_dir,
+    const char* key,
+    MMSDir* dir,
+    const char* file,
+    char** path);
+
+void
+mms_store_add(
+    const char* root_dir,
+    const char* key,
+    MMSDir* dir,
+    const char* file);
+
+gboolean
+mms_store_write(
+    const char* root_dir,
+    MMSDir* dir,
+    const char* file,
+    const void* data,
+    gsize size,
+    char** path,
+    GError** error);
+
+void
+mms_store_intern(
+    const char* root_dir,
+    const char* path);
+
+guint
+mms_store_gc(
+    const char* root_dir);
+
+void
+mms_store_stats_get(
+    MMSStoreStats* stats);
+
+#endif /* SAILFISH_MMS_STORE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
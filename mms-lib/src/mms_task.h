@@ -17,6 +17,7 @@
 #define JOLLA_MMS_TASK_H
 
 #include "mms_settings.h"
+#include "mms_pdu_stream.h"
 
 /* Claim MMS 1.1 support */
 #define MMS_VERSION MMS_MESSAGE_VERSION_1_1
@@ -259,7 +260,9 @@ mms_task_encode_new(
 MMSTask*
 mms_task_send_new(
     MMSTask* parent,
-    MMSTransferList* transfers);
+    MMSTransferList* transfers,
+    MMSPduStream* pdu,
+    guint64 staging_size);
 
 #endif /* JOLLA_MMS_TASK_H */
 
@@ -18,6 +18,8 @@
 #include "mms_handler.h"
 #include "mms_message.h"
 #include "mms_file_util.h"
+#include "mms_file_batch.h"
+#include "mms_store.h"
 #include "mms_transfer_list.h"
 
 /* Logging */
@@ -104,39 +106,109 @@ mms_task_decode_make_content_id(
 }
 
 static
-void
+gboolean
 mms_task_decode_part(
-    MMSMessagePart* part,
+    const struct mms_attachment_view* attach,
     GMimeContentEncoding enc,
-    const char* dir,
-    GPtrArray* part_files)
+    MMSDir* dir,
+    const char* file,
+    GPtrArray* part_files,
+    char** path,
+    char** orig,
+    gboolean* written)
 {
-    char* default_name;
-    const char* orig_file;
-    const char* part_file;
-    G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
-    part_file = g_basename(part->file);
-    G_GNUC_END_IGNORE_DEPRECATIONS;
-
-    default_name = g_strconcat(part_file, ".orig", NULL);
-    orig_file = mms_task_decode_add_file_name(part_files, default_name);
-    g_free(default_name);
-
-    part->orig = g_build_filename(dir, orig_file, NULL);
-    if (rename(part->file, part->orig) == 0) {
-        GError* error = NULL;
-        if (!mms_file_decode(part->orig, part->file, enc, &error)) {
-            unlink(part->file);
-            rename(part->orig, part->file);
-            g_free(part->orig);
-            part->orig = NULL;
-            GERR("%s", GERRMSG(error));
-            g_error_free(error);
+    GError* error = NULL;
+
+    /* Decode straight from the PDU, no intermediate file */
+    GDEBUG("Decoding %s", attach->transfer_encoding);
+    if (mms_file_decode(attach->data, attach->length, dir, file, enc, path,
+        &error)) {
+        if (orig) {
+            /* Keep the original for debugging purposes */
+            char* default_name = g_strconcat(file, ".orig", NULL);
+            const char* orig_file =
+                mms_task_decode_add_file_name(part_files, default_name);
+
+            g_free(default_name);
+            if (!mms_dir_write_file(dir, orig_file, attach->data,
+                attach->length, orig, &error)) {
+                GERR("%s", GERRMSG(error));
+                g_error_free(error);
+            }
         }
+        return TRUE;
     } else {
-        GERR("Failed to rename %s to %s: %s", part->file, part->orig,
-            strerror(errno));
+        /* Decoding can't fail, it's the storage (write or sync) */
+        GERR("%s", GERRMSG(error));
+        g_error_free(error);
+        *written = FALSE;
+        return FALSE;
+    }
+}
+
+static
+gboolean
+mms_task_decode_extract(
+    const MMSConfig* config,
+    int fd,
+    const struct mms_attachment_view* attach,
+    MMSDir* dir,
+    const char* file,
+    char** path,
+    gsize* cloned,
+    gsize* copied)
+{
+    char* key = NULL;
+    gboolean ok;
+
+    /* The same file may have already been received */
+    if (config->dedup && attach->length > 0) {
+        key = mms_store_key(attach->data, attach->length);
+        if (mms_store_link(config->root_dir, key, dir, file, path)) {
+            g_free(key);
+            return TRUE;
+        }
+    }
+
+    /* Try to avoid copying the data through the user space */
+    switch (mms_file_extract(config->root_dir, fd, attach->offset,
+        attach->data, attach->length, dir, file, path)) {
+    case MMS_FILE_EXTRACT_CLONE:
+        *cloned += attach->length;
+        ok = TRUE;
+        break;
+    case MMS_FILE_EXTRACT_COPY_RANGE:
+        *copied += attach->length;
+        ok = TRUE;
+        break;
+    case MMS_FILE_EXTRACT_WRITE:
+        ok = TRUE;
+        break;
+    default:
+        ok = FALSE;
+        break;
+    }
+    if (ok && key) {
+        mms_store_add(config->root_dir, key, dir, file);
+    }
+    g_free(key);
+    return ok;
+}
+
+static
+MMSDir*
+mms_task_decode_open_dir(
+    const MMSConfig* config,
+    const char* path)
+{
+    GError* error = NULL;
+    MMSDir* dir = mms_dir_open_full(path, (config->sync == MMS_SYNC_FILE) ?
+        MMS_DIR_SYNC_FILES : 0, &error);
+    if (!dir) {
+        GERR("%s", GERRMSG(error));
+        g_error_free(error);
     }
+    return dir;
 }
 
 static
@@ -144,12 +216,19 @@ MMSMessage*
 mms_task_decode_retrieve_conf(
     MMSTask* task,
     const MMSPdu* pdu,
-    const guint8* pdu_data,
-    gsize pdu_size)
+    struct mms_message_attachment_iter* parts,
+    const char* file,
+    int fd,
+    gboolean* io_error)
 {
-    GSList* entry;
-    int i, nparts = g_slist_length(pdu->attachments);
-    GPtrArray* part_files = g_ptr_array_new_full(nparts, g_free);
+    const MMSConfig* config = task_config(task);
+    int i;
+    gsize cloned = 0, copied = 0;
+    MMSDir* parts_dir = NULL;
+    MMSFileBatch* batch = NULL;
+    gboolean written = TRUE;
+    struct mms_attachment_view attach;
+    GPtrArray* part_files = g_ptr_array_new_with_free_func(g_free);
     GPtrArray* part_ids = g_ptr_array_new();
     char* dir = mms_task_dir(task);
     const struct mms_retrieve_conf* rc = &pdu->rc;
@@ -172,10 +251,9 @@ mms_task_decode_retrieve_conf(
     GDEBUG("  Transaction-ID: %s", pdu->transaction_id);
     if (rc->subject) GDEBUG("  Subject: %s", rc->subject);
     GDEBUG("  Date: %s", date);
-    GDEBUG("  %u parts", nparts);
 #endif /* GUTIL_LOG_DEBUG */
 
-    if (task_config(task)->keep_temp_files) {
+    if (config->keep_temp_files) {
         msg->flags |= MMS_MESSAGE_FLAG_KEEP_FILES;
     }
 
@@ -203,38 +281,89 @@ mms_task_decode_retrieve_conf(
     }
 
     msg->parts_dir = g_build_filename(dir, MMS_PARTS_DIR, NULL);
-    for (i=0, entry = pdu->attachments; entry; entry = entry->next, i++) {
-        struct mms_attachment* attach = entry->data;
-        const char* name =  attach->content_location ?
-            attach->content_location : attach->content_id;
+    for (i=0; mms_message_attachment_iter_next(parts, &attach); i++) {
+        const char* name =  attach.content_location ?
+            attach.content_location : attach.content_id;
         char* path = NULL;
-        const char* file;
+        char* orig = NULL;
+        const char* part_file;
+        GMimeContentEncoding enc;
+        gboolean ok;
         if (name && name[0]) {
-            file = mms_task_decode_add_file_name(part_files, name);
+            part_file = mms_task_decode_add_file_name(part_files, name);
         } else {
             char* name = g_strdup_printf("part_%d",i);
-            file = mms_task_decode_add_file_name(part_files, name);
+            part_file = mms_task_decode_add_file_name(part_files, name);
             g_free(name);
         }
-        GDEBUG("Part: %s %s", name, attach->content_type);
-        GASSERT(attach->offset < pdu_size);
-        if (mms_write_file(msg->parts_dir, file, pdu_data + attach->offset,
-            attach->length, &path)) {
+        GDEBUG("Part: %s %s%s%s", name, attach.mimetype,
+            attach.charset ? ";charset=" : "",
+            attach.charset ? attach.charset : "");
+        enc = attach.transfer_encoding ?
+            g_mime_content_encoding_from_string(attach.transfer_encoding) :
+            GMIME_CONTENT_ENCODING_DEFAULT;
+        if (enc <= GMIME_CONTENT_ENCODING_BINARY && config->virtual_parts) {
+            /* The handler will read it straight from the PDU */
+            ok = TRUE;
+        } else if (!parts_dir &&
+            !(parts_dir = mms_task_decode_open_dir(config,
+            msg->parts_dir))) {
+            /* Storage problem */
+            ok = written = FALSE;
+        } else if (enc > GMIME_CONTENT_ENCODING_BINARY) {
+            /* The part actually needs some decoding */
+            ok = mms_task_decode_part(&attach, enc, parts_dir,
+                part_file, part_files, &path,
+                (msg->flags & MMS_MESSAGE_FLAG_KEEP_FILES) ? &orig : NULL,
+                &written);
+            if (ok && config->dedup) {
+                mms_store_intern(config->root_dir, path);
+            }
+#ifdef HAVE_LIBURING
+        } else if (!config->dedup &&
+            !mms_file_can_extract_in_kernel(config->root_dir, fd)) {
+            /*
+             * The file system has been found to support neither reflinks
+             * nor copy_file_range, and nothing is shared with the store.
+             * The data has to be copied anyway, io_uring writes them all
+             * at once. Without io_uring that's no better than writing
+             * them one by one.
+             */
+            GBytes* bytes = g_bytes_new_static(attach.data, attach.length);
+
+            if (!batch) {
+                batch = mms_file_batch_new(parts_dir, 0);
+            }
+            mms_file_batch_add(batch, part_file, bytes, &path);
+            g_bytes_unref(bytes);
+            ok = TRUE;
+#endif /* HAVE_LIBURING */
+        } else {
+            ok = mms_task_decode_extract(config, fd, &attach, parts_dir,
+                part_file, &path, &cloned, &copied);
+            if (!ok) {
+                /* Nothing to decode, so it's a storage problem too */
+                written = FALSE;
+            }
+        }
+        if (ok) {
             MMSMessagePart* part = g_new0(MMSMessagePart, 1);
             char* tmp = NULL;
-            char* id = attach->content_id ? g_strdup(attach->content_id) :
-                (tmp = g_strconcat("<", file, ">", NULL));
-            part->content_type = g_strdup(attach->content_type);
+            char* id = attach.content_id ? g_strdup(attach.content_id) :
+                (tmp = g_strconcat("<", part_file, ">", NULL));
+            part->content_type = attach.charset ?
+                g_strconcat(attach.mimetype, ";charset=",
+                    attach.charset, NULL) :
+                g_strdup(attach.mimetype);
             part->content_id = mms_task_decode_make_content_id(part_ids, id);
             part->file = path;
-            if (attach->transfer_encoding) {
-                GMimeContentEncoding enc =
-                    g_mime_content_encoding_from_string(
-                        attach->transfer_encoding);
-                if (enc > GMIME_CONTENT_ENCODING_BINARY) {
-                    /* The part actually needs some decoding */
-                    GDEBUG("Decoding %s", attach->transfer_encoding);
-                    mms_task_decode_part(part,enc,msg->parts_dir,part_files);
+            part->orig = orig;
+            if (!path) {
+                part->name = g_strdup(part_file);
+                part->offset = attach.offset;
+                part->length = attach.length;
+                if (!msg->pdu) {
+                    msg->pdu = g_strdup(file);
                 }
             }
             msg->parts = g_slist_append(msg->parts, part);
@@ -242,14 +371,85 @@ mms_task_decode_retrieve_conf(
         }
     }
 
+    if (batch) {
+        GError* error = NULL;
+
+        /* The data are still mapped, the iterator is not closed yet */
+        if (!mms_file_batch_commit(batch, &error)) {
+            GERR("%s", GERRMSG(error));
+            g_error_free(error);
+            written = FALSE;
+        }
+        mms_file_batch_free(batch);
+    }
+    mms_dir_close(parts_dir);
+    if (msg->pdu && config->sync == MMS_SYNC_FILE) {
+        /* The parts are going to be read from the PDU file */
+        char* pdu_path = g_path_get_dirname(msg->pdu);
+        char* pdu_file = g_path_get_basename(msg->pdu);
+        MMSDir* pdu_dir = mms_task_decode_open_dir(config, pdu_path);
+
+        if (pdu_dir) {
+            if (!mms_dir_sync_file(pdu_dir, pdu_file)) {
+                written = FALSE;
+            }
+            mms_dir_close(pdu_dir);
+        } else {
+            written = FALSE;
+        }
+        g_free(pdu_path);
+        g_free(pdu_file);
+    }
+    if (mms_message_attachment_iter_close(parts) && written) {
+        GDEBUG("%d part(s), %u bytes cloned, %u bytes copied by kernel", i,
+            (guint)cloned, (guint)copied);
+    } else {
+        /* This removes the files we have written so far */
+        GERR("Failed to decode message parts%s",
+            (parts->result == MMS_DECODE_ERROR_LIMIT) ?
+            " (limits exceeded)" : "");
+        if (!written) {
+            /* Storage problem, keep the PDU and try again later */
+            *io_error = TRUE;
+            g_free(msg->pdu);
+            msg->pdu = NULL;
+        }
+        mms_message_unref(msg);
+        msg = NULL;
+    }
+
     g_ptr_array_free(part_files, TRUE);
     g_ptr_array_free(part_ids, TRUE);
     g_free(dir);
     return msg;
 }
 
+/* Group commit, makes sure that the message survives a power loss */
 static
-void
+gboolean
+mms_task_decode_sync(
+    MMSTask* task,
+    MMSMessage* msg)
+{
+    gboolean ok = TRUE;
+
+    if (task_config(task)->sync == MMS_SYNC_MESSAGE) {
+        GError* error = NULL;
+        MMSDir* dir = mms_dir_open(msg->msg_dir, &error);
+
+        if (!dir || !mms_dir_sync(dir, &error)) {
+            GERR("%s", GERRMSG(error));
+            g_error_free(error);
+            ok = FALSE;
+        }
+        mms_dir_close(dir);
+    }
+    return ok;
+}
+
+/* Returns FALSE if the message couldn't be stored and needs another try */
+static
+gboolean
 mms_task_decode_process_pdu(
     MMSTaskDecode* dec,
     MMSPdu* pdu)
@@ -257,7 +457,11 @@ mms_task_decode_process_pdu(
     MMSTask* task = &dec->task;
     const void* data = g_mapped_file_get_contents(dec->map);
     const gsize len = g_mapped_file_get_length(dec->map);
-    if (mms_message_decode(data, len, pdu)) {
+    struct mms_message_attachment_iter parts;
+    struct mms_decode_limits limits;
+    mms_decode_limits_init(&limits, task_config(task));
+    if (mms_message_attachment_iter_init_full(&parts, data, len, pdu,
+        &limits)) {
         if (pdu->type == MMS_MESSAGE_TYPE_RETRIEVE_CONF) {
             struct mms_retrieve_conf* rc = &pdu->rc;
             /* Message-ID must be present only if the M-Retrieve.conf PDU
@@ -266,7 +470,27 @@ mms_task_decode_process_pdu(
                (rc->retrieve_status == 0 /* no status at all */ ||
                 rc->retrieve_status == MMS_MESSAGE_RETRIEVE_STATUS_OK)) {
                 MMSMessage* msg;
-                msg = mms_task_decode_retrieve_conf(task, pdu, data, len);
+                gboolean io_error = FALSE;
+                int fd = open(dec->file, O_RDONLY | O_BINARY);
+                msg = mms_task_decode_retrieve_conf(task, pdu, &parts,
+                    dec->file, fd, &io_error);
+                if (fd >= 0) close(fd);
+                if (msg && !mms_task_decode_sync(task, msg)) {
+                    /* Don't ack what may not be on disk, keep the PDU */
+                    g_free(msg->pdu);
+                    msg->pdu = NULL;
+                    mms_message_unref(msg);
+                    msg = NULL;
+                    io_error = TRUE;
+                }
+                if (io_error) {
+                    return FALSE;
+                }
+                if (msg && msg->pdu) {
+                    /* Now the message owns the PDU file */
+                    g_free(dec->file);
+                    dec->file = NULL;
+                }
                 if (msg) {
                     /* Successfully received and decoded MMS message */
                     mms_task_queue_and_unref(task->delegate,
@@ -276,7 +500,7 @@ mms_task_decode_process_pdu(
                         mms_task_publish_new(task->settings,
                             task->handler, msg));
                     mms_message_unref(msg);
-                    return;
+                    return TRUE;
                 }
             } else {
                 /* MMS server returned an error. Most likely, MMS message
@@ -285,11 +509,13 @@ mms_task_decode_process_pdu(
                 GERR("MMSC responded with %u", rc->retrieve_status);
                 mms_handler_message_receive_state_changed(task->handler,
                     task->id, MMS_RECEIVE_STATE_DOWNLOAD_ERROR);
-                return;
+                return TRUE;
             }
         } else {
             GERR("Unexpected MMS PDU type %u", (guint)pdu->type);
         }
+    } else if (parts.result == MMS_DECODE_ERROR_LIMIT) {
+        GERR("MMS PDU exceeds the decoding limits");
     } else {
         GERR("Failed to decode MMS PDU");
     }
@@ -300,6 +526,7 @@ mms_task_decode_process_pdu(
             MMS_MESSAGE_NOTIFY_STATUS_UNRECOGNISED));
     mms_handler_message_receive_state_changed(task->handler, task->id,
         MMS_RECEIVE_STATE_DECODING_ERROR);
+    return TRUE;
 }
 
 static
@@ -308,9 +535,17 @@ mms_task_decode_run(
     MMSTask* task)
 {
     MMSPdu* pdu = g_new0(MMSPdu, 1);
-    mms_task_decode_process_pdu(MMS_TASK_DECODE(task), pdu);
+    const gboolean done = mms_task_decode_process_pdu(MMS_TASK_DECODE(task),
+        pdu);
     mms_message_free(pdu);
-    mms_task_set_state(task, MMS_TASK_STATE_DONE);
+    if (done) {
+        mms_task_set_state(task, MMS_TASK_STATE_DONE);
+    } else {
+        /* The PDU is still there, decode it again later */
+        mms_handler_message_receive_state_changed(task->handler, task->id,
+            mms_task_retry(task) ? MMS_RECEIVE_STATE_DEFERRED :
+            MMS_RECEIVE_STATE_DOWNLOAD_ERROR);
+    }
 }
 
 static
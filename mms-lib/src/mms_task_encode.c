@@ -20,9 +20,11 @@
 #include "mms_settings.h"
 #include "mms_handler.h"
 #include "mms_file_util.h"
+#include "mms_store.h"
 #include "mms_transfer_list.h"
 #include "mms_util.h"
 #include "mms_codec.h"
+#include "mms_pdu_stream.h"
 
 #include <gio/gio.h>
 
@@ -46,6 +48,8 @@ typedef struct mms_task_encode {
     int nparts;
     MMSEncodeJob* active_job;
     MMSTransferList* transfers;
+    gboolean staged;
+    guint64 staging_size;
 } MMSTaskEncode;
 
 G_DEFINE_TYPE(MMSTaskEncode, mms_task_encode, MMS_TYPE_TASK);
@@ -55,6 +59,20 @@ G_DEFINE_TYPE(MMSTaskEncode, mms_task_encode, MMS_TYPE_TASK);
 
 /* Encoding job (runs on its own thread) */
 
+/* How many times to try predictive resizing before falling back */
+#define MMS_ENCODE_PLAN_ROUNDS  (2)
+
+/* Aim a bit lower than the limit */
+#define MMS_ENCODE_PLAN_MARGIN  (0.9)
+
+/*
+ * Memory which parallel resizing is allowed to use, and the expected
+ * size of the decoded image relative to the compressed file. A 12 MP
+ * photo is typically 3-4 MB as JPEG and 36 MB as RGB.
+ */
+#define MMS_ENCODE_RESIZE_MEMORY    (96*1024*1024)
+#define MMS_ENCODE_RESIZE_EXPANSION (10)
+
 typedef enum mms_encode_state {
     MMS_ENCODE_STATE_NONE,
     MMS_ENCODE_STATE_RUNNING,
@@ -68,11 +86,22 @@ typedef struct mms_encode_job {
     MMSTaskEncode* enc;             /* Associated task */
     GCancellable* cancellable;      /* Can be used to cancel the job */
     GMainContext* context;          /* Pointer to the main contex */
-    char* path;                     /* Path to the encoded file */
+    MMSPduStream* pdu;              /* Encoded message */
     MMSSettingsSimDataCopy* settings;  /* Copy of settings to use */
     MMS_ENCODE_STATE state;         /* Job state */
+    int encodes;                    /* Number of encoding attempts */
 } MMSEncodeJob;
 
+/* Attachments being resized in parallel */
+typedef struct mms_encode_resize {
+    MMSEncodeJob* job;
+    double ratio;
+    GMutex mutex;
+    GCond cond;
+    gsize memory;                   /* Estimated memory in use */
+    gboolean failed;
+} MMSEncodeResize;
+
 static
 void
 mms_task_encode_job_done(
@@ -87,28 +116,17 @@ mms_encode_job_resize(
     /* Resize the largest resizable attachment */
     MMSTaskEncode* enc = job->enc;
     MMSAttachment* resize_me = NULL;
-    unsigned int largest_size = 0;
+    gsize largest_size = 0;
     int i;
     GDEBUG("Message is too big, need to resize");
     for (i=0; i<enc->nparts; i++) {
         MMSAttachment* part = enc->parts[i];
-        if (part->flags & MMS_ATTACHMENT_RESIZABLE) {
-            const char* fname = part->file_name;
-            int fd = open(fname, O_RDONLY);
-            if (fd >= 0) {
-                struct stat st;
-                int err = fstat(fd, &st);
-                if (!err) {
-                    if (largest_size < (unsigned int)st.st_size) {
-                        largest_size = st.st_size;
-                        resize_me = part;
-                    }
-                } else {
-                    GERR("Can't stat %s: %s", fname, strerror(errno));
-                }
-                close(fd);
-            } else {
-                GERR("Can't open %s: %s", fname, strerror(errno));
+        /* The map always refers to the current file */
+        if ((part->flags & MMS_ATTACHMENT_RESIZABLE) && part->map) {
+            const gsize size = g_mapped_file_get_length(part->map);
+            if (largest_size < size) {
+                largest_size = size;
+                resize_me = part;
             }
         }
     }
@@ -123,85 +141,237 @@ mms_encode_job_resize(
 
 static
 gsize
-mms_encode_job_encode(
-    MMSEncodeJob* job)
+mms_encode_resize_memory(
+    MMSAttachment* part)
+{
+    const gsize size = part->map ? g_mapped_file_get_length(part->map) : 0;
+
+    return MIN(size, MMS_ENCODE_RESIZE_MEMORY/MMS_ENCODE_RESIZE_EXPANSION) *
+        MMS_ENCODE_RESIZE_EXPANSION;
+}
+
+/*
+ * Runs on a worker thread. Waits until there's enough memory for
+ * another image. One is always let through, no matter how large.
+ */
+static
+void
+mms_encode_resize_thread(
+    gpointer data,
+    gpointer user_data)
+{
+    MMSAttachment* part = data;
+    MMSEncodeResize* resize = user_data;
+    MMSEncodeJob* job = resize->job;
+    const gsize memory = mms_encode_resize_memory(part);
+    gboolean ok = FALSE;
+
+    g_mutex_lock(&resize->mutex);
+    while (resize->memory &&
+        (resize->memory + memory) > MMS_ENCODE_RESIZE_MEMORY) {
+        g_cond_wait(&resize->cond, &resize->mutex);
+    }
+    resize->memory += memory;
+    g_mutex_unlock(&resize->mutex);
+
+    if (!g_cancellable_is_cancelled(job->cancellable)) {
+        ok = mms_attachment_resize_ratio(part, &job->settings->data,
+            resize->ratio);
+    }
+
+    g_mutex_lock(&resize->mutex);
+    resize->memory -= memory;
+    if (!ok) resize->failed = TRUE;
+    g_cond_broadcast(&resize->cond);
+    g_mutex_unlock(&resize->mutex);
+}
+
+/*
+ * Resizes all resizable attachments by the same ratio, each one on its
+ * own thread. Returns when all of them are done.
+ */
+static
+gboolean
+mms_encode_job_resize_all(
+    MMSEncodeJob* job,
+    double ratio)
 {
     MMSTaskEncode* enc = job->enc;
-    gsize pdu_size = 0;
-    char* dir;
-    int fd;
-
-    g_free(job->path);
-    job->path = NULL;
-    dir = mms_task_dir(&enc->task);
-    fd = mms_create_file(dir, MMS_SEND_REQ_FILE, &job->path, NULL);
-    if (fd >= 0) {
-        int i;
-        gboolean ok;
-        char* start;
-        const int flags = enc->flags;
-        MMSPdu* mms = g_new0(MMSPdu, 1);
-        MMSAttachment* smil = enc->parts[0];
-
-        const char* ct[6];
-        ct[0] = "application/vnd.wap.multipart.related";
-        ct[1] = "start";
-        ct[2] = (start = g_strconcat("<", smil->content_id, ">", NULL));
-        ct[3] = "type";
-        ct[4] = SMIL_CONTENT_TYPE;
-        ct[5] = NULL;
-        GASSERT(smil->flags & MMS_ATTACHMENT_SMIL);
-
-        mms->type = MMS_MESSAGE_TYPE_SEND_REQ;
-        mms->version = MMS_VERSION;
-        mms->transaction_id = g_strdup(enc->task.id);
-        mms->sr.to = g_strdup(enc->to);
-        mms->sr.cc = g_strdup(enc->cc);
-        mms->sr.bcc = g_strdup(enc->bcc);
-        if (enc->subject && enc->subject[0]) {
-            mms->sr.subject = g_strdup(enc->subject);
+    MMSEncodeResize resize;
+    GThreadPool* pool = NULL;
+    guint i, count = 0;
+
+    for (i=0; i<(guint)enc->nparts; i++) {
+        if (enc->parts[i]->flags & MMS_ATTACHMENT_RESIZABLE) {
+            count++;
         }
-        mms->sr.dr = ((flags & MMS_SEND_FLAG_REQUEST_DELIVERY_REPORT) != 0);
-        mms->sr.rr = ((flags & MMS_SEND_FLAG_REQUEST_READ_REPORT) != 0);
-        mms->sr.content_type = mms_unparse_http_content_type((char**)ct);
-        for (i=0; i<enc->nparts; i++) {
-            MMSAttachment* part = enc->parts[i];
-            struct mms_attachment* at = g_new0(struct mms_attachment, 1);
-            at->content_type = g_strdup(part->content_type);
-            at->data = (void*)g_mapped_file_get_contents(part->map);
-            at->length = g_mapped_file_get_length(part->map);
-            at->content_id = g_strdup(part->content_id);
-            at->content_location = g_strdup(part->content_location);
-            mms->attachments = g_slist_append(mms->attachments, at);
+    }
+
+    memset(&resize, 0, sizeof(resize));
+    resize.job = job;
+    resize.ratio = ratio;
+    g_mutex_init(&resize.mutex);
+    g_cond_init(&resize.cond);
+
+    if (count > 1) {
+        /* Non-exclusive pools share threads with each other */
+        const guint max_threads = MIN(count, g_get_num_processors());
+        GError* error = NULL;
+
+        pool = g_thread_pool_new(mms_encode_resize_thread, &resize,
+            max_threads, FALSE, &error);
+        if (pool) {
+            GDEBUG("Resizing %u attachments on %u threads", count,
+                max_threads);
+        } else {
+            GWARN("%s", GERRMSG(error));
+            g_error_free(error);
         }
+    }
 
-        ok = mms_message_encode(mms, fd);
-        mms_message_free(mms);
-        g_free(start);
-
-        if (ok) {
-            struct stat st;
-            int err = fstat(fd, &st);
-            if (!err) {
-                pdu_size = st.st_size;
-                GDEBUG("Created %s (%d bytes)", job->path, (int)pdu_size);
-            } else {
-                GERR("Can't stat %s: %s", job->path, strerror(errno));
-                ok = FALSE;
+    for (i=0; i<(guint)enc->nparts; i++) {
+        MMSAttachment* part = enc->parts[i];
+        if (part->flags & MMS_ATTACHMENT_RESIZABLE) {
+            if (!pool || !g_thread_pool_push(pool, part, NULL)) {
+                mms_encode_resize_thread(part, &resize);
             }
-        } else {
-            GERR("Failed to encode message");
         }
+    }
+
+    if (pool) {
+        /* Wait for all of them to finish */
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+    GASSERT(!resize.memory);
+    g_mutex_clear(&resize.mutex);
+    g_cond_clear(&resize.cond);
+    return !resize.failed;
+}
+
+/*
+ * Estimates how much the resizable attachments need to shrink to fit
+ * into the limit and resizes all of them at once. Non-resizable parts
+ * and headers stay the same, so the budget is whatever they leave.
+ * The bytes per pixel ratio observed in the last encode is assumed
+ * to stay the same, which is a bit optimistic for smaller images,
+ * hence the margin.
+ */
+static
+gboolean
+mms_encode_job_plan(
+    MMSEncodeJob* job,
+    gsize size,
+    gsize size_limit)
+{
+    MMSTaskEncode* enc = job->enc;
+    gsize resizable = 0;
+    double ratio;
+    int i;
+
+    for (i=0; i<enc->nparts; i++) {
+        MMSAttachment* part = enc->parts[i];
+        if ((part->flags & MMS_ATTACHMENT_RESIZABLE) && part->map) {
+            resizable += g_mapped_file_get_length(part->map);
+        }
+    }
+
+    if (!resizable || resizable > size || (size - resizable) >= size_limit) {
+        GDEBUG("Nothing to plan");
+        return FALSE;
+    }
+
+    ratio = MMS_ENCODE_PLAN_MARGIN *
+        (size_limit - (size - resizable)) / resizable;
+    GDEBUG("Need to shrink %u bytes to %u%%", (guint)resizable,
+        (guint)(ratio * 100));
+    return mms_encode_job_resize_all(job, ratio);
+}
+
+static
+gsize
+mms_encode_job_encode(
+    MMSEncodeJob* job)
+{
+    int i;
+    char* start;
+    MMSTaskEncode* enc = job->enc;
+    const MMSConfig* config = task_config(&enc->task);
+    const int flags = enc->flags;
+    MMSPdu* mms = g_new0(MMSPdu, 1);
+    MMSAttachment* smil = enc->parts[0];
+    GBytes** data = g_new0(GBytes*, enc->nparts + 1);
+
+    const char* ct[6];
+    ct[0] = "application/vnd.wap.multipart.related";
+    ct[1] = "start";
+    ct[2] = (start = g_strconcat("<", smil->content_id, ">", NULL));
+    ct[3] = "type";
+    ct[4] = SMIL_CONTENT_TYPE;
+    ct[5] = NULL;
+    GASSERT(smil->flags & MMS_ATTACHMENT_SMIL);
+
+    mms_pdu_stream_unref(job->pdu);
+    job->pdu = NULL;
+    job->encodes++;
+
+    mms->type = MMS_MESSAGE_TYPE_SEND_REQ;
+    mms->version = MMS_VERSION;
+    mms->transaction_id = g_strdup(enc->task.id);
+    mms->sr.to = g_strdup(enc->to);
+    mms->sr.cc = g_strdup(enc->cc);
+    mms->sr.bcc = g_strdup(enc->bcc);
+    if (enc->subject && enc->subject[0]) {
+        mms->sr.subject = g_strdup(enc->subject);
+    }
+    mms->sr.dr = ((flags & MMS_SEND_FLAG_REQUEST_DELIVERY_REPORT) != 0);
+    mms->sr.rr = ((flags & MMS_SEND_FLAG_REQUEST_READ_REPORT) != 0);
+    mms->sr.content_type = mms_unparse_http_content_type((char**)ct);
+    for (i=0; i<enc->nparts; i++) {
+        MMSAttachment* part = enc->parts[i];
+        struct mms_attachment* at;
+        if (!part->map) {
+            GERR("No data for %s", part->original_file);
+            break;
+        }
+        at = g_new0(struct mms_attachment, 1);
+        /* GBytes keeps the mapping alive while the data is being sent */
+        data[i] = g_mapped_file_get_bytes(part->map);
+        at->content_type = g_strdup(part->content_type);
+        at->data = g_bytes_get_data(data[i], &at->length);
+        at->content_id = g_strdup(part->content_id);
+        at->content_location = g_strdup(part->content_location);
+        mms->attachments = g_slist_append(mms->attachments, at);
+    }
 
-        close(fd);
-        if (!ok && job->path) {
-            unlink(job->path);
-            g_free(job->path);
-            job->path = NULL;
+    /* Headers are encoded in memory, attachments are referenced */
+    if (i == enc->nparts) {
+        job->pdu = mms_pdu_stream_encode(mms, data);
+    }
+    mms_message_free(mms);
+    for (i=0; i<enc->nparts && data[i]; i++) g_bytes_unref(data[i]);
+    g_free(data);
+    g_free(start);
+
+    if (job->pdu) {
+        /* Save the PDU for debugging purposes */
+        if (config->keep_temp_files) {
+            char* dir = mms_task_dir(&enc->task);
+            char* path = NULL;
+            int fd = mms_create_file(dir, MMS_SEND_REQ_FILE, &path, NULL);
+            if (fd >= 0) {
+                if (mms_pdu_stream_write(job->pdu, fd)) {
+                    GDEBUG("Created %s", path);
+                }
+                close(fd);
+                g_free(path);
+            }
+            g_free(dir);
         }
+        return mms_pdu_stream_size(job->pdu);
+    } else {
+        GERR("Failed to encode message");
+        return 0;
     }
-    g_free(dir);
-    return pdu_size;
 }
 
 static
@@ -209,9 +379,10 @@ void
 mms_encode_job_run(
     MMSEncodeJob* job)
 {
-    int i;
+    int i, n;
     gsize size;
     MMSTaskEncode* enc = job->enc;
+    const gint64 start = g_get_monotonic_time();
     const unsigned int size_limit = job->settings ?
         job->settings->data.size_limit : MMS_SETTINGS_DEFAULT_SIZE_LIMIT;
 
@@ -222,8 +393,17 @@ mms_encode_job_run(
         mms_attachment_reset(enc->parts[i]);
     }
 
-    /* Keep resizing attachments until we squeeze them into the limit */
+    /* Try to get there in one or two steps */
     size = mms_encode_job_encode(job);
+    for (n=0; n<MMS_ENCODE_PLAN_ROUNDS && size_limit && size > size_limit &&
+         !g_cancellable_is_cancelled(job->cancellable) &&
+         mms_encode_job_plan(job, size, size_limit); n++) {
+        gsize last_size = size;
+        size = mms_encode_job_encode(job);
+        if (!size || size >= last_size) break;
+    }
+
+    /* Keep resizing attachments until we squeeze them into the limit */
     while (size_limit && size > size_limit &&
            !g_cancellable_is_cancelled(job->cancellable) &&
            mms_encode_job_resize(job)) {
@@ -232,14 +412,13 @@ mms_encode_job_run(
         if (!size || size >= last_size) break;
     }
 
+    GDEBUG("%d encode(s), %u bytes, %u ms", job->encodes, (guint)size, (guint)
+        ((g_get_monotonic_time() - start) / 1000));
     if (size > 0 && (!size_limit || size <= size_limit)) {
         job->state = MMS_ENCODE_STATE_DONE;
     } else {
-        if (job->path) {
-            unlink(job->path);
-        }
-        g_free(job->path);
-        job->path = NULL;
+        mms_pdu_stream_unref(job->pdu);
+        job->pdu = NULL;
         job->state = (size > 0) ? MMS_ENCODE_STATE_TOO_BIG :
             MMS_ENCODE_STATE_ERROR;
     }
@@ -269,7 +448,7 @@ mms_encode_job_unref(
             g_object_unref(job->cancellable);
             g_main_context_unref(job->context);
             mms_settings_sim_data_copy_free(job->settings);
-            g_free(job->path);
+            mms_pdu_stream_unref(job->pdu);
             g_free(job);
         }
     }
@@ -327,8 +506,11 @@ mms_task_encode_job_done(
         GVERBOSE_("Encoding completion state %d", job->state);
         enc->active_job = NULL;
         if (job->state == MMS_ENCODE_STATE_DONE) {
+            /* The staged files stay mapped until the send is done */
             mms_task_queue_and_unref(task->delegate,
-                mms_task_send_new(task, enc->transfers));
+                mms_task_send_new(task, enc->transfers, job->pdu,
+                enc->staging_size));
+            enc->staging_size = 0;
         } else {
             mms_handler_message_send_state_changed(task->handler, task->id,
                 (job->state == MMS_ENCODE_STATE_TOO_BIG) ?
@@ -342,16 +524,44 @@ mms_task_encode_job_done(
     }
 }
 
+static
+gboolean
+mms_task_encode_have_space(
+    MMSTaskEncode* enc)
+{
+    const MMSConfig* config = task_config(&enc->task);
+    guint64 size = 0;
+    int i;
+
+    /* Resized images shouldn't take more than the originals */
+    for (i=0; i<enc->nparts; i++) {
+        MMSAttachment* part = enc->parts[i];
+        if (part->map) size += g_mapped_file_get_length(part->map);
+    }
+    return mms_file_space_available(enc->staged ? config->staging_dir :
+        config->root_dir, size);
+}
+
 static
 void
 mms_task_encode_run(
     MMSTask* task)
 {
     MMSTaskEncode* enc = MMS_TASK_ENCODE(task);
-    MMSEncodeJob* job = mms_encode_job_new(enc);
+    MMSEncodeJob* job;
     GError* error = NULL;
     GThread* thread;
+
+    if (!mms_task_encode_have_space(enc)) {
+        /* Check again later, maybe something will get deleted */
+        mms_handler_message_send_state_changed(task->handler, task->id,
+            mms_task_retry(task) ? MMS_SEND_STATE_NO_SPACE :
+            MMS_SEND_STATE_SEND_ERROR, NULL);
+        return;
+    }
+
     /* Add one extra reference. mms_encode_job_done() will release it */
+    job = mms_encode_job_new(enc);
     mms_encode_job_ref(job);
     thread = g_thread_try_new(task->name, mms_encode_job_thread, job, &error);
     if (thread) {
@@ -450,30 +660,48 @@ GPtrArray*
 mms_task_encode_prepare_attachments(
     const MMSConfig* config,
     const char* dir,
+    gboolean staged,
     const MMSAttachmentInfo* parts,
     unsigned int nparts,
     GError** error)
 {
     unsigned int i;
     int smil_index = -1;
-    GPtrArray* array = g_ptr_array_sized_new(nparts);
+    GPtrArray* array;
+    MMSDir* out = mms_dir_open(dir, error);
+
+    if (!out) {
+        return NULL;
+    }
+
+    array = g_ptr_array_sized_new(nparts);
     for (i=0; i<nparts; i++) {
         const MMSAttachmentInfo* part = parts + i;
         MMSAttachment* attachment = NULL;
+        const char* file;
         char* path;
 
         G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
         path = mms_task_encode_generate_path(dir,
             g_basename(part->file_name), part->content_type);
+        file = g_basename(path);
         G_GNUC_END_IGNORE_DEPRECATIONS;
 
-        if (mms_copy_attachment(part, path, error)) {
+        /* The store lives in root_dir, hard links can't point there */
+        if ((config->dedup && !staged) ?
+            mms_store_write(config->root_dir, out, file, part->data,
+                part->size, NULL, error) :
+            mms_stage_attachment(staged ? config->staging_dir :
+                config->root_dir, part, out, file, error)) {
             MMSAttachmentInfo ai;
-            
+
             if (mms_attachment_info_path(&ai, path, part->content_type,
                 part->content_id, error)) {
                 attachment = mms_attachment_new(config, &ai, error);
                 if (attachment) {
+                    if (staged) {
+                        attachment->flags |= MMS_ATTACHMENT_STAGED;
+                    }
                     if (smil_index < 0 && (attachment->flags &
                         MMS_ATTACHMENT_SMIL)) {
                         smil_index = i;
@@ -489,6 +717,7 @@ mms_task_encode_prepare_attachments(
         g_free(path);
         if (!attachment) break;
     }
+    mms_dir_close(out);
 
     if (i == nparts) {
         /* Generate SMIL if necessary */
@@ -560,6 +789,18 @@ mms_task_encode_finalize(
         for (i=0; i<enc->nparts; i++) mms_attachment_unref(enc->parts[i]);
         g_free(enc->parts);
     }
+    if (enc->staged) {
+        const MMSConfig* config = task_config(&enc->task);
+        if (!config->keep_temp_files) {
+            char* dir = g_build_filename(config->staging_dir,
+                MMS_MESSAGE_DIR, enc->task.id, NULL);
+            rmdir(dir);
+            g_free(dir);
+        }
+        if (enc->staging_size) {
+            mms_file_staging_release(enc->staging_size);
+        }
+    }
     g_free(enc->to);
     g_free(enc->cc);
     g_free(enc->bcc);
@@ -604,18 +845,44 @@ mms_task_encode_new(
 {
     GASSERT(to && to[0]);
     if (to && to[0]) {
-        int err;
+        int i, err;
+        guint64 size = 0;
         char* dir;
+        const MMSConfig* config = settings->config;
         MMSTaskEncode* enc = mms_task_alloc(MMS_TYPE_TASK_ENCODE,
             settings, handler, "Encode", id, imsi);
         MMSTask* task = &enc->task;
 
         mms_task_make_id(task);
-        dir = mms_task_file(task, MMS_ENCODE_DIR);
+        for (i=0; i<nparts; i++) {
+            size += parts[i].size;
+        }
+
+        /*
+         * Copies of the attachments plus resized images. None of that
+         * needs to survive a restart, so it goes to the staging area
+         * if there's room for it there.
+         */
+        if (mms_file_staging_reserve(config, 2*size)) {
+            enc->staged = TRUE;
+            enc->staging_size = 2*size;
+            dir = g_build_filename(config->staging_dir, MMS_MESSAGE_DIR,
+                task->id, MMS_ENCODE_DIR, NULL);
+            GDEBUG("Staging %s", dir);
+        } else {
+            dir = mms_task_file(task, MMS_ENCODE_DIR);
+        }
         err = g_mkdir_with_parents(dir, MMS_DIR_PERM);
-        if (!err || errno == EEXIST) {
+        if (err && errno != EEXIST) {
+            MMS_ERROR(error, MMS_LIB_ERROR_IO,
+                "Failed to create directory %s: %s", dir, strerror(errno));
+        } else if (!enc->staged && !mms_file_space_available(dir, 2*size)) {
+            /* The task doesn't exist, the caller gets the error */
+            MMS_ERROR(error, MMS_LIB_ERROR_NOSPACE,
+                "Not enough space for %" G_GUINT64_FORMAT " bytes", size);
+        } else {
             GPtrArray* array = mms_task_encode_prepare_attachments(
-                settings->config, dir, parts, nparts, error);
+                config, dir, enc->staged, parts, nparts, error);
             if (array) {
                 enc->nparts = array->len;
                 enc->parts = (MMSAttachment**)g_ptr_array_free(array, FALSE);
@@ -630,9 +897,6 @@ mms_task_encode_new(
                 g_free(dir);
                 return &enc->task;
             }
-        } else {
-            MMS_ERROR(error, MMS_LIB_ERROR_IO,
-                "Failed to create directory %s: %s", dir, strerror(errno));
         }
         g_free(dir);
         mms_task_unref(task);
@@ -76,6 +76,7 @@ typedef struct mms_http_transfer {
     guint bytes_received;
     guint bytes_to_send;
     guint bytes_to_receive;
+    MMSPduStreamPos send_pos;
     gulong msg_signal_id[MMS_SOUP_MESSAGE_SIGNAL_COUNT];
 } MMSHttpTransfer;
 
@@ -84,11 +85,13 @@ struct mms_task_http_priv {
     MMSHttpTransfer* tx;
     char* uri;
     char* send_path;
+    MMSPduStream* send_pdu;
     char* receive_path;
     char* receive_file;
     char* transfer_type;
     MMS_HTTP_STATE transaction_state;
     MMS_CONNECTION_TYPE connection_type;
+    gboolean no_space;
 };
 
 G_DEFINE_TYPE(MMSTaskHttp, mms_task_http, MMS_TYPE_TASK)
@@ -350,7 +353,11 @@ mms_task_http_set_state(
             if (klass->fn_started) klass->fn_started(http);
             break;
         case MMS_HTTP_PAUSED:
-            if (klass->fn_paused) klass->fn_paused(http);
+            if (priv->no_space && klass->fn_no_space) {
+                klass->fn_no_space(http);
+            } else if (klass->fn_paused) {
+                klass->fn_paused(http);
+            }
             break;
         case MMS_HTTP_DONE:
             if (klass->fn_done) klass->fn_done(http, priv->receive_path, ss);
@@ -439,7 +446,22 @@ mms_task_http_write_next_chunk(
     }
 #endif
     GASSERT(tx && tx->message == msg);
-    if (tx && tx->message == msg) {
+    if (tx && tx->message == msg && priv->send_pdu) {
+        /* Attachment data is referenced, not copied */
+        GBytes* bytes = mms_pdu_stream_read(priv->send_pdu, &tx->send_pos,
+            MMS_HTTP_MAX_CHUNK);
+        if (bytes) {
+            gsize size;
+            const void* data = g_bytes_get_data(bytes, &size);
+            SoupBuffer* buf = soup_buffer_new_with_owner(data, size, bytes,
+                (GDestroyNotify)g_bytes_unref);
+            tx->bytes_sent += size;
+            soup_message_body_append_buffer(msg->request_body, buf);
+            soup_buffer_free(buf);
+            mms_task_http_send_progress(http);
+            return;
+        }
+    } else if (tx && tx->message == msg) {
         void* chunk = g_malloc(MMS_HTTP_MAX_CHUNK);
         int nbytes = read(tx->send_fd, chunk, MMS_HTTP_MAX_CHUNK);
         if (nbytes > 0) {
@@ -453,6 +475,16 @@ mms_task_http_write_next_chunk(
     soup_message_body_complete(msg->request_body);
 }
 
+static
+void
+mms_task_http_pause(
+    MMSTaskHttp* http)
+{
+    mms_task_http_finish_transfer(http);
+    mms_task_http_set_state(http, MMS_HTTP_PAUSED, 0);
+    mms_task_set_state(&http->task, MMS_TASK_STATE_SLEEP);
+}
+
 static
 void
 mms_task_http_got_headers(
@@ -471,7 +503,14 @@ mms_task_http_got_headers(
             GVERBOSE("Receiving %u bytes", tx->bytes_to_receive);
         }
 #endif
-        mms_task_http_receive_progress(http);
+        /* Better find out that it doesn't fit before we start */
+        if (!mms_file_reserve(tx->receive_fd, tx->bytes_to_receive)) {
+            GWARN("No space for %u bytes", tx->bytes_to_receive);
+            priv->no_space = TRUE;
+            mms_task_http_pause(http);
+        } else {
+            mms_task_http_receive_progress(http);
+        }
     }
 }
 
@@ -492,9 +531,8 @@ mms_task_http_got_chunk(
             mms_task_http_receive_progress(http);
         } else {
             GERR("Write error: %s", strerror(errno));
-            mms_task_http_finish_transfer(http);
-            mms_task_http_set_state(http, MMS_HTTP_PAUSED, 0);
-            mms_task_set_state(&http->task, MMS_TASK_STATE_SLEEP);
+            priv->no_space = (errno == ENOSPC || errno == EDQUOT);
+            mms_task_http_pause(http);
         }
     }
 }
@@ -509,11 +547,15 @@ mms_task_http_start(
     int receive_fd = -1;
     guint bytes_to_send = 0;
     MMSTaskHttpPriv* priv = http->priv;
+    const gboolean post = (priv->send_path || priv->send_pdu);
     GASSERT(mms_connection_is_open(connection));
     mms_task_http_finish_transfer(http);
+    priv->no_space = FALSE;
 
     /* Open the files */
-    if (priv->send_path) {
+    if (priv->send_pdu) {
+        bytes_to_send = mms_pdu_stream_size(priv->send_pdu);
+    } else if (priv->send_path) {
         send_fd = open(priv->send_path, O_RDONLY | O_BINARY);
         if (send_fd >= 0) {
             struct stat st;
@@ -544,12 +586,12 @@ mms_task_http_start(
 
     if ((!priv->send_path || send_fd >= 0) &&
         (!priv->receive_path || receive_fd >= 0) &&
-        (send_fd >= 0 || receive_fd >= 0)) {
+        (priv->send_pdu || send_fd >= 0 || receive_fd >= 0)) {
 
         /* Set up the transfer */
         const char* uri = priv->uri ? priv->uri : connection->mmsc;
         priv->tx = mms_http_transfer_new(mms_task_sim_settings(&http->task),
-            connection, priv->send_path ? SOUP_METHOD_POST : SOUP_METHOD_GET,
+            connection, post ? SOUP_METHOD_POST : SOUP_METHOD_GET,
             uri, receive_fd, send_fd);
         if (priv->tx) {
             MMSHttpTransfer* tx = priv->tx;
@@ -557,7 +599,7 @@ mms_task_http_start(
             soup_message_body_set_accumulate(msg->response_body, FALSE);
 
             /* If we have data to send */
-            if (priv->send_path) {
+            if (post) {
                 tx->bytes_to_send = bytes_to_send;
                 soup_message_headers_set_content_type(
                     msg->request_headers,
@@ -587,7 +629,14 @@ mms_task_http_start(
 
             /* Start the transfer */
 #if GUTIL_LOG_DEBUG
-            if (priv->send_path) {
+            if (priv->send_pdu) {
+                if (priv->receive_path) {
+                    GDEBUG("PDU (%u bytes) -> %s -> %s", bytes_to_send, uri,
+                        priv->receive_path);
+                } else {
+                    GDEBUG("PDU (%u bytes) -> %s", bytes_to_send, uri);
+                }
+            } else if (priv->send_path) {
                 if (priv->receive_path) {
                     GDEBUG("%s (%u bytes) -> %s -> %s", priv->send_path,
                         bytes_to_send, uri, priv->receive_path);
@@ -706,6 +755,7 @@ mms_task_http_finalize(
     g_free(priv->transfer_type);
     g_free(priv->send_path);
     g_free(priv->receive_path);
+    mms_pdu_stream_unref(priv->send_pdu);
     g_free(priv->receive_file);
     mms_transfer_list_unref(http->transfers);
     G_OBJECT_CLASS(mms_task_http_parent_class)->finalize(object);
@@ -789,6 +839,23 @@ mms_task_http_alloc_with_parent(
         send_file, MMS_CONNECTION_TYPE_AUTO);
 }
 
+void*
+mms_task_http_alloc_with_pdu(
+    GType type,                 /* Zero for MMS_TYPE_TASK_HTTP       */
+    MMSTask* parent,            /* Parent task                       */
+    MMSTransferList* transfers, /* Transfer list                     */
+    const char* name,           /* Task name                         */
+    const char* uri,            /* NULL to use MMSC URL              */
+    const char* receive_file,   /* File to write data to (optional)  */
+    MMSPduStream* send_pdu)     /* Data to send                      */
+{
+    MMSTaskHttp* http = mms_task_http_alloc_with_parent(type, parent,
+        transfers, name, uri, receive_file, NULL);
+    GASSERT(send_pdu);
+    http->priv->send_pdu = mms_pdu_stream_ref(send_pdu);
+    return http;
+}
+
 /*
  * Local Variables:
  * mode: C
@@ -43,6 +43,7 @@ typedef struct mms_task_http_class {
     MMSTaskClass task;
     void (*fn_started)(MMSTaskHttp* task);
     void (*fn_paused)(MMSTaskHttp* task);
+    void (*fn_no_space)(MMSTaskHttp* task);
     void (*fn_done)(MMSTaskHttp* task, const char* path, SoupStatus status);
 } MMSTaskHttpClass;
 
@@ -77,6 +78,17 @@ mms_task_http_alloc_with_parent(
     const char* receive_file,   /* File to write data to (optional)  */
     const char* send_file);     /* File to read data from (optional) */
 
+/* POSTs the PDU which has been encoded in memory */
+void*
+mms_task_http_alloc_with_pdu(
+    GType type,                 /* Zero for MMS_TYPE_TASK_HTTP       */
+    MMSTask* parent,            /* Parent task                       */
+    MMSTransferList* transfers, /* Transfer list                     */
+    const char* name,           /* Task name                         */
+    const char* uri,            /* NULL to use MMSC URL              */
+    const char* receive_file,   /* File to write data to (optional)  */
+    MMSPduStream* send_pdu);    /* Data to send                      */
+
 #endif /* JOLLA_MMS_TASK_HTTP_H */
 
 /*
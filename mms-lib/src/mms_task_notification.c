@@ -380,8 +380,9 @@ mms_task_notification_new(
     GBytes* bytes,
     GError** error)
 {
-    MMSPdu* pdu = mms_decode_bytes(bytes);
+    MMSPdu* pdu;
     GASSERT(!error || !(*error));
+    pdu = mms_decode_bytes(settings->config, bytes, error);
     if (pdu) {
         MMSTaskNotification* ind;
 
@@ -401,7 +402,6 @@ mms_task_notification_new(
         ind->pdu = pdu;
         return &ind->task;
     } else {
-        MMS_ERROR(error, MMS_LIB_ERROR_DECODE, "Failed to decode MMS PDU");
         mms_task_notification_unrecornized(settings->config, bytes);
         return NULL;
     }
@@ -29,6 +29,7 @@ typedef MMSTaskHttpClass MMSTaskRetrieveClass;
 typedef struct mms_task_retrieve {
     MMSTaskHttp http;
     char* transaction_id;
+    guint size;
 } MMSTaskRetrieve;
 
 G_DEFINE_TYPE(MMSTaskRetrieve, mms_task_retrieve, MMS_TYPE_TASK_HTTP)
@@ -54,6 +55,15 @@ mms_task_retrieve_paused(
         http->task.id, MMS_RECEIVE_STATE_DEFERRED);
 }
 
+static
+void
+mms_task_retrieve_no_space(
+    MMSTaskHttp* http)
+{
+    mms_handler_message_receive_state_changed(http->task.handler,
+        http->task.id, MMS_RECEIVE_STATE_NOSPACE);
+}
+
 static
 void
 mms_task_retrieve_done(
@@ -74,6 +84,29 @@ mms_task_retrieve_done(
         http->task.id, state);
 }
 
+static
+void
+mms_task_retrieve_run(
+    MMSTask* task)
+{
+    MMSTaskRetrieve* retrieve = MMS_TASK_RETRIEVE(task);
+    const MMSConfig* config = task_config(task);
+    guint64 need = retrieve->size;
+
+    /* Unless the parts stay in the PDU, they take the same space again */
+    if (!config->virtual_parts) {
+        need *= 2;
+    }
+    if (mms_file_space_available(config->root_dir, need)) {
+        MMS_TASK_CLASS(mms_task_retrieve_parent_class)->fn_run(task);
+    } else {
+        /* Check again later, maybe something will get deleted */
+        mms_handler_message_receive_state_changed(task->handler, task->id,
+            mms_task_retry(task) ? MMS_RECEIVE_STATE_NOSPACE :
+            MMS_RECEIVE_STATE_DOWNLOAD_ERROR);
+    }
+}
+
 /**
  * Final stage of deinitialization
  */
@@ -95,8 +128,10 @@ void
 mms_task_retrieve_class_init(
     MMSTaskRetrieveClass* klass)
 {
+    klass->task.fn_run = mms_task_retrieve_run;
     klass->fn_started = mms_task_retrieve_started;
     klass->fn_paused = mms_task_retrieve_paused;
+    klass->fn_no_space = mms_task_retrieve_no_space;
     klass->fn_done = mms_task_retrieve_done;
     G_OBJECT_CLASS(klass)->finalize = mms_task_retrieve_finalize;
 }
@@ -136,6 +171,7 @@ mms_task_retrieve_new(
             retrieve->http.task.deadline = pdu->ni.expiry;
         }
         retrieve->transaction_id = g_strdup(pdu->transaction_id);
+        retrieve->size = pdu->ni.size;
         return &retrieve->http.task;
     } else {
         MMS_ERROR(error, MMS_LIB_ERROR_EXPIRED, "Message already expired");
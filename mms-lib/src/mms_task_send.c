@@ -26,7 +26,10 @@ GLOG_MODULE_DEFINE2("mms-task-send", MMS_TASK_HTTP_LOG);
 
 /* Class definition */
 typedef MMSTaskHttpClass MMSTaskSendClass;
-typedef MMSTaskHttp MMSTaskSend;
+typedef struct mms_task_send {
+    MMSTaskHttp http;
+    guint64 staging_size;
+} MMSTaskSend;
 
 G_DEFINE_TYPE(MMSTaskSend, mms_task_send, MMS_TYPE_TASK_HTTP)
 #define MMS_TYPE_TASK_SEND (mms_task_send_get_type())
@@ -117,6 +120,20 @@ mms_task_send_done(
     if (pdu) mms_message_free(pdu);
 }
 
+static
+void
+mms_task_send_finalize(
+    GObject* object)
+{
+    const guint64 staging_size = MMS_TASK_SEND(object)->staging_size;
+
+    /* The PDU maps the staged files, they are gone after that */
+    G_OBJECT_CLASS(mms_task_send_parent_class)->finalize(object);
+    if (staging_size) {
+        mms_file_staging_release(staging_size);
+    }
+}
+
 /**
  * Per class initializer
  */
@@ -128,6 +145,7 @@ mms_task_send_class_init(
     klass->fn_started = mms_task_send_started;
     klass->fn_paused = mms_task_send_paused;
     klass->fn_done = mms_task_send_done;
+    G_OBJECT_CLASS(klass)->finalize = mms_task_send_finalize;
 }
 
 /**
@@ -140,15 +158,23 @@ mms_task_send_init(
 {
 }
 
-/* Create MMS send task */
+/*
+ * Create MMS send task. The task takes over the staging reservation
+ * (if any) and releases it when it no longer needs the PDU.
+ */
 MMSTask*
 mms_task_send_new(
     MMSTask* parent,
-    MMSTransferList* transfers)
+    MMSTransferList* transfers,
+    MMSPduStream* pdu,
+    guint64 staging_size)
 {
-    return mms_task_http_alloc_with_parent(MMS_TYPE_TASK_SEND, parent,
-        transfers, MMS_TRANSFER_TYPE_SEND, NULL, MMS_SEND_CONF_FILE,
-        MMS_SEND_REQ_FILE);
+    MMSTaskSend* send = mms_task_http_alloc_with_pdu(MMS_TYPE_TASK_SEND,
+        parent, transfers, MMS_TRANSFER_TYPE_SEND, NULL, MMS_SEND_CONF_FILE,
+        pdu);
+
+    send->staging_size = staging_size;
+    return &send->http.task;
 }
 
 /*
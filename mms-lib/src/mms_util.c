@@ -15,6 +15,8 @@
 
 #include "mms_util.h"
 #include "mms_codec.h"
+#include "mms_error.h"
+#include "mms_settings.h"
 
 /**
  * Strips leading spaces and "/TYPE=" suffix from the string.
@@ -89,24 +91,56 @@ mms_address_normalize(
     return NULL;
 }
 
+/**
+ * Fills in the decoder limits from the configuration.
+ */
+void
+mms_decode_limits_init(
+    struct mms_decode_limits* limits,
+    const MMSConfig* config)
+{
+    memset(limits, 0, sizeof(*limits));
+    if (config) {
+        limits->max_headers = config->max_headers;
+        limits->max_parts = config->max_parts;
+        limits->max_text = config->max_text;
+        limits->max_time_ms = config->decode_ms;
+    }
+}
+
 /**
  * Allocates and decodes WAP push PDU. Returns NULL if decoding fails.
  */
 MMSPdu*
 mms_decode_bytes(
-    GBytes* bytes)
+    const MMSConfig* config,
+    GBytes* bytes,
+    GError** error)
 {
-    MMSPdu* pdu = NULL;
     if (bytes) {
         gsize len = 0;
         const guint8* data = g_bytes_get_data(bytes, &len);
-        pdu = g_new0(MMSPdu, 1);
-        if (!mms_message_decode(data, len, pdu)) {
-            mms_message_free(pdu);
-            pdu = NULL;
+        struct mms_decode_limits limits;
+        MMSPdu* pdu = g_new0(MMSPdu, 1);
+
+        mms_decode_limits_init(&limits, config);
+        switch (mms_message_decode_full(data, len, pdu, &limits)) {
+        case MMS_DECODE_OK:
+            return pdu;
+        case MMS_DECODE_ERROR_LIMIT:
+            MMS_ERROR(error, MMS_LIB_ERROR_DECODE_LIMIT,
+                "MMS PDU exceeds the decoding limits");
+            break;
+        case MMS_DECODE_ERROR_FORMAT:
+            MMS_ERROR(error, MMS_LIB_ERROR_DECODE,
+                "Failed to decode MMS PDU");
+            break;
         }
+        mms_message_free(pdu);
+    } else {
+        MMS_ERROR(error, MMS_LIB_ERROR_DECODE, "No MMS PDU");
     }
-    return pdu;
+    return NULL;
 }
 
 /*
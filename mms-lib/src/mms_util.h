@@ -30,9 +30,18 @@ char*
 mms_address_normalize(
     const char* address);
 
+struct mms_decode_limits;
+
+void
+mms_decode_limits_init(
+    struct mms_decode_limits* limits,
+    const MMSConfig* config);
+
 MMSPdu*
 mms_decode_bytes(
-    GBytes* bytes);
+    const MMSConfig* config,
+    GBytes* bytes,
+    GError** error);
 
 /* NULL-resistant variant of g_strstrip */
 static inline char* mms_strip(char* str)
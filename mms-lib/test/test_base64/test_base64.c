@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "test_util.h"
+
+#include "mms_lib_util.h"
+#include "mms_file_util.h"
+#include "mms_base64.h"
+
+#include <gutil_log.h>
+
+#define RANDOM_ROUNDS (200)
+#define BENCHMARK_SIZE (4*1024*1024)
+#define BENCHMARK_ROUNDS (10)
+
+static TestOpt test_opt;
+
+typedef struct test_decode_desc {
+    const char* name;
+    const char* in;
+    const char* out;
+    gsize out_len;
+} TestDecodeDesc;
+
+static const TestDecodeDesc decode_tests[] = {
+    { "Empty", "", "", 0 },
+    { "Pad2", "Zg==", "f", 1 },
+    { "Pad1", "Zm8=", "fo", 2 },
+    { "Pad0", "Zm9v", "foo", 3 },
+    { "Incomplete", "Zm9vYg", "foo", 3 },
+    { "Long", "QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVo=",
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ", 26 },
+    { "Binary", "AP8Q7w==", "\x00\xff\x10\xef", 4 },
+    { "CRLF", "QUJDREVG\r\nR0hJSktM\r\nTU5PUFFS\r\nU1RVVldY\r\nWVo=\r\n",
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ", 26 },
+    { "Spaces", " QUJD REVG\tR0hJ SktM TU5P UFFS U1RV VldY WVo= ",
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ", 26 },
+    { "Garbage", "Zm9v!!Zm9v", "foofoo", 6 }
+};
+
+static
+gsize
+test_gmime_decode(
+    GMimeContentEncoding enc,
+    const void* in,
+    gsize len,
+    void* out)
+{
+    GMimeEncoding state;
+    gsize n;
+
+    g_mime_encoding_init_decode(&state, enc);
+    n = g_mime_encoding_step(&state, in, len, out);
+    return n + g_mime_encoding_flush(&state, NULL, 0, (char*)out + n);
+}
+
+static
+char*
+test_base64_encode(
+    const void* data,
+    gsize len)
+{
+    GString* buf = g_string_new(NULL);
+    char* b64 = g_base64_encode(data, len);
+    const char* ptr = b64;
+    gsize left = strlen(b64);
+
+    /* Split it into MIME lines */
+    while (left > 76) {
+        g_string_append_len(buf, ptr, 76);
+        g_string_append(buf, "\r\n");
+        ptr += 76;
+        left -= 76;
+    }
+    g_string_append_len(buf, ptr, left);
+    g_free(b64);
+    return g_string_free(buf, FALSE);
+}
+
+/*==========================================================================*
+ * Decode
+ *==========================================================================*/
+
+static
+void
+test_decode(
+    gconstpointer data)
+{
+    const TestDecodeDesc* test = data;
+    const gsize len = strlen(test->in);
+    guint8* out = g_malloc(MMS_BASE64_DECODED_MAX(len) + 1);
+
+    g_assert_cmpuint(mms_base64_decode(test->in, len, out), == ,
+        test->out_len);
+    g_assert(!memcmp(out, test->out, test->out_len));
+    g_free(out);
+}
+
+/*==========================================================================*
+ * Random
+ *==========================================================================*/
+
+static
+void
+test_random(
+    void)
+{
+    GRand* rand = g_rand_new_with_seed(1234);
+    guint k;
+
+    for (k = 0; k < RANDOM_ROUNDS; k++) {
+        const gsize size = g_rand_int_range(rand, 0, 4096);
+        guint8* in = g_malloc(size + 1);
+        char* b64;
+        guint8* out;
+        guint8* out2;
+        gsize i, len, max;
+
+        for (i = 0; i < size; i++) {
+            in[i] = (guint8)g_rand_int(rand);
+        }
+
+        /* Every other one without line breaks */
+        if (k & 1) {
+            b64 = test_base64_encode(in, size);
+        } else {
+            b64 = g_base64_encode(in, size);
+        }
+
+        /* Compare against GMime */
+        len = strlen(b64);
+        max = MMS_BASE64_DECODED_MAX(len) + 4;
+        out = g_malloc(max);
+        out2 = g_malloc(max);
+        g_assert_cmpuint(mms_base64_decode(b64, len, out), == ,size);
+        g_assert_cmpuint(test_gmime_decode(GMIME_CONTENT_ENCODING_BASE64,
+            b64, len, out2), == ,size);
+        g_assert(!memcmp(out, in, size));
+        g_assert(!memcmp(out2, in, size));
+        g_free(out);
+        g_free(out2);
+        g_free(b64);
+        g_free(in);
+    }
+    g_rand_free(rand);
+}
+
+/*==========================================================================*
+ * File
+ *==========================================================================*/
+
+static
+void
+test_file(
+    void)
+{
+    static const char qp[] = "caf=C3=A9 au=\r\n lait";
+    static const char b64[] = "Y2Fmw6kgYXUgbGFpdA==";
+    static const char text[] = "caf\xc3\xa9 au lait";
+    char* dir = g_dir_make_tmp("test_base64_XXXXXX", NULL);
+    char* busy = g_build_filename(dir, "busy", NULL);
+    MMSDir* out = mms_dir_open(dir, NULL);
+    GError* error = NULL;
+    gchar* contents = NULL;
+    char* file = NULL;
+    gsize len = 0;
+
+    g_assert(out);
+    g_assert(mms_file_decode(b64, strlen(b64), out, "part",
+        GMIME_CONTENT_ENCODING_BASE64, &file, NULL));
+    g_assert(g_file_get_contents(file, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,strlen(text));
+    g_assert(!memcmp(contents, text, len));
+    g_free(contents);
+    g_free(file);
+    file = NULL;
+
+    g_assert(mms_file_decode(qp, strlen(qp), out, "part",
+        GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE, &file, NULL));
+    g_assert(g_file_get_contents(file, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,strlen(text));
+    g_assert(!memcmp(contents, text, len));
+    g_free(contents);
+
+    /* Destination can't be replaced */
+    g_assert(!mkdir(busy, 0700));
+    g_assert(!mms_file_decode(b64, strlen(b64), out, "busy",
+        GMIME_CONTENT_ENCODING_BASE64, NULL, &error));
+    g_assert(error);
+    g_error_free(error);
+
+    mms_dir_close(out);
+    unlink(file);
+    rmdir(busy);
+    rmdir(dir);
+    g_free(file);
+    g_free(busy);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Benchmark
+ *==========================================================================*/
+
+static
+void
+test_benchmark(
+    void)
+{
+    GRand* rand = g_rand_new_with_seed(5678);
+    guint8* in = g_malloc(BENCHMARK_SIZE);
+    guint8* out;
+    char* b64;
+    gint64 start, usec;
+    gsize i, len;
+
+    for (i = 0; i < BENCHMARK_SIZE; i++) {
+        in[i] = (guint8)g_rand_int(rand);
+    }
+    b64 = test_base64_encode(in, BENCHMARK_SIZE);
+    len = strlen(b64);
+    out = g_malloc(MMS_BASE64_DECODED_MAX(len));
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCHMARK_ROUNDS; i++) {
+        g_assert_cmpuint(mms_base64_decode(b64, len, out), == ,
+            BENCHMARK_SIZE);
+    }
+    usec = MAX(g_get_monotonic_time() - start, 1);
+    g_assert(!memcmp(in, out, BENCHMARK_SIZE));
+    GDEBUG("mms_base64_decode: %u MB/s", (guint)
+        ((gint64)len * BENCHMARK_ROUNDS / usec));
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCHMARK_ROUNDS; i++) {
+        g_assert_cmpuint(test_gmime_decode(GMIME_CONTENT_ENCODING_BASE64,
+            b64, len, out), == ,BENCHMARK_SIZE);
+    }
+    usec = MAX(g_get_monotonic_time() - start, 1);
+    GDEBUG("g_mime_encoding_step: %u MB/s", (guint)
+        ((gint64)len * BENCHMARK_ROUNDS / usec));
+
+    g_free(b64);
+    g_free(out);
+    g_free(in);
+    g_rand_free(rand);
+}
+
+#define TEST_(x) "/Base64/" x
+
+int main(int argc, char* argv[])
+{
+    int ret;
+    guint i;
+
+    mms_lib_init(argv[0]);
+    g_test_init(&argc, &argv, NULL);
+    test_init(&test_opt, &argc, argv);
+    for (i = 0; i < G_N_ELEMENTS(decode_tests); i++) {
+        const TestDecodeDesc* test = decode_tests + i;
+        char* name = g_strdup_printf(TEST_("Decode/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_decode);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("Random"), test_random);
+    g_test_add_func(TEST_("File"), test_file);
+    g_test_add_func(TEST_("Benchmark"), test_benchmark);
+    ret = g_test_run();
+    mms_lib_deinit();
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
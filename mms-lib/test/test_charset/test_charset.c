@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "test_util.h"
+
+#include "mms_lib_util.h"
+#include "mms_charset.h"
+#include "mms_codec.h"
+
+#include <gutil_log.h>
+
+#define CODEC_DATA_DIR "../test_mms_codec/data"
+#define BENCHMARK_ROUNDS (100)
+#define THREAD_COUNT (4)
+#define THREAD_ROUNDS (1000)
+
+static TestOpt test_opt;
+
+typedef struct test_convert_desc {
+    const char* name;
+    const char* from;
+    const char* in;
+    gsize in_len;
+    const char* out;
+} TestConvertDesc;
+
+static const char latin1_in[] = { 'c', 'a', 'f', 0xe9 };
+static const char ucs2_in[] = { 0, 'a', 0, 'b', 0, 'c' };
+static const char koi8_in[] = { 0xf0, 0xd2, 0xc9, 0xd7, 0xc5, 0xd4 };
+
+static const TestConvertDesc convert_tests[] = {
+    { "Ascii", "US-ASCII", "abc", 3, "abc" },
+    { "AsciiLatin1", "ISO-8859-1", "abc", 3, "abc" },
+    { "Latin1", "ISO-8859-1", latin1_in, sizeof(latin1_in), "caf\xc3\xa9" },
+    { "Ucs2", "UTF-16BE", ucs2_in, sizeof(ucs2_in), "abc" },
+    { "Koi8", "KOI8-R", koi8_in, sizeof(koi8_in),
+      "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82" },
+    { "Unsupported", "no-such-charset", latin1_in, sizeof(latin1_in), NULL }
+};
+
+/*==========================================================================*
+ * IsAscii
+ *==========================================================================*/
+
+static
+void
+test_is_ascii(
+    void)
+{
+    guint8 buf[128];
+    gsize len, off, i;
+
+    /* Different alignments and lengths to hit all the code paths */
+    memset(buf, 'a', sizeof(buf));
+    for (off = 1; off < 16; off++) {
+        for (len = 0; len < sizeof(buf) - 16; len++) {
+            g_assert(mms_charset_is_ascii(buf + off, len));
+            buf[off - 1] = 0x80;
+            buf[off + len] = 0x80;
+            g_assert(mms_charset_is_ascii(buf + off, len));
+            for (i = 0; i < len; i++) {
+                buf[off + i] = 0xff;
+                g_assert(!mms_charset_is_ascii(buf + off, len));
+                buf[off + i] = 'a';
+            }
+            buf[off - 1] = 'a';
+            buf[off + len] = 'a';
+        }
+    }
+}
+
+/*==========================================================================*
+ * Compatible
+ *==========================================================================*/
+
+static
+void
+test_compatible(
+    void)
+{
+    g_assert(mms_charset_is_ascii_compatible("us-ascii"));
+    g_assert(mms_charset_is_ascii_compatible("UTF-8"));
+    g_assert(mms_charset_is_ascii_compatible("ISO-8859-15"));
+    g_assert(mms_charset_is_ascii_compatible("windows-1251"));
+    g_assert(mms_charset_is_ascii_compatible("Big5"));
+    g_assert(!mms_charset_is_ascii_compatible(NULL));
+    g_assert(!mms_charset_is_ascii_compatible("UTF-16"));
+    g_assert(!mms_charset_is_ascii_compatible("ISO-10646-UCS-2"));
+    g_assert(!mms_charset_is_ascii_compatible("shift_JIS"));
+    g_assert(!mms_charset_is_ascii_compatible("ISO-2022-JP"));
+    g_assert(!mms_charset_is_ascii_compatible("UTF-7"));
+}
+
+/*==========================================================================*
+ * Convert
+ *==========================================================================*/
+
+static
+void
+test_convert(
+    gconstpointer data)
+{
+    const TestConvertDesc* test = data;
+    GError* error = NULL;
+    gsize len = 0;
+    int i;
+
+    /* Second time around it's using the cached descriptor */
+    for (i = 0; i < 2; i++) {
+        char* out = mms_charset_convert(test->in, test->in_len, "UTF-8",
+            test->from, NULL, &len, &error);
+
+        if (test->out) {
+            g_assert(out);
+            g_assert(!error);
+            g_assert_cmpuint(len, == ,strlen(test->out));
+            g_assert_cmpstr(out, == ,test->out);
+            g_free(out);
+        } else {
+            g_assert(!out);
+            g_assert(error);
+            g_clear_error(&error);
+        }
+    }
+    mms_charset_cache_clear();
+}
+
+static
+void
+test_convert_partial(
+    void)
+{
+    /* The last UTF-16 character is cut in half */
+    static const char in[] = { 0, 'a', 0, 'b', 0 };
+    GError* error = NULL;
+    gsize used = 0, len = 0;
+    char* out;
+
+    /* Like g_convert, tolerates it if the caller wants to know */
+    out = mms_charset_convert(in, sizeof(in), "UTF-8", "UTF-16BE",
+        &used, &len, &error);
+    g_assert(!error);
+    g_assert_cmpstr(out, == ,"ab");
+    g_assert_cmpuint(used, == ,4);
+    g_assert_cmpuint(len, == ,2);
+    g_free(out);
+
+    /* Otherwise it's an error */
+    g_assert(!mms_charset_convert(in, sizeof(in), "UTF-8", "UTF-16BE",
+        NULL, &len, &error));
+    g_assert(g_error_matches(error, G_CONVERT_ERROR,
+        G_CONVERT_ERROR_PARTIAL_INPUT));
+    g_clear_error(&error);
+    mms_charset_cache_clear();
+}
+
+/*==========================================================================*
+ * ConvertToFd
+ *==========================================================================*/
+
+static
+void
+test_convert_to_fd(
+    gconstpointer data)
+{
+    const TestConvertDesc* test = data;
+    GError* error = NULL;
+    char* path = NULL;
+    int fd = g_file_open_tmp("test_charset_XXXXXX", &path, &error);
+    gsize len = 0;
+    char* out = NULL;
+
+    g_assert(fd >= 0);
+    if (test->out) {
+        g_assert(mms_charset_convert_to_fd(test->in, test->in_len, "UTF-8",
+            test->from, fd, &len, &error));
+        g_assert(!error);
+        g_assert_cmpuint(len, == ,strlen(test->out));
+        g_assert(g_file_get_contents(path, &out, &len, NULL));
+        g_assert_cmpuint(len, == ,strlen(test->out));
+        g_assert_cmpstr(out, == ,test->out);
+        g_free(out);
+    } else {
+        g_assert(!mms_charset_convert_to_fd(test->in, test->in_len, "UTF-8",
+            test->from, fd, &len, &error));
+        g_assert(error);
+        g_assert_cmpuint(len, == ,0);
+        g_clear_error(&error);
+    }
+    close(fd);
+    unlink(path);
+    g_free(path);
+    mms_charset_cache_clear();
+}
+
+static
+void
+test_convert_to_fd_large(
+    void)
+{
+    /* Much more than one chunk, in both directions */
+    const gsize n = 100000;
+    char* latin1 = g_malloc(n * sizeof(latin1_in));
+    char* path = NULL;
+    int fd = g_file_open_tmp("test_charset_XXXXXX", &path, NULL);
+    char* utf8 = NULL;
+    char* back = NULL;
+    gsize i, len = 0;
+
+    for (i = 0; i < n; i++) {
+        memcpy(latin1 + i * sizeof(latin1_in), latin1_in, sizeof(latin1_in));
+    }
+    g_assert(fd >= 0);
+    g_assert(mms_charset_convert_to_fd(latin1, n * sizeof(latin1_in),
+        "UTF-8", "ISO-8859-1", fd, &len, NULL));
+    g_assert_cmpuint(len, == ,n * 5);
+    close(fd);
+
+    g_assert(g_file_get_contents(path, &utf8, &len, NULL));
+    g_assert_cmpuint(len, == ,n * 5);
+    back = mms_charset_convert(utf8, len, "ISO-8859-1", "UTF-8", NULL, &len,
+        NULL);
+    g_assert(back);
+    g_assert_cmpuint(len, == ,n * sizeof(latin1_in));
+    g_assert(!memcmp(back, latin1, len));
+
+    unlink(path);
+    g_free(path);
+    g_free(latin1);
+    g_free(utf8);
+    g_free(back);
+    mms_charset_cache_clear();
+}
+
+/*==========================================================================*
+ * Threads
+ *==========================================================================*/
+
+static
+gpointer
+test_threads_proc(
+    gpointer data)
+{
+    int i;
+
+    for (i = 0; i < THREAD_ROUNDS; i++) {
+        char* out = mms_charset_convert(latin1_in, sizeof(latin1_in),
+            "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+
+        g_assert_cmpstr(out, == ,"caf\xc3\xa9");
+        g_free(out);
+    }
+    return NULL;
+}
+
+static
+void
+test_threads(
+    void)
+{
+    GThread* thread[THREAD_COUNT];
+    int i;
+
+    for (i = 0; i < THREAD_COUNT; i++) {
+        thread[i] = g_thread_new("test", test_threads_proc, NULL);
+    }
+    for (i = 0; i < THREAD_COUNT; i++) {
+        g_thread_join(thread[i]);
+    }
+    mms_charset_cache_clear();
+}
+
+/*==========================================================================*
+ * Benchmark
+ *==========================================================================*/
+
+static
+void
+test_benchmark(
+    void)
+{
+    static const char* files[] = {
+        "m-notification_1.ind",
+        "m-notification_2.ind",
+        "m-notification_3.ind",
+        "m-retrieve_1.conf",
+        "m-retrieve_2.conf",
+        "m-retrieve_3.conf",
+        "m-retrieve_4.conf",
+        "m-retrieve_5.conf",
+        "m-retrieve_6.conf",
+        "m-retrieve_7.conf",
+        "m-retrieve_8.conf",
+        "m-retrieve_9.conf",
+        "m-retrieve_10.conf"
+    };
+    GMappedFile* map[G_N_ELEMENTS(files)];
+    gint64 start;
+    guint i, k;
+
+    for (i = 0; i < G_N_ELEMENTS(files); i++) {
+        char* path = g_build_filename(CODEC_DATA_DIR, files[i], NULL);
+
+        map[i] = g_mapped_file_new(path, FALSE, NULL);
+        g_assert(map[i]);
+        g_free(path);
+    }
+
+    start = g_get_monotonic_time();
+    for (k = 0; k < BENCHMARK_ROUNDS; k++) {
+        for (i = 0; i < G_N_ELEMENTS(files); i++) {
+            struct mms_message* msg = g_new0(struct mms_message, 1);
+
+            g_assert(mms_message_decode((void*)
+                g_mapped_file_get_contents(map[i]),
+                g_mapped_file_get_length(map[i]), msg));
+            mms_message_free(msg);
+        }
+    }
+    GDEBUG("Decoded %u PDUs in %u ms", (guint)(BENCHMARK_ROUNDS *
+        G_N_ELEMENTS(files)), (guint)((g_get_monotonic_time() - start)/1000));
+
+    for (i = 0; i < G_N_ELEMENTS(files); i++) {
+        g_mapped_file_unref(map[i]);
+    }
+}
+
+#define TEST_(x) "/Charset/" x
+
+int main(int argc, char* argv[])
+{
+    int ret;
+    guint i;
+
+    mms_lib_init(argv[0]);
+    g_test_init(&argc, &argv, NULL);
+    test_init(&test_opt, &argc, argv);
+    g_test_add_func(TEST_("IsAscii"), test_is_ascii);
+    g_test_add_func(TEST_("Compatible"), test_compatible);
+    for (i = 0; i < G_N_ELEMENTS(convert_tests); i++) {
+        const TestConvertDesc* test = convert_tests + i;
+        char* name = g_strdup_printf(TEST_("Convert/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_convert);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("Convert/Partial"), test_convert_partial);
+    for (i = 0; i < G_N_ELEMENTS(convert_tests); i++) {
+        const TestConvertDesc* test = convert_tests + i;
+        char* name = g_strdup_printf(TEST_("ConvertToFd/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_convert_to_fd);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("ConvertToFd/Large"), test_convert_to_fd_large);
+    g_test_add_func(TEST_("Threads"), test_threads);
+    g_test_add_func(TEST_("Benchmark"), test_benchmark);
+    ret = g_test_run();
+    mms_lib_deinit();
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
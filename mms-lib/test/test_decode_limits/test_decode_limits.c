@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "test_util.h"
+
+#include "mms_lib_util.h"
+#include "mms_file_util.h"
+#include "mms_settings.h"
+#include "mms_codec.h"
+#include "mms_task.h"
+#include "mms_util.h"
+
+#include <gutil_log.h>
+
+#define CODEC_DATA_DIR "../test_mms_codec/data"
+#define NOTIFICATION_IND "m-notification_1.ind"
+#define JUNK_HEADERS (100000)
+#define RECIPIENTS (5000)
+#define PARTS (10000)
+#define FUZZ_SEED (1234)
+#define FUZZ_ROUNDS (500)
+#define FUZZ_MAX_BYTES (8)
+
+/* Worst case decoding time allowed on top of the time budget */
+#define TIME_SLACK_MS (1000)
+
+static TestOpt test_opt;
+
+/*==========================================================================*
+ * Generators of pathological PDUs
+ *==========================================================================*/
+
+static
+void
+test_append_byte(
+    GByteArray* buf,
+    guint8 byte)
+{
+    g_byte_array_append(buf, &byte, 1);
+}
+
+static
+void
+test_append_text(
+    GByteArray* buf,
+    const char* text)
+{
+    g_byte_array_append(buf, (const void*)text, strlen(text) + 1);
+}
+
+static
+void
+test_append_uintvar(
+    GByteArray* buf,
+    guint value)
+{
+    guint8 octets[5];
+    int i = G_N_ELEMENTS(octets) - 1;
+
+    octets[i] = value & 0x7f;
+    while ((value >>= 7) != 0) {
+        octets[--i] = 0x80 | (value & 0x7f);
+    }
+    g_byte_array_append(buf, octets + i, G_N_ELEMENTS(octets) - i);
+}
+
+static
+void
+test_append_junk(
+    GByteArray* buf,
+    guint count)
+{
+    guint i;
+
+    /* Application headers are skipped by the parser */
+    for (i = 0; i < count; i++) {
+        test_append_text(buf, "X-Junk");
+        test_append_text(buf, "x");
+    }
+}
+
+static
+GBytes*
+test_notification_with_junk(
+    guint count)
+{
+    char* path = g_build_filename(CODEC_DATA_DIR, NOTIFICATION_IND, NULL);
+    GMappedFile* map = g_mapped_file_new(path, FALSE, NULL);
+    GByteArray* buf = g_byte_array_new();
+
+    g_assert(map);
+    g_byte_array_append(buf, (void*)g_mapped_file_get_contents(map),
+        g_mapped_file_get_length(map));
+    test_append_junk(buf, count);
+    g_mapped_file_unref(map);
+    g_free(path);
+    return g_byte_array_free_to_bytes(buf);
+}
+
+static
+GBytes*
+test_retrieve_conf(
+    guint recipients,
+    guint parts)
+{
+    GByteArray* buf = g_byte_array_new();
+    guint i;
+
+    test_append_byte(buf, 0x8c); /* X-Mms-Message-Type */
+    test_append_byte(buf, MMS_MESSAGE_TYPE_RETRIEVE_CONF);
+    test_append_byte(buf, 0x98); /* X-Mms-Transaction-Id */
+    test_append_text(buf, "T1");
+    test_append_byte(buf, 0x8d); /* X-Mms-MMS-Version */
+    test_append_byte(buf, MMS_MESSAGE_VERSION_1_2);
+    test_append_byte(buf, 0x85); /* Date */
+    test_append_byte(buf, 4);
+    test_append_byte(buf, 0x5f);
+    test_append_byte(buf, 0x00);
+    test_append_byte(buf, 0x00);
+    test_append_byte(buf, 0x00);
+    for (i = 0; i < recipients; i++) {
+        test_append_byte(buf, 0x97); /* To */
+        test_append_text(buf, "+1234567890/TYPE=PLMN");
+    }
+    test_append_byte(buf, 0x84); /* Content-Type */
+    test_append_byte(buf, 0xa3); /* application/vnd.wap.multipart.mixed */
+    test_append_uintvar(buf, parts);
+    for (i = 0; i < parts; i++) {
+        test_append_uintvar(buf, 1);  /* HeadersLen */
+        test_append_uintvar(buf, 1);  /* DataLen */
+        test_append_byte(buf, 0x83);  /* text/plain */
+        test_append_byte(buf, 'x');   /* Data */
+    }
+    return g_byte_array_free_to_bytes(buf);
+}
+
+static
+void
+test_default_limits(
+    struct mms_decode_limits* limits)
+{
+    MMSConfig config;
+
+    mms_lib_default_config(&config);
+    mms_decode_limits_init(limits, &config);
+}
+
+static
+enum mms_decode_result
+test_decode(
+    GBytes* bytes,
+    const struct mms_decode_limits* limits,
+    guint* ms)
+{
+    gsize len = 0;
+    const guint8* data = g_bytes_get_data(bytes, &len);
+    struct mms_message* msg = g_new0(struct mms_message, 1);
+    const gint64 start = g_get_monotonic_time();
+    enum mms_decode_result result;
+
+    result = mms_message_decode_full(data, len, msg, limits);
+    if (ms) {
+        *ms = (guint)((g_get_monotonic_time() - start) / 1000);
+    }
+    mms_message_free(msg);
+    return result;
+}
+
+static
+void
+test_check_bounded(
+    GBytes* bytes,
+    const char* what)
+{
+    struct mms_decode_limits limits;
+    guint ms1, ms2;
+
+    /* The PDU itself is valid */
+    g_assert(test_decode(bytes, NULL, &ms1) == MMS_DECODE_OK);
+
+    /* But it's not accepted with the default limits */
+    test_default_limits(&limits);
+    g_assert(test_decode(bytes, &limits, &ms2) == MMS_DECODE_ERROR_LIMIT);
+    g_assert_cmpuint(ms2, <= ,limits.max_time_ms + TIME_SLACK_MS);
+    GDEBUG("%s: %u ms unlimited, %u ms limited", what, ms1, ms2);
+}
+
+/*==========================================================================*
+ * Headers
+ *==========================================================================*/
+
+static
+void
+test_headers(
+    void)
+{
+    GBytes* bytes = test_notification_with_junk(JUNK_HEADERS);
+    struct mms_decode_limits limits;
+
+    test_check_bounded(bytes, "Junk headers");
+
+    /* Enough room for all headers */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_headers = JUNK_HEADERS + 20;
+    g_assert(test_decode(bytes, &limits, NULL) == MMS_DECODE_OK);
+    limits.max_headers = JUNK_HEADERS;
+    g_assert(test_decode(bytes, &limits, NULL) == MMS_DECODE_ERROR_LIMIT);
+    g_bytes_unref(bytes);
+}
+
+/*==========================================================================*
+ * Recipients
+ *==========================================================================*/
+
+static
+void
+test_recipients(
+    void)
+{
+    GBytes* bytes = test_retrieve_conf(RECIPIENTS, 1);
+    struct mms_decode_limits limits;
+
+    test_check_bounded(bytes, "Recipients");
+
+    /* Text limit */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_text = 1000;
+    g_assert(test_decode(bytes, &limits, NULL) == MMS_DECODE_ERROR_LIMIT);
+    g_bytes_unref(bytes);
+}
+
+/*==========================================================================*
+ * Parts
+ *==========================================================================*/
+
+static
+void
+test_parts(
+    void)
+{
+    GBytes* bytes = test_retrieve_conf(1, PARTS);
+    struct mms_decode_limits limits;
+    struct mms_message_attachment_iter iter;
+    struct mms_attachment_view part;
+    struct mms_message* msg = g_new0(struct mms_message, 1);
+    gsize len = 0;
+    const guint8* data = g_bytes_get_data(bytes, &len);
+    guint n = 0;
+
+    test_check_bounded(bytes, "Parts");
+
+    /* Iterator stops right after the limit */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_parts = 10;
+    g_assert(mms_message_attachment_iter_init_full(&iter, data, len, msg,
+        &limits));
+    while (mms_message_attachment_iter_next(&iter, &part)) {
+        g_assert_cmpuint(part.length, == ,1);
+        g_assert_cmpstr(part.mimetype, == ,"text/plain");
+        n++;
+    }
+    g_assert_cmpuint(n, == ,limits.max_parts);
+    g_assert(!mms_message_attachment_iter_close(&iter));
+    g_assert(iter.result == MMS_DECODE_ERROR_LIMIT);
+    mms_message_free(msg);
+
+    /* Everything is there without the limits */
+    msg = g_new0(struct mms_message, 1);
+    g_assert(mms_message_decode(data, len, msg));
+    g_assert_cmpuint(g_slist_length(msg->attachments), == ,PARTS);
+    mms_message_free(msg);
+    g_bytes_unref(bytes);
+}
+
+/*==========================================================================*
+ * Time
+ *==========================================================================*/
+
+static
+void
+test_time(
+    void)
+{
+    GBytes* bytes = test_notification_with_junk(10 * JUNK_HEADERS);
+    struct mms_decode_limits limits;
+    guint ms;
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_time_ms = 1;
+    g_assert(test_decode(bytes, &limits, &ms) == MMS_DECODE_ERROR_LIMIT);
+    g_assert_cmpuint(ms, <= ,limits.max_time_ms + TIME_SLACK_MS);
+    g_bytes_unref(bytes);
+}
+
+/*==========================================================================*
+ * Push
+ *==========================================================================*/
+
+static
+void
+test_push(
+    void)
+{
+    GBytes* bytes = test_notification_with_junk(JUNK_HEADERS);
+    MMSConfig config;
+    MMSSettings* settings;
+    TestDirs dirs;
+    GError* error = NULL;
+    char* dir;
+    char* file;
+
+    test_dirs_init(&dirs, "test_decode_limits");
+    mms_lib_default_config(&config);
+    config.root_dir = dirs.root;
+    config.attic_enabled = TRUE;
+    settings = mms_settings_default_new(&config);
+
+    /* Distinct error code */
+    g_assert(!mms_decode_bytes(&config, bytes, &error));
+    g_assert(g_error_matches(error, MMS_LIB_ERROR,
+        MMS_LIB_ERROR_DECODE_LIMIT));
+    g_clear_error(&error);
+
+    /* And the PDU ends up in the attic */
+    g_assert(!mms_task_notification_new(settings, NULL, NULL, NULL,
+        bytes, &error));
+    g_assert(g_error_matches(error, MMS_LIB_ERROR,
+        MMS_LIB_ERROR_DECODE_LIMIT));
+    g_clear_error(&error);
+
+    dir = g_build_filename(dirs.attic, "000", NULL);
+    file = g_build_filename(dir, MMS_UNRECOGNIZED_PUSH_FILE, NULL);
+    g_assert(g_file_test(file, G_FILE_TEST_IS_REGULAR));
+    remove(file);
+    rmdir(dir);
+    g_free(file);
+    g_free(dir);
+
+    mms_settings_unref(settings);
+    test_dirs_cleanup(&dirs, TRUE);
+    g_bytes_unref(bytes);
+}
+
+/*==========================================================================*
+ * Fuzz
+ *==========================================================================*/
+
+static
+void
+test_fuzz(
+    void)
+{
+    static const char* files[] = {
+        "m-acknowledge.ind",
+        "m-notification_1.ind",
+        "m-notification_2.ind",
+        "m-delivery_1.ind",
+        "m-read-orig.ind",
+        "m-retrieve_1.conf",
+        "m-retrieve_3.conf",
+        "m-retrieve_5.conf",
+        "m-send_1.req",
+        "m-send_1.conf"
+    };
+    GRand* rand = g_rand_new_with_seed(FUZZ_SEED);
+    struct mms_decode_limits limits;
+    guint i, k, worst = 0, counts[MMS_DECODE_ERROR_LIMIT + 1];
+
+    memset(counts, 0, sizeof(counts));
+    test_default_limits(&limits);
+    for (i = 0; i < G_N_ELEMENTS(files); i++) {
+        char* path = g_build_filename(CODEC_DATA_DIR, files[i], NULL);
+        GMappedFile* map = g_mapped_file_new(path, FALSE, NULL);
+        const gsize size = g_mapped_file_get_length(map);
+
+        g_assert(map);
+        for (k = 0; k < FUZZ_ROUNDS; k++) {
+            guint8* data = g_memdup(g_mapped_file_get_contents(map), size);
+            const guint n = g_rand_int_range(rand, 1, FUZZ_MAX_BYTES + 1);
+            gsize len = size;
+            GBytes* bytes;
+            guint j, ms;
+
+            /* Random bytes at random positions, sometimes truncated */
+            for (j = 0; j < n; j++) {
+                data[g_rand_int_range(rand, 0, size)] =
+                    (guint8)g_rand_int_range(rand, 0, 0x100);
+            }
+            if (g_rand_boolean(rand)) {
+                len = g_rand_int_range(rand, 0, size);
+            }
+            bytes = g_bytes_new_take(data, len);
+            counts[test_decode(bytes, &limits, &ms)]++;
+            worst = MAX(worst, ms);
+            g_bytes_unref(bytes);
+        }
+        g_mapped_file_unref(map);
+        g_free(path);
+    }
+    GDEBUG("%u ok, %u malformed, %u over the limits, worst %u ms",
+        counts[MMS_DECODE_OK], counts[MMS_DECODE_ERROR_FORMAT],
+        counts[MMS_DECODE_ERROR_LIMIT], worst);
+    g_assert_cmpuint(worst, <= ,limits.max_time_ms + TIME_SLACK_MS);
+    g_rand_free(rand);
+}
+
+#define TEST_(x) "/DecodeLimits/" x
+
+int main(int argc, char* argv[])
+{
+    int ret;
+
+    mms_lib_init(argv[0]);
+    g_test_init(&argc, &argv, NULL);
+    test_init(&test_opt, &argc, argv);
+    g_test_add_func(TEST_("Headers"), test_headers);
+    g_test_add_func(TEST_("Recipients"), test_recipients);
+    g_test_add_func(TEST_("Parts"), test_parts);
+    g_test_add_func(TEST_("Time"), test_time);
+    g_test_add_func(TEST_("Push"), test_push);
+    g_test_add_func(TEST_("Fuzz"), test_fuzz);
+    ret = g_test_run();
+    mms_lib_deinit();
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
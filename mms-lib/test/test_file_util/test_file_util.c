@@ -0,0 +1,769 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "test_util.h"
+
+#include "mms_lib_util.h"
+#include "mms_file_util.h"
+#include "mms_file_batch.h"
+#include "mms_settings.h"
+#include "mms_attachment_info.h"
+
+#include <gutil_log.h>
+
+#define SOURCE_SIZE (3*65536 + 123)
+#define BATCH_FILES (20)
+#define BENCHMARK_SIZE (2*1024*1024)
+#define BENCHMARK_ROUNDS (10)
+
+static TestOpt test_opt;
+
+typedef struct test_extract_desc {
+    const char* name;
+    gsize offset;
+    gsize size;
+} TestExtractDesc;
+
+static const TestExtractDesc extract_tests[] = {
+    { "Empty", 0, 0 },
+    { "Small", 7, 100 },
+    { "Aligned", 65536, 65536 },
+    { "Tail", 65536, SOURCE_SIZE - 65536 },
+    { "Unaligned", 4097, 2*65536 },
+    { "All", 0, SOURCE_SIZE }
+};
+
+/*==========================================================================*
+ * Extract
+ *==========================================================================*/
+
+static
+void
+test_extract(
+    gconstpointer test_data)
+{
+    const TestExtractDesc* test = test_data;
+    char* root = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* src = g_build_filename(root, "source", NULL);
+    char* dir = g_build_filename(root, "parts", NULL);
+    guint8* data = g_malloc(SOURCE_SIZE);
+    char* path = NULL;
+    gchar* contents = NULL;
+    gsize i, len = 0;
+    MMS_FILE_EXTRACT method;
+    MMSDir* out;
+    int fd;
+
+    for (i = 0; i < SOURCE_SIZE; i++) {
+        data[i] = (guint8)(i * 7 + (i >> 8));
+    }
+    g_assert(g_file_set_contents(src, (void*)data, SOURCE_SIZE, NULL));
+    fd = open(src, O_RDONLY);
+    g_assert(fd >= 0);
+    out = mms_dir_open(dir, NULL);
+    g_assert(out);
+
+    /* Twice to make sure that cached capabilities work too */
+    for (i = 0; i < 2; i++) {
+        method = mms_file_extract(root, fd, test->offset,
+            data + test->offset, test->size, out, "part", &path);
+        GDEBUG("%s: method %d", test->name, method);
+        g_assert(method != MMS_FILE_EXTRACT_FAILED);
+        g_assert(path);
+        g_assert(g_file_get_contents(path, &contents, &len, NULL));
+        g_assert_cmpuint(len, == ,test->size);
+        g_assert(!memcmp(contents, data + test->offset, len));
+        g_free(contents);
+        unlink(path);
+        g_free(path);
+        path = NULL;
+    }
+
+    /* Invalid fd falls back to write */
+    g_assert_cmpint(mms_file_extract(root, -1, test->offset,
+        data + test->offset, test->size, out, "part", &path), == ,
+        MMS_FILE_EXTRACT_WRITE);
+    g_assert(g_file_get_contents(path, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,test->size);
+    g_assert(!memcmp(contents, data + test->offset, len));
+    g_free(contents);
+    unlink(path);
+    g_free(path);
+
+    close(fd);
+    mms_dir_close(out);
+    unlink(src);
+    rmdir(dir);
+    rmdir(root);
+    mms_file_caps_clear();
+    g_free(data);
+    g_free(src);
+    g_free(dir);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * DirError
+ *==========================================================================*/
+
+static
+void
+test_dir_error(
+    void)
+{
+    char* root = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* file = g_build_filename(root, "file", NULL);
+    char* dir = g_build_filename(file, "parts", NULL);
+    GError* error = NULL;
+
+    /* Directory can't be created because there's a file in the way */
+    g_assert(g_file_set_contents(file, "", 0, NULL));
+    g_assert(!mms_dir_open(dir, &error));
+    g_assert(error);
+    g_error_free(error);
+    error = NULL;
+
+    /* And the file itself is not a directory */
+    g_assert(!mms_dir_open(file, &error));
+    g_assert(error);
+    g_error_free(error);
+
+    mms_dir_close(NULL);
+    unlink(file);
+    rmdir(root);
+    g_free(file);
+    g_free(dir);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * DirWrite
+ *==========================================================================*/
+
+static
+void
+test_dir_write(
+    void)
+{
+    static const char data1[] = "first";
+    static const char data2[] = "second";
+    char* root = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* dir = g_build_filename(root, "a", "b", NULL);
+    MMSDir* out = mms_dir_open(dir, NULL);
+    GDir* list;
+    char* path = NULL;
+    char* path2 = NULL;
+    gchar* contents = NULL;
+    gsize len = 0;
+    struct stat st;
+
+    /* Directory gets created */
+    g_assert(out);
+    g_assert_cmpstr(mms_dir_path(out), == ,dir);
+    g_assert(g_file_test(dir, G_FILE_TEST_IS_DIR));
+
+    g_assert(mms_dir_write_file(out, "file", data1, strlen(data1),
+        &path, NULL));
+    g_assert(g_file_get_contents(path, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,strlen(data1));
+    g_assert(!memcmp(contents, data1, len));
+    g_free(contents);
+    g_assert(!stat(path, &st));
+    g_assert_cmpuint(st.st_mode & 0777, == ,MMS_FILE_PERM);
+
+    /* Overwrite it */
+    g_assert(mms_dir_write_file(out, "file", data2, strlen(data2),
+        &path2, NULL));
+    g_assert_cmpstr(path, == ,path2);
+    g_assert(g_file_get_contents(path, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,strlen(data2));
+    g_assert(!memcmp(contents, data2, len));
+    g_free(contents);
+
+    /* No temporary files must be left behind */
+    list = g_dir_open(dir, 0, NULL);
+    g_assert(list);
+    g_assert_cmpstr(g_dir_read_name(list), == ,"file");
+    g_assert(!g_dir_read_name(list));
+    g_dir_close(list);
+
+    /* Opening it again doesn't hurt */
+    mms_dir_close(out);
+    out = mms_dir_open(dir, NULL);
+    g_assert(out);
+    mms_dir_close(out);
+
+    unlink(path);
+    rmdir(dir);
+    *strrchr(dir, G_DIR_SEPARATOR) = 0;
+    rmdir(dir);
+    rmdir(root);
+    g_free(path);
+    g_free(path2);
+    g_free(dir);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * DirSync
+ *==========================================================================*/
+
+static
+void
+test_dir_sync(
+    void)
+{
+    static const char data[] = "test";
+    char* dir = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    MMSDir* out = mms_dir_open_full(dir, MMS_DIR_SYNC_FILES, NULL);
+    MMSSyncStats before, after;
+    char* path = NULL;
+
+    g_assert(out);
+    mms_file_sync_stats_get(&before);
+
+    /* File data and the directory entry */
+    g_assert(mms_dir_write_file(out, "file", data, strlen(data),
+        &path, NULL));
+    mms_file_sync_stats_get(&after);
+    g_assert_cmpuint(after.count, == ,before.count + 2);
+
+    /* Same for a file written by someone else */
+    g_assert(mms_dir_sync_file(out, "file"));
+    mms_file_sync_stats_get(&before);
+    g_assert_cmpuint(before.count, == ,after.count + 2);
+    g_assert(!mms_dir_sync_file(out, "nosuchfile"));
+
+    /* Group commit */
+    g_assert(mms_dir_sync(out, NULL));
+    mms_file_sync_stats_get(&after);
+    g_assert_cmpuint(after.count, > ,before.count);
+    g_assert(after.total_us >= after.max_us);
+    mms_dir_close(out);
+
+    /* Without MMS_DIR_SYNC_FILES nothing is synced */
+    out = mms_dir_open(dir, NULL);
+    g_assert(mms_dir_write_file(out, "file", data, strlen(data),
+        NULL, NULL));
+    g_assert(mms_dir_sync_file(out, "nosuchfile"));
+    mms_file_sync_stats_get(&before);
+    g_assert_cmpuint(before.count, == ,after.count);
+    mms_dir_close(out);
+
+    unlink(path);
+    rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Space
+ *==========================================================================*/
+
+static
+void
+test_space(
+    void)
+{
+    char* dir = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* file = g_build_filename(dir, "file", NULL);
+    char* none = g_build_filename(dir, "none", NULL);
+    struct stat st;
+    int fd;
+
+    g_assert(mms_file_space_available(dir, 0));
+    g_assert(!mms_file_space_available(dir, G_MAXUINT64/2));
+
+    /* If we can't tell, we assume that there's enough */
+    g_assert(mms_file_space_available(none, G_MAXUINT64/2));
+
+    /* Reserving the space doesn't change the file size */
+    fd = open(file, O_CREAT|O_RDWR, MMS_FILE_PERM);
+    g_assert(fd >= 0);
+    g_assert(mms_file_reserve(fd, 0));
+    g_assert(mms_file_reserve(fd, 10000));
+    g_assert(!fstat(fd, &st));
+    g_assert_cmpuint(st.st_size, == ,0);
+    close(fd);
+
+    unlink(file);
+    rmdir(dir);
+    g_free(file);
+    g_free(none);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Staging
+ *==========================================================================*/
+
+static
+void
+test_staging(
+    void)
+{
+    char* root = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* dir = g_build_filename(root, "staging", NULL);
+    MMSConfig config;
+
+    mms_lib_default_config(&config);
+    config.root_dir = root;
+    config.staging_limit = 1000;
+
+    /* No staging directory - nothing to reserve */
+    g_assert(!mms_file_staging_reserve(&config, 1));
+    g_assert_cmpuint(mms_file_staging_used(), == ,0);
+
+    /* Directory gets created on demand */
+    config.staging_dir = dir;
+    g_assert(mms_file_staging_reserve(&config, 600));
+    g_assert(g_file_test(dir, G_FILE_TEST_IS_DIR));
+    g_assert_cmpuint(mms_file_staging_used(), == ,600);
+
+    /* The limit applies to the total */
+    g_assert(!mms_file_staging_reserve(&config, 600));
+    g_assert(mms_file_staging_reserve(&config, 400));
+    g_assert_cmpuint(mms_file_staging_used(), == ,1000);
+    mms_file_staging_release(600);
+    g_assert(mms_file_staging_reserve(&config, 600));
+    mms_file_staging_release(600);
+    mms_file_staging_release(400);
+    g_assert_cmpuint(mms_file_staging_used(), == ,0);
+
+    rmdir(dir);
+    rmdir(root);
+    g_free(dir);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * Stage
+ *==========================================================================*/
+
+static const char stage_data[] = "attachment";
+
+static
+void
+test_stage_check(
+    MMSDir* dir,
+    const char* file,
+    const char* data,
+    gsize size)
+{
+    char* path = g_build_filename(mms_dir_path(dir), file, NULL);
+    gchar* contents = NULL;
+    gsize len = 0;
+
+    g_assert(g_file_get_contents(path, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,size);
+    g_assert(!memcmp(contents, data, len));
+    g_free(contents);
+    unlink(path);
+    g_free(path);
+}
+
+static
+void
+test_stage_link(
+    void)
+{
+    const gsize size = strlen(stage_data);
+    char* dir = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* src = g_build_filename(dir, "src", NULL);
+    char* dest = g_build_filename(dir, "dest", NULL);
+    MMSDir* out = mms_dir_open(dest, NULL);
+    MMSAttachmentInfo ai;
+    struct stat st1, st2;
+    int fd;
+
+    g_assert(out);
+    g_assert(g_file_set_contents(src, stage_data, size, NULL));
+
+    /* Path */
+    g_assert(mms_attachment_info_path(&ai, src, NULL, NULL, NULL));
+    g_assert_cmpint(ai.fd, == ,-1);
+    g_assert_cmpint(mms_stage_attachment(dir, &ai, out, "a", NULL), == ,
+        MMS_FILE_STAGE_LINK);
+    mms_attachment_info_cleanup(&ai);
+    g_assert(!stat(src, &st1));
+    g_assert_cmpuint(st1.st_nlink, == ,2);
+    test_stage_check(out, "a", stage_data, size);
+
+    /* File descriptor (this one needs /proc) */
+    fd = open(src, O_RDONLY);
+    g_assert(fd >= 0);
+    g_assert(mms_attachment_info_fd(&ai, fd, "b", NULL, NULL, NULL));
+    g_assert_cmpint(ai.fd, == ,fd);
+    if (g_file_test("/proc/self/fd", G_FILE_TEST_IS_DIR)) {
+        char* path = g_build_filename(dest, "b", NULL);
+
+        g_assert_cmpint(mms_stage_attachment(dir, &ai, out, "b", NULL),
+            == ,MMS_FILE_STAGE_LINK);
+        g_assert(!stat(src, &st1));
+        g_assert(!stat(path, &st2));
+        g_assert_cmpuint(st1.st_ino, == ,st2.st_ino);
+        g_free(path);
+    } else {
+        g_assert(mms_stage_attachment(dir, &ai, out, "b", NULL));
+    }
+    test_stage_check(out, "b", stage_data, size);
+    mms_attachment_info_cleanup(&ai);
+    close(fd);
+
+    mms_dir_close(out);
+    unlink(src);
+    rmdir(dest);
+    rmdir(dir);
+    g_free(src);
+    g_free(dest);
+    g_free(dir);
+}
+
+static
+void
+test_stage_copy(
+    void)
+{
+    const gsize size = strlen(stage_data);
+    char* dir = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    char* src = g_build_filename(dir, "src", NULL);
+    MMSDir* out = mms_dir_open(dir, NULL);
+    MMSAttachmentInfo ai;
+    MMS_FILE_STAGE method;
+    int fd, fds[2];
+    FILE* f;
+
+    /* Deleted file */
+    g_assert(g_file_set_contents(src, stage_data, size, NULL));
+    fd = open(src, O_RDONLY);
+    g_assert(fd >= 0);
+    g_assert(mms_attachment_info_fd(&ai, fd, "a", NULL, NULL, NULL));
+    unlink(src);
+    method = mms_stage_attachment(dir, &ai, out, "a", NULL);
+    g_assert_cmpint(method, != ,MMS_FILE_STAGE_FAILED);
+    g_assert_cmpint(method, != ,MMS_FILE_STAGE_LINK);
+    test_stage_check(out, "a", stage_data, size);
+    mms_attachment_info_cleanup(&ai);
+    close(fd);
+
+    /* File which has changed since it was mapped */
+    g_assert(g_file_set_contents(src, stage_data, size, NULL));
+    g_assert(mms_attachment_info_path(&ai, src, NULL, NULL, NULL));
+    f = fopen(src, "a");
+    g_assert(f);
+    g_assert(fputs(stage_data, f) >= 0);
+    fclose(f);
+    method = mms_stage_attachment(dir, &ai, out, "b", NULL);
+    g_assert_cmpint(method, != ,MMS_FILE_STAGE_FAILED);
+    g_assert_cmpint(method, != ,MMS_FILE_STAGE_LINK);
+    test_stage_check(out, "b", stage_data, size);
+    mms_attachment_info_cleanup(&ai);
+    unlink(src);
+
+    /* Pipe (can't be mapped, the data come from elsewhere) */
+    g_assert(!pipe(fds));
+    memset(&ai, 0, sizeof(ai));
+    ai.data = stage_data;
+    ai.size = size;
+    ai.file_name = "c";
+    ai.fd = fds[0];
+    g_assert_cmpint(mms_stage_attachment(dir, &ai, out, "c", NULL), == ,
+        MMS_FILE_STAGE_WRITE);
+    test_stage_check(out, "c", stage_data, size);
+    close(fds[0]);
+    close(fds[1]);
+
+    mms_dir_close(out);
+    rmdir(dir);
+    g_free(src);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Smil
+ *==========================================================================*/
+
+typedef struct test_smil_desc {
+    const char* name;
+    const char* data;
+    gboolean smil;
+} TestSmilDesc;
+
+static const TestSmilDesc smil_tests[] = {
+    { "Root", "<smil><body/></smil>", TRUE },
+    { "Prolog", "<?xml version=\"1.0\"?>\n"
+      "<!DOCTYPE smil PUBLIC \"-//W3C//DTD SMIL 1.0//EN\" "
+      "\"http://www.w3.org/TR/REC-smil/SMIL10.dtd\">\n"
+      "<!-- Comment -->\n<smil xmlns=\"http://www.w3.org/2001/SMIL20\">\n"
+      "</smil>\n", TRUE },
+    /* Only the root element is looked at */
+    { "Incomplete", "<smil>\n <head>\n  <layout>", TRUE },
+    { "Html", "<html><body><smil/></body></html>", FALSE },
+    { "Text", "smil", FALSE },
+    { "Empty", "", FALSE }
+};
+
+static
+void
+test_smil(
+    gconstpointer data)
+{
+    const TestSmilDesc* test = data;
+    MMSAttachmentInfo ai;
+
+    memset(&ai, 0, sizeof(ai));
+    ai.data = test->data;
+    ai.size = strlen(test->data);
+    g_assert(mms_file_is_smil(&ai) == test->smil);
+}
+
+static
+void
+test_smil_prefix(
+    void)
+{
+    static const char root[] = "<smil>";
+    const gsize size = 1024*1024;
+    char* data = g_malloc(size);
+    MMSAttachmentInfo ai;
+
+    memset(&ai, 0, sizeof(ai));
+    ai.data = data;
+    ai.size = size;
+
+    /* Whatever follows the root element doesn't matter */
+    memset(data, '<', size);
+    memcpy(data, root, strlen(root));
+    g_assert(mms_file_is_smil(&ai));
+
+    /* The root element has to be near the beginning */
+    memset(data, ' ', size);
+    memcpy(data + size - strlen(root), root, strlen(root));
+    g_assert(!mms_file_is_smil(&ai));
+    g_free(data);
+}
+
+/*==========================================================================*
+ * Batch
+ *==========================================================================*/
+
+typedef struct test_batch_desc {
+    const char* name;
+    int batch_flags;
+    int dir_flags;
+} TestBatchDesc;
+
+static const TestBatchDesc batch_tests[] = {
+    { "Default", 0, 0 },
+    { "Sync", 0, MMS_DIR_SYNC_FILES },
+    { "NoUring", MMS_FILE_BATCH_NO_URING, 0 },
+    { "NoUringSync", MMS_FILE_BATCH_NO_URING, MMS_DIR_SYNC_FILES }
+};
+
+static
+void
+test_batch(
+    gconstpointer data)
+{
+    const TestBatchDesc* test = data;
+    char* dir = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    MMSDir* out = mms_dir_open_full(dir, test->dir_flags, NULL);
+    MMSFileBatch* batch = mms_file_batch_new(out, test->batch_flags);
+    char* paths[BATCH_FILES];
+    GBytes* bytes[BATCH_FILES];
+    GDir* list;
+    guint i;
+
+    g_assert(out);
+    g_assert_cmpuint(mms_file_batch_count(NULL), == ,0);
+    g_assert_cmpuint(mms_file_batch_count(batch), == ,0);
+
+    /* Empty batch is fine too */
+    g_assert(mms_file_batch_commit(batch, NULL));
+
+    /* The last one is empty */
+    for (i = 0; i < BATCH_FILES; i++) {
+        char* name = g_strdup_printf("file%u", i);
+        char* contents = g_strnfill((BATCH_FILES - i - 1) * 1000, 'a' + i);
+
+        bytes[i] = g_bytes_new_take(contents, strlen(contents));
+        mms_file_batch_add(batch, name, bytes[i], paths + i);
+        g_free(name);
+    }
+    g_assert_cmpuint(mms_file_batch_count(batch), == ,BATCH_FILES);
+
+    /* Nothing is written until it's committed */
+    g_assert(!g_file_test(paths[0], G_FILE_TEST_EXISTS));
+    g_assert(mms_file_batch_commit(batch, NULL));
+    mms_file_batch_free(batch);
+    mms_file_batch_free(NULL);
+
+    for (i = 0; i < BATCH_FILES; i++) {
+        gsize size = 0;
+        const void* expected = g_bytes_get_data(bytes[i], &size);
+        gchar* contents = NULL;
+        gsize len = 0;
+        struct stat st;
+
+        g_assert(g_file_get_contents(paths[i], &contents, &len, NULL));
+        g_assert_cmpuint(len, == ,size);
+        g_assert(!memcmp(contents, expected, len));
+        g_assert(!stat(paths[i], &st));
+        g_assert_cmpuint(st.st_mode & 0777, == ,MMS_FILE_PERM);
+        g_free(contents);
+    }
+
+    /* No temporary files must be left behind */
+    list = g_dir_open(dir, 0, NULL);
+    g_assert(list);
+    for (i = 0; g_dir_read_name(list); i++);
+    g_assert_cmpuint(i, == ,BATCH_FILES);
+    g_dir_close(list);
+
+    mms_dir_close(out);
+    for (i = 0; i < BATCH_FILES; i++) {
+        unlink(paths[i]);
+        g_free(paths[i]);
+        g_bytes_unref(bytes[i]);
+    }
+    rmdir(dir);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * BatchBenchmark
+ *==========================================================================*/
+
+static
+gint64
+test_batch_benchmark_run(
+    MMSDir* out,
+    int flags,
+    GBytes** bytes)
+{
+    const gint64 start = g_get_monotonic_time();
+    guint i, k;
+
+    for (i = 0; i < BENCHMARK_ROUNDS; i++) {
+        MMSFileBatch* batch = mms_file_batch_new(out, flags);
+
+        for (k = 0; k < BATCH_FILES; k++) {
+            char* name = g_strdup_printf("file%u", k);
+
+            mms_file_batch_add(batch, name, bytes[k], NULL);
+            g_free(name);
+        }
+        g_assert(mms_file_batch_commit(batch, NULL));
+        mms_file_batch_free(batch);
+    }
+    return MAX(g_get_monotonic_time() - start, 1);
+}
+
+static
+void
+test_batch_benchmark(
+    void)
+{
+    const gsize size = BENCHMARK_SIZE / BATCH_FILES;
+    char* dir = g_dir_make_tmp("test_file_util_XXXXXX", NULL);
+    MMSDir* out = mms_dir_open(dir, NULL);
+    GRand* rand = g_rand_new_with_seed(1234);
+    GBytes* bytes[BATCH_FILES];
+    gint64 usec;
+    guint i;
+
+    for (i = 0; i < BATCH_FILES; i++) {
+        guint8* data = g_malloc(size);
+        gsize k;
+
+        for (k = 0; k < size; k++) {
+            data[k] = (guint8)g_rand_int(rand);
+        }
+        bytes[i] = g_bytes_new_take(data, size);
+    }
+
+    usec = test_batch_benchmark_run(out, MMS_FILE_BATCH_NO_URING, bytes);
+    GDEBUG("write: %u files, %u MB/s", BATCH_FILES, (guint)
+        ((gint64)BENCHMARK_SIZE * BENCHMARK_ROUNDS / usec));
+    usec = test_batch_benchmark_run(out, 0, bytes);
+    GDEBUG("io_uring%s: %u files, %u MB/s", mms_file_batch_uring_supported() ?
+        "" : " (not supported)", BATCH_FILES, (guint)
+        ((gint64)BENCHMARK_SIZE * BENCHMARK_ROUNDS / usec));
+
+    mms_dir_close(out);
+    for (i = 0; i < BATCH_FILES; i++) {
+        char* path = g_strdup_printf("%s/file%u", dir, i);
+
+        unlink(path);
+        g_free(path);
+        g_bytes_unref(bytes[i]);
+    }
+    rmdir(dir);
+    g_rand_free(rand);
+    g_free(dir);
+}
+
+#define TEST_(x) "/FileUtil/" x
+
+int main(int argc, char* argv[])
+{
+    int ret;
+    guint i;
+
+    mms_lib_init(argv[0]);
+    g_test_init(&argc, &argv, NULL);
+    test_init(&test_opt, &argc, argv);
+    for (i = 0; i < G_N_ELEMENTS(extract_tests); i++) {
+        const TestExtractDesc* test = extract_tests + i;
+        char* name = g_strdup_printf(TEST_("Extract/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_extract);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("DirError"), test_dir_error);
+    g_test_add_func(TEST_("DirWrite"), test_dir_write);
+    g_test_add_func(TEST_("DirSync"), test_dir_sync);
+    g_test_add_func(TEST_("Space"), test_space);
+    g_test_add_func(TEST_("Staging"), test_staging);
+    g_test_add_func(TEST_("Stage/Link"), test_stage_link);
+    g_test_add_func(TEST_("Stage/Copy"), test_stage_copy);
+    for (i = 0; i < G_N_ELEMENTS(smil_tests); i++) {
+        const TestSmilDesc* test = smil_tests + i;
+        char* name = g_strdup_printf(TEST_("Smil/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_smil);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("Smil/Prefix"), test_smil_prefix);
+    for (i = 0; i < G_N_ELEMENTS(batch_tests); i++) {
+        const TestBatchDesc* test = batch_tests + i;
+        char* name = g_strdup_printf(TEST_("Batch/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_batch);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("BatchBenchmark"), test_batch_benchmark);
+    ret = g_test_run();
+    mms_lib_deinit();
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
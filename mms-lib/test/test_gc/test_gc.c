@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "test_util.h"
+
+#include "mms_lib_util.h"
+#include "mms_file_util.h"
+#include "mms_settings.h"
+#include "mms_gc.h"
+
+#include <gutil_log.h>
+
+#include <utime.h>
+
+#define TEST_ORPHAN_SECS (60)
+
+static TestOpt test_opt;
+
+static
+gboolean
+test_gc_busy(
+    const char* id,
+    void* user_data)
+{
+    return !g_strcmp0(id, user_data);
+}
+
+static
+void
+test_gc_run(
+    MMSGc* gc)
+{
+    g_assert(mms_gc_running(gc));
+    while (mms_gc_running(gc)) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+static
+char*
+test_gc_message(
+    const char* root,
+    const char* id,
+    const char* data,
+    gboolean old)
+{
+    char* dir = g_build_filename(root, MMS_MESSAGE_DIR, id, NULL);
+    char* parts = g_build_filename(dir, MMS_PARTS_DIR, NULL);
+    char* file = g_build_filename(parts, "part", NULL);
+    char* pdu = g_build_filename(dir, MMS_RETRIEVE_CONF_FILE, NULL);
+
+    g_assert(!g_mkdir_with_parents(parts, MMS_DIR_PERM));
+    g_assert(g_file_set_contents(file, data, strlen(data), NULL));
+    g_assert(g_file_set_contents(pdu, data, strlen(data), NULL));
+    if (old) {
+        struct utimbuf t;
+
+        t.actime = t.modtime = time(NULL) - 2*TEST_ORPHAN_SECS;
+        g_assert(!utime(file, &t));
+        g_assert(!utime(pdu, &t));
+        g_assert(!utime(parts, &t));
+        g_assert(!utime(dir, &t));
+    }
+    g_free(parts);
+    g_free(file);
+    g_free(pdu);
+    return dir;
+}
+
+static
+void
+test_gc_remove_message(
+    const char* dir)
+{
+    char* parts = g_build_filename(dir, MMS_PARTS_DIR, NULL);
+    char* file = g_build_filename(parts, "part", NULL);
+    char* pdu = g_build_filename(dir, MMS_RETRIEVE_CONF_FILE, NULL);
+
+    g_assert(!unlink(file));
+    g_assert(!unlink(pdu));
+    g_assert(!rmdir(parts));
+    g_assert(!rmdir(dir));
+    g_free(parts);
+    g_free(file);
+    g_free(pdu);
+}
+
+/*==========================================================================*
+ * Disabled
+ *==========================================================================*/
+
+static
+void
+test_disabled(
+    void)
+{
+    char* root = g_dir_make_tmp("test_gc_XXXXXX", NULL);
+    MMSConfig config;
+    MMSGc* gc;
+
+    mms_lib_default_config(&config);
+    config.root_dir = root;
+    config.orphan_secs = 0;
+    gc = mms_gc_new(&config, NULL, NULL);
+    g_assert(!mms_gc_start(gc));
+    g_assert(!mms_gc_running(gc));
+    mms_gc_free(gc);
+
+    /* Nothing is deleted if we are asked to keep the files */
+    config.orphan_secs = TEST_ORPHAN_SECS;
+    config.keep_temp_files = TRUE;
+    gc = mms_gc_new(&config, NULL, NULL);
+    g_assert(!mms_gc_start(gc));
+    mms_gc_free(gc);
+
+    /* Nothing to walk */
+    config.keep_temp_files = FALSE;
+    gc = mms_gc_new(&config, NULL, NULL);
+    g_assert(mms_gc_start(gc));
+    g_assert(mms_gc_start(gc));
+    test_gc_run(gc);
+    mms_gc_free(gc);
+
+    mms_gc_free(NULL);
+    g_assert(!mms_gc_running(NULL));
+    rmdir(root);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * Orphans
+ *==========================================================================*/
+
+static
+void
+test_orphans(
+    void)
+{
+    static const char data[] = "data";
+    char* root = g_dir_make_tmp("test_gc_XXXXXX", NULL);
+    char* staging = g_build_filename(root, "staging", NULL);
+    char* msg = g_build_filename(root, MMS_MESSAGE_DIR, NULL);
+    char* staging_msg = g_build_filename(staging, MMS_MESSAGE_DIR, NULL);
+    char* old1 = test_gc_message(root, "1", data, TRUE);
+    char* old2 = test_gc_message(staging, "2", data, TRUE);
+    char* busy = test_gc_message(root, "3", data, TRUE);
+    char* fresh = test_gc_message(root, "4", data, FALSE);
+    MMSGcStats stats;
+    MMSConfig config;
+    MMSGc* gc;
+
+    mms_lib_default_config(&config);
+    config.root_dir = root;
+    config.staging_dir = staging;
+    config.orphan_secs = TEST_ORPHAN_SECS;
+    gc = mms_gc_new(&config, test_gc_busy, "3");
+    g_assert(mms_gc_start(gc));
+    test_gc_run(gc);
+
+    /* Old ones are gone, the busy and the fresh ones are still there */
+    g_assert(!g_file_test(old1, G_FILE_TEST_EXISTS));
+    g_assert(!g_file_test(old2, G_FILE_TEST_EXISTS));
+    g_assert(g_file_test(busy, G_FILE_TEST_IS_DIR));
+    g_assert(g_file_test(fresh, G_FILE_TEST_IS_DIR));
+    mms_gc_stats_get(gc, &stats);
+    g_assert_cmpuint(stats.dirs, == ,2);
+    g_assert_cmpuint(stats.bytes, == ,4*strlen(data));
+
+    /* Too early for another pass */
+    g_assert(!mms_gc_start(gc));
+    mms_gc_free(gc);
+
+    test_gc_remove_message(busy);
+    test_gc_remove_message(fresh);
+    rmdir(staging_msg);
+    rmdir(staging);
+    rmdir(msg);
+    rmdir(root);
+    g_free(old1);
+    g_free(old2);
+    g_free(busy);
+    g_free(fresh);
+    g_free(staging_msg);
+    g_free(staging);
+    g_free(msg);
+    g_free(root);
+}
+
+#define TEST_(x) "/GC/" x
+
+int main(int argc, char* argv[])
+{
+    int ret;
+
+    mms_lib_init(argv[0]);
+    g_test_init(&argc, &argv, NULL);
+    test_init(&test_opt, &argc, argv);
+    g_test_add_func(TEST_("Disabled"), test_disabled);
+    g_test_add_func(TEST_("Orphans"), test_orphans);
+    ret = g_test_run();
+    mms_lib_deinit();
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
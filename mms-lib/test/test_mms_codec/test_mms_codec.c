@@ -17,6 +17,7 @@
 #include "mms_lib_util.h"
 #include "mms_lib_log.h"
 #include "mms_codec.h"
+#include "mms_pdu_stream.h"
 
 #include <gutil_log.h>
 
@@ -24,6 +25,124 @@
 
 static TestOpt test_opt;
 
+static
+void
+check_attachment_iter(
+    const void* data,
+    gsize length,
+    const struct mms_message* msg)
+{
+    struct mms_message* msg2 = g_new0(struct mms_message, 1);
+    struct mms_message_attachment_iter iter;
+    struct mms_attachment_view view;
+    GSList* l = msg->attachments;
+
+    /* Iterator must produce the same parts as mms_message_decode */
+    g_assert(mms_message_attachment_iter_init(&iter, data, length, msg2));
+    g_assert(msg2->type == msg->type);
+    g_assert(!msg2->attachments);
+    while (mms_message_attachment_iter_next(&iter, &view)) {
+        const struct mms_attachment* part;
+        char* ct = view.charset ?
+            g_strconcat(view.mimetype, ";charset=", view.charset, NULL) :
+            g_strdup(view.mimetype);
+
+        g_assert(l);
+        part = l->data;
+        g_assert_cmpstr(part->content_type, ==, ct);
+        g_assert_cmpstr(part->content_id, ==, view.content_id);
+        g_assert_cmpstr(part->content_location, ==, view.content_location);
+        g_assert_cmpstr(part->transfer_encoding, ==, view.transfer_encoding);
+        g_assert(part->offset == view.offset);
+        g_assert(part->length == view.length);
+        g_assert(view.data == (const guint8*)data + view.offset);
+        g_free(ct);
+        l = l->next;
+    }
+    g_assert(!l);
+    g_assert(mms_message_attachment_iter_close(&iter));
+    mms_message_free(msg2);
+}
+
+static
+gboolean
+test_encode_write(
+    const void* data,
+    unsigned int len,
+    const struct mms_attachment* part,
+    void* user_data)
+{
+    g_byte_array_append(user_data, data, len);
+    return TRUE;
+}
+
+static
+void
+check_encode_stream(
+    const void* data,
+    struct mms_message* msg)
+{
+    const guint n = g_slist_length(msg->attachments);
+    GBytes** parts = g_new0(GBytes*, n + 1);
+    GByteArray* buf = g_byte_array_new();
+    GByteArray* wire = g_byte_array_new();
+    MMSPduStream* stream;
+    MMSPduStreamPos pos;
+    GBytes* chunk;
+    GSList* l;
+    char* path = NULL;
+    gchar* contents = NULL;
+    gsize len = 0;
+    int fd = g_file_open_tmp("test_mms_codec_XXXXXX", &path, NULL);
+    guint i;
+
+    /* The parts are encoded from the data of the decoded PDU */
+    for (l = msg->attachments, i = 0; l; l = l->next, i++) {
+        struct mms_attachment* part = l->data;
+
+        parts[i] = g_bytes_new_static((const guint8*)data + part->offset,
+            part->length);
+        part->data = g_bytes_get_data(parts[i], NULL);
+    }
+
+    /* Written to a file */
+    g_assert(fd >= 0);
+    g_assert(mms_message_encode(msg, fd));
+    close(fd);
+    g_assert(g_file_get_contents(path, &contents, &len, NULL));
+
+    /* Written through the callback */
+    g_assert(mms_message_encode_stream(msg, test_encode_write, buf));
+    g_assert_cmpuint(buf->len, ==, len);
+    g_assert(!memcmp(buf->data, contents, len));
+
+    /* Sent over the wire */
+    stream = mms_pdu_stream_encode(msg, parts);
+    g_assert(stream);
+    g_assert_cmpuint(mms_pdu_stream_size(stream), ==, len);
+    memset(&pos, 0, sizeof(pos));
+    while ((chunk = mms_pdu_stream_read(stream, &pos, 1000)) != NULL) {
+        gsize size = 0;
+        const void* bytes = g_bytes_get_data(chunk, &size);
+
+        g_byte_array_append(wire, bytes, size);
+        g_bytes_unref(chunk);
+    }
+    g_assert_cmpuint(wire->len, ==, len);
+    g_assert(!memcmp(wire->data, contents, len));
+
+    mms_pdu_stream_unref(stream);
+    for (i = 0; i < n; i++) {
+        g_bytes_unref(parts[i]);
+    }
+    g_byte_array_free(buf, TRUE);
+    g_byte_array_free(wire, TRUE);
+    unlink(path);
+    g_free(contents);
+    g_free(parts);
+    g_free(path);
+}
+
 static
 void
 run_test(
@@ -39,6 +158,11 @@ run_test(
     const gsize length = g_mapped_file_get_length(map);
 
     g_assert(mms_message_decode(data, length, msg));
+    check_attachment_iter(data, length, msg);
+    if (msg->type == MMS_MESSAGE_TYPE_SEND_REQ) {
+        /* All the ways of encoding it must produce the same bytes */
+        check_encode_stream(data, msg);
+    }
     g_mapped_file_unref(map);
     mms_message_free(msg);
     g_free(file2);
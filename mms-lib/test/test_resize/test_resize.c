@@ -21,6 +21,7 @@
 #include "mms_lib_util.h"
 #include "mms_lib_log.h"
 #include "mms_file_util.h"
+#include "mms_box_filter.h"
 
 #include <gutil_log.h>
 #include <gutil_macros.h>
@@ -37,6 +38,10 @@
 #include <jerror.h>
 #include <setjmp.h>
 
+#ifdef HAVE_GIFLIB
+#  include <gif_lib.h>
+#endif
+
 static TestOpt test_opt;
 
 typedef struct test_size {
@@ -49,6 +54,11 @@ typedef struct test_image_type {
     gboolean (*filesize)(const char* file, TestSize* size);
 } TestImageType;
 
+typedef struct test_animation {
+    unsigned int frames;
+    int delay;
+} TestAnimation;
+
 typedef struct test_desc {
     const char* name;
     const char* file;
@@ -56,6 +66,7 @@ typedef struct test_desc {
     int steps;
     int max_pixels;
     TestSize size;
+    TestAnimation anim;
 } TestDesc;
 
 typedef struct test_jpeg_error {
@@ -87,6 +98,14 @@ test_png_size(
     const char* file,
     TestSize* size);
 
+#ifdef HAVE_GIFLIB
+static
+gboolean
+test_gif_size(
+    const char* file,
+    TestSize* size);
+#endif
+
 static const TestImageType test_jpeg =
     { "image/jpeg", test_jpeg_size };
 
@@ -100,6 +119,11 @@ static const TestImageType test_auto_jpeg =
 static const TestImageType test_png =
     { "image/png", test_png_size };
 
+#ifdef HAVE_GIFLIB
+static const TestImageType test_gif =
+    { "image/gif", test_gif_size };
+#endif
+
 static const TestDesc resize_tests[] = {
     {
         "Jpeg_Portrait1",
@@ -136,6 +160,22 @@ static const TestDesc resize_tests[] = {
         3,
         3000000,
         {612, 816}
+    },{
+        /* Decoded at 1/2 scale, then averaged 3x3 */
+        "Jpeg_Portrait6",
+        "data/0004.jpg",
+        &test_jpeg,
+        1,
+        221952,
+        {408, 544}
+    },{
+        /* Decoded at 1/8 scale, nothing left for the box filter */
+        "Jpeg_Portrait7",
+        "data/0004.jpg",
+        &test_jpeg,
+        1,
+        124848,
+        {306, 408}
     },{
         "Jpeg_Landscape1",
         "data/0002.jpg",
@@ -185,6 +225,24 @@ static const TestDesc resize_tests[] = {
         3,
         3000000,
         {500, 375}
+#ifdef HAVE_GIFLIB
+    },{
+        "Gif_1",
+        "data/0005.gif",
+        &test_gif,
+        1,
+        5000,
+        {80, 60},
+        {4, 10} /* Scaling is enough, all frames are kept */
+    },{
+        "Gif_3",
+        "data/0005.gif",
+        &test_gif,
+        3,
+        5000,
+        {53, 40},
+        {2, 20} /* Every other frame is dropped */
+#endif
     }
 };
 
@@ -354,6 +412,55 @@ test_png_size(
     return ok;
 }
 
+#ifdef HAVE_GIFLIB
+static
+gboolean
+test_gif_size(
+    const char* file,
+    TestSize* size)
+{
+    gboolean ok = FALSE;
+    FILE* in = fopen(file, "rb");
+
+    if (in) {
+        /* Logical screen size follows the signature */
+        guint8 header[10];
+
+        if (fread(header, sizeof(header), 1, in) == 1 &&
+            !memcmp(header, "GIF8", 4)) {
+            size->width = header[6] | (header[7] << 8);
+            size->height = header[8] | (header[9] << 8);
+            ok = TRUE;
+        }
+        fclose(in);
+    }
+    return ok;
+}
+
+static
+void
+test_gif_check_animation(
+    const char* file,
+    const TestAnimation* anim)
+{
+    int err = 0;
+    GifFileType* gif = DGifOpenFileName(file, &err);
+    int i;
+
+    g_assert(gif);
+    g_assert_cmpint(DGifSlurp(gif), == ,GIF_OK);
+    g_assert_cmpint(gif->ImageCount, == ,anim->frames);
+    for (i = 0; i < gif->ImageCount; i++) {
+        GraphicsControlBlock gcb;
+
+        /* The dropped frames' delays go to the ones that are kept */
+        g_assert_cmpint(DGifSavedExtensionToGCB(gif, i, &gcb), == ,GIF_OK);
+        g_assert_cmpint(gcb.DelayTime, == ,anim->delay);
+    }
+    DGifCloseFile(gif, &err);
+}
+#endif
+
 static
 void
 run_test(
@@ -370,6 +477,7 @@ run_test(
     MMSAttachment* at;
     MMSAttachmentInfo info;
     MMSSettingsSimData sim_settings;
+    MMSDir* out;
     gboolean ok = TRUE;
     int i;
 
@@ -385,8 +493,11 @@ run_test(
 
     /* Copy the file */
     g_assert(mms_attachment_info_path(&info, test->file, NULL, NULL, &error));
-    g_assert(mms_copy_attachment(&info, testfile, &error));
+    out = mms_dir_open(dir, &error);
+    g_assert(out);
+    g_assert(mms_copy_attachment(&info, out, name, &error));
     mms_attachment_info_cleanup(&info);
+    mms_dir_close(out);
 
     mms_settings_sim_data_default(&sim_settings);
     sim_settings.max_pixels = test->max_pixels;
@@ -409,10 +520,18 @@ run_test(
         g_assert(test->type->filesize(at->file_name, &size));
         g_assert_cmpint(size.width, == ,test->size.width);
         g_assert_cmpint(size.height, == ,test->size.height);
+#ifdef HAVE_GIFLIB
+        if (test->anim.frames) {
+            test_gif_check_animation(at->file_name, &test->anim);
+        }
+#endif
         mms_attachment_reset(at);
         g_assert_cmpstr(at->file_name, == ,testfile);
     } else {
         g_assert(!ok && !test->size.width && !test->size.height);
+        /* The original is still there to be sent */
+        g_assert(at->map);
+        g_assert_cmpstr(at->file_name, == ,testfile);
     }
 
     /* Extra ref/unref improves the coverage */
@@ -427,6 +546,486 @@ run_test(
     test_dirs_cleanup(&dirs, TRUE);
 }
 
+/*==========================================================================*
+ * Plan
+ *==========================================================================*/
+
+#define TEST_PLAN_MARGIN (0.9)
+#define TEST_PLAN_ROUNDS (2)
+
+typedef struct test_plan_desc {
+    const char* name;
+    const char* file;
+    const TestImageType* type;
+    int divisor;
+} TestPlanDesc;
+
+static const TestPlanDesc plan_tests[] = {
+    { "Jpeg_Portrait", "data/0001.jpg", &test_jpeg, 8 },
+    { "Jpeg_Landscape", "data/0002.jpg", &test_jpeg, 8 },
+    { "Jpeg_Large", "data/0004.jpg", &test_jpeg, 16 },
+    { "Png", "data/0003.png", &test_png, 8 }
+};
+
+static
+gsize
+test_plan_size(
+    MMSAttachment* at)
+{
+    return g_mapped_file_get_length(at->map);
+}
+
+static
+void
+test_plan(
+    gconstpointer data)
+{
+    const TestPlanDesc* test = data;
+    char* name = g_path_get_basename(test->file);
+    char* testfile;
+    MMSConfig config;
+    MMSAttachment* at;
+    MMSAttachmentInfo info;
+    MMSSettingsSimData sim_settings;
+    MMSDir* out;
+    TestDirs dirs;
+    gsize target, size;
+    gint64 start, loop_us, plan_us;
+    int loop_count, plan_count;
+
+    test_dirs_init(&dirs, "test_resize");
+    mms_lib_default_config(&config);
+    config.root_dir = dirs.root;
+    config.keep_temp_files = (test_opt.flags & TEST_FLAG_DEBUG) != 0;
+    testfile = g_build_filename(dirs.root, name, NULL);
+
+    g_assert(mms_attachment_info_path(&info, test->file, NULL, NULL, NULL));
+    out = mms_dir_open(dirs.root, NULL);
+    g_assert(out);
+    g_assert(mms_copy_attachment(&info, out, name, NULL));
+    mms_attachment_info_cleanup(&info);
+    mms_dir_close(out);
+
+    /* Only the resolution changes, see test_quality for the quality */
+    mms_settings_sim_data_default(&sim_settings);
+    sim_settings.max_pixels = 0;
+    sim_settings.min_jpeg_quality = 0;
+    g_assert(mms_attachment_info_path(&info, testfile,
+        test->type->content_type, name, NULL));
+    at = mms_attachment_new(&config, &info, NULL);
+    mms_attachment_info_cleanup(&info);
+    g_assert(at);
+    target = test_plan_size(at) / test->divisor;
+
+    /* One step at a time */
+    start = g_get_monotonic_time();
+    for (loop_count = 0; (size = test_plan_size(at)) > target; loop_count++) {
+        g_assert(mms_attachment_resize(at, &sim_settings));
+    }
+    loop_us = g_get_monotonic_time() - start;
+    mms_attachment_reset(at);
+
+    /* Predictive, then one step at a time if that wasn't enough */
+    start = g_get_monotonic_time();
+    for (plan_count = 0; (size = test_plan_size(at)) > target; plan_count++) {
+        if (plan_count < TEST_PLAN_ROUNDS) {
+            g_assert(mms_attachment_resize_ratio(at, &sim_settings,
+                TEST_PLAN_MARGIN * target / size));
+        } else {
+            g_assert(mms_attachment_resize(at, &sim_settings));
+        }
+    }
+    plan_us = g_get_monotonic_time() - start;
+
+    GDEBUG("%s: %u -> %u bytes, %d step(s) in %u ms vs %d in %u ms", name,
+        (guint)(target * test->divisor), (guint)target, loop_count,
+        (guint)(loop_us / 1000), plan_count, (guint)(plan_us / 1000));
+    g_assert_cmpint(plan_count, <= ,loop_count);
+
+    /* Zero and negative ratios work like mms_attachment_resize */
+    mms_attachment_reset(at);
+    g_assert(mms_attachment_resize_ratio(at, &sim_settings, 0));
+    mms_attachment_unref(at);
+    g_assert(!mms_attachment_resize_ratio(NULL, &sim_settings, 0.5));
+
+    g_free(testfile);
+    g_free(name);
+    test_dirs_cleanup(&dirs, TRUE);
+}
+
+/*==========================================================================*
+ * Quality
+ *==========================================================================*/
+
+static
+void
+test_quality(
+    void)
+{
+    static const char file[] = "data/0001.jpg";
+    char* name = g_path_get_basename(file);
+    char* testfile;
+    MMSConfig config;
+    MMSAttachment* at;
+    MMSAttachmentInfo info;
+    MMSSettingsSimData sim_settings;
+    MMSDir* out;
+    TestDirs dirs;
+    TestSize orig, size;
+    gsize orig_size;
+
+    test_dirs_init(&dirs, "test_resize");
+    mms_lib_default_config(&config);
+    config.root_dir = dirs.root;
+    config.keep_temp_files = (test_opt.flags & TEST_FLAG_DEBUG) != 0;
+    testfile = g_build_filename(dirs.root, name, NULL);
+
+    g_assert(mms_attachment_info_path(&info, file, NULL, NULL, NULL));
+    out = mms_dir_open(dirs.root, NULL);
+    g_assert(out);
+    g_assert(mms_copy_attachment(&info, out, name, NULL));
+    mms_attachment_info_cleanup(&info);
+    mms_dir_close(out);
+    g_assert(test_jpeg_size(testfile, &orig));
+
+    mms_settings_sim_data_default(&sim_settings);
+    sim_settings.max_pixels = 0;
+    g_assert(mms_attachment_info_path(&info, testfile, test_jpeg.content_type,
+        name, NULL));
+    at = mms_attachment_new(&config, &info, NULL);
+    mms_attachment_info_cleanup(&info);
+    g_assert(at);
+    orig_size = g_mapped_file_get_length(at->map);
+
+    /* The quality goes down first, the resolution stays the same */
+    g_assert(mms_attachment_resize_ratio(at, &sim_settings, 0.8));
+    g_assert_cmpstr(at->file_name, != ,testfile);
+    g_assert(test_jpeg_size(at->file_name, &size));
+    g_assert_cmpuint(size.width, == ,orig.width);
+    g_assert_cmpuint(size.height, == ,orig.height);
+    GDEBUG("%u -> %u bytes", (guint)orig_size,
+        (guint)g_mapped_file_get_length(at->map));
+
+    /* Reset restores the original file and the quality */
+    mms_attachment_reset(at);
+    g_assert_cmpstr(at->file_name, == ,testfile);
+    g_assert_cmpuint(g_mapped_file_get_length(at->map), == ,orig_size);
+
+    /* Can't go below the floor, the resolution still stays the same */
+    g_assert(mms_attachment_resize_ratio(at, &sim_settings, 0.01));
+    g_assert(test_jpeg_size(at->file_name, &size));
+    g_assert_cmpuint(size.width, == ,orig.width);
+    g_assert_cmpuint(size.height, == ,orig.height);
+
+    /* The floor has been reached, now the resolution goes down */
+    g_assert(mms_attachment_resize_ratio(at, &sim_settings, 0.5));
+    g_assert(test_jpeg_size(at->file_name, &size));
+    g_assert_cmpuint(size.width, < ,orig.width);
+    g_assert_cmpuint(size.height, < ,orig.height);
+    mms_attachment_reset(at);
+
+    /* Zero floor disables the quality search */
+    sim_settings.min_jpeg_quality = 0;
+    g_assert(mms_attachment_resize_ratio(at, &sim_settings, 0.8));
+    g_assert(test_jpeg_size(at->file_name, &size));
+    g_assert_cmpuint(size.width, < ,orig.width);
+    g_assert_cmpuint(size.height, < ,orig.height);
+    mms_attachment_unref(at);
+
+    g_free(testfile);
+    g_free(name);
+    test_dirs_cleanup(&dirs, TRUE);
+}
+
+/*==========================================================================*
+ * Preview
+ *==========================================================================*/
+
+/* The EXIF thumbnail of 0006.jpg is red, the image itself is blue */
+typedef struct test_preview_desc {
+    const char* name;
+    int max_pixels;
+    TestSize size;
+    gboolean red;
+} TestPreviewDesc;
+
+static const TestPreviewDesc preview_tests[] = {
+    /* 1600x1200 => 320x240, oriented 6 */
+    { "Thumbnail", 76800, {240, 320}, TRUE },
+    /* 1600x1200 => 400x300, the thumbnail is too small */
+    { "Image", 120000, {300, 400}, FALSE }
+};
+
+static
+gboolean
+test_jpeg_center(
+    const char* file,
+    guint8 rgb[3])
+{
+    gboolean ok = FALSE;
+    FILE* in = fopen(file, "rb");
+    if (in) {
+        TestJpegError err;
+        struct jpeg_decompress_struct dec;
+        JSAMPROW row = NULL;
+        dec.err = jpeg_std_error(&err.pub);
+        err.pub.error_exit = test_jpeg_error_exit;
+        err.pub.output_message = test_jpeg_error_output;
+        if (!setjmp(err.setjmp_buf)) {
+            jpeg_create_decompress(&dec);
+            jpeg_stdio_src(&dec, in);
+            jpeg_read_header(&dec, TRUE);
+            dec.out_color_space = JCS_RGB;
+            jpeg_start_decompress(&dec);
+            row = g_malloc(dec.output_width * 3);
+            while (dec.output_scanline <= dec.output_height / 2) {
+                jpeg_read_scanlines(&dec, &row, 1);
+            }
+            memcpy(rgb, row + 3 * (dec.output_width / 2), 3);
+            ok = TRUE;
+        }
+        jpeg_destroy_decompress(&dec);
+        g_free(row);
+        fclose(in);
+    }
+    return ok;
+}
+
+static
+void
+test_preview(
+    gconstpointer data)
+{
+    const TestPreviewDesc* test = data;
+    static const char file[] = "data/0006.jpg";
+    char* name = g_path_get_basename(file);
+    char* testfile;
+    MMSConfig config;
+    MMSAttachment* at;
+    MMSAttachmentInfo info;
+    MMSSettingsSimData sim_settings;
+    MMSDir* out;
+    TestDirs dirs;
+    TestSize size;
+    guint8 rgb[3];
+
+    test_dirs_init(&dirs, "test_resize");
+    mms_lib_default_config(&config);
+    config.root_dir = dirs.root;
+    config.keep_temp_files = (test_opt.flags & TEST_FLAG_DEBUG) != 0;
+    testfile = g_build_filename(dirs.root, name, NULL);
+
+    g_assert(mms_attachment_info_path(&info, file, NULL, NULL, NULL));
+    out = mms_dir_open(dirs.root, NULL);
+    g_assert(out);
+    g_assert(mms_copy_attachment(&info, out, name, NULL));
+    mms_attachment_info_cleanup(&info);
+    mms_dir_close(out);
+
+    mms_settings_sim_data_default(&sim_settings);
+    sim_settings.max_pixels = test->max_pixels;
+    g_assert(mms_attachment_info_path(&info, testfile, test_jpeg.content_type,
+        name, NULL));
+    at = mms_attachment_new(&config, &info, NULL);
+    mms_attachment_info_cleanup(&info);
+    g_assert(at);
+
+    /* Same size either way, the orientation is preserved */
+    g_assert(mms_attachment_resize(at, &sim_settings));
+    g_assert(test_jpeg_size(at->file_name, &size));
+    g_assert_cmpuint(size.width, == ,test->size.width);
+    g_assert_cmpuint(size.height, == ,test->size.height);
+
+    /* And the colour tells where the pixels came from */
+    g_assert(test_jpeg_center(at->file_name, rgb));
+    if (test->red) {
+        g_assert_cmpuint(rgb[0], > ,rgb[2]);
+    } else {
+        g_assert_cmpuint(rgb[0], < ,rgb[2]);
+    }
+    mms_attachment_unref(at);
+
+    g_free(testfile);
+    g_free(name);
+    test_dirs_cleanup(&dirs, TRUE);
+}
+
+/*==========================================================================*
+ * BoxFilter
+ *==========================================================================*/
+
+#define TEST_BOX_ROWS (3)
+
+static const MMS_BOX_FILTER_IMPL test_box_impls[] = {
+    MMS_BOX_FILTER_AUTO,
+    MMS_BOX_FILTER_SSE2,
+    MMS_BOX_FILTER_NEON
+};
+
+/* Returns the number of differences between the scalar and vector rows */
+static
+guint
+test_box_filter_compare(
+    MMS_BOX_FILTER_IMPL impl,
+    GRand* rand,
+    guint out_width,
+    guint nx,
+    guint ny,
+    gboolean max)
+{
+    /* Extra columns on the right side are ignored */
+    const guint in_bytes = 3 * (out_width * nx + nx - 1);
+    const guint out_bytes = 3 * out_width;
+    MMSBoxFilter* scalar = mms_box_filter_new(out_width, nx, ny,
+        MMS_BOX_FILTER_SCALAR);
+    MMSBoxFilter* vector = mms_box_filter_new(out_width, nx, ny, impl);
+    guint8* in = g_malloc(in_bytes);
+    guint8* out1 = g_malloc(out_bytes);
+    guint8* out2 = g_malloc(out_bytes);
+    guint i, diffs = 0;
+
+    g_assert_cmpint(mms_box_filter_impl(scalar), == ,MMS_BOX_FILTER_SCALAR);
+    for (i = 0; i < ny * TEST_BOX_ROWS; i++) {
+        gboolean emit1, emit2;
+        guint k;
+
+        for (k = 0; k < in_bytes; k++) {
+            in[k] = max ? 0xff : (guint8)g_rand_int(rand);
+        }
+        emit1 = mms_box_filter_add_row(scalar, in, out1);
+        emit2 = mms_box_filter_add_row(vector, in, out2);
+        g_assert(emit1 == emit2);
+        g_assert(emit1 == ((i % ny) == (ny - 1)));
+        if (emit1 && memcmp(out1, out2, out_bytes)) {
+            diffs++;
+        }
+    }
+
+    mms_box_filter_free(scalar);
+    mms_box_filter_free(vector);
+    g_free(in);
+    g_free(out1);
+    g_free(out2);
+    return diffs;
+}
+
+static
+void
+test_box_filter(
+    void)
+{
+    GRand* rand = g_rand_new_with_seed(4321);
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(test_box_impls); i++) {
+        const MMS_BOX_FILTER_IMPL impl = test_box_impls[i];
+        guint w, nx, ny;
+
+        if (!mms_box_filter_impl_supported(impl)) {
+            GDEBUG("%s is not supported", mms_box_filter_impl_name(impl));
+            continue;
+        }
+
+        /* Various widths to exercise the tails */
+        for (w = 1; w <= 37; w += 3) {
+            for (nx = 1; nx <= 6; nx++) {
+                for (ny = 1; ny <= 6; ny++) {
+                    g_assert_cmpuint(test_box_filter_compare(impl, rand,
+                        w, nx, ny, FALSE), == ,0);
+                    g_assert_cmpuint(test_box_filter_compare(impl, rand,
+                        w, nx, ny, TRUE), == ,0);
+                }
+            }
+        }
+
+        /* Large boxes, including the ones too large for reciprocals */
+        g_assert_cmpuint(test_box_filter_compare(impl, rand,
+            17, 63, 64, TRUE), == ,0);
+        g_assert_cmpuint(test_box_filter_compare(impl, rand,
+            17, 64, 64, TRUE), == ,0);
+        g_assert_cmpuint(test_box_filter_compare(impl, rand,
+            17, 70, 70, FALSE), == ,0);
+    }
+
+    /* Unsupported ones fall back to scalar */
+    for (i = 0; i < G_N_ELEMENTS(test_box_impls); i++) {
+        const MMS_BOX_FILTER_IMPL impl = test_box_impls[i];
+
+        if (!mms_box_filter_impl_supported(impl)) {
+            MMSBoxFilter* filter = mms_box_filter_new(1, 2, 2, impl);
+
+            g_assert_cmpint(mms_box_filter_impl(filter), == ,
+                MMS_BOX_FILTER_SCALAR);
+            mms_box_filter_free(filter);
+        }
+    }
+    g_assert_cmpstr(mms_box_filter_impl_name(MMS_BOX_FILTER_SCALAR), == ,
+        "scalar");
+    g_assert(!mms_box_filter_new(0, 1, 1, MMS_BOX_FILTER_AUTO));
+    mms_box_filter_free(NULL);
+    g_rand_free(rand);
+}
+
+/*==========================================================================*
+ * BoxFilterBenchmark
+ *==========================================================================*/
+
+/* 12 MP downscaled 4 times in each direction */
+#define TEST_BENCHMARK_WIDTH (4000)
+#define TEST_BENCHMARK_HEIGHT (3000)
+#define TEST_BENCHMARK_STEP (4)
+
+static
+gint64
+test_box_filter_benchmark_run(
+    MMS_BOX_FILTER_IMPL impl,
+    const guint8* in,
+    guint8* out)
+{
+    const gint64 start = g_get_monotonic_time();
+    MMSBoxFilter* filter = mms_box_filter_new(TEST_BENCHMARK_WIDTH /
+        TEST_BENCHMARK_STEP, TEST_BENCHMARK_STEP, TEST_BENCHMARK_STEP, impl);
+    guint y;
+
+    for (y = 0; y < TEST_BENCHMARK_HEIGHT; y++) {
+        mms_box_filter_add_row(filter, in, out);
+    }
+    mms_box_filter_free(filter);
+    return MAX(g_get_monotonic_time() - start, 1);
+}
+
+static
+void
+test_box_filter_benchmark(
+    void)
+{
+    const gsize size = 3 * TEST_BENCHMARK_WIDTH;
+    GRand* rand = g_rand_new_with_seed(1234);
+    guint8* in = g_malloc(size);
+    guint8* out = g_malloc(size);
+    gint64 scalar_us;
+    gsize i;
+
+    for (i = 0; i < size; i++) {
+        in[i] = (guint8)g_rand_int(rand);
+    }
+    scalar_us = test_box_filter_benchmark_run(MMS_BOX_FILTER_SCALAR, in, out);
+    for (i = 0; i < G_N_ELEMENTS(test_box_impls); i++) {
+        const MMS_BOX_FILTER_IMPL impl = test_box_impls[i];
+
+        if (mms_box_filter_impl_supported(impl)) {
+            const gint64 us = test_box_filter_benchmark_run(impl, in, out);
+
+            GDEBUG("%s: %u ms vs %u ms (scalar)",
+                mms_box_filter_impl_name(impl), (guint)(us / 1000),
+                (guint)(scalar_us / 1000));
+        }
+    }
+    g_free(in);
+    g_free(out);
+    g_rand_free(rand);
+}
+
 #define TEST_(x) "/Resize/" x
 
 int main(int argc, char* argv[])
@@ -444,6 +1043,23 @@ int main(int argc, char* argv[])
         g_test_add_data_func(name, test, run_test);
         g_free(name);
     }
+    for (i = 0; i < G_N_ELEMENTS(plan_tests); i++) {
+        const TestPlanDesc* test = plan_tests + i;
+        char* name = g_strdup_printf(TEST_("Plan/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_plan);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("Quality"), test_quality);
+    for (i = 0; i < G_N_ELEMENTS(preview_tests); i++) {
+        const TestPreviewDesc* test = preview_tests + i;
+        char* name = g_strdup_printf(TEST_("Preview/%s"), test->name);
+
+        g_test_add_data_func(name, test, test_preview);
+        g_free(name);
+    }
+    g_test_add_func(TEST_("BoxFilter"), test_box_filter);
+    g_test_add_func(TEST_("BoxFilterBenchmark"), test_box_filter_benchmark);
     ret = g_test_run();
     mms_lib_deinit();
     return ret;
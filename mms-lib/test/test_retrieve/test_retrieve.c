@@ -63,6 +63,7 @@ typedef struct test_desc {
 #define TEST_CONNECTION_FAILURE       (0x08)
 #define TEST_OFFLINE                  (0x10)
 #define TEST_CANCEL_RECEIVED          (0x20)
+#define TEST_VIRTUAL_PARTS            (0x40)
 
 } TestDesc;
 
@@ -219,6 +220,32 @@ static const TestDesc retrieve_tests[] = {
         TEST_PARTS(retrieve_success1_parts),
         LOCALHOST,
         TEST_DEFER_RECEIVE | TEST_CANCEL_RECEIVED
+     },{
+        "VirtualParts",
+        "Success1",
+        "m-notification.ind",
+        "m-retrieve.conf",
+        SOUP_STATUS_OK,
+        MMS_CONTENT_TYPE,
+        NULL,
+        MMS_RECEIVE_STATE_DECODING,
+        MMS_MESSAGE_TYPE_ACKNOWLEDGE_IND,
+        TEST_PARTS(retrieve_success1_parts),
+        LOCALHOST,
+        TEST_VIRTUAL_PARTS
+     },{
+        "VirtualPartsBase64", /* Text parts are decoded to files */
+        "Base64",
+        "m-notification.ind",
+        "m-retrieve.conf",
+        SOUP_STATUS_OK,
+        MMS_CONTENT_TYPE,
+        NULL,
+        MMS_RECEIVE_STATE_DECODING,
+        MMS_MESSAGE_TYPE_ACKNOWLEDGE_IND,
+        TEST_PARTS(retrieve_transfer_encoding_parts),
+        LOCALHOST,
+        TEST_VIRTUAL_PARTS
      },{
         "Expired1",
         NULL,
@@ -365,6 +392,32 @@ static const TestDesc retrieve_tests[] = {
     }
 };
 
+static
+gboolean
+retrieve_test_range_equal(
+    const char* path,
+    gsize offset,
+    gsize length,
+    const char* sample)
+{
+    gboolean equal = FALSE;
+    GMappedFile* f1 = g_mapped_file_new(path, FALSE, NULL);
+    GMappedFile* f2 = g_mapped_file_new(sample, FALSE, NULL);
+
+    if (f1 && f2 && g_mapped_file_get_length(f2) == length &&
+        g_mapped_file_get_length(f1) >= offset + length) {
+        equal = !memcmp(g_mapped_file_get_contents(f1) + offset,
+            g_mapped_file_get_contents(f2), length);
+    }
+    if (f1) g_mapped_file_unref(f1);
+    if (f2) g_mapped_file_unref(f2);
+    if (!equal) {
+        GERR("%s (%u bytes at %u) is not identical to %s", path,
+            (guint)length, (guint)offset, sample);
+    }
+    return equal;
+}
+
 static
 void
 retrieve_test_validate_parts(
@@ -385,11 +438,19 @@ retrieve_test_validate_parts(
                 expect->file_name, NULL);
             const char* fname;
 
-            G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
-            fname = g_basename(part->file);
-            G_GNUC_END_IGNORE_DEPRECATIONS;
-
-            g_assert(test_files_equal(part->file, sample));
+            if (part->file) {
+                G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
+                fname = g_basename(part->file);
+                G_GNUC_END_IGNORE_DEPRECATIONS;
+                g_assert(test_files_equal(part->file, sample));
+            } else {
+                /* Virtual part */
+                g_assert(desc->flags & TEST_VIRTUAL_PARTS);
+                g_assert(msg->pdu);
+                fname = part->name;
+                g_assert(retrieve_test_range_equal(msg->pdu, part->offset,
+                    part->length, sample));
+            }
             g_assert_cmpstr(expect->content_type, == ,part->content_type);
             g_assert_cmpstr(expect->file_name, == ,fname);
             g_assert(part->content_id);
@@ -543,6 +604,7 @@ run_test(
     config.keep_temp_files = (test_opt.flags & TEST_FLAG_DEBUG) != 0;
     config.network_idle_secs = 0;
     config.attic_enabled = TRUE;
+    config.virtual_parts = (desc->flags & TEST_VIRTUAL_PARTS) != 0;
 
     memset(&test, 0, sizeof(test));
     test.desc = desc;
@@ -25,13 +25,20 @@
 #include "mms_settings.h"
 #include "mms_dispatcher.h"
 #include "mms_attachment_info.h"
+#include "mms_resize_cache.h"
+#include "mms_sniff.h"
 
 #include <gutil_macros.h>
 #include <gutil_log.h>
 #include <gio/gio.h>
 #include <libsoup/soup-status.h>
 
+#ifdef HAVE_MAGIC
+#  include <magic.h>
+#endif
+
 #define DATA_DIR "data"
+#define BENCHMARK_ROUNDS (20)
 
 static TestOpt test_opt;
 
@@ -63,6 +70,8 @@ typedef struct test_desc {
 #define TEST_FLAG_CANCEL                  (0x1000)
 #define TEST_FLAG_NO_SIM                  (0x2000)
 #define TEST_FLAG_DONT_CONVERT_TO_UTF8    (0x4000)
+#define TEST_FLAG_STAGING                 (0x8000)
+#define TEST_FLAG_RESIZE_CACHE            (0x10000)
 #define TEST_FLAG_REQUEST_DELIVERY_REPORT MMS_SEND_FLAG_REQUEST_DELIVERY_REPORT
 #define TEST_FLAG_REQUEST_READ_REPORT     MMS_SEND_FLAG_REQUEST_READ_REPORT
 
@@ -73,7 +82,9 @@ typedef struct test_desc {
 #define TEST_PRIVATE_FLAGS (\
   TEST_FLAG_CANCEL         |\
   TEST_FLAG_NO_SIM         |\
-  TEST_FLAG_DONT_CONVERT_TO_UTF8)
+  TEST_FLAG_DONT_CONVERT_TO_UTF8 |\
+  TEST_FLAG_STAGING        |\
+  TEST_FLAG_RESIZE_CACHE)
 G_STATIC_ASSERT(!(TEST_PRIVATE_FLAGS & TEST_DISPATCHER_FLAGS));
 
 typedef struct test {
@@ -111,6 +122,11 @@ static const TestAttachment test_files_reject [] = {
     { "test.txt", "text/plain", "text" }
 };
 
+static const TestAttachment test_resize [] = {
+    { "0001.jpg", "image/jpeg", "image1" },
+    { "0002.jpg", "image/jpeg", "image2" }
+};
+
 static const TestAttachment test_txt [] = {
     { "test.txt", NULL, "text" }
 };
@@ -280,6 +296,38 @@ static const TestDesc send_tests[] = {
         MMS_SEND_STATE_TOO_BIG,
         NULL,
         NULL
+    },{
+        "Staging",
+        ATTACHMENTS(test_txt),
+        0,
+        "Transient files in the staging area",
+        "+1234567890",
+        NULL,
+        NULL,
+        NULL,
+        TEST_FLAG_STAGING,
+        "m-send.conf",
+        MMS_CONTENT_TYPE,
+        SOUP_STATUS_OK,
+        MMS_SEND_STATE_SENDING,
+        NULL,
+        "TestMessageId"
+    },{
+        "Resize",
+        ATTACHMENTS(test_resize),
+        300000,
+        "Resized in parallel, then sent again from the cache",
+        "+1234567890",
+        NULL,
+        NULL,
+        NULL,
+        TEST_FLAG_RESIZE_CACHE,
+        "m-send.conf",
+        MMS_CONTENT_TYPE,
+        SOUP_STATUS_OK,
+        MMS_SEND_STATE_SENDING,
+        NULL,
+        "TestMessageId"
     },{
         "NoSim",
         NULL, 0,
@@ -356,14 +404,13 @@ run_test(
     const TestDesc* desc = data;
     MMSConfig config;
     MMSSettings* settings;
+    MMSResizeCacheStats stats[3];
     GError* error = NULL;
     TestDirs dirs;
     Test test;
     guint port;
-    int i;
-    const char* id;
-    char* imsi;
-    char* imsi2;
+    int i, k, sends = 1;
+    char* staging = NULL;
 
     test_dirs_init(&dirs, "test_send");
     mms_lib_default_config(&config);
@@ -374,6 +421,14 @@ run_test(
     if (desc->flags & TEST_FLAG_DONT_CONVERT_TO_UTF8) {
         config.convert_to_utf8 = FALSE;
     }
+    if (desc->flags & TEST_FLAG_STAGING) {
+        staging = g_build_filename(dirs.root, "staging", NULL);
+        config.staging_dir = staging;
+    }
+    if (desc->flags & TEST_FLAG_RESIZE_CACHE) {
+        config.resize_cache = 4000000;
+        sends = 2;
+    }
 
     settings = mms_settings_default_new(&config);
 
@@ -427,23 +482,49 @@ run_test(
     }
     mms_settings_unref(settings);
 
-    /* Send message and run the event loop */
-    imsi = desc->imsi ? g_strdup(desc->imsi) :
-        mms_connman_default_imsi(test.cm);
-    id = mms_handler_test_send_new(test.handler, imsi);
-    imsi2 = mms_dispatcher_send_message(test.disp, id, desc->imsi,
-        desc->to, desc->cc, desc->bcc, desc->subject,
-        desc->flags & TEST_DISPATCHER_FLAGS, test.parts,
-        desc->nparts, &error);
-    test.id = g_strdup(id);
-    if (imsi2) {
-        g_assert(!desc->imsi || !g_strcmp0(desc->imsi, imsi2));
-        g_assert(mms_dispatcher_start(test.disp));
-        test_run_loop(&test_opt, test.loop);
-    } else {
-        g_assert(desc->flags & TEST_FLAG_NO_SIM);
-        g_assert(error);
-        g_error_free(error);
+    /* Send message(s) and run the event loop */
+    mms_resize_cache_stats_get(stats);
+    for (k = 0; k < sends; k++) {
+        char* imsi = desc->imsi ? g_strdup(desc->imsi) :
+            mms_connman_default_imsi(test.cm);
+        const char* id = mms_handler_test_send_new(test.handler, imsi);
+        char* imsi2 = mms_dispatcher_send_message(test.disp, id, desc->imsi,
+            desc->to, desc->cc, desc->bcc, desc->subject,
+            desc->flags & TEST_DISPATCHER_FLAGS, test.parts,
+            desc->nparts, &error);
+
+        g_free(test.id);
+        test.id = g_strdup(id);
+        if (imsi2) {
+            g_assert(!desc->imsi || !g_strcmp0(desc->imsi, imsi2));
+            if (k > 0) {
+                test_http_add_response(test.http, test.resp_file,
+                    desc->resp_type, desc->resp_status);
+            }
+            g_assert(mms_dispatcher_start(test.disp));
+            test_run_loop(&test_opt, test.loop);
+        } else {
+            g_assert(desc->flags & TEST_FLAG_NO_SIM);
+            g_assert(error);
+            g_clear_error(&error);
+        }
+        mms_resize_cache_stats_get(stats + k + 1);
+        g_free(imsi);
+        g_free(imsi2);
+    }
+
+    if (desc->flags & TEST_FLAG_RESIZE_CACHE) {
+        char* cache = g_build_filename(dirs.root, MMS_RESIZE_CACHE_DIR, NULL);
+
+        /* The first time something gets resized, the second time not */
+        g_assert_cmpuint(stats[1].hits - stats[0].hits, < ,
+            stats[1].lookups - stats[0].lookups);
+        g_assert_cmpuint(stats[2].lookups - stats[1].lookups, > ,0);
+        g_assert_cmpuint(stats[2].hits - stats[1].hits, == ,
+            stats[2].lookups - stats[1].lookups);
+        mms_resize_cache_trim(dirs.root, 0);
+        g_assert(!rmdir(cache));
+        g_free(cache);
     }
 
     /* Done */
@@ -463,11 +544,171 @@ run_test(
     g_free(test.parts);
     g_free(test.id);
 
-    g_free(imsi);
-    g_free(imsi2);
+    /* Staging area must be cleaned up */
+    g_assert_cmpuint(mms_file_staging_used(), == ,0);
+    if (staging) {
+        if (!config.keep_temp_files) {
+            g_assert(!rmdir(staging));
+        }
+        g_free(staging);
+    }
+    test_dirs_cleanup(&dirs, TRUE);
+}
+
+#ifdef HAVE_MAGIC
+
+/*==========================================================================*
+ * Benchmark
+ *
+ * sendMessage latency for a message with 10 attachments, none of which
+ * has a content type, so that all of them get sniffed. It's measured
+ * right after the calling thread has dropped its magic database (that
+ * is, the first message) and with the database already loaded. For
+ * comparison, it also measures what sniffing these parts used to cost
+ * when every lookup opened and loaded the database on its own.
+ *==========================================================================*/
+
+static const TestAttachment test_benchmark_parts [] = {
+    { "smil", NULL, NULL },
+    { "0001", NULL, "image1" },
+    { "0001", NULL, "image2" },
+    { "0001", NULL, "image3" },
+    { "0001", NULL, "image4" },
+    { "0001", NULL, "image5" },
+    { "test.text", NULL, "text1" },
+    { "test.text", NULL, "text2" },
+    { "test.text", NULL, "text3" },
+    { "test.text", NULL, "text4" }
+};
+
+static
+gint64
+test_benchmark_send(
+    MMSDispatcher* disp,
+    MMSHandler* handler,
+    const MMSAttachmentInfo* parts,
+    gboolean cold)
+{
+    gint64 usec = 0;
+    guint i;
+
+    for (i = 0; i < BENCHMARK_ROUNDS; i++) {
+        const char* id = mms_handler_test_send_new(handler, "IMSI");
+        GError* error = NULL;
+        gint64 start;
+        char* imsi;
+
+        if (cold) {
+            mms_sniff_cleanup();
+        }
+        start = g_get_monotonic_time();
+        imsi = mms_dispatcher_send_message(disp, id, "IMSI", "+1234567890",
+            NULL, NULL, "Benchmark", 0, parts,
+            G_N_ELEMENTS(test_benchmark_parts), &error);
+        usec += g_get_monotonic_time() - start;
+        g_assert(imsi);
+        g_assert(!error);
+        g_free(imsi);
+    }
+    return usec / BENCHMARK_ROUNDS;
+}
+
+/* Sniffing the way it was done before the magic database was shared */
+static
+const char*
+test_benchmark_magic_lookup(
+    magic_t magic,
+    const MMSAttachmentInfo* ai)
+{
+    g_assert(magic);
+    g_assert(!magic_load(magic, NULL));
+    return magic_buffer(magic, ai->data, ai->size);
+}
+
+static
+gint64
+test_benchmark_sniff_per_part(
+    const MMSAttachmentInfo* parts)
+{
+    const gint64 start = g_get_monotonic_time();
+    guint i, k;
+
+    for (k = 0; k < BENCHMARK_ROUNDS; k++) {
+        for (i = 0; i < G_N_ELEMENTS(test_benchmark_parts); i++) {
+            const MMSAttachmentInfo* ai = parts + i;
+            magic_t magic = magic_open(MAGIC_MIME_TYPE);
+            const char* type = test_benchmark_magic_lookup(magic, ai);
+
+            if (type && g_str_has_prefix(type, "text/")) {
+                magic_t magic2 = magic_open(MAGIC_MIME_ENCODING);
+
+                g_assert(test_benchmark_magic_lookup(magic2, ai));
+                magic_close(magic2);
+            }
+            magic_close(magic);
+        }
+    }
+    return (g_get_monotonic_time() - start) / BENCHMARK_ROUNDS;
+}
+
+static
+void
+test_benchmark(
+    void)
+{
+    const guint n = G_N_ELEMENTS(test_benchmark_parts);
+    MMSAttachmentInfo parts[G_N_ELEMENTS(test_benchmark_parts)];
+    char* files[G_N_ELEMENTS(test_benchmark_parts)];
+    MMSConfig config;
+    MMSSettings* settings;
+    MMSConnMan* cm;
+    MMSHandler* handler;
+    MMSDispatcher* disp;
+    gint64 cold, warm, sniff;
+    TestDirs dirs;
+    guint i;
+
+    test_dirs_init(&dirs, "test_send");
+    mms_lib_default_config(&config);
+    config.root_dir = dirs.root;
+    config.network_idle_secs = 0;
+
+    memset(parts, 0, sizeof(parts));
+    for (i = 0; i < n; i++) {
+        files[i] = g_build_filename(DATA_DIR, "AcceptNoExt",
+            test_benchmark_parts[i].file_name, NULL);
+        g_assert(mms_attachment_info_path(parts + i, files[i], NULL,
+            test_benchmark_parts[i].content_id, NULL));
+    }
+
+    settings = mms_settings_default_new(&config);
+    cm = mms_connman_test_new();
+    handler = mms_handler_test_new();
+    disp = mms_dispatcher_new(settings, cm, handler, NULL);
+    mms_settings_unref(settings);
+
+    /* The messages are never sent, they are cancelled by unref */
+    cold = test_benchmark_send(disp, handler, parts, TRUE);
+    warm = test_benchmark_send(disp, handler, parts, FALSE);
+    sniff = test_benchmark_sniff_per_part(parts);
+    GDEBUG("sendMessage (%u parts): %u us (first), %u us (next)", n,
+        (guint)cold, (guint)warm);
+    GDEBUG("Loading the magic database per lookup: +%u us per message",
+        (guint)sniff);
+
+    mms_dispatcher_unref(disp);
+    mms_handler_unref(handler);
+    mms_connman_unref(cm);
+    for (i = 0; i < n; i++) {
+        mms_attachment_info_cleanup(parts + i);
+        g_free(files[i]);
+    }
+    g_assert_cmpuint(mms_file_staging_used(), == ,0);
     test_dirs_cleanup(&dirs, TRUE);
 }
 
+#endif /* HAVE_MAGIC */
+
 #define TEST_(x) "/Send/" x
 
 int main(int argc, char* argv[])
@@ -485,6 +726,9 @@ int main(int argc, char* argv[])
         g_test_add_data_func(name, test, run_test);
         g_free(name);
     }
+#ifdef HAVE_MAGIC
+    g_test_add_func(TEST_("Benchmark"), test_benchmark);
+#endif
     ret = g_test_run();
     mms_lib_deinit();
     return ret;
@@ -30,14 +30,20 @@ typedef struct test_desc {
     MMSSettingsSimData defaults;
 } TestDesc;
 
+#define DEFAULT_DECODE_LIMITS \
+    MMS_CONFIG_DEFAULT_MAX_HEADERS, MMS_CONFIG_DEFAULT_MAX_PARTS, \
+    MMS_CONFIG_DEFAULT_MAX_TEXT, MMS_CONFIG_DEFAULT_DECODE_MS
 #define DEFAULT_CONFIG \
     MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS, \
     MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS, MMS_CONFIG_DEFAULT_IDLE_SECS, \
-    FALSE, FALSE
+    FALSE, FALSE, FALSE, DEFAULT_DECODE_LIMITS, FALSE, \
+    MMS_CONFIG_DEFAULT_SYNC, FALSE, MMS_CONFIG_DEFAULT_STAGING_DIR, \
+    MMS_CONFIG_DEFAULT_STAGING_LIMIT, MMS_CONFIG_DEFAULT_ORPHAN_SECS, \
+    MMS_CONFIG_DEFAULT_RESIZE_CACHE
 #define DEFAULT_SETTINGS \
     MMS_SETTINGS_DEFAULT_USER_AGENT, MMS_SETTINGS_DEFAULT_UAPROF, \
     MMS_SETTINGS_DEFAULT_SIZE_LIMIT, MMS_SETTINGS_DEFAULT_MAX_PIXELS, \
-    MMS_SETTINGS_DEFAULT_ALLOW_DR
+    MMS_SETTINGS_DEFAULT_ALLOW_DR, MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY
 
 static const TestDesc tests [] = {
     {
@@ -52,55 +58,159 @@ static const TestDesc tests [] = {
         "RootDir",
         { "TestRootDir", MMS_CONFIG_DEFAULT_RETRY_SECS,
           MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
-          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE },
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE,
+          MMS_CONFIG_DEFAULT_SYNC, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
         { DEFAULT_SETTINGS }
     },{
         "RetryDelay",
         { MMS_CONFIG_DEFAULT_ROOT_DIR, 111,
           MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
-          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE },
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE,
+          MMS_CONFIG_DEFAULT_SYNC, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
         { DEFAULT_SETTINGS }
     },{
         "NetworkIdleTimeout",
         { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
-          111, MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE },
+          111, MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE,
+          MMS_CONFIG_DEFAULT_SYNC, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
         { DEFAULT_SETTINGS }
     },{
         "IdleTimeout",
         { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
           MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
-          222, FALSE, FALSE },
+          222, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE,
+          MMS_CONFIG_DEFAULT_SYNC, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "DecodeLimits",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, 100, 10, 1000, 50, FALSE, MMS_CONFIG_DEFAULT_SYNC, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "VirtualParts",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, TRUE, MMS_CONFIG_DEFAULT_SYNC, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "Sync",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE, MMS_SYNC_FILE, FALSE,
+          MMS_CONFIG_DEFAULT_STAGING_DIR, MMS_CONFIG_DEFAULT_STAGING_LIMIT,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "SyncInvalid",
+        { DEFAULT_CONFIG },
+        { DEFAULT_SETTINGS }
+    },{
+        "Deduplicate",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE, MMS_CONFIG_DEFAULT_SYNC,
+          TRUE, MMS_CONFIG_DEFAULT_STAGING_DIR,
+          MMS_CONFIG_DEFAULT_STAGING_LIMIT, MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "Staging",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE, MMS_CONFIG_DEFAULT_SYNC,
+          FALSE, "TestStagingDir", 1000000,
+          MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "OrphanTimeout",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE, MMS_CONFIG_DEFAULT_SYNC,
+          FALSE, MMS_CONFIG_DEFAULT_STAGING_DIR,
+          MMS_CONFIG_DEFAULT_STAGING_LIMIT, 0,
+          MMS_CONFIG_DEFAULT_RESIZE_CACHE },
+        { DEFAULT_SETTINGS }
+    },{
+        "ResizeCache",
+        { MMS_CONFIG_DEFAULT_ROOT_DIR, MMS_CONFIG_DEFAULT_RETRY_SECS,
+          MMS_CONFIG_DEFAULT_NETWORK_IDLE_SECS,
+          MMS_CONFIG_DEFAULT_IDLE_SECS, FALSE, FALSE,
+          FALSE, DEFAULT_DECODE_LIMITS, FALSE, MMS_CONFIG_DEFAULT_SYNC,
+          FALSE, MMS_CONFIG_DEFAULT_STAGING_DIR,
+          MMS_CONFIG_DEFAULT_STAGING_LIMIT, MMS_CONFIG_DEFAULT_ORPHAN_SECS,
+          4000000 },
         { DEFAULT_SETTINGS }
     },{
         "UserAgent",
         { DEFAULT_CONFIG },
         { "TestUserAgent", MMS_SETTINGS_DEFAULT_UAPROF,
           MMS_SETTINGS_DEFAULT_SIZE_LIMIT, MMS_SETTINGS_DEFAULT_MAX_PIXELS,
-          MMS_SETTINGS_DEFAULT_ALLOW_DR }
+          MMS_SETTINGS_DEFAULT_ALLOW_DR,
+          MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY }
     },{
         "UAProfile",
         { DEFAULT_CONFIG },
         { MMS_SETTINGS_DEFAULT_USER_AGENT, "TestUAProfile",
           MMS_SETTINGS_DEFAULT_SIZE_LIMIT, MMS_SETTINGS_DEFAULT_MAX_PIXELS,
-          MMS_SETTINGS_DEFAULT_ALLOW_DR }
+          MMS_SETTINGS_DEFAULT_ALLOW_DR,
+          MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY }
     },{
         "SizeLimit",
         { DEFAULT_CONFIG },
         { MMS_SETTINGS_DEFAULT_USER_AGENT, MMS_SETTINGS_DEFAULT_UAPROF,
           100000, MMS_SETTINGS_DEFAULT_MAX_PIXELS,
-          MMS_SETTINGS_DEFAULT_ALLOW_DR }
+          MMS_SETTINGS_DEFAULT_ALLOW_DR,
+          MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY }
     },{
         "MaxPixels",
         { DEFAULT_CONFIG },
         { MMS_SETTINGS_DEFAULT_USER_AGENT, MMS_SETTINGS_DEFAULT_UAPROF,
           MMS_SETTINGS_DEFAULT_SIZE_LIMIT, 1000000,
-          MMS_SETTINGS_DEFAULT_ALLOW_DR }
+          MMS_SETTINGS_DEFAULT_ALLOW_DR,
+          MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY }
     },{
         "SendDeliveryReport",
         { DEFAULT_CONFIG },
         { MMS_SETTINGS_DEFAULT_USER_AGENT, MMS_SETTINGS_DEFAULT_UAPROF,
           MMS_SETTINGS_DEFAULT_SIZE_LIMIT, MMS_SETTINGS_DEFAULT_MAX_PIXELS,
-          FALSE }
+          FALSE, MMS_SETTINGS_DEFAULT_MIN_JPEG_QUALITY }
+    },{
+        "MinJpegQuality",
+        { DEFAULT_CONFIG },
+        { MMS_SETTINGS_DEFAULT_USER_AGENT, MMS_SETTINGS_DEFAULT_UAPROF,
+          MMS_SETTINGS_DEFAULT_SIZE_LIMIT, MMS_SETTINGS_DEFAULT_MAX_PIXELS,
+          MMS_SETTINGS_DEFAULT_ALLOW_DR, 50 }
     }
 };
 
@@ -116,6 +226,17 @@ check_config(
     g_assert_cmpint(c1->idle_secs, == ,c2->idle_secs);
     g_assert(c1->keep_temp_files == c2->keep_temp_files);
     g_assert(c1->attic_enabled == c2->attic_enabled);
+    g_assert_cmpuint(c1->max_headers, == ,c2->max_headers);
+    g_assert_cmpuint(c1->max_parts, == ,c2->max_parts);
+    g_assert_cmpuint(c1->max_text, == ,c2->max_text);
+    g_assert_cmpuint(c1->decode_ms, == ,c2->decode_ms);
+    g_assert(c1->virtual_parts == c2->virtual_parts);
+    g_assert_cmpint(c1->sync, == ,c2->sync);
+    g_assert(c1->dedup == c2->dedup);
+    g_assert_cmpstr(c1->staging_dir, == ,c2->staging_dir);
+    g_assert_cmpuint(c1->staging_limit, == ,c2->staging_limit);
+    g_assert_cmpint(c1->orphan_secs, == ,c2->orphan_secs);
+    g_assert_cmpuint(c1->resize_cache, == ,c2->resize_cache);
 }
 
 static
@@ -129,6 +250,7 @@ check_settings(
     g_assert_cmpuint(s1->size_limit, == ,s2->size_limit);
     g_assert_cmpuint(s1->max_pixels, == ,s2->max_pixels);
     g_assert(s1->allow_dr == s2->allow_dr);
+    g_assert_cmpuint(s1->min_jpeg_quality, == ,s2->min_jpeg_quality);
 }
 
 static
@@ -153,6 +275,7 @@ run_test(
 
     g_free(path);
     g_free(global.root_dir);
+    g_free(global.staging_dir);
     mms_settings_sim_data_reset(&defaults);
 }
 
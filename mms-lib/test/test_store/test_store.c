@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ * Copyright (C) 2020 Open Mobile Platform LLC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "test_util.h"
+
+#include "mms_lib_util.h"
+#include "mms_store.h"
+
+#include <gutil_log.h>
+
+static TestOpt test_opt;
+
+static const char test_data[] = "The same attachment, again and again";
+
+static
+void
+test_assert_same_file(
+    const char* path1,
+    const char* path2)
+{
+    struct stat st1, st2;
+
+    g_assert(!stat(path1, &st1));
+    g_assert(!stat(path2, &st2));
+    g_assert_cmpuint(st1.st_dev, == ,st2.st_dev);
+    g_assert_cmpuint(st1.st_ino, == ,st2.st_ino);
+}
+
+static
+void
+test_assert_contents(
+    const char* path,
+    const void* data,
+    gsize size)
+{
+    gchar* contents = NULL;
+    gsize len = 0;
+
+    g_assert(g_file_get_contents(path, &contents, &len, NULL));
+    g_assert_cmpuint(len, == ,size);
+    g_assert(!memcmp(contents, data, len));
+    g_free(contents);
+}
+
+/*==========================================================================*
+ * Write
+ *==========================================================================*/
+
+static
+void
+test_write(
+    void)
+{
+    const gsize size = strlen(test_data);
+    char* root = g_dir_make_tmp("test_store_XXXXXX", NULL);
+    char* dir1 = g_build_filename(root, "1", NULL);
+    char* dir2 = g_build_filename(root, "2", NULL);
+    char* key = mms_store_key(test_data, size);
+    char* stored = g_build_filename(root, MMS_STORE_DIR, key, NULL);
+    char* store = g_path_get_dirname(stored);
+    MMSDir* out1 = mms_dir_open(dir1, NULL);
+    MMSDir* out2 = mms_dir_open(dir2, NULL);
+    MMSStoreStats before, after;
+    char* path1 = NULL;
+    char* path2 = NULL;
+    char* path3 = NULL;
+    struct stat st;
+
+    g_assert(out1);
+    g_assert(out2);
+    mms_store_stats_get(&before);
+
+    /* The first one gets written and stored */
+    g_assert(mms_store_write(root, out1, "a", test_data, size, &path1,
+        NULL));
+    test_assert_contents(path1, test_data, size);
+    test_assert_same_file(path1, stored);
+    mms_store_stats_get(&after);
+    g_assert_cmpuint(after.lookups, == ,before.lookups + 1);
+    g_assert_cmpuint(after.hits, == ,before.hits);
+
+    /* The second one is linked */
+    g_assert(mms_store_write(root, out2, "b", test_data, size, &path2,
+        NULL));
+    test_assert_same_file(path2, stored);
+    mms_store_stats_get(&before);
+    g_assert_cmpuint(before.lookups, == ,after.lookups + 1);
+    g_assert_cmpuint(before.hits, == ,after.hits + 1);
+    g_assert(before.bytes_saved == after.bytes_saved + size);
+
+    /* Linking the same thing again doesn't hurt */
+    g_assert(mms_store_link(root, key, out2, "b", NULL));
+    test_assert_same_file(path2, stored);
+
+    /* Empty files don't go to the store */
+    g_assert(mms_store_write(root, out2, "c", test_data, 0, &path3, NULL));
+    g_assert(!stat(path3, &st));
+    g_assert_cmpuint(st.st_size, == ,0);
+    g_assert_cmpuint(st.st_nlink, == ,1);
+
+    /* The file is kept while someone refers to it */
+    g_assert_cmpuint(mms_store_gc(root), == ,0);
+    unlink(path1);
+    g_assert_cmpuint(mms_store_gc(root), == ,0);
+    unlink(path2);
+    g_assert_cmpuint(mms_store_gc(root), == ,1);
+    g_assert(!g_file_test(stored, G_FILE_TEST_EXISTS));
+
+    mms_dir_close(out1);
+    mms_dir_close(out2);
+    unlink(path3);
+    rmdir(dir1);
+    rmdir(dir2);
+    rmdir(store);
+    rmdir(root);
+    g_free(path1);
+    g_free(path2);
+    g_free(path3);
+    g_free(key);
+    g_free(stored);
+    g_free(store);
+    g_free(dir1);
+    g_free(dir2);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * Intern
+ *==========================================================================*/
+
+static
+void
+test_intern(
+    void)
+{
+    const gsize size = strlen(test_data);
+    char* root = g_dir_make_tmp("test_store_XXXXXX", NULL);
+    char* path1 = g_build_filename(root, "a", NULL);
+    char* path2 = g_build_filename(root, "b", NULL);
+    char* key = mms_store_key(test_data, size);
+    char* stored = g_build_filename(root, MMS_STORE_DIR, key, NULL);
+    char* store = g_path_get_dirname(stored);
+
+    g_assert(g_file_set_contents(path1, test_data, size, NULL));
+    g_assert(g_file_set_contents(path2, test_data, size, NULL));
+
+    /* The first one gets added, the second one gets replaced */
+    mms_store_intern(root, path1);
+    test_assert_same_file(path1, stored);
+    mms_store_intern(root, path2);
+    test_assert_same_file(path2, stored);
+    test_assert_contents(path2, test_data, size);
+
+    /* Interning the same file twice is fine too */
+    mms_store_intern(root, path2);
+    test_assert_same_file(path2, stored);
+
+    /* These don't do anything */
+    mms_store_intern(root, store);
+    mms_store_intern(root, root);
+
+    unlink(path1);
+    unlink(path2);
+    g_assert_cmpuint(mms_store_gc(root), == ,1);
+    g_assert_cmpuint(mms_store_gc(path1), == ,0);
+
+    rmdir(store);
+    rmdir(root);
+    g_free(path1);
+    g_free(path2);
+    g_free(key);
+    g_free(stored);
+    g_free(store);
+    g_free(root);
+}
+
+/*==========================================================================*
+ * Decode
+ *==========================================================================*/
+
+static
+void
+test_decode(
+    void)
+{
+    static const char b64[] = "Y2Fmw6kgYXUgbGFpdA==";
+    static const char text[] = "caf\xc3\xa9 au lait";
+    const gsize size = strlen(test_data);
+    char* root = g_dir_make_tmp("test_store_XXXXXX", NULL);
+    char* path = g_build_filename(root, "a", NULL);
+    char* key = mms_store_key(test_data, size);
+    char* stored = g_build_filename(root, MMS_STORE_DIR, key, NULL);
+    char* store = g_path_get_dirname(stored);
+    MMSDir* dir = mms_dir_open(root, NULL);
+    struct stat st1, st2;
+
+    /* The part left behind by the previous attempt, already interned */
+    g_assert(dir);
+    g_assert(g_file_set_contents(path, test_data, size, NULL));
+    mms_store_intern(root, path);
+    test_assert_same_file(path, stored);
+
+    /* Decoding under the same name must not touch the stored file */
+    g_assert(mms_file_decode(b64, strlen(b64), dir, "a",
+        GMIME_CONTENT_ENCODING_BASE64, NULL, NULL));
+    test_assert_contents(path, text, strlen(text));
+    test_assert_contents(stored, test_data, size);
+    g_assert(!stat(path, &st1));
+    g_assert(!stat(stored, &st2));
+    g_assert_cmpuint(st1.st_ino, != ,st2.st_ino);
+    g_assert_cmpuint(st2.st_nlink, == ,1);
+
+    mms_dir_close(dir);
+    unlink(path);
+    g_assert_cmpuint(mms_store_gc(root), == ,1);
+
+    rmdir(store);
+    rmdir(root);
+    g_free(path);
+    g_free(key);
+    g_free(stored);
+    g_free(store);
+    g_free(root);
+}
+
+#define TEST_(x) "/Store/" x
+
+int main(int argc, char* argv[])
+{
+    int ret;
+
+    mms_lib_init(argv[0]);
+    g_test_init(&argc, &argv, NULL);
+    test_init(&test_opt, &argc, argv);
+    g_test_add_func(TEST_("Write"), test_write);
+    g_test_add_func(TEST_("Intern"), test_intern);
+    g_test_add_func(TEST_("Decode"), test_decode);
+    ret = g_test_run();
+    mms_lib_deinit();
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
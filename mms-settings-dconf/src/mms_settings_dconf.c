@@ -54,6 +54,7 @@ G_DEFINE_TYPE(MMSSettingsDconf, mms_settings_dconf, MMS_TYPE_SETTINGS)
 #define MMS_DCONF_KEY_SIZE_LIMIT    "max-message-size"
 #define MMS_DCONF_KEY_MAX_PIXELS    "max-pixels"
 #define MMS_DCONF_KEY_ALLOW_DR      "allow-delivery-reports"
+#define MMS_DCONF_KEY_MIN_JPEG_QUALITY "min-jpeg-quality"
 
 typedef struct mms_settings_dconf_key {
     const char* name;
@@ -184,6 +185,21 @@ mms_settings_dconf_update_allow_dr(
     dest->data.allow_dr = value;
 }
 
+static
+void
+mms_settings_dconf_update_min_jpeg_quality(
+    MMSSettingsSimDataCopy* dest,
+    GVariant* variant)
+{
+    if (mms_settings_dconf_get_uint32(variant,
+        &dest->data.min_jpeg_quality)) {
+        GDEBUG(MMS_DCONF_KEY_MIN_JPEG_QUALITY " = %u",
+            dest->data.min_jpeg_quality);
+    } else {
+        GWARN("Unable to decode " MMS_DCONF_KEY_MIN_JPEG_QUALITY " value");
+    }
+}
+
 static const MMSSettingsDconfKey mms_settings_dconf_keys[] = {
     {
         MMS_DCONF_KEY_USER_AGENT,
@@ -205,6 +221,10 @@ static const MMSSettingsDconfKey mms_settings_dconf_keys[] = {
         MMS_DCONF_KEY_ALLOW_DR,
         MMS_SETTINGS_FLAG_OVERRIDE_ALLOW_DR,
         mms_settings_dconf_update_allow_dr
+    },{
+        MMS_DCONF_KEY_MIN_JPEG_QUALITY,
+        0,
+        mms_settings_dconf_update_min_jpeg_quality
     }
 };
 
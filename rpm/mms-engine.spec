@@ -32,6 +32,7 @@ Requires(postun): glib2
 
 BuildRequires: file-devel
 BuildRequires: libjpeg-turbo-devel
+BuildRequires: giflib-devel >= 5.1
 BuildRequires: gmime-devel
 BuildRequires: pkgconfig
 BuildRequires: pkgconfig(systemd)